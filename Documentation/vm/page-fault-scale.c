@@ -0,0 +1,183 @@
+/*
+ * page-fault-scale: measure the page fault rate of a threaded program
+ *
+ * Each thread repeatedly maps a private region, touches every page of it
+ * and unmaps it, so that every touch is a page fault. Optionally another
+ * thread keeps mapping and unmapping a small region meanwhile, which is
+ * what takes mmap_sem for writing in the threaded programs that allocate
+ * and free memory in the background.
+ *
+ * Compare the faults/sec at different thread counts, with and without
+ * CONFIG_SPECULATIVE_PAGE_FAULT, and see speculative_pgfault and
+ * speculative_pgfault_abort in /proc/vmstat.
+ *
+ * Usage: page-fault-scale [-t threads] [-s MB] [-d seconds] [-r] [-m]
+ *			   [-f file]
+ *	-t	number of faulting threads (default: 1)
+ *	-s	size of each thread's region in MB (default: 16)
+ *	-d	duration of the run in seconds (default: 5)
+ *	-r	read the pages instead of writing them
+ *	-m	run a thread doing mmap/munmap in a loop meanwhile
+ *	-f	map this file privately instead of anonymous memory, it
+ *		should be at least as large as the region
+ *
+ * This program is released under the GPL v2.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/time.h>
+
+static unsigned long region_size = 16UL << 20;
+static int duration = 5;
+static int read_only;
+static int fd = -1;
+static long page_size;
+static volatile int stop;
+
+struct worker {
+	pthread_t thread;
+	unsigned long faults;
+};
+
+static void *fault_thread(void *arg)
+{
+	struct worker *w = arg;
+	int flags = MAP_PRIVATE | (fd < 0 ? MAP_ANONYMOUS : 0);
+	unsigned long offset;
+	volatile char *p;
+	char sum = 0;
+
+	while (!stop) {
+		p = mmap(NULL, region_size, PROT_READ | PROT_WRITE, flags,
+			 fd, 0);
+		if (p == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		for (offset = 0; offset < region_size; offset += page_size) {
+			if (read_only)
+				sum += p[offset];
+			else
+				p[offset] = 1;
+		}
+		w->faults += region_size / page_size;
+		munmap((void *)p, region_size);
+	}
+	return (void *)(long)sum;
+}
+
+static void *mmap_thread(void *arg)
+{
+	unsigned long *loops = arg;
+	void *p;
+
+	while (!stop) {
+		p = mmap(NULL, page_size, PROT_READ | PROT_WRITE,
+			 MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED) {
+			perror("mmap");
+			exit(1);
+		}
+		munmap(p, page_size);
+		(*loops)++;
+	}
+	return NULL;
+}
+
+static void usage(const char *name)
+{
+	fprintf(stderr, "Usage: %s [-t threads] [-s MB] [-d seconds] [-r] "
+			"[-m] [-f file]\n", name);
+	exit(1);
+}
+
+int main(int argc, char **argv)
+{
+	struct worker *workers;
+	pthread_t mmapper;
+	unsigned long mmap_loops = 0, faults = 0;
+	struct timeval start, end;
+	double elapsed;
+	int nr_threads = 1, antagonist = 0;
+	int c, i;
+
+	while ((c = getopt(argc, argv, "t:s:d:rmf:")) != -1) {
+		switch (c) {
+		case 't':
+			nr_threads = atoi(optarg);
+			break;
+		case 's':
+			region_size = strtoul(optarg, NULL, 0) << 20;
+			break;
+		case 'd':
+			duration = atoi(optarg);
+			break;
+		case 'r':
+			read_only = 1;
+			break;
+		case 'm':
+			antagonist = 1;
+			break;
+		case 'f':
+			fd = open(optarg, O_RDONLY);
+			if (fd < 0) {
+				perror(optarg);
+				return 1;
+			}
+			break;
+		default:
+			usage(argv[0]);
+		}
+	}
+	if (nr_threads < 1 || !region_size || duration < 1)
+		usage(argv[0]);
+
+	page_size = sysconf(_SC_PAGESIZE);
+	workers = calloc(nr_threads, sizeof(*workers));
+	if (!workers) {
+		perror("calloc");
+		return 1;
+	}
+
+	gettimeofday(&start, NULL);
+	for (i = 0; i < nr_threads; i++) {
+		if (pthread_create(&workers[i].thread, NULL, fault_thread,
+				   &workers[i])) {
+			perror("pthread_create");
+			return 1;
+		}
+	}
+	if (antagonist &&
+	    pthread_create(&mmapper, NULL, mmap_thread, &mmap_loops)) {
+		perror("pthread_create");
+		return 1;
+	}
+
+	sleep(duration);
+	stop = 1;
+
+	for (i = 0; i < nr_threads; i++) {
+		pthread_join(workers[i].thread, NULL);
+		faults += workers[i].faults;
+	}
+	if (antagonist)
+		pthread_join(mmapper, NULL);
+	gettimeofday(&end, NULL);
+
+	elapsed = (end.tv_sec - start.tv_sec) +
+		  (end.tv_usec - start.tv_usec) / 1e6;
+	printf("threads %d: %lu faults in %.2fs, %.0f faults/sec, "
+	       "%.0f faults/sec/thread\n", nr_threads, faults, elapsed,
+	       faults / elapsed, faults / elapsed / nr_threads);
+	if (antagonist)
+		printf("mmap/munmap: %.0f loops/sec\n", mmap_loops / elapsed);
+
+	free(workers);
+	return 0;
+}
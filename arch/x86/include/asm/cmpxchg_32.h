@@ -280,4 +280,27 @@ static inline unsigned long cmpxchg_386(volatile void *ptr, unsigned long old,
 
 #endif
 
+/*
+ * Compare and exchange two adjacent words, the first of them double word
+ * aligned, in one go: p2 must be p1 + 1. Returns true if both words
+ * matched and were replaced. Only to be used on processors with cmpxchg8b,
+ * see system_has_cmpxchg_double().
+ */
+#define cmpxchg_double(p1, p2, o1, o2, n1, n2)				\
+({									\
+	char __ret;							\
+	__typeof__(*(p1)) __old1 = (o1), __new1 = (n1);			\
+	__typeof__(*(p2)) __old2 = (o2), __new2 = (n2);			\
+	BUILD_BUG_ON(sizeof(*(p1)) != 4);				\
+	BUILD_BUG_ON(sizeof(*(p2)) != 4);				\
+	asm volatile(LOCK_PREFIX "cmpxchg8b %2\n\tsetz %0"		\
+		     : "=a" (__ret), "+d" (__old2),			\
+		       "+m" (*(p1)), "+m" (*(p2))			\
+		     : "a" (__old1), "b" (__new1), "c" (__new2)		\
+		     : "memory");					\
+	__ret;								\
+})
+
+#define system_has_cmpxchg_double() cpu_has_cx8
+
 #endif /* _ASM_X86_CMPXCHG_32_H */
@@ -151,4 +151,27 @@ extern void __cmpxchg_wrong_size(void);
 	cmpxchg_local((ptr), (o), (n));					\
 })
 
+/*
+ * Compare and exchange two adjacent words, the first of them double word
+ * aligned, in one go: p2 must be p1 + 1. Returns true if both words
+ * matched and were replaced. Only to be used on processors with cmpxchg16b,
+ * see system_has_cmpxchg_double().
+ */
+#define cmpxchg_double(p1, p2, o1, o2, n1, n2)				\
+({									\
+	char __ret;							\
+	__typeof__(*(p1)) __old1 = (o1), __new1 = (n1);			\
+	__typeof__(*(p2)) __old2 = (o2), __new2 = (n2);			\
+	BUILD_BUG_ON(sizeof(*(p1)) != 8);				\
+	BUILD_BUG_ON(sizeof(*(p2)) != 8);				\
+	asm volatile(LOCK_PREFIX "cmpxchg16b %2\n\tsetz %0"		\
+		     : "=a" (__ret), "+d" (__old2),			\
+		       "+m" (*(p1)), "+m" (*(p2))			\
+		     : "a" (__old1), "b" (__new1), "c" (__new2)		\
+		     : "memory");					\
+	__ret;								\
+})
+
+#define system_has_cmpxchg_double() cpu_has_cx16
+
 #endif /* _ASM_X86_CMPXCHG_64_H */
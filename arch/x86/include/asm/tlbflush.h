@@ -145,6 +145,8 @@ static inline void flush_tlb_range(struct vm_area_struct *vma,
 void native_flush_tlb_others(const struct cpumask *cpumask,
 			     struct mm_struct *mm, unsigned long va);
 
+extern void arch_tlbbatch_flush(const struct cpumask *cpumask);
+
 #define TLBSTATE_OK	1
 #define TLBSTATE_LAZY	2
 
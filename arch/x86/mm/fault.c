@@ -1054,6 +1054,31 @@ do_page_fault(struct pt_regs *regs, unsigned long error_code)
 		return;
 	}
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+	/*
+	 * Try to fill a missing pte without mmap_sem first. Anything
+	 * the speculative path does not handle, including every error,
+	 * is left to the regular path below.
+	 */
+	if (!(error_code & PF_PROT) &&
+	    ((error_code & PF_USER) || search_exception_tables(regs->ip))) {
+		fault = handle_speculative_fault(mm, address, flags);
+		if (!(fault & VM_FAULT_RETRY)) {
+			if (fault & VM_FAULT_MAJOR) {
+				tsk->maj_flt++;
+				perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS_MAJ, 1, 0,
+					      regs, address);
+			} else {
+				tsk->min_flt++;
+				perf_sw_event(PERF_COUNT_SW_PAGE_FAULTS_MIN, 1, 0,
+					      regs, address);
+			}
+			check_v8086_mode(regs, address, tsk);
+			return;
+		}
+	}
+#endif
+
 	/*
 	 * When running in the kernel we expect faults to occur only to
 	 * addresses in user space.  All other faults represent errors in
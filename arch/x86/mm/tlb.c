@@ -330,3 +330,25 @@ void flush_tlb_all(void)
 {
 	on_each_cpu(do_flush_tlb_all, NULL, 1);
 }
+
+static void do_flush_tlb_batched(void *info)
+{
+	if (percpu_read(cpu_tlbstate.state) == TLBSTATE_OK)
+		local_flush_tlb();
+	else
+		leave_mm(smp_processor_id());
+}
+
+/*
+ * Flush the user TLB entries of the cpus in @cpumask, whatever mm they
+ * run now: reclaim gathers the mask from all the mms it unmapped pages
+ * from, see try_to_unmap_flush().
+ */
+void arch_tlbbatch_flush(const struct cpumask *cpumask)
+{
+	preempt_disable();
+	if (cpumask_test_cpu(smp_processor_id(), cpumask))
+		do_flush_tlb_batched(NULL);
+	smp_call_function_many(cpumask, do_flush_tlb_batched, NULL, 1);
+	preempt_enable();
+}
@@ -1926,7 +1926,7 @@ static void e1000_unmap_and_free_tx_resource(struct e1000_adapter *adapter,
 		buffer_info->dma = 0;
 	}
 	if (buffer_info->skb) {
-		dev_kfree_skb_any(buffer_info->skb);
+		napi_consume_skb(buffer_info->skb);
 		buffer_info->skb = NULL;
 	}
 	buffer_info->time_stamp = 0;
@@ -3908,7 +3908,7 @@ next_desc:
  * this should improve performance for small packets with large amounts
  * of reassembly being done in the stack
  */
-static void e1000_check_copybreak(struct net_device *netdev,
+static void e1000_check_copybreak(struct e1000_adapter *adapter,
 				 struct e1000_buffer *buffer_info,
 				 u32 length, struct sk_buff **skb)
 {
@@ -3917,7 +3917,7 @@ static void e1000_check_copybreak(struct net_device *netdev,
 	if (length > copybreak)
 		return;
 
-	new_skb = netdev_alloc_skb_ip_align(netdev, length);
+	new_skb = napi_alloc_skb(&adapter->napi, length);
 	if (!new_skb)
 		return;
 
@@ -4028,7 +4028,7 @@ static bool e1000_clean_rx_irq(struct e1000_adapter *adapter,
 		total_rx_bytes += length;
 		total_rx_packets++;
 
-		e1000_check_copybreak(netdev, buffer_info, length, &skb);
+		e1000_check_copybreak(adapter, buffer_info, length, &skb);
 
 		skb_put(skb, length);
 
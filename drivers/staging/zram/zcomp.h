@@ -0,0 +1,71 @@
+/*
+ * Compression streams and backends for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZCOMP_H_
+#define _ZCOMP_H_
+
+#include <linux/mutex.h>
+
+/*
+ * A compression stream: the output buffer and the backend scratch memory
+ * needed to (de)compress one page. There is one per CPU.
+ */
+struct zcomp_strm {
+	struct mutex lock;
+	/* compression output, two pages since data may expand */
+	void *buffer;
+	/* backend private data, e.g. its work memory */
+	void *private;
+};
+
+/*
+ * A compression backend. compress() takes a whole page and returns the
+ * compressed length in dst_len; decompress() always produces a whole
+ * page. Both return 0 or a negative error code.
+ */
+struct zcomp_backend {
+	int (*compress)(const unsigned char *src, unsigned char *dst,
+			size_t *dst_len, void *private);
+
+	int (*decompress)(const unsigned char *src, size_t src_len,
+			unsigned char *dst, void *private);
+
+	void *(*create)(void);
+	void (*destroy)(void *private);
+
+	const char *name;
+};
+
+struct zcomp {
+	struct zcomp_strm __percpu *stream;
+	struct zcomp_backend *backend;
+};
+
+extern struct zcomp_backend zcomp_lzo;
+#ifdef CONFIG_ZRAM_DEFLATE
+extern struct zcomp_backend zcomp_deflate;
+#endif
+
+ssize_t zcomp_available_show(const char *comp, char *buf);
+bool zcomp_available_algorithm(const char *comp);
+
+struct zcomp *zcomp_create(const char *comp);
+void zcomp_destroy(struct zcomp *comp);
+
+struct zcomp_strm *zcomp_strm_find(struct zcomp *comp);
+void zcomp_strm_release(struct zcomp *comp, struct zcomp_strm *zstrm);
+
+int zcomp_compress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t *dst_len);
+
+int zcomp_decompress(struct zcomp *comp, struct zcomp_strm *zstrm,
+		const unsigned char *src, size_t src_len, unsigned char *dst);
+
+#endif /* _ZCOMP_H_ */
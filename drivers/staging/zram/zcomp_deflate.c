@@ -0,0 +1,150 @@
+/*
+ * Deflate compression backend for zram
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#include <linux/kernel.h>
+#include <linux/slab.h>
+#include <linux/vmalloc.h>
+#include <linux/zlib.h>
+
+#include "zcomp.h"
+
+/*
+ * Raw deflate, as in crypto/deflate.c. A 4KB window is all a page
+ * needs and keeps the per-CPU workspace small.
+ */
+#define DEFLATE_DEF_LEVEL		Z_DEFAULT_COMPRESSION
+#define DEFLATE_DEF_WINBITS		12
+#define DEFLATE_DEF_MEMLEVEL		MAX_MEM_LEVEL
+
+struct deflate_ctx {
+	struct z_stream_s comp_stream;
+	struct z_stream_s decomp_stream;
+};
+
+static void deflate_destroy(void *private)
+{
+	struct deflate_ctx *ctx = private;
+
+	if (ctx->comp_stream.workspace) {
+		zlib_deflateEnd(&ctx->comp_stream);
+		vfree(ctx->comp_stream.workspace);
+	}
+	if (ctx->decomp_stream.workspace) {
+		zlib_inflateEnd(&ctx->decomp_stream);
+		vfree(ctx->decomp_stream.workspace);
+	}
+	kfree(ctx);
+}
+
+static void *deflate_create(void)
+{
+	struct deflate_ctx *ctx;
+	struct z_stream_s *stream;
+
+	ctx = kzalloc(sizeof(*ctx), GFP_KERNEL);
+	if (!ctx)
+		return NULL;
+
+	stream = &ctx->comp_stream;
+	stream->workspace = vzalloc(zlib_deflate_workspacesize(
+				-DEFLATE_DEF_WINBITS, DEFLATE_DEF_MEMLEVEL));
+	if (!stream->workspace)
+		goto fail;
+	if (zlib_deflateInit2(stream, DEFLATE_DEF_LEVEL, Z_DEFLATED,
+			-DEFLATE_DEF_WINBITS, DEFLATE_DEF_MEMLEVEL,
+			Z_DEFAULT_STRATEGY) != Z_OK) {
+		vfree(stream->workspace);
+		stream->workspace = NULL;
+		goto fail;
+	}
+
+	stream = &ctx->decomp_stream;
+	stream->workspace = vzalloc(zlib_inflate_workspacesize());
+	if (!stream->workspace)
+		goto fail;
+	if (zlib_inflateInit2(stream, -DEFLATE_DEF_WINBITS) != Z_OK) {
+		vfree(stream->workspace);
+		stream->workspace = NULL;
+		goto fail;
+	}
+
+	return ctx;
+
+fail:
+	deflate_destroy(ctx);
+	return NULL;
+}
+
+static int deflate_compress(const unsigned char *src, unsigned char *dst,
+		size_t *dst_len, void *private)
+{
+	struct deflate_ctx *ctx = private;
+	struct z_stream_s *stream = &ctx->comp_stream;
+	int ret;
+
+	ret = zlib_deflateReset(stream);
+	if (ret != Z_OK)
+		return -EINVAL;
+
+	stream->next_in = src;
+	stream->avail_in = PAGE_SIZE;
+	stream->next_out = dst;
+	/* the zstrm buffer is two pages, more than a deflated page needs */
+	stream->avail_out = 2 * PAGE_SIZE;
+
+	ret = zlib_deflate(stream, Z_FINISH);
+	if (ret != Z_STREAM_END)
+		return -EINVAL;
+
+	*dst_len = stream->total_out;
+	return 0;
+}
+
+static int deflate_decompress(const unsigned char *src, size_t src_len,
+		unsigned char *dst, void *private)
+{
+	struct deflate_ctx *ctx = private;
+	struct z_stream_s *stream = &ctx->decomp_stream;
+	int ret;
+
+	ret = zlib_inflateReset(stream);
+	if (ret != Z_OK)
+		return -EINVAL;
+
+	stream->next_in = src;
+	stream->avail_in = src_len;
+	stream->next_out = dst;
+	stream->avail_out = PAGE_SIZE;
+
+	ret = zlib_inflate(stream, Z_SYNC_FLUSH);
+	/*
+	 * Work around a bug in zlib, which sometimes wants to taste an extra
+	 * byte when being used in the (undocumented) raw deflate mode.
+	 * (From USAGI).
+	 */
+	if (ret == Z_OK && !stream->avail_in && stream->avail_out) {
+		u8 zerostuff = 0;
+		stream->next_in = &zerostuff;
+		stream->avail_in = 1;
+		ret = zlib_inflate(stream, Z_FINISH);
+	}
+	if (ret != Z_STREAM_END || stream->total_out != PAGE_SIZE)
+		return -EINVAL;
+
+	return 0;
+}
+
+struct zcomp_backend zcomp_deflate = {
+	.compress = deflate_compress,
+	.decompress = deflate_decompress,
+	.create = deflate_create,
+	.destroy = deflate_destroy,
+	.name = "deflate",
+};
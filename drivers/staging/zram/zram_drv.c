@@ -29,7 +29,7 @@
 #include <linux/genhd.h>
 #include <linux/highmem.h>
 #include <linux/slab.h>
-#include <linux/lzo.h>
+#include <linux/err.h>
 #include <linux/string.h>
 #include <linux/vmalloc.h>
 
@@ -42,14 +42,14 @@ struct zram *devices;
 /* Module params (documentation at end) */
 unsigned int num_devices;
 
-static void zram_stat_inc(u32 *v)
+static void zram_stat_inc(atomic_t *v)
 {
-	*v = *v + 1;
+	atomic_inc(v);
 }
 
-static void zram_stat_dec(u32 *v)
+static void zram_stat_dec(atomic_t *v)
 {
-	*v = *v - 1;
+	atomic_dec(v);
 }
 
 static void zram_stat64_add(struct zram *zram, u64 *v, u64 inc)
@@ -136,12 +136,9 @@ static void zram_set_disksize(struct zram *zram, size_t totalram_bytes)
 static void zram_free_page(struct zram *zram, size_t index)
 {
 	u32 clen;
-	void *obj;
+	unsigned long handle = zram->table[index].handle;
 
-	struct page *page = zram->table[index].page;
-	u32 offset = zram->table[index].offset;
-
-	if (unlikely(!page)) {
+	if (unlikely(!handle)) {
 		/*
 		 * No memory is allocated for zero filled pages.
 		 * Simply clear zero page flag.
@@ -155,17 +152,14 @@ static void zram_free_page(struct zram *zram, size_t index)
 
 	if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
 		clen = PAGE_SIZE;
-		__free_page(page);
+		__free_page((struct page *)handle);
 		zram_clear_flag(zram, index, ZRAM_UNCOMPRESSED);
 		zram_stat_dec(&zram->stats.pages_expand);
 		goto out;
 	}
 
-	obj = kmap_atomic(page, KM_USER0) + offset;
-	clen = xv_get_object_size(obj) - sizeof(struct zobj_header);
-	kunmap_atomic(obj, KM_USER0);
-
-	xv_free(zram->mem_pool, page, offset);
+	clen = zram->table[index].size;
+	zs_free(zram->mem_pool, handle);
 	if (clen <= PAGE_SIZE / 2)
 		zram_stat_dec(&zram->stats.good_compress);
 
@@ -173,8 +167,8 @@ out:
 	zram_stat64_sub(zram, &zram->stats.compr_size, clen);
 	zram_stat_dec(&zram->stats.pages_stored);
 
-	zram->table[index].page = NULL;
-	zram->table[index].offset = 0;
+	zram->table[index].handle = 0;
+	zram->table[index].size = 0;
 }
 
 static void handle_zero_page(struct page *page)
@@ -194,12 +188,11 @@ static void handle_uncompressed_page(struct zram *zram,
 	unsigned char *user_mem, *cmem;
 
 	user_mem = kmap_atomic(page, KM_USER0);
-	cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-			zram->table[index].offset;
+	cmem = kmap_atomic((struct page *)zram->table[index].handle, KM_USER1);
 
 	memcpy(user_mem, cmem, PAGE_SIZE);
-	kunmap_atomic(user_mem, KM_USER0);
 	kunmap_atomic(cmem, KM_USER1);
+	kunmap_atomic(user_mem, KM_USER0);
 
 	flush_dcache_page(page);
 }
@@ -216,8 +209,8 @@ static void zram_read(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		size_t clen;
 		struct page *page;
+		struct zcomp_strm *zstrm;
 		struct zobj_header *zheader;
 		unsigned char *user_mem, *cmem;
 
@@ -230,7 +223,7 @@ static void zram_read(struct zram *zram, struct bio *bio)
 		}
 
 		/* Requested page is not present in compressed area */
-		if (unlikely(!zram->table[index].page)) {
+		if (unlikely(!zram->table[index].handle)) {
 			pr_debug("Read before write: sector=%lu, size=%u",
 				(ulong)(bio->bi_sector), bio->bi_size);
 			handle_zero_page(page);
@@ -245,22 +238,23 @@ static void zram_read(struct zram *zram, struct bio *bio)
 			continue;
 		}
 
+		zstrm = zcomp_strm_find(zram->comp);
 		user_mem = kmap_atomic(page, KM_USER0);
-		clen = PAGE_SIZE;
 
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, zram->table[index].handle,
+				ZS_MM_RO);
 
-		ret = lzo1x_decompress_safe(
+		ret = zcomp_decompress(zram->comp, zstrm,
 			cmem + sizeof(*zheader),
-			xv_get_object_size(cmem) - sizeof(*zheader),
-			user_mem, &clen);
+			zram->table[index].size,
+			user_mem);
 
+		zs_unmap_object(zram->mem_pool, zram->table[index].handle);
 		kunmap_atomic(user_mem, KM_USER0);
-		kunmap_atomic(cmem, KM_USER1);
+		zcomp_strm_release(zram->comp, zstrm);
 
 		/* Should NEVER happen. Return bio error if it does. */
-		if (unlikely(ret != LZO_E_OK)) {
+		if (unlikely(ret)) {
 			pr_err("Decompression failed! err=%d, page=%u\n",
 				ret, index);
 			zram_stat64_inc(zram, &zram->stats.failed_reads);
@@ -290,42 +284,42 @@ static void zram_write(struct zram *zram, struct bio *bio)
 
 	bio_for_each_segment(bvec, bio, i) {
 		int ret;
-		u32 offset;
 		size_t clen;
+		unsigned long handle;
+		struct zcomp_strm *zstrm;
 		struct zobj_header *zheader;
 		struct page *page, *page_store;
 		unsigned char *user_mem, *cmem, *src;
 
 		page = bvec->bv_page;
-		src = zram->compress_buffer;
 
 		/*
 		 * System overwrites unused sectors. Free memory associated
 		 * with this sector now.
 		 */
-		if (zram->table[index].page ||
+		if (zram->table[index].handle ||
 				zram_test_flag(zram, index, ZRAM_ZERO))
 			zram_free_page(zram, index);
 
-		mutex_lock(&zram->lock);
+		zstrm = zcomp_strm_find(zram->comp);
+		src = zstrm->buffer;
 
 		user_mem = kmap_atomic(page, KM_USER0);
 		if (page_zero_filled(user_mem)) {
 			kunmap_atomic(user_mem, KM_USER0);
-			mutex_unlock(&zram->lock);
+			zcomp_strm_release(zram->comp, zstrm);
 			zram_stat_inc(&zram->stats.pages_zero);
 			zram_set_flag(zram, index, ZRAM_ZERO);
 			index++;
 			continue;
 		}
 
-		ret = lzo1x_1_compress(user_mem, PAGE_SIZE, src, &clen,
-					zram->compress_workmem);
+		ret = zcomp_compress(zram->comp, zstrm, user_mem, &clen);
 
 		kunmap_atomic(user_mem, KM_USER0);
 
-		if (unlikely(ret != LZO_E_OK)) {
-			mutex_unlock(&zram->lock);
+		if (unlikely(ret)) {
+			zcomp_strm_release(zram->comp, zstrm);
 			pr_err("Compression failed! err=%d\n", ret);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
@@ -340,7 +334,7 @@ static void zram_write(struct zram *zram, struct bio *bio)
 			clen = PAGE_SIZE;
 			page_store = alloc_page(GFP_NOIO | __GFP_HIGHMEM);
 			if (unlikely(!page_store)) {
-				mutex_unlock(&zram->lock);
+				zcomp_strm_release(zram->comp, zstrm);
 				pr_info("Error allocating memory for "
 					"incompressible page: %u\n", index);
 				zram_stat64_inc(zram,
@@ -348,29 +342,27 @@ static void zram_write(struct zram *zram, struct bio *bio)
 				goto out;
 			}
 
-			offset = 0;
 			zram_set_flag(zram, index, ZRAM_UNCOMPRESSED);
 			zram_stat_inc(&zram->stats.pages_expand);
-			zram->table[index].page = page_store;
+			handle = (unsigned long)page_store;
+			zram->table[index].handle = handle;
 			src = kmap_atomic(page, KM_USER0);
+			cmem = kmap_atomic(page_store, KM_USER1);
 			goto memstore;
 		}
 
-		if (xv_malloc(zram->mem_pool, clen + sizeof(*zheader),
-				&zram->table[index].page, &offset,
-				GFP_NOIO | __GFP_HIGHMEM)) {
-			mutex_unlock(&zram->lock);
+		handle = zs_malloc(zram->mem_pool, clen + sizeof(*zheader));
+		if (!handle) {
+			zcomp_strm_release(zram->comp, zstrm);
 			pr_info("Error allocating memory for compressed "
 				"page: %u, size=%zu\n", index, clen);
 			zram_stat64_inc(zram, &zram->stats.failed_writes);
 			goto out;
 		}
+		zram->table[index].handle = handle;
+		zram->table[index].size = clen;
 
-memstore:
-		zram->table[index].offset = offset;
-
-		cmem = kmap_atomic(zram->table[index].page, KM_USER1) +
-				zram->table[index].offset;
+		cmem = zs_map_object(zram->mem_pool, handle, ZS_MM_WO);
 
 #if 0
 		/* Back-reference needed for memory defragmentation */
@@ -381,11 +373,15 @@ memstore:
 		}
 #endif
 
+memstore:
 		memcpy(cmem, src, clen);
 
-		kunmap_atomic(cmem, KM_USER1);
-		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
+		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED))) {
+			kunmap_atomic(cmem, KM_USER1);
 			kunmap_atomic(src, KM_USER0);
+		} else {
+			zs_unmap_object(zram->mem_pool, handle);
+		}
 
 		/* Update stats */
 		zram_stat64_add(zram, &zram->stats.compr_size, clen);
@@ -393,7 +389,7 @@ memstore:
 		if (clen <= PAGE_SIZE / 2)
 			zram_stat_inc(&zram->stats.good_compress);
 
-		mutex_unlock(&zram->lock);
+		zcomp_strm_release(zram->comp, zstrm);
 		index++;
 	}
 
@@ -460,34 +456,29 @@ void zram_reset_device(struct zram *zram)
 	mutex_lock(&zram->init_lock);
 	zram->init_done = 0;
 
-	/* Free various per-device buffers */
-	kfree(zram->compress_workmem);
-	free_pages((unsigned long)zram->compress_buffer, 1);
-
-	zram->compress_workmem = NULL;
-	zram->compress_buffer = NULL;
+	/* Free the per-device compression streams */
+	if (zram->comp)
+		zcomp_destroy(zram->comp);
+	zram->comp = NULL;
 
 	/* Free all pages that are still in this zram device */
 	for (index = 0; index < zram->disksize >> PAGE_SHIFT; index++) {
-		struct page *page;
-		u16 offset;
-
-		page = zram->table[index].page;
-		offset = zram->table[index].offset;
+		unsigned long handle = zram->table[index].handle;
 
-		if (!page)
+		if (!handle)
 			continue;
 
 		if (unlikely(zram_test_flag(zram, index, ZRAM_UNCOMPRESSED)))
-			__free_page(page);
+			__free_page((struct page *)handle);
 		else
-			xv_free(zram->mem_pool, page, offset);
+			zs_free(zram->mem_pool, handle);
 	}
 
 	vfree(zram->table);
 	zram->table = NULL;
 
-	xv_destroy_pool(zram->mem_pool);
+	if (zram->mem_pool)
+		zs_destroy_pool(zram->mem_pool);
 	zram->mem_pool = NULL;
 
 	/* Reset stats */
@@ -511,17 +502,12 @@ int zram_init_device(struct zram *zram)
 
 	zram_set_disksize(zram, totalram_pages << PAGE_SHIFT);
 
-	zram->compress_workmem = kzalloc(LZO1X_MEM_COMPRESS, GFP_KERNEL);
-	if (!zram->compress_workmem) {
-		pr_err("Error allocating compressor working memory!\n");
-		ret = -ENOMEM;
-		goto fail;
-	}
-
-	zram->compress_buffer = (void *)__get_free_pages(__GFP_ZERO, 1);
-	if (!zram->compress_buffer) {
-		pr_err("Error allocating compressor buffer space\n");
-		ret = -ENOMEM;
+	zram->comp = zcomp_create(zram->compressor);
+	if (IS_ERR(zram->comp)) {
+		pr_err("Cannot initialise %s compressing backend\n",
+			zram->compressor);
+		ret = PTR_ERR(zram->comp);
+		zram->comp = NULL;
 		goto fail;
 	}
 
@@ -540,7 +526,8 @@ int zram_init_device(struct zram *zram)
 	/* zram devices sort of resembles non-rotational disks */
 	queue_flag_set_unlocked(QUEUE_FLAG_NONROT, zram->disk->queue);
 
-	zram->mem_pool = xv_create_pool();
+	zram->mem_pool = zs_create_pool(zram->disk->disk_name,
+					GFP_NOIO | __GFP_HIGHMEM);
 	if (!zram->mem_pool) {
 		pr_err("Error creating memory pool\n");
 		ret = -ENOMEM;
@@ -579,9 +566,10 @@ static int create_device(struct zram *zram, int device_id)
 {
 	int ret = 0;
 
-	mutex_init(&zram->lock);
 	mutex_init(&zram->init_lock);
 	spin_lock_init(&zram->stat64_lock);
+	strlcpy(zram->compressor, default_compressor,
+		sizeof(zram->compressor));
 
 	zram->queue = blk_alloc_queue(GFP_KERNEL);
 	if (!zram->queue) {
@@ -17,8 +17,10 @@
 
 #include <linux/spinlock.h>
 #include <linux/mutex.h>
+#include <linux/atomic.h>
 
-#include "xvmalloc.h"
+#include "../zsmalloc/zsmalloc.h"
+#include "zcomp.h"
 
 /*
  * Some arbitrary value. This is just to catch
@@ -43,6 +45,9 @@ struct zobj_header {
 /* Default zram disk size: 25% of total RAM */
 static const unsigned default_disksize_perc_ram = 25;
 
+/* Default compression backend, see zcomp.c for the others */
+static const char default_compressor[] = "lzo";
+
 /*
  * Pages that compress to size greater than this are stored
  * uncompressed in memory.
@@ -51,8 +56,8 @@ static const unsigned max_zpage_size = PAGE_SIZE / 4 * 3;
 
 /*
  * NOTE: max_zpage_size must be less than or equal to:
- *   XV_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
- * otherwise, xv_malloc() would always return failure.
+ *   ZS_MAX_ALLOC_SIZE - sizeof(struct zobj_header)
+ * otherwise, zs_malloc() would always return failure.
  */
 
 /*-- End of configurable params */
@@ -76,10 +81,13 @@ enum zram_pageflags {
 
 /*-- Data structures */
 
-/* Allocated for each disk page */
+/*
+ * Allocated for each disk page. handle is the zsmalloc handle of the
+ * compressed object, or the struct page of a page stored uncompressed.
+ */
 struct table {
-	struct page *page;
-	u16 offset;
+	unsigned long handle;
+	u16 size;	/* object size (excluding header) */
 	u8 count;	/* object ref count (not yet used) */
 	u8 flags;
 } __attribute__((aligned(4)));
@@ -92,20 +100,17 @@ struct zram_stats {
 	u64 failed_writes;	/* can happen when memory is too low */
 	u64 invalid_io;		/* non-page-aligned I/O requests */
 	u64 notify_free;	/* no. of swap slot free notifications */
-	u32 pages_zero;		/* no. of zero filled pages */
-	u32 pages_stored;	/* no. of pages currently stored */
-	u32 good_compress;	/* % of pages with compression ratio<=50% */
-	u32 pages_expand;	/* % of incompressible pages */
+	atomic_t pages_zero;	/* no. of zero filled pages */
+	atomic_t pages_stored;	/* no. of pages currently stored */
+	atomic_t good_compress;	/* % of pages with compression ratio<=50% */
+	atomic_t pages_expand;	/* % of incompressible pages */
 };
 
 struct zram {
-	struct xv_pool *mem_pool;
-	void *compress_workmem;
-	void *compress_buffer;
+	struct zs_pool *mem_pool;
+	struct zcomp *comp;	/* per-cpu compression streams */
 	struct table *table;
 	spinlock_t stat64_lock;	/* protect 64-bit stats */
-	struct mutex lock;	/* protect compression buffers against
-				 * concurrent writes */
 	struct request_queue *queue;
 	struct gendisk *disk;
 	int init_done;
@@ -116,6 +121,8 @@ struct zram {
 	 * we can store in a disk.
 	 */
 	u64 disksize;	/* bytes */
+	/* compression backend, can only be changed before init */
+	char compressor[10];
 
 	struct zram_stats stats;
 };
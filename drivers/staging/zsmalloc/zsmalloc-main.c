@@ -0,0 +1,831 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+/*
+ * zsmalloc groups objects by size into size classes, ZS_SIZE_CLASS_DELTA
+ * bytes apart, and each class carves its objects out of "zspages": groups
+ * of up to ZS_MAX_PAGES_PER_ZSPAGE order-0 pages chosen so that little
+ * space is left at their end. Objects may cross the boundary between two
+ * pages of a zspage, so an object is only known by a handle, which must
+ * be mapped with zs_map_object() to get at its data.
+ *
+ * The pages of a zspage use the following struct page fields:
+ *
+ *	page->first_page: all pages but the first point to the first page
+ *	page->private: the first page points to the second page, if any
+ *	page->lru: links the pages after the first together; links first
+ *		pages into the fullness lists of their class
+ *	page->index: all pages but the first hold their offset within the
+ *		zspage
+ *	page->freelist: the first page holds the handle of the first free
+ *		object of the zspage
+ *	page->inuse: the first page holds the number of used objects
+ *	page->objects: the first page holds the number of objects
+ *	page->mapping: the first page holds its class and fullness group
+ *
+ * PG_private identifies the first page and PG_private_2 the last one.
+ */
+
+#define KMSG_COMPONENT "zsmalloc"
+#define pr_fmt(fmt) KMSG_COMPONENT ": " fmt
+
+#include <linux/module.h>
+#include <linux/kernel.h>
+#include <linux/bitops.h>
+#include <linux/errno.h>
+#include <linux/highmem.h>
+#include <linux/init.h>
+#include <linux/string.h>
+#include <linux/slab.h>
+#include <linux/percpu.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+
+#include "zsmalloc.h"
+#include "zsmalloc_int.h"
+
+/* page->mapping of a first page: class index and fullness group */
+#define FULLNESS_BITS	4
+#define CLASS_IDX_BITS	28
+
+#define FULLNESS_MASK	((1 << FULLNESS_BITS) - 1)
+#define CLASS_IDX_MASK	((1 << CLASS_IDX_BITS) - 1)
+
+/*
+ * Bounce buffer for objects that span two pages, see zs_map_object().
+ * Only one object can be mapped at a time on each CPU.
+ */
+struct mapping_area {
+	char *vm_buf;		/* copy of the object */
+	char *vm_addr;		/* address of the kmap_atomic()'ed page */
+	enum zs_mapmode vm_mm;
+};
+
+static DEFINE_PER_CPU(struct mapping_area, zs_map_area);
+static bool zs_initialized;
+
+static int is_first_page(struct page *page)
+{
+	return PagePrivate(page);
+}
+
+static int is_last_page(struct page *page)
+{
+	return PagePrivate2(page);
+}
+
+static void get_zspage_mapping(struct page *page, unsigned int *class_idx,
+				enum fullness_group *fullness)
+{
+	unsigned long m;
+
+	BUG_ON(!is_first_page(page));
+
+	m = (unsigned long)page->mapping;
+	*fullness = m & FULLNESS_MASK;
+	*class_idx = (m >> FULLNESS_BITS) & CLASS_IDX_MASK;
+}
+
+static void set_zspage_mapping(struct page *page, unsigned int class_idx,
+				enum fullness_group fullness)
+{
+	unsigned long m;
+
+	BUG_ON(!is_first_page(page));
+
+	m = ((class_idx & CLASS_IDX_MASK) << FULLNESS_BITS) |
+			(fullness & FULLNESS_MASK);
+	page->mapping = (struct address_space *)m;
+}
+
+static int get_size_class_index(int size)
+{
+	int idx = 0;
+
+	if (likely(size > ZS_MIN_ALLOC_SIZE))
+		idx = DIV_ROUND_UP(size - ZS_MIN_ALLOC_SIZE,
+				ZS_SIZE_CLASS_DELTA);
+
+	return idx;
+}
+
+static enum fullness_group get_fullness_group(struct page *page)
+{
+	int inuse, max_objects;
+
+	BUG_ON(!is_first_page(page));
+
+	inuse = page->inuse;
+	max_objects = page->objects;
+
+	if (inuse == 0)
+		return ZS_EMPTY;
+	if (inuse == max_objects)
+		return ZS_FULL;
+	if (inuse <= max_objects / fullness_threshold_frac)
+		return ZS_ALMOST_EMPTY;
+	return ZS_ALMOST_FULL;
+}
+
+/*
+ * Move a zspage to the fullness list matching its number of used
+ * objects, if it changed. Empty and full zspages are on no list.
+ * Returns the new fullness group. Called with the class lock held.
+ */
+static enum fullness_group fix_fullness_group(struct size_class *class,
+						struct page *first_page)
+{
+	unsigned int class_idx;
+	enum fullness_group currfg, newfg;
+
+	get_zspage_mapping(first_page, &class_idx, &currfg);
+	newfg = get_fullness_group(first_page);
+	if (newfg == currfg)
+		goto out;
+
+	if (currfg < _ZS_NR_FULLNESS_GROUPS)
+		list_del_init(&first_page->lru);
+	if (newfg < _ZS_NR_FULLNESS_GROUPS)
+		list_add(&first_page->lru, &class->fullness_list[newfg]);
+
+	set_zspage_mapping(first_page, class_idx, newfg);
+
+out:
+	return newfg;
+}
+
+/*
+ * Pick the number of pages per zspage that wastes the smallest share of
+ * the zspage for objects of the given size.
+ */
+static int get_pages_per_zspage(int class_size)
+{
+	int i, max_usedpc = 0;
+	int max_usedpc_order = 1;
+
+	for (i = 1; i <= ZS_MAX_PAGES_PER_ZSPAGE; i++) {
+		int zspage_size;
+		int waste, usedpc;
+
+		zspage_size = i * PAGE_SIZE;
+		waste = zspage_size % class_size;
+		usedpc = (zspage_size - waste) * 100 / zspage_size;
+
+		if (usedpc > max_usedpc) {
+			max_usedpc = usedpc;
+			max_usedpc_order = i;
+		}
+	}
+
+	return max_usedpc_order;
+}
+
+static struct page *get_first_page(struct page *page)
+{
+	if (is_first_page(page))
+		return page;
+	return page->first_page;
+}
+
+static struct page *get_next_page(struct page *page)
+{
+	struct page *next;
+
+	if (is_last_page(page))
+		next = NULL;
+	else if (is_first_page(page))
+		next = (struct page *)page->private;
+	else
+		next = list_entry(page->lru.next, struct page, lru);
+
+	return next;
+}
+
+static unsigned long obj_location_to_handle(struct page *page,
+				unsigned long obj_idx)
+{
+	unsigned long handle;
+
+	handle = page_to_pfn(page) << OBJ_INDEX_BITS;
+	handle |= (obj_idx & OBJ_INDEX_MASK);
+
+	return handle;
+}
+
+static void obj_handle_to_location(unsigned long handle, struct page **page,
+				unsigned long *obj_idx)
+{
+	*page = pfn_to_page(handle >> OBJ_INDEX_BITS);
+	*obj_idx = handle & OBJ_INDEX_MASK;
+}
+
+/* Offset of an object within the page it starts in */
+static unsigned long obj_idx_to_offset(struct page *page,
+				unsigned long obj_idx, int class_size)
+{
+	unsigned long off = 0;
+
+	if (!is_first_page(page))
+		off = page->index;
+
+	return obj_idx * class_size - off;
+}
+
+static void reset_page(struct page *page)
+{
+	ClearPagePrivate(page);
+	ClearPagePrivate2(page);
+	set_page_private(page, 0);
+	page->mapping = NULL;
+	page->freelist = NULL;
+	reset_page_mapcount(page);
+}
+
+static void free_zspage(struct page *first_page)
+{
+	struct page *nextp, *tmp, *head_extra;
+
+	BUG_ON(!is_first_page(first_page));
+	BUG_ON(first_page->inuse);
+
+	head_extra = (struct page *)page_private(first_page);
+
+	reset_page(first_page);
+	__free_page(first_page);
+
+	/* zspage with only 1 system page */
+	if (!head_extra)
+		return;
+
+	list_for_each_entry_safe(nextp, tmp, &head_extra->lru, lru) {
+		list_del(&nextp->lru);
+		reset_page(nextp);
+		__free_page(nextp);
+	}
+	reset_page(head_extra);
+	__free_page(head_extra);
+}
+
+/* Link all the objects of a new zspage into its free list */
+static void init_zspage(struct page *first_page, struct size_class *class)
+{
+	unsigned long obj_idx = 0;
+	unsigned long page_start = 0;
+	struct page *page = first_page;
+
+	while (page) {
+		struct page *next_page;
+		struct link_free *link;
+		void *vaddr;
+
+		next_page = get_next_page(page);
+		vaddr = kmap_atomic(page, KM_USER0);
+
+		while (obj_idx < class->objs_per_zspage &&
+				obj_idx * class->size < page_start + PAGE_SIZE) {
+			unsigned long next_idx = obj_idx + 1;
+			struct page *next_obj_page = page;
+
+			link = vaddr + obj_idx * class->size - page_start;
+			if (next_idx == class->objs_per_zspage) {
+				link->next = 0;
+			} else {
+				if (next_idx * class->size >=
+						page_start + PAGE_SIZE)
+					next_obj_page = next_page;
+				link->next = obj_location_to_handle(
+						next_obj_page, next_idx);
+			}
+			obj_idx = next_idx;
+		}
+
+		kunmap_atomic(vaddr, KM_USER0);
+		page = next_page;
+		page_start += PAGE_SIZE;
+	}
+}
+
+/* Allocate and set up a zspage for the given class */
+static struct page *alloc_zspage(struct size_class *class, gfp_t flags)
+{
+	int i;
+	struct page *pages[ZS_MAX_PAGES_PER_ZSPAGE];
+	struct page *first_page;
+
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		pages[i] = alloc_page(flags);
+		if (!pages[i])
+			goto cleanup;
+	}
+
+	/*
+	 * Link the pages together as:
+	 * 1. first page->private = second page
+	 * 2. all sub-pages are linked together using page->lru
+	 * 3. each sub-page is linked to the first page using ->first_page
+	 *
+	 * For each size class, the first page of its zspages is linked
+	 * into the fullness lists of the class using page->lru.
+	 */
+	first_page = pages[0];
+	for (i = 0; i < class->pages_per_zspage; i++) {
+		struct page *page = pages[i];
+
+		INIT_LIST_HEAD(&page->lru);
+		if (i == 0) {
+			SetPagePrivate(page);
+			set_page_private(page, 0);
+			page->inuse = 0;
+			page->objects = class->objs_per_zspage;
+		} else {
+			page->first_page = first_page;
+			page->index = i * PAGE_SIZE;
+		}
+		if (i == 1)
+			set_page_private(first_page, (unsigned long)page);
+		if (i >= 2)
+			list_add(&page->lru, &pages[i - 1]->lru);
+		if (i == class->pages_per_zspage - 1)
+			SetPagePrivate2(page);
+	}
+
+	init_zspage(first_page, class);
+
+	first_page->freelist = (void *)obj_location_to_handle(first_page, 0);
+
+	return first_page;
+
+cleanup:
+	while (--i >= 0)
+		__free_page(pages[i]);
+	return NULL;
+}
+
+static struct page *find_get_zspage(struct size_class *class)
+{
+	int i;
+
+	for (i = 0; i < _ZS_NR_FULLNESS_GROUPS; i++) {
+		if (!list_empty(&class->fullness_list[i]))
+			return list_first_entry(&class->fullness_list[i],
+						struct page, lru);
+	}
+
+	return NULL;
+}
+
+#ifdef CONFIG_DEBUG_FS
+
+static struct dentry *zs_debugfs_root;
+
+/*
+ * Per class usage of a pool. Objects that are allocated but not in use
+ * are the internal fragmentation of the class; the difference between
+ * the size of the objects and the size of the data stored in them is
+ * not known here.
+ */
+static int zs_stats_show(struct seq_file *s, void *v)
+{
+	struct zs_pool *pool = s->private;
+	u64 total_inuse = 0, total_allocated = 0, total_pages = 0;
+	int i;
+
+	seq_printf(s, "%5s %5s %8s %10s %10s %10s %6s\n", "class", "size",
+		"pages/zs", "obj_inuse", "obj_alloc", "pages", "frag%");
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+		u64 inuse, allocated, pages;
+
+		spin_lock(&class->lock);
+		inuse = class->objs_inuse;
+		pages = class->pages_allocated;
+		spin_unlock(&class->lock);
+
+		if (!pages)
+			continue;
+
+		allocated = div_u64(pages, class->pages_per_zspage) *
+				class->objs_per_zspage;
+		seq_printf(s, "%5u %5d %8d %10llu %10llu %10llu %6llu\n",
+			class->index, class->size, class->pages_per_zspage,
+			inuse, allocated, pages,
+			div64_u64((allocated - inuse) * 100, allocated));
+
+		total_inuse += inuse * class->size;
+		total_allocated += allocated * class->size;
+		total_pages += pages;
+	}
+
+	seq_printf(s, "\ntotal: %llu bytes in use in %llu pages, %llu%% "
+		"of the pages used\n", total_inuse, total_pages,
+		total_pages ? div64_u64(total_inuse * 100,
+					total_pages << PAGE_SHIFT) : 0);
+
+	return 0;
+}
+
+static int zs_stats_open(struct inode *inode, struct file *file)
+{
+	return single_open(file, zs_stats_show, inode->i_private);
+}
+
+static const struct file_operations zs_stats_fops = {
+	.owner = THIS_MODULE,
+	.open = zs_stats_open,
+	.read = seq_read,
+	.llseek = seq_lseek,
+	.release = single_release,
+};
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+	if (!zs_debugfs_root)
+		return;
+
+	pool->debugfs_dentry = debugfs_create_file(pool->name, S_IRUGO,
+					zs_debugfs_root, pool, &zs_stats_fops);
+	if (!pool->debugfs_dentry)
+		pr_warning("no debugfs stats for pool %s\n",
+			pool->name);
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+	debugfs_remove(pool->debugfs_dentry);
+}
+
+static void __init zs_stat_init(void)
+{
+	zs_debugfs_root = debugfs_create_dir("zsmalloc", NULL);
+}
+
+#else
+
+static void zs_pool_stat_create(struct zs_pool *pool)
+{
+}
+
+static void zs_pool_stat_destroy(struct zs_pool *pool)
+{
+}
+
+static void __init zs_stat_init(void)
+{
+}
+
+#endif
+
+/**
+ * zs_create_pool - Creates an allocation pool to work from.
+ * @name: name of the pool, used for its statistics
+ * @flags: allocation flags used to allocate pool pages, may include
+ *	__GFP_HIGHMEM
+ *
+ * Returns the new pool or NULL on failure.
+ */
+struct zs_pool *zs_create_pool(const char *name, gfp_t flags)
+{
+	int i;
+	struct zs_pool *pool;
+
+	if (!zs_initialized)
+		return NULL;
+
+	pool = kzalloc(sizeof(*pool), GFP_KERNEL);
+	if (!pool)
+		return NULL;
+
+	pool->name = kstrdup(name, GFP_KERNEL);
+	if (!pool->name) {
+		kfree(pool);
+		return NULL;
+	}
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		int fg;
+		struct size_class *class = &pool->size_class[i];
+
+		class->size = ZS_MIN_ALLOC_SIZE + i * ZS_SIZE_CLASS_DELTA;
+		class->index = i;
+		spin_lock_init(&class->lock);
+		class->pages_per_zspage = get_pages_per_zspage(class->size);
+		class->objs_per_zspage = class->pages_per_zspage *
+					PAGE_SIZE / class->size;
+		for (fg = 0; fg < _ZS_NR_FULLNESS_GROUPS; fg++)
+			INIT_LIST_HEAD(&class->fullness_list[fg]);
+	}
+
+	pool->flags = flags;
+	zs_pool_stat_create(pool);
+
+	return pool;
+}
+EXPORT_SYMBOL_GPL(zs_create_pool);
+
+/**
+ * zs_destroy_pool - Destroys a pool, all its objects must have been freed.
+ * @pool: pool to destroy
+ */
+void zs_destroy_pool(struct zs_pool *pool)
+{
+	int i;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++) {
+		struct size_class *class = &pool->size_class[i];
+
+		if (class->pages_allocated)
+			pr_info("freeing non-empty size class %d of "
+				"pool %s: %llu objects leaked\n", class->size,
+				pool->name, class->objs_inuse);
+	}
+
+	zs_pool_stat_destroy(pool);
+	kfree(pool->name);
+	kfree(pool);
+}
+EXPORT_SYMBOL_GPL(zs_destroy_pool);
+
+/**
+ * zs_malloc - Allocate an object of given size from the pool.
+ * @pool: pool to allocate from
+ * @size: size of the object, at most ZS_MAX_ALLOC_SIZE
+ *
+ * The object is not directly addressable: use zs_map_object() on the
+ * returned handle to get at it.
+ *
+ * Returns the handle of the object or 0 on failure.
+ */
+unsigned long zs_malloc(struct zs_pool *pool, size_t size)
+{
+	unsigned long obj;
+	struct link_free *link;
+	int class_idx;
+	struct size_class *class;
+
+	struct page *first_page, *m_page;
+	unsigned long m_objidx, m_offset;
+
+	if (unlikely(!size || size > ZS_MAX_ALLOC_SIZE))
+		return 0;
+
+	class_idx = get_size_class_index(size);
+	class = &pool->size_class[class_idx];
+	BUG_ON(class_idx != class->index);
+
+	spin_lock(&class->lock);
+	first_page = find_get_zspage(class);
+
+	if (!first_page) {
+		spin_unlock(&class->lock);
+		first_page = alloc_zspage(class, pool->flags);
+		if (unlikely(!first_page))
+			return 0;
+
+		set_zspage_mapping(first_page, class->index, ZS_EMPTY);
+		spin_lock(&class->lock);
+		class->pages_allocated += class->pages_per_zspage;
+	}
+
+	obj = (unsigned long)first_page->freelist;
+	obj_handle_to_location(obj, &m_page, &m_objidx);
+	m_offset = obj_idx_to_offset(m_page, m_objidx, class->size);
+
+	link = (struct link_free *)((unsigned char *)kmap_atomic(m_page,
+					KM_USER0) + m_offset);
+	first_page->freelist = (void *)link->next;
+	kunmap_atomic(link, KM_USER0);
+
+	first_page->inuse++;
+	class->objs_inuse++;
+	/* Now move the zspage to another fullness group, if required */
+	fix_fullness_group(class, first_page);
+	spin_unlock(&class->lock);
+
+	return obj;
+}
+EXPORT_SYMBOL_GPL(zs_malloc);
+
+/**
+ * zs_free - Free an object allocated with zs_malloc().
+ * @pool: pool the object was allocated from
+ * @handle: handle of the object, 0 is ignored
+ *
+ * The zspage of the object is freed along with its last object.
+ */
+void zs_free(struct zs_pool *pool, unsigned long handle)
+{
+	struct link_free *link;
+	struct page *first_page, *f_page;
+	unsigned long f_objidx, f_offset;
+
+	unsigned int class_idx;
+	enum fullness_group fullness;
+	struct size_class *class;
+
+	if (unlikely(!handle))
+		return;
+
+	obj_handle_to_location(handle, &f_page, &f_objidx);
+	first_page = get_first_page(f_page);
+
+	get_zspage_mapping(first_page, &class_idx, &fullness);
+	class = &pool->size_class[class_idx];
+	f_offset = obj_idx_to_offset(f_page, f_objidx, class->size);
+
+	spin_lock(&class->lock);
+
+	/* Insert this object in containing zspage's freelist */
+	link = (struct link_free *)((unsigned char *)kmap_atomic(f_page,
+					KM_USER0) + f_offset);
+	link->next = (unsigned long)first_page->freelist;
+	kunmap_atomic(link, KM_USER0);
+	first_page->freelist = (void *)handle;
+
+	first_page->inuse--;
+	class->objs_inuse--;
+	fullness = fix_fullness_group(class, first_page);
+
+	if (fullness == ZS_EMPTY)
+		class->pages_allocated -= class->pages_per_zspage;
+
+	spin_unlock(&class->lock);
+
+	if (fullness == ZS_EMPTY)
+		free_zspage(first_page);
+}
+EXPORT_SYMBOL_GPL(zs_free);
+
+/* Copy an object spanning two pages to or from a linear buffer */
+static void zs_copy_object(char *buf, struct page *page, unsigned long off,
+				int size, bool to_buf)
+{
+	int sizes[2];
+	struct page *pages[2];
+	int i, done = 0;
+
+	pages[0] = page;
+	pages[1] = get_next_page(page);
+	BUG_ON(!pages[1]);
+
+	sizes[0] = PAGE_SIZE - off;
+	sizes[1] = size - sizes[0];
+
+	for (i = 0; i < 2; i++) {
+		char *addr = kmap_atomic(pages[i], KM_USER0);
+
+		if (i == 0)
+			addr += off;
+		if (to_buf)
+			memcpy(buf + done, addr, sizes[i]);
+		else
+			memcpy(addr, buf + done, sizes[i]);
+		done += sizes[i];
+
+		if (i == 0)
+			addr -= off;
+		kunmap_atomic(addr, KM_USER0);
+	}
+}
+
+/**
+ * zs_map_object - Get the address of an object.
+ * @pool: pool the object was allocated from
+ * @handle: handle returned by zs_malloc()
+ * @mm: what the caller will do with the object
+ *
+ * Objects within a single page are mapped in place; objects spanning two
+ * pages are copied to a per-cpu buffer, and back by zs_unmap_object()
+ * unless mapped ZS_MM_RO. Either way this disables preemption until the
+ * object is unmapped: only one object may be mapped at a time and the
+ * caller must not sleep until then.
+ */
+void *zs_map_object(struct zs_pool *pool, unsigned long handle,
+			enum zs_mapmode mm)
+{
+	struct page *page;
+	unsigned long obj_idx, off;
+
+	unsigned int class_idx;
+	enum fullness_group fg;
+	struct size_class *class;
+	struct mapping_area *area;
+
+	BUG_ON(!handle);
+
+	obj_handle_to_location(handle, &page, &obj_idx);
+	get_zspage_mapping(get_first_page(page), &class_idx, &fg);
+	class = &pool->size_class[class_idx];
+	off = obj_idx_to_offset(page, obj_idx, class->size);
+
+	area = &get_cpu_var(zs_map_area);
+	area->vm_mm = mm;
+	if (off + class->size <= PAGE_SIZE) {
+		/* this object is contained entirely within a page */
+		area->vm_addr = kmap_atomic(page, KM_USER0);
+		return area->vm_addr + off;
+	}
+
+	/* this object spans two pages */
+	area->vm_addr = NULL;
+	if (mm != ZS_MM_WO)
+		zs_copy_object(area->vm_buf, page, off, class->size, true);
+
+	return area->vm_buf;
+}
+EXPORT_SYMBOL_GPL(zs_map_object);
+
+/**
+ * zs_unmap_object - Unmap an object mapped with zs_map_object().
+ * @pool: pool the object was allocated from
+ * @handle: handle of the object
+ */
+void zs_unmap_object(struct zs_pool *pool, unsigned long handle)
+{
+	struct page *page;
+	unsigned long obj_idx, off;
+
+	unsigned int class_idx;
+	enum fullness_group fg;
+	struct size_class *class;
+	struct mapping_area *area;
+
+	BUG_ON(!handle);
+
+	area = &__get_cpu_var(zs_map_area);
+	if (area->vm_addr) {
+		kunmap_atomic(area->vm_addr, KM_USER0);
+		goto out;
+	}
+
+	if (area->vm_mm != ZS_MM_RO) {
+		obj_handle_to_location(handle, &page, &obj_idx);
+		get_zspage_mapping(get_first_page(page), &class_idx, &fg);
+		class = &pool->size_class[class_idx];
+		off = obj_idx_to_offset(page, obj_idx, class->size);
+
+		zs_copy_object(area->vm_buf, page, off, class->size, false);
+	}
+
+out:
+	put_cpu_var(zs_map_area);
+}
+EXPORT_SYMBOL_GPL(zs_unmap_object);
+
+/**
+ * zs_get_total_size_bytes - Memory used by the pool, in bytes.
+ * @pool: pool to report on
+ */
+u64 zs_get_total_size_bytes(struct zs_pool *pool)
+{
+	int i;
+	u64 npages = 0;
+
+	for (i = 0; i < ZS_SIZE_CLASSES; i++)
+		npages += pool->size_class[i].pages_allocated;
+
+	return npages << PAGE_SHIFT;
+}
+EXPORT_SYMBOL_GPL(zs_get_total_size_bytes);
+
+/*
+ * The bounce buffers are allocated for all possible CPUs up front, which
+ * spares us a CPU hotplug notifier for a few pages per CPU.
+ */
+static int __init zs_init(void)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct mapping_area *area = &per_cpu(zs_map_area, cpu);
+
+		area->vm_buf = kmalloc(ZS_MAX_ALLOC_SIZE, GFP_KERNEL);
+		if (!area->vm_buf)
+			goto fail;
+	}
+
+	zs_stat_init();
+	zs_initialized = true;
+
+	return 0;
+
+fail:
+	for_each_possible_cpu(cpu) {
+		struct mapping_area *area = &per_cpu(zs_map_area, cpu);
+
+		kfree(area->vm_buf);
+		area->vm_buf = NULL;
+	}
+	pr_err("cannot allocate mapping buffers\n");
+
+	return -ENOMEM;
+}
+
+module_init(zs_init);
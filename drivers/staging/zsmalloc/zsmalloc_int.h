@@ -0,0 +1,114 @@
+/*
+ * zsmalloc memory allocator
+ *
+ * This code is released using a dual license strategy: BSD/GPL
+ * You can choose the licence that better fits your requirements.
+ *
+ * Released under the terms of 3-clause BSD License
+ * Released under the terms of GNU General Public License Version 2.0
+ */
+
+#ifndef _ZS_MALLOC_INT_H_
+#define _ZS_MALLOC_INT_H_
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+
+/*
+ * A zspage is made of up to this many, not necessarily contiguous,
+ * pages. More pages per zspage means less waste at the end of it for
+ * sizes that do not divide PAGE_SIZE, but also more pages pinned by
+ * a single live object.
+ */
+#define ZS_MAX_PAGES_PER_ZSPAGE	(_AC(1, UL) << 2)
+
+/*
+ * A handle is the pfn of the page an object starts in and the index of
+ * the object in its zspage. Without sparsemem we do not know how many
+ * bits a pfn needs, so assume it can use them all but PAGE_SHIFT.
+ */
+#ifndef MAX_PHYSMEM_BITS
+#ifdef CONFIG_HIGHMEM64G
+#define MAX_PHYSMEM_BITS	36
+#else
+#define MAX_PHYSMEM_BITS	BITS_PER_LONG
+#endif
+#endif
+#define _PFN_BITS		(MAX_PHYSMEM_BITS - PAGE_SHIFT)
+#define OBJ_INDEX_BITS		(BITS_PER_LONG - _PFN_BITS)
+#define OBJ_INDEX_MASK		((_AC(1, UL) << OBJ_INDEX_BITS) - 1)
+
+/*
+ * Objects are at least this big: a free object must hold a link_free
+ * and the index of any object of a zspage must fit in OBJ_INDEX_BITS.
+ */
+#define _ZS_MIN_OBJ_SIZE \
+	(ZS_MAX_PAGES_PER_ZSPAGE << PAGE_SHIFT >> OBJ_INDEX_BITS)
+#define ZS_MIN_ALLOC_SIZE \
+	(_ZS_MIN_OBJ_SIZE > 32 ? ALIGN(_ZS_MIN_OBJ_SIZE, ZS_SIZE_CLASS_DELTA) : 32)
+#define ZS_MAX_ALLOC_SIZE	PAGE_SIZE
+
+/*
+ * Size classes are ZS_SIZE_CLASS_DELTA bytes apart. This keeps objects
+ * aligned enough that a link_free never crosses a page boundary.
+ */
+#define ZS_SIZE_CLASS_DELTA	16
+#define ZS_SIZE_CLASSES		((ZS_MAX_ALLOC_SIZE - ZS_MIN_ALLOC_SIZE) / \
+					ZS_SIZE_CLASS_DELTA + 1)
+
+/*
+ * A zspage whose in use objects are at most 1/fullness_threshold_frac
+ * of its capacity is "almost empty", any other partially used one is
+ * "almost full". Allocations are served from almost full zspages first
+ * so that almost empty ones get a chance to drain and be freed.
+ */
+static const int fullness_threshold_frac = 4;
+
+enum fullness_group {
+	ZS_ALMOST_FULL,
+	ZS_ALMOST_EMPTY,
+	_ZS_NR_FULLNESS_GROUPS,
+
+	ZS_EMPTY,
+	ZS_FULL
+};
+
+struct size_class {
+	/* Size of objects in this class */
+	int size;
+	unsigned int index;
+
+	/* Number of PAGE_SIZE sized pages in a zspage of this class */
+	int pages_per_zspage;
+	/* Number of objects a zspage of this class holds */
+	unsigned int objs_per_zspage;
+
+	spinlock_t lock;
+
+	/* stats */
+	u64 pages_allocated;
+	u64 objs_inuse;
+
+	/* First pages of the partially used zspages, linked by ->lru */
+	struct list_head fullness_list[_ZS_NR_FULLNESS_GROUPS];
+};
+
+/*
+ * Placed within free objects to form a singly linked list of the free
+ * objects of a zspage. The link is the handle of the next free object.
+ */
+struct link_free {
+	unsigned long next;
+};
+
+struct zs_pool {
+	struct size_class size_class[ZS_SIZE_CLASSES];
+
+	gfp_t flags;	/* allocation flags used when growing pool */
+	char *name;
+	struct dentry *debugfs_dentry;
+};
+
+#endif
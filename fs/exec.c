@@ -265,6 +265,7 @@ static int __bprm_mm_init(struct linux_binprm *bprm)
 
 	down_write(&mm->mmap_sem);
 	vma->vm_mm = mm;
+	vma_init_sequence(vma);
 
 	/*
 	 * Place the stack at the largest stack address the architecture
@@ -1949,7 +1949,7 @@ out:
 	return ~0U;
 }
 
-#define PROC_FDINFO_MAX 64
+#define PROC_FDINFO_MAX 160
 
 static int proc_fd_info(struct inode *inode, struct path *path, char *info)
 {
@@ -1974,12 +1974,24 @@ static int proc_fd_info(struct inode *inode, struct path *path, char *info)
 				*path = file->f_path;
 				path_get(&file->f_path);
 			}
-			if (info)
-				snprintf(info, PROC_FDINFO_MAX,
-					 "pos:\t%lli\n"
-					 "flags:\t0%o\n",
-					 (long long) file->f_pos,
-					 file->f_flags);
+			if (info) {
+				int len;
+
+				len = snprintf(info, PROC_FDINFO_MAX,
+					       "pos:\t%lli\n"
+					       "flags:\t0%o\n",
+					       (long long) file->f_pos,
+					       file->f_flags);
+				if (S_ISREG(file->f_path.dentry->d_inode->i_mode))
+					snprintf(info + len,
+						 PROC_FDINFO_MAX - len,
+						 "ra_hit:\t%lu\n"
+						 "ra_miss:\t%lu\n"
+						 "ra_waste:\t%lu\n",
+						 file->f_ra.hit,
+						 file->f_ra.miss,
+						 file->f_ra.waste);
+			}
 			spin_unlock(&files->file_lock);
 			put_files_struct(files);
 			return 0;
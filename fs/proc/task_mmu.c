@@ -397,6 +397,10 @@ static int smaps_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 		if (pmd_trans_splitting(*pmd)) {
 			spin_unlock(&walk->mm->page_table_lock);
 			wait_split_huge_page(vma->anon_vma, pmd);
+		} else if (is_huge_zero_pmd(*pmd)) {
+			/* like the small zero page, not accounted */
+			spin_unlock(&walk->mm->page_table_lock);
+			return 0;
 		} else {
 			smaps_pte_entry(*(pte_t *)pmd, addr,
 					HPAGE_PMD_SIZE, walk);
@@ -471,6 +475,15 @@ static int show_smap(struct seq_file *m, void *v)
 		   (vma->vm_flags & VM_LOCKED) ?
 			(unsigned long)(mss.pss >> (10 + PSS_SHIFT)) : 0);
 
+#ifdef CONFIG_KSM
+	if (vma->vm_flags & VM_MERGEABLE)
+		seq_printf(m,
+			   "KsmScanned:     %8lu kB\n"
+			   "KsmMerged:      %8lu kB\n",
+			   vma->ksm_pages_scanned << (PAGE_SHIFT - 10),
+			   vma->ksm_pages_merged << (PAGE_SHIFT - 10));
+#endif
+
 	if (m->count < m->size)  /* vma is copied successfully */
 		m->version = (vma != get_gate_vma(task->mm))
 			? vma->vm_start : 0;
@@ -504,7 +517,7 @@ static int clear_refs_pte_range(pmd_t *pmd, unsigned long addr,
 	spinlock_t *ptl;
 	struct page *page;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd(vma, addr, pmd);
 
 	pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
 	for (; addr != end; pte++, addr += PAGE_SIZE) {
@@ -662,7 +675,7 @@ static int pagemap_pte_range(pmd_t *pmd, unsigned long addr, unsigned long end,
 	pte_t *pte;
 	int err = 0;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd_mm(walk->mm, addr, pmd);
 
 	/* find the first VMA at or above 'addr' */
 	vma = find_vma(walk->mm, addr);
@@ -62,6 +62,9 @@ struct bdi_writeback {
 struct backing_dev_info {
 	struct list_head bdi_list;
 	unsigned long ra_pages;	/* max readahead in PAGE_CACHE_SIZE units */
+	unsigned int ra_shift;	/* ra_pages is scaled down by this much */
+	atomic_long_t ra_accounted; /* readahead pages accounted this period */
+	atomic_long_t ra_waste;	/* of which were never used */
 	unsigned long state;	/* Always use atomic bitops on this */
 	unsigned int capabilities; /* Device capabilities */
 	congested_fn *congested_fn; /* Function pointer if device is md/dm */
@@ -18,6 +18,8 @@ extern int sysctl_compaction_handler(struct ctl_table *table, int write,
 extern int sysctl_extfrag_threshold;
 extern int sysctl_extfrag_handler(struct ctl_table *table, int write,
 			void __user *buffer, size_t *length, loff_t *ppos);
+extern int sysctl_kcompactd_extfrag_threshold;
+extern int sysctl_kcompactd_sleep_millisecs;
 
 extern int fragmentation_index(struct zone *zone, unsigned int order);
 extern unsigned long try_to_compact_pages(struct zonelist *zonelist,
@@ -26,6 +28,10 @@ extern unsigned long try_to_compact_pages(struct zonelist *zonelist,
 extern unsigned long compaction_suitable(struct zone *zone, int order);
 extern unsigned long compact_zone_order(struct zone *zone, int order,
 					gfp_t gfp_mask, bool sync);
+extern int kcompactd_run(int nid);
+extern void kcompactd_stop(int nid);
+extern void wakeup_kcompactd(struct zone *zone, int order,
+			     enum zone_type classzone_idx);
 
 /* Do not skip compaction more than 64 times */
 #define COMPACT_MAX_DEFER_SHIFT 6
@@ -75,6 +81,20 @@ static inline unsigned long compact_zone_order(struct zone *zone, int order,
 	return COMPACT_CONTINUE;
 }
 
+static inline int kcompactd_run(int nid)
+{
+	return 0;
+}
+
+static inline void kcompactd_stop(int nid)
+{
+}
+
+static inline void wakeup_kcompactd(struct zone *zone, int order,
+				    enum zone_type classzone_idx)
+{
+}
+
 static inline void defer_compaction(struct zone *zone)
 {
 }
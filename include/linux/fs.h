@@ -915,7 +915,28 @@ struct file_ra_state {
 
 	unsigned int ra_pages;		/* Maximum readahead window */
 	unsigned int mmap_miss;		/* Cache miss stat for mmap accesses */
+	unsigned int mmap_hit;		/* read-around pages faulted in */
 	loff_t prev_pos;		/* Cache last read() position */
+
+	unsigned int pattern;		/* RA_PATTERN_* of the window */
+	long stride;			/* distance between the last two misses */
+	pgoff_t prev_miss;		/* offset of the last cache miss */
+
+	unsigned long hit;		/* readahead pages used */
+	unsigned long miss;		/* synchronous cache misses */
+	unsigned long waste;		/* readahead pages left unused */
+};
+
+/*
+ * Access pattern the current readahead window was sized for.
+ * RA_PATTERN_NONE means there is no window to account for.
+ */
+enum {
+	RA_PATTERN_NONE,
+	RA_PATTERN_SEQUENTIAL,
+	RA_PATTERN_AROUND,		/* mmap read-around */
+	RA_PATTERN_STRIDE,
+	RA_PATTERN_BACKWARD,
 };
 
 /*
@@ -38,6 +38,16 @@ static inline void ksm_exit(struct mm_struct *mm)
 		__ksm_exit(mm);
 }
 
+/*
+ * A vma copied by fork, mremap or split is a new mapping for smaps: its
+ * ksmd counts start from zero.
+ */
+static inline void ksm_vma_init(struct vm_area_struct *vma)
+{
+	vma->ksm_pages_scanned = 0;
+	vma->ksm_pages_merged = 0;
+}
+
 /*
  * A KSM page is one of those write-protected "shared pages" or "merged pages"
  * which KSM maps into multiple mms, wherever identical anonymous page content
@@ -101,6 +111,10 @@ static inline void ksm_exit(struct mm_struct *mm)
 {
 }
 
+static inline void ksm_vma_init(struct vm_area_struct *vma)
+{
+}
+
 static inline int PageKsm(struct page *page)
 {
 	return 0;
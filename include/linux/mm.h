@@ -191,6 +191,10 @@ struct vm_fault {
 					 * is set (which is also implied by
 					 * VM_FAULT_ERROR).
 					 */
+	/* for ->map_pages() only */
+	pgoff_t max_pgoff;		/* map pages for offset from pgoff till
+					 * max_pgoff inclusive */
+	pte_t *pte;			/* pte entry associated with ->pgoff */
 };
 
 /*
@@ -203,6 +207,12 @@ struct vm_operations_struct {
 	void (*close)(struct vm_area_struct * area);
 	int (*fault)(struct vm_area_struct *vma, struct vm_fault *vmf);
 
+	/*
+	 * Map the pages around a read fault that need no I/O, called with
+	 * the pte lock held: see do_fault_around().
+	 */
+	void (*map_pages)(struct vm_area_struct *vma, struct vm_fault *vmf);
+
 	/* notification that a previously read-only page is about to become
 	 * writable, if an error is returned it will cause a SIGBUS */
 	int (*page_mkwrite)(struct vm_area_struct *vma, struct vm_fault *vmf);
@@ -981,6 +991,48 @@ static inline int handle_mm_fault(struct mm_struct *mm,
 }
 #endif
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * The fields of a vma that the speculative page fault relies upon are
+ * only changed between vma_write_begin() and vma_write_end(), with
+ * mmap_sem held for writing, and the vma is freed after an RCU grace
+ * period once its last reference is put.
+ */
+static inline void vma_init_sequence(struct vm_area_struct *vma)
+{
+	seqcount_init(&vma->vm_sequence);
+	atomic_set(&vma->vm_ref_count, 1);
+}
+
+static inline void vma_write_begin(struct vm_area_struct *vma)
+{
+	write_seqcount_begin(&vma->vm_sequence);
+}
+
+static inline void vma_write_end(struct vm_area_struct *vma)
+{
+	write_seqcount_end(&vma->vm_sequence);
+}
+
+extern int handle_speculative_fault(struct mm_struct *mm,
+			unsigned long address, unsigned int flags);
+extern struct vm_area_struct *find_vma_rcu(struct mm_struct *mm,
+			unsigned long addr);
+extern void put_vma(struct vm_area_struct *vma);
+#else
+static inline void vma_init_sequence(struct vm_area_struct *vma)
+{
+}
+
+static inline void vma_write_begin(struct vm_area_struct *vma)
+{
+}
+
+static inline void vma_write_end(struct vm_area_struct *vma)
+{
+}
+#endif
+
 extern int make_pages_present(unsigned long addr, unsigned long end);
 extern int access_process_vm(struct task_struct *tsk, unsigned long addr, void *buf, int len, int write);
 extern int access_remote_vm(struct mm_struct *mm, unsigned long addr,
@@ -1487,6 +1539,9 @@ extern void truncate_inode_pages_range(struct address_space *,
 
 /* generic vm_area_ops exported for stackable file systems */
 extern int filemap_fault(struct vm_area_struct *, struct vm_fault *);
+extern void filemap_map_pages(struct vm_area_struct *, struct vm_fault *);
+
+extern unsigned long sysctl_fault_around_bytes;
 
 /* mm/page-writeback.c */
 int write_one_page(struct page *page, int wait);
@@ -1516,6 +1571,8 @@ unsigned long max_sane_readahead(unsigned long nr);
 unsigned long ra_submit(struct file_ra_state *ra,
 			struct address_space *mapping,
 			struct file *filp);
+void ra_window_abandon(struct address_space *mapping,
+		       struct file_ra_state *ra);
 
 /* Do stack extension */
 extern int expand_stack(struct vm_area_struct *vma, unsigned long address);
@@ -21,6 +21,63 @@ static inline int page_is_file_cache(struct page *page)
 	return !PageSwapBacked(page);
 }
 
+/**
+ * pfn_zone_lru - the LRU sub-list of a page frame
+ * @zone: the zone of the page frame
+ * @pfn: the page frame number
+ *
+ * Pages are spread over the sub-lists of their zone by pageblock, so
+ * that physically contiguous pages share the same sub-list and lock.
+ */
+static inline struct zone_lru *pfn_zone_lru(struct zone *zone,
+					    unsigned long pfn)
+{
+	return &zone->lru[(pfn >> pageblock_order) & (LRU_SHARDS - 1)];
+}
+
+/**
+ * page_zone_lru - the LRU sub-list of a page
+ * @page: the page
+ */
+static inline struct zone_lru *page_zone_lru(struct page *page)
+{
+	return pfn_zone_lru(page_zone(page), page_to_pfn(page));
+}
+
+/**
+ * page_lru_lock - the lock protecting the LRU state of a page
+ * @page: the page
+ *
+ * This protects PageLRU, PageActive and PageUnevictable of pages on the
+ * LRU and their list linkage.
+ */
+static inline spinlock_t *page_lru_lock(struct page *page)
+{
+	return &page_zone_lru(page)->lock;
+}
+
+/*
+ * Lock all the LRU sub-lists of a zone, for walking lists that mix pages
+ * of different sub-lists: the memcg LRU lists.
+ */
+static inline void zone_lru_lock_all_irq(struct zone *zone)
+{
+	int i;
+
+	local_irq_disable();
+	for (i = 0; i < LRU_SHARDS; i++)
+		spin_lock_nested(&zone->lru[i].lock, i);
+}
+
+static inline void zone_lru_unlock_all_irq(struct zone *zone)
+{
+	int i;
+
+	for (i = LRU_SHARDS - 1; i >= 0; i--)
+		spin_unlock(&zone->lru[i].lock);
+	local_irq_enable();
+}
+
 static inline void
 __add_page_to_lru_list(struct zone *zone, struct page *page, enum lru_list l,
 		       struct list_head *head)
@@ -33,7 +90,7 @@ __add_page_to_lru_list(struct zone *zone, struct page *page, enum lru_list l,
 static inline void
 add_page_to_lru_list(struct zone *zone, struct page *page, enum lru_list l)
 {
-	__add_page_to_lru_list(zone, page, l, &zone->lru[l].list);
+	__add_page_to_lru_list(zone, page, l, &page_zone_lru(page)->list[l]);
 }
 
 static inline void
@@ -62,7 +62,7 @@ struct free_area {
 struct pglist_data;
 
 /*
- * zone->lock and zone->lru_lock are two of the hottest locks in the kernel.
+ * zone->lock and the zone LRU locks are the hottest locks in the kernel.
  * So add a wild amount of padding here to ensure that they fall into separate
  * cachelines.  There are very few zone structures in the machine, so space
  * consumption is not a concern here.
@@ -106,6 +106,8 @@ enum zone_stat_item {
 	NR_SHMEM,		/* shmem pages (included tmpfs/GEM pages) */
 	NR_DIRTIED,		/* page dirtyings since bootup */
 	NR_WRITTEN,		/* page writings since bootup */
+	WORKINGSET_REFAULT,	/* evicted file pages read in again */
+	WORKINGSET_ACTIVATE,	/* ... and activated, see mm/workingset.c */
 #ifdef CONFIG_NUMA
 	NUMA_HIT,		/* allocated in intended node */
 	NUMA_MISS,		/* allocated in non intended node */
@@ -270,9 +272,12 @@ struct zone_reclaim_stat {
 	 * that cache is.
 	 *
 	 * The anon LRU stats live in [0], file LRU stats in [1]
+	 *
+	 * These are updated under the lock of whichever LRU sub-list the
+	 * page is on, so they are atomic rather than lock protected.
 	 */
-	unsigned long		recent_rotated[2];
-	unsigned long		recent_scanned[2];
+	atomic_long_t		recent_rotated[2];
+	atomic_long_t		recent_scanned[2];
 
 	/*
 	 * accumulated for batching
@@ -280,6 +285,33 @@ struct zone_reclaim_stat {
 	unsigned long		nr_saved_scan[NR_LRU_LISTS];
 };
 
+/*
+ * The LRU lists of a zone are split into LRU_SHARDS sub-lists, each with
+ * its own lock, so that adding pages to the LRU, rotating them and
+ * reclaiming them do not all serialize on a single lock per zone.
+ *
+ * A page always lives on the sub-list of its pageblock, see
+ * page_zone_lru(): lumpy reclaim, compaction and huge page splitting deal
+ * with physically contiguous pages and get away with one lock. Reclaim
+ * isolates its batches from one sub-list at a time, going round the
+ * sub-lists of the zone.
+ *
+ * Operations that need the whole LRU of a zone, such as memcg reclaim
+ * walking the per-memcg lists, take all the sub-list locks in order with
+ * zone_lru_lock_all_irq(). Lockdep allows no more than 8 of them.
+ */
+#ifdef CONFIG_SMP
+#define LRU_SHARDS_SHIFT	2
+#else
+#define LRU_SHARDS_SHIFT	0
+#endif
+#define LRU_SHARDS		(1 << LRU_SHARDS_SHIFT)
+
+struct zone_lru {
+	spinlock_t		lock;
+	struct list_head	list[NR_LRU_LISTS];
+} ____cacheline_aligned_in_smp;
+
 struct zone {
 	/* Fields commonly accessed by the page allocator */
 
@@ -344,13 +376,15 @@ struct zone {
 	ZONE_PADDING(_pad1_)
 
 	/* Fields commonly accessed by the page reclaim scanner */
-	spinlock_t		lru_lock;	
-	struct zone_lru {
-		struct list_head list;
-	} lru[NR_LRU_LISTS];
+	struct zone_lru		lru[LRU_SHARDS];
+	/* next sub-list reclaim isolates from, see zone_lru_scan_shard() */
+	unsigned int		lru_scan_shard;
 
 	struct zone_reclaim_stat reclaim_stat;
 
+	/* Evictions and activations of inactive file pages */
+	atomic_long_t		inactive_age;
+
 	unsigned long		pages_scanned;	   /* since last reclaim */
 	unsigned long		flags;		   /* zone flags, see below */
 
@@ -641,6 +675,12 @@ typedef struct pglist_data {
 	struct task_struct *kswapd;
 	int kswapd_max_order;
 	enum zone_type classzone_idx;
+#ifdef CONFIG_COMPACTION
+	wait_queue_head_t kcompactd_wait;
+	struct task_struct *kcompactd;
+	int kcompactd_max_order;
+	enum zone_type kcompactd_classzone_idx;
+#endif
 } pg_data_t;
 
 #define node_present_pages(nid)	(NODE_DATA(nid)->node_present_pages)
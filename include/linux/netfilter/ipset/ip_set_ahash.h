@@ -14,10 +14,22 @@
  *
  * Readers and resizing
  *
+ * Kernel side tests run under rcu_read_lock_bh() only, without the set
+ * lock, see ip_set_test(). Writers still hold the set lock for writing,
+ * so they exclude each other but not the tests:
+ *
+ * - an element is appended to a bucket in place when there is room:
+ *   the element is written before the count is raised, so a reader
+ *   sees either the old or the new count and valid data below it;
+ * - every other change (growing, deleting, replacing, expiring) builds
+ *   a new bucket, publishes it with rcu_assign_pointer() and frees the
+ *   old one after an RCU-bh grace period.
+ *
  * Resizing can be triggered by userspace command only, and those
  * are serialized by the nfnl mutex. During resizing the set is
  * read-locked, so the only possible concurrent operations are
- * the kernel side readers. Those must be protected by proper RCU locking.
+ * the tests: they keep using the old table until the new one is
+ * published, then the old one is freed after a grace period.
  */
 
 /* Number of elements to store in an initial array block */
@@ -25,20 +37,30 @@
 /* Max number of elements to store in an array block */
 #define AHASH_MAX_SIZE			(3*4)
 
-/* A hash bucket */
+/* A hash bucket: the header and the elements are allocated together,
+ * so a lookup in a short chain touches a single cache line. */
 struct hbucket {
-	void *value;		/* the array of the values */
+	struct rcu_head rcu;	/* freeing the bucket after a grace period */
 	u8 size;		/* size of the array */
 	u8 pos;			/* position of the first free entry */
+	unsigned char value[0]	/* the array of the values */
+		__attribute__ ((aligned));
 };
 
 /* The hash table: the table size stored here in order to make resizing easy */
 struct htable {
 	u8 htable_bits;		/* size of hash table == 2^htable_bits */
-	struct hbucket bucket[0]; /* hashtable buckets */
+	struct hbucket __rcu *bucket[0]; /* hashtable buckets */
 };
 
-#define hbucket(h, i)		&((h)->bucket[i])
+/* Readers and writers both run with BHs disabled */
+#define hbucket(h, i)		rcu_dereference_bh((h)->bucket[i])
+/* No readers can see the table (destroy, or not yet published) */
+#define hbucket_unseen(h, i)	rcu_dereference_protected((h)->bucket[i], 1)
+
+#define htable_size(htable_bits)				\
+	(sizeof(struct htable)					\
+	 + jhash_size(htable_bits) * sizeof(struct hbucket *))
 
 /* Book-keeping of the prefixes added to the set */
 struct ip_set_hash_nets {
@@ -124,6 +146,121 @@ del_cidr(struct ip_set_hash *h, u8 cidr, u8 host_mask)
 }
 #endif
 
+static inline struct hbucket *
+hbucket_alloc(u8 size, size_t dsize)
+{
+	struct hbucket *n;
+
+	n = kzalloc(sizeof(*n) + size * dsize, GFP_ATOMIC);
+	if (n)
+		n->size = size;
+	return n;
+}
+
+static void
+hbucket_free_rcu(struct rcu_head *head)
+{
+	kfree(container_of(head, struct hbucket, rcu));
+}
+
+/* Free a bucket which may still be looked at by readers */
+static inline void
+hbucket_free(struct hbucket *n)
+{
+	call_rcu_bh(&n->rcu, hbucket_free_rcu);
+}
+
+/* Number of valid elements in a bucket, for lockless readers */
+static inline u8
+hbucket_pos(const struct hbucket *n)
+{
+	u8 pos = ACCESS_ONCE(n->pos);
+
+	/* Pairs with smp_wmb() in ahash_add_elem() */
+	smp_rmb();
+	return pos;
+}
+
+/* Buckets grow and shrink in AHASH_INIT_SIZE steps */
+static inline u8
+hbucket_roundup(u8 pos)
+{
+	return pos ? roundup(pos, AHASH_INIT_SIZE) : AHASH_INIT_SIZE;
+}
+
+/* Append an element to the key bucket of the table */
+static int
+ahash_add_elem(struct htable *t, u32 key, const void *value, size_t dsize)
+{
+	struct hbucket *n = hbucket(t, key), *tmp;
+
+	if (n && n->pos < n->size) {
+		memcpy(n->value + n->pos * dsize, value, dsize);
+		/* Publish the element before the count */
+		smp_wmb();
+		n->pos++;
+		return 0;
+	}
+	if (n && n->size >= AHASH_MAX_SIZE)
+		/* Trigger rehashing */
+		return -EAGAIN;
+
+	tmp = hbucket_alloc((n ? n->size : 0) + AHASH_INIT_SIZE, dsize);
+	if (!tmp)
+		return -ENOMEM;
+	if (n) {
+		memcpy(tmp->value, n->value, n->pos * dsize);
+		tmp->pos = n->pos;
+	}
+	memcpy(tmp->value + tmp->pos * dsize, value, dsize);
+	tmp->pos++;
+
+	rcu_assign_pointer(t->bucket[key], tmp);
+	if (n)
+		hbucket_free(n);
+	return 0;
+}
+
+/* Delete the ith element from the key bucket of the table */
+static int
+ahash_del_elem(struct htable *t, u32 key, u8 i, size_t dsize)
+{
+	struct hbucket *n = hbucket(t, key), *tmp = NULL;
+
+	if (n->pos > 1) {
+		tmp = hbucket_alloc(hbucket_roundup(n->pos - 1), dsize);
+		if (!tmp)
+			return -ENOMEM;
+		memcpy(tmp->value, n->value, i * dsize);
+		memcpy(tmp->value + i * dsize, n->value + (i + 1) * dsize,
+		       (n->pos - i - 1) * dsize);
+		tmp->pos = n->pos - 1;
+	}
+
+	rcu_assign_pointer(t->bucket[key], tmp);
+	hbucket_free(n);
+	return 0;
+}
+
+/* Overwrite the ith element of the key bucket of the table */
+static int
+ahash_replace_elem(struct htable *t, u32 key, u8 i, const void *value,
+		   size_t dsize)
+{
+	struct hbucket *n = hbucket(t, key), *tmp;
+
+	tmp = hbucket_alloc(n->size, dsize);
+	if (!tmp)
+		return -ENOMEM;
+	memcpy(tmp->value, n->value, n->pos * dsize);
+	memcpy(tmp->value + i * dsize, value, dsize);
+	tmp->pos = n->pos;
+
+	rcu_assign_pointer(t->bucket[key], tmp);
+	hbucket_free(n);
+	return 0;
+}
+
 /* Destroy the hashtable part of the set */
 static void
 ahash_destroy(struct htable *t)
@@ -132,10 +269,9 @@ ahash_destroy(struct htable *t)
 	u32 i;
 
 	for (i = 0; i < jhash_size(t->htable_bits); i++) {
-		n = hbucket(t, i);
-		if (n->size)
-			/* FIXME: use slab cache */
-			kfree(n->value);
+		n = hbucket_unseen(t, i);
+		if (n)
+			kfree(n);
 	}
 
 	ip_set_free(t);
@@ -146,16 +282,19 @@ static size_t
 ahash_memsize(const struct ip_set_hash *h, size_t dsize, u8 host_mask)
 {
 	u32 i;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
+	const struct hbucket *n;
 	size_t memsize = sizeof(*h)
-			 + sizeof(*t)
 #ifdef IP_SET_HASH_WITH_NETS
 			 + sizeof(struct ip_set_hash_nets) * host_mask
 #endif
-			 + jhash_size(t->htable_bits) * sizeof(struct hbucket);
+			 + htable_size(t->htable_bits);
 
-	for (i = 0; i < jhash_size(t->htable_bits); i++)
-			memsize += t->bucket[i].size * dsize;
+	for (i = 0; i < jhash_size(t->htable_bits); i++) {
+		n = hbucket(t, i);
+		if (n)
+			memsize += sizeof(*n) + n->size * dsize;
+	}
 
 	return memsize;
 }
@@ -165,16 +304,15 @@ static void
 ip_set_hash_flush(struct ip_set *set)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
 	struct hbucket *n;
 	u32 i;
 
 	for (i = 0; i < jhash_size(t->htable_bits); i++) {
 		n = hbucket(t, i);
-		if (n->size) {
-			n->size = n->pos = 0;
-			/* FIXME: use slab cache */
-			kfree(n->value);
+		if (n) {
+			rcu_assign_pointer(t->bucket[i], NULL);
+			hbucket_free(n);
 		}
 	}
 #ifdef IP_SET_HASH_WITH_NETS
@@ -196,6 +334,10 @@ ip_set_hash_destroy(struct ip_set *set)
 	ahash_destroy(h->table);
 	kfree(h);
 
+	/* Buckets dropped by earlier deletes are freed by a callback
+	 * living in the set type module */
+	rcu_barrier_bh();
+
 	set->data = NULL;
 }
 
@@ -259,46 +401,31 @@ ip_set_hash_destroy(struct ip_set *set)
 #define ahash_data(n, i)	\
 	((struct type_pf_elem *)((n)->value) + (i))
 
-/* Add an element to the hash table when resizing the set:
- * we spare the maintenance of the internal counters. */
+/* Add an element to the key bucket of the table */
 static int
-type_pf_elem_add(struct hbucket *n, const struct type_pf_elem *value)
+type_pf_elem_add(struct htable *t, u32 key, const struct type_pf_elem *value)
 {
-	if (n->pos >= n->size) {
-		void *tmp;
-
-		if (n->size >= AHASH_MAX_SIZE)
-			/* Trigger rehashing */
-			return -EAGAIN;
+	struct type_pf_elem data = { };
 
-		tmp = kzalloc((n->size + AHASH_INIT_SIZE)
-			      * sizeof(struct type_pf_elem),
-			      GFP_ATOMIC);
-		if (!tmp)
-			return -ENOMEM;
-		if (n->size) {
-			memcpy(tmp, n->value,
-			       sizeof(struct type_pf_elem) * n->size);
-			kfree(n->value);
-		}
-		n->value = tmp;
-		n->size += AHASH_INIT_SIZE;
-	}
-	type_pf_data_copy(ahash_data(n, n->pos++), value);
-	return 0;
+	type_pf_data_copy(&data, value);
+	return ahash_add_elem(t, key, &data, sizeof(data));
 }
 
 /* Resize a hash: create a new hash table with doubling the hashsize
  * and inserting the elements to it. Repeat until we succeed or
- * fail due to memory pressures. */
+ * fail due to memory pressures. The elements are copied verbatim,
+ * so timeouts are preserved as well. */
 static int
 type_pf_resize(struct ip_set *set, bool retried)
 {
 	struct ip_set_hash *h = set->data;
 	struct htable *t, *orig = h->table;
 	u8 htable_bits = orig->htable_bits;
+	size_t dsize = with_timeout(h->timeout)
+			? sizeof(struct type_pf_telem)
+			: sizeof(struct type_pf_elem);
 	const struct type_pf_elem *data;
-	struct hbucket *n, *m;
+	struct hbucket *n;
 	u32 i, j;
 	int ret;
 
@@ -310,8 +437,7 @@ retry:
 	if (!htable_bits)
 		/* In case we have plenty of memory :-) */
 		return -IPSET_ERR_HASH_FULL;
-	t = ip_set_alloc(sizeof(*t)
-			 + jhash_size(htable_bits) * sizeof(struct hbucket));
+	t = ip_set_alloc(htable_size(htable_bits));
 	if (!t)
 		return -ENOMEM;
 	t->htable_bits = htable_bits;
@@ -319,10 +445,14 @@ retry:
 	read_lock_bh(&set->lock);
 	for (i = 0; i < jhash_size(orig->htable_bits); i++) {
 		n = hbucket(orig, i);
+		if (!n)
+			continue;
 		for (j = 0; j < n->pos; j++) {
-			data = ahash_data(n, j);
-			m = hbucket(t, HKEY(data, h->initval, htable_bits));
-			ret = type_pf_elem_add(m, data);
+			data = (const struct type_pf_elem *)
+				(n->value + j * dsize);
+			ret = ahash_add_elem(t,
+					     HKEY(data, h->initval, htable_bits),
+					     data, dsize);
 			if (ret < 0) {
 				read_unlock_bh(&set->lock);
 				ahash_destroy(t);
@@ -365,13 +495,13 @@ type_pf_add(struct ip_set *set, void *value, u32 timeout)
 	t = rcu_dereference_bh(h->table);
 	key = HKEY(value, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++)
+	for (i = 0; n && i < n->pos; i++)
 		if (type_pf_data_equal(ahash_data(n, i), d)) {
 			ret = -IPSET_ERR_EXIST;
 			goto out;
 		}
 
-	ret = type_pf_elem_add(n, value);
+	ret = type_pf_elem_add(t, key, value);
 	if (ret != 0)
 		goto out;
 
@@ -391,40 +521,27 @@ static int
 type_pf_del(struct ip_set *set, void *value, u32 timeout)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
 	const struct type_pf_elem *d = value;
 	struct hbucket *n;
-	int i;
+	int i, ret;
 	struct type_pf_elem *data;
 	u32 key;
 
 	key = HKEY(value, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++) {
+	for (i = 0; n && i < n->pos; i++) {
 		data = ahash_data(n, i);
 		if (!type_pf_data_equal(data, d))
 			continue;
-		if (i != n->pos - 1)
-			/* Not last one */
-			type_pf_data_copy(data, ahash_data(n, n->pos - 1));
+		ret = ahash_del_elem(t, key, i, sizeof(struct type_pf_elem));
+		if (ret)
+			return ret;
 
-		n->pos--;
 		h->elements--;
 #ifdef IP_SET_HASH_WITH_NETS
 		del_cidr(h, d->cidr, HOST_MASK);
 #endif
-		if (n->pos + AHASH_INIT_SIZE < n->size) {
-			void *tmp = kzalloc((n->size - AHASH_INIT_SIZE)
-					    * sizeof(struct type_pf_elem),
-					    GFP_ATOMIC);
-			if (!tmp)
-				return 0;
-			n->size -= AHASH_INIT_SIZE;
-			memcpy(tmp, n->value,
-			       n->size * sizeof(struct type_pf_elem));
-			kfree(n->value);
-			n->value = tmp;
-		}
 		return 0;
 	}
 
@@ -439,19 +556,29 @@ static int
 type_pf_test_cidrs(struct ip_set *set, struct type_pf_elem *d, u32 timeout)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
 	struct hbucket *n;
 	const struct type_pf_elem *data;
-	int i, j = 0;
+	int i, j = 0, pos;
 	u32 key;
 	u8 host_mask = SET_HOST_MASK(set->family);
 
 	pr_debug("test by nets\n");
-	for (; j < host_mask && h->nets[j].cidr; j++) {
-		type_pf_data_netmask(d, h->nets[j].cidr);
+	/* A concurrent add/del of a new prefix length may make us miss
+	 * that prefix once, the entries themselves are always consistent */
+	for (; j < host_mask; j++) {
+		/* read once, nets[] may shift under us */
+		u8 cidr = ACCESS_ONCE(h->nets[j].cidr);
+
+		if (!cidr)
+			break;
+		type_pf_data_netmask(d, cidr);
 		key = HKEY(d, h->initval, t->htable_bits);
 		n = hbucket(t, key);
-		for (i = 0; i < n->pos; i++) {
+		if (!n)
+			continue;
+		pos = hbucket_pos(n);
+		for (i = 0; i < pos; i++) {
 			data = ahash_data(n, i);
 			if (type_pf_data_equal(data, d))
 				return 1;
@@ -466,11 +593,11 @@ static int
 type_pf_test(struct ip_set *set, void *value, u32 timeout)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
 	struct type_pf_elem *d = value;
 	struct hbucket *n;
 	const struct type_pf_elem *data;
-	int i;
+	int i, pos;
 	u32 key;
 
 #ifdef IP_SET_HASH_WITH_NETS
@@ -482,7 +609,10 @@ type_pf_test(struct ip_set *set, void *value, u32 timeout)
 
 	key = HKEY(d, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++) {
+	if (!n)
+		return 0;
+	pos = hbucket_pos(n);
+	for (i = 0; i < pos; i++) {
 		data = ahash_data(n, i);
 		if (type_pf_data_equal(data, d))
 			return 1;
@@ -549,7 +679,7 @@ type_pf_list(const struct ip_set *set,
 		incomplete = skb_tail_pointer(skb);
 		n = hbucket(t, cb->args[2]);
 		pr_debug("cb->args[2]: %lu, t %p n %p\n", cb->args[2], t, n);
-		for (i = 0; i < n->pos; i++) {
+		for (i = 0; n && i < n->pos; i++) {
 			data = ahash_data(n, i);
 			pr_debug("list hash %lu hbucket %p i %u, data %p\n",
 				 cb->args[2], n, i, data);
@@ -605,6 +735,7 @@ static const struct ip_set_type_variant type_pf_variant = {
 	.list	= type_pf_list,
 	.resize	= type_pf_resize,
 	.same_set = type_pf_same_set,
+	.rcu_test = true,
 };
 
 /* Flavour with timeout support */
@@ -638,78 +769,64 @@ type_pf_data_timeout_set(struct type_pf_elem *data, u32 timeout)
 	tdata->timeout = ip_set_timeout_set(timeout);
 }
 
+/* Add an element with timeout to the key bucket of the table */
 static int
-type_pf_elem_tadd(struct hbucket *n, const struct type_pf_elem *value,
+type_pf_elem_tadd(struct htable *t, u32 key, const struct type_pf_elem *value,
 		  u32 timeout)
 {
-	struct type_pf_elem *data;
-
-	if (n->pos >= n->size) {
-		void *tmp;
-
-		if (n->size >= AHASH_MAX_SIZE)
-			/* Trigger rehashing */
-			return -EAGAIN;
+	struct type_pf_telem data = { };
 
-		tmp = kzalloc((n->size + AHASH_INIT_SIZE)
-			      * sizeof(struct type_pf_telem),
-			      GFP_ATOMIC);
-		if (!tmp)
-			return -ENOMEM;
-		if (n->size) {
-			memcpy(tmp, n->value,
-			       sizeof(struct type_pf_telem) * n->size);
-			kfree(n->value);
-		}
-		n->value = tmp;
-		n->size += AHASH_INIT_SIZE;
-	}
-	data = ahash_tdata(n, n->pos++);
-	type_pf_data_copy(data, value);
-	type_pf_data_timeout_set(data, timeout);
-	return 0;
+	type_pf_data_copy((struct type_pf_elem *)&data, value);
+	type_pf_data_timeout_set((struct type_pf_elem *)&data, timeout);
+	return ahash_add_elem(t, key, &data, sizeof(data));
 }
 
-/* Delete expired elements from the hashtable */
+/* Delete expired elements from the hashtable: the surviving elements
+ * of a bucket are copied into a new one, see the RCU notes at the top */
 static void
 type_pf_expire(struct ip_set_hash *h)
 {
-	struct htable *t = h->table;
-	struct hbucket *n;
+	struct htable *t = rcu_dereference_bh(h->table);
+	struct hbucket *n, *tmp;
 	struct type_pf_elem *data;
 	u32 i;
-	int j;
+	int j, k, expired;
 
 	for (i = 0; i < jhash_size(t->htable_bits); i++) {
 		n = hbucket(t, i);
-		for (j = 0; j < n->pos; j++) {
+		if (!n)
+			continue;
+		for (j = 0, expired = 0; j < n->pos; j++)
+			if (type_pf_data_expired(ahash_tdata(n, j)))
+				expired++;
+		if (!expired)
+			continue;
+
+		tmp = NULL;
+		if (expired < n->pos) {
+			tmp = hbucket_alloc(hbucket_roundup(n->pos - expired),
+					    sizeof(struct type_pf_telem));
+			if (!tmp)
+				/* Still try to delete expired elements */
+				continue;
+		}
+		for (j = 0, k = 0; j < n->pos; j++) {
 			data = ahash_tdata(n, j);
 			if (type_pf_data_expired(data)) {
 				pr_debug("expired %u/%u\n", i, j);
 #ifdef IP_SET_HASH_WITH_NETS
 				del_cidr(h, data->cidr, HOST_MASK);
 #endif
-				if (j != n->pos - 1)
-					/* Not last one */
-					type_pf_data_copy(data,
-						ahash_tdata(n, n->pos - 1));
-				n->pos--;
 				h->elements--;
-			}
-		}
-		if (n->pos + AHASH_INIT_SIZE < n->size) {
-			void *tmp = kzalloc((n->size - AHASH_INIT_SIZE)
-					    * sizeof(struct type_pf_telem),
-					    GFP_ATOMIC);
-			if (!tmp)
-				/* Still try to delete expired elements */
 				continue;
-			n->size -= AHASH_INIT_SIZE;
-			memcpy(tmp, n->value,
-			       n->size * sizeof(struct type_pf_telem));
-			kfree(n->value);
-			n->value = tmp;
+			}
+			memcpy(ahash_tdata(tmp, k++), data,
+			       sizeof(struct type_pf_telem));
 		}
+		if (tmp)
+			tmp->pos = k;
+		rcu_assign_pointer(t->bucket[i], tmp);
+		hbucket_free(n);
 	}
 }
 
@@ -717,69 +834,26 @@ static int
 type_pf_tresize(struct ip_set *set, bool retried)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t, *orig = h->table;
-	u8 htable_bits = orig->htable_bits;
-	const struct type_pf_elem *data;
-	struct hbucket *n, *m;
-	u32 i, j;
-	int ret;
+	u32 elements;
 
 	/* Try to cleanup once */
 	if (!retried) {
-		i = h->elements;
+		elements = h->elements;
 		write_lock_bh(&set->lock);
 		type_pf_expire(set->data);
 		write_unlock_bh(&set->lock);
-		if (h->elements <  i)
+		if (h->elements < elements)
 			return 0;
 	}
 
-retry:
-	ret = 0;
-	htable_bits++;
-	if (!htable_bits)
-		/* In case we have plenty of memory :-) */
-		return -IPSET_ERR_HASH_FULL;
-	t = ip_set_alloc(sizeof(*t)
-			 + jhash_size(htable_bits) * sizeof(struct hbucket));
-	if (!t)
-		return -ENOMEM;
-	t->htable_bits = htable_bits;
-
-	read_lock_bh(&set->lock);
-	for (i = 0; i < jhash_size(orig->htable_bits); i++) {
-		n = hbucket(orig, i);
-		for (j = 0; j < n->pos; j++) {
-			data = ahash_tdata(n, j);
-			m = hbucket(t, HKEY(data, h->initval, htable_bits));
-			ret = type_pf_elem_tadd(m, data,
-						type_pf_data_timeout(data));
-			if (ret < 0) {
-				read_unlock_bh(&set->lock);
-				ahash_destroy(t);
-				if (ret == -EAGAIN)
-					goto retry;
-				return ret;
-			}
-		}
-	}
-
-	rcu_assign_pointer(h->table, t);
-	read_unlock_bh(&set->lock);
-
-	/* Give time to other readers of the set */
-	synchronize_rcu_bh();
-
-	ahash_destroy(orig);
-
-	return 0;
+	return type_pf_resize(set, retried);
 }
 
 static int
 type_pf_tadd(struct ip_set *set, void *value, u32 timeout)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t;
 	const struct type_pf_elem *d = value;
 	struct hbucket *n;
 	struct type_pf_elem *data;
@@ -796,7 +870,7 @@ type_pf_tadd(struct ip_set *set, void *value, u32 timeout)
 	t = rcu_dereference_bh(h->table);
 	key = HKEY(d, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++) {
+	for (i = 0; n && i < n->pos; i++) {
 		data = ahash_tdata(n, i);
 		if (type_pf_data_equal(data, d)) {
 			if (type_pf_data_expired(data))
@@ -810,16 +884,26 @@ type_pf_tadd(struct ip_set *set, void *value, u32 timeout)
 			j = i;
 	}
 	if (j != AHASH_MAX_SIZE + 1) {
+		struct type_pf_telem tdata = { };
+
+		/* Reuse the slot of an expired element */
+		type_pf_data_copy((struct type_pf_elem *)&tdata, d);
+		type_pf_data_timeout_set((struct type_pf_elem *)&tdata,
+					 timeout);
 		data = ahash_tdata(n, j);
 #ifdef IP_SET_HASH_WITH_NETS
 		del_cidr(h, data->cidr, HOST_MASK);
-		add_cidr(h, d->cidr, HOST_MASK);
 #endif
-		type_pf_data_copy(data, d);
-		type_pf_data_timeout_set(data, timeout);
+		ret = ahash_replace_elem(t, key, j, &tdata, sizeof(tdata));
+#ifdef IP_SET_HASH_WITH_NETS
+		if (ret)
+			add_cidr(h, data->cidr, HOST_MASK);
+		else
+			add_cidr(h, d->cidr, HOST_MASK);
+#endif
 		goto out;
 	}
-	ret = type_pf_elem_tadd(n, d, timeout);
+	ret = type_pf_elem_tadd(t, key, d, timeout);
 	if (ret != 0)
 		goto out;
 
@@ -836,7 +920,7 @@ static int
 type_pf_tdel(struct ip_set *set, void *value, u32 timeout)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
 	const struct type_pf_elem *d = value;
 	struct hbucket *n;
 	int i, ret = 0;
@@ -845,34 +929,20 @@ type_pf_tdel(struct ip_set *set, void *value, u32 timeout)
 
 	key = HKEY(value, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++) {
+	for (i = 0; n && i < n->pos; i++) {
 		data = ahash_tdata(n, i);
 		if (!type_pf_data_equal(data, d))
 			continue;
 		if (type_pf_data_expired(data))
 			ret = -IPSET_ERR_EXIST;
-		if (i != n->pos - 1)
-			/* Not last one */
-			type_pf_data_copy(data, ahash_tdata(n, n->pos - 1));
+		if (ahash_del_elem(t, key, i, sizeof(struct type_pf_telem)))
+			return -ENOMEM;
 
-		n->pos--;
 		h->elements--;
 #ifdef IP_SET_HASH_WITH_NETS
 		del_cidr(h, d->cidr, HOST_MASK);
 #endif
-		if (n->pos + AHASH_INIT_SIZE < n->size) {
-			void *tmp = kzalloc((n->size - AHASH_INIT_SIZE)
-					    * sizeof(struct type_pf_telem),
-					    GFP_ATOMIC);
-			if (!tmp)
-				return 0;
-			n->size -= AHASH_INIT_SIZE;
-			memcpy(tmp, n->value,
-			       n->size * sizeof(struct type_pf_telem));
-			kfree(n->value);
-			n->value = tmp;
-		}
-		return 0;
+		return ret;
 	}
 
 	return -IPSET_ERR_EXIST;
@@ -883,18 +953,26 @@ static int
 type_pf_ttest_cidrs(struct ip_set *set, struct type_pf_elem *d, u32 timeout)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
 	struct type_pf_elem *data;
 	struct hbucket *n;
-	int i, j = 0;
+	int i, j = 0, pos;
 	u32 key;
 	u8 host_mask = SET_HOST_MASK(set->family);
 
-	for (; j < host_mask && h->nets[j].cidr; j++) {
-		type_pf_data_netmask(d, h->nets[j].cidr);
+	for (; j < host_mask; j++) {
+		/* read once, nets[] may shift under us */
+		u8 cidr = ACCESS_ONCE(h->nets[j].cidr);
+
+		if (!cidr)
+			break;
+		type_pf_data_netmask(d, cidr);
 		key = HKEY(d, h->initval, t->htable_bits);
 		n = hbucket(t, key);
-		for (i = 0; i < n->pos; i++) {
+		if (!n)
+			continue;
+		pos = hbucket_pos(n);
+		for (i = 0; i < pos; i++) {
 			data = ahash_tdata(n, i);
 			if (type_pf_data_equal(data, d))
 				return !type_pf_data_expired(data);
@@ -908,10 +986,10 @@ static int
 type_pf_ttest(struct ip_set *set, void *value, u32 timeout)
 {
 	struct ip_set_hash *h = set->data;
-	struct htable *t = h->table;
+	struct htable *t = rcu_dereference_bh(h->table);
 	struct type_pf_elem *data, *d = value;
 	struct hbucket *n;
-	int i;
+	int i, pos;
 	u32 key;
 
 #ifdef IP_SET_HASH_WITH_NETS
@@ -920,7 +998,10 @@ type_pf_ttest(struct ip_set *set, void *value, u32 timeout)
 #endif
 	key = HKEY(d, h->initval, t->htable_bits);
 	n = hbucket(t, key);
-	for (i = 0; i < n->pos; i++) {
+	if (!n)
+		return 0;
+	pos = hbucket_pos(n);
+	for (i = 0; i < pos; i++) {
 		data = ahash_tdata(n, i);
 		if (type_pf_data_equal(data, d))
 			return !type_pf_data_expired(data);
@@ -948,7 +1029,7 @@ type_pf_tlist(const struct ip_set *set,
 	for (; cb->args[2] < jhash_size(t->htable_bits); cb->args[2]++) {
 		incomplete = skb_tail_pointer(skb);
 		n = hbucket(t, cb->args[2]);
-		for (i = 0; i < n->pos; i++) {
+		for (i = 0; n && i < n->pos; i++) {
 			data = ahash_tdata(n, i);
 			pr_debug("list %p %u\n", n, i);
 			if (type_pf_data_expired(data))
@@ -999,6 +1080,7 @@ static const struct ip_set_type_variant type_pf_tvariant = {
 	.list	= type_pf_tlist,
 	.resize	= type_pf_tresize,
 	.same_set = type_pf_same_set,
+	.rcu_test = true,
 };
 
 static void
@@ -14,6 +14,7 @@
  */
 
 #include <linux/cgroup.h>
+#include <linux/atomic.h>
 
 /*
  * The core object. the cgroup that wishes to account for some
@@ -23,9 +24,9 @@
 
 struct res_counter {
 	/*
-	 * the current resource consumption level
+	 * the current resource consumption level, changed without the lock
 	 */
-	unsigned long long usage;
+	atomic64_t usage;
 	/*
 	 * the maximal value of the usage from the counter creation
 	 */
@@ -43,7 +44,7 @@ struct res_counter {
 	 */
 	unsigned long long failcnt;
 	/*
-	 * the lock to protect all of the above.
+	 * the lock to protect all of the above but the usage.
 	 * the routines below consider this to be IRQ-safe
 	 */
 	spinlock_t lock;
@@ -108,11 +109,12 @@ void res_counter_init(struct res_counter *counter, struct res_counter *parent);
  *       units, e.g. numbers, bytes, Kbytes, etc
  *
  * returns 0 on success and <0 if the counter->usage will exceed the
- * counter->limit _locked call expects the counter->lock to be taken
+ * counter->limit. The usage of every level of the hierarchy is updated
+ * atomically, without taking the counters' locks: concurrent charges
+ * may transiently push the usage over the limit, in which case those
+ * that did fail and back out.
  */
 
-int __must_check res_counter_charge_locked(struct res_counter *counter,
-		unsigned long val);
 int __must_check res_counter_charge(struct res_counter *counter,
 		unsigned long val, struct res_counter **limit_fail_at);
 
@@ -123,12 +125,34 @@ int __must_check res_counter_charge(struct res_counter *counter,
  * @val: the amount of the resource
  *
  * these calls check for usage underflow and show a warning on the console
- * _locked call expects the counter->lock to be taken
  */
 
-void res_counter_uncharge_locked(struct res_counter *counter, unsigned long val);
 void res_counter_uncharge(struct res_counter *counter, unsigned long val);
 
+static inline unsigned long long res_counter_usage(struct res_counter *cnt)
+{
+	return atomic64_read(&cnt->usage);
+}
+
+/*
+ * The limit is only changed under the lock, but read without it by
+ * res_counter_charge() where a 64-bit load is atomic.
+ */
+static inline unsigned long long res_counter_limit(struct res_counter *cnt)
+{
+#if BITS_PER_LONG == 64
+	return ACCESS_ONCE(cnt->limit);
+#else
+	unsigned long long limit;
+	unsigned long flags;
+
+	spin_lock_irqsave(&cnt->lock, flags);
+	limit = cnt->limit;
+	spin_unlock_irqrestore(&cnt->lock, flags);
+	return limit;
+#endif
+}
+
 /**
  * res_counter_margin - calculate chargeable space of a counter
  * @cnt: the counter
@@ -138,13 +162,13 @@ void res_counter_uncharge(struct res_counter *counter, unsigned long val);
  */
 static inline unsigned long long res_counter_margin(struct res_counter *cnt)
 {
-	unsigned long long margin;
-	unsigned long flags;
+	unsigned long long usage = res_counter_usage(cnt);
+	unsigned long long limit = res_counter_limit(cnt);
 
-	spin_lock_irqsave(&cnt->lock, flags);
-	margin = cnt->limit - cnt->usage;
-	spin_unlock_irqrestore(&cnt->lock, flags);
-	return margin;
+	/* The usage is over the limit while racing charges back out */
+	if (usage >= limit)
+		return 0;
+	return limit - usage;
 }
 
 /**
@@ -157,14 +181,14 @@ static inline unsigned long long res_counter_margin(struct res_counter *cnt)
 static inline unsigned long long
 res_counter_soft_limit_excess(struct res_counter *cnt)
 {
-	unsigned long long excess;
+	unsigned long long excess, usage = res_counter_usage(cnt);
 	unsigned long flags;
 
 	spin_lock_irqsave(&cnt->lock, flags);
-	if (cnt->usage <= cnt->soft_limit)
+	if (usage <= cnt->soft_limit)
 		excess = 0;
 	else
-		excess = cnt->usage - cnt->soft_limit;
+		excess = usage - cnt->soft_limit;
 	spin_unlock_irqrestore(&cnt->lock, flags);
 	return excess;
 }
@@ -174,7 +198,7 @@ static inline void res_counter_reset_max(struct res_counter *cnt)
 	unsigned long flags;
 
 	spin_lock_irqsave(&cnt->lock, flags);
-	cnt->max_usage = cnt->usage;
+	cnt->max_usage = res_counter_usage(cnt);
 	spin_unlock_irqrestore(&cnt->lock, flags);
 }
 
@@ -190,13 +214,23 @@ static inline void res_counter_reset_failcnt(struct res_counter *cnt)
 static inline int res_counter_set_limit(struct res_counter *cnt,
 		unsigned long long limit)
 {
+	unsigned long long old;
 	unsigned long flags;
 	int ret = -EBUSY;
 
 	spin_lock_irqsave(&cnt->lock, flags);
-	if (cnt->usage <= limit) {
+	if (res_counter_usage(cnt) <= limit) {
+		old = cnt->limit;
 		cnt->limit = limit;
-		ret = 0;
+		/*
+		 * A charge that did not see the new limit yet has to be
+		 * visible in the usage now, or it will see the limit.
+		 */
+		smp_mb();
+		if (res_counter_usage(cnt) <= limit)
+			ret = 0;
+		else
+			cnt->limit = old;
 	}
 	spin_unlock_irqrestore(&cnt->lock, flags);
 	return ret;
@@ -722,6 +722,24 @@ extern struct user_struct root_user;
 struct backing_dev_info;
 struct reclaim_state;
 
+/*
+ * TLB flushes owed by the ptes try_to_unmap() cleared with
+ * TTU_BATCH_FLUSH, see try_to_unmap_flush().
+ */
+struct tlbflush_unmap_batch {
+#ifdef CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH
+	/* cpus which may still cache one of the cleared ptes */
+	struct cpumask cpumask;
+	bool flush_required;
+	/*
+	 * One of the ptes was dirty: its TLB entry may still be written
+	 * through without dirtying the page again, so the flush has to
+	 * come before the page is written out or unlocked.
+	 */
+	bool writable;
+#endif
+};
+
 #if defined(CONFIG_SCHEDSTATS) || defined(CONFIG_TASK_DELAY_ACCT)
 struct sched_info {
 	/* cumulative counters */
@@ -1439,6 +1457,7 @@ struct task_struct {
 
 /* VM state */
 	struct reclaim_state *reclaim_state;
+	struct tlbflush_unmap_batch tlb_ubc;
 
 	struct backing_dev_info *backing_dev_info;
 
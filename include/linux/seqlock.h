@@ -167,6 +167,23 @@ static inline unsigned read_seqcount_begin(const seqcount_t *s)
 	return ret;
 }
 
+/**
+ * raw_seqcount_begin - begin a seq-read critical section without waiting
+ * @s: pointer to seqcount_t
+ * Returns: count to be passed to read_seqcount_retry
+ *
+ * raw_seqcount_begin is like read_seqcount_begin, but does not wait for
+ * a writer to finish: the critical section then fails read_seqcount_retry.
+ * For readers that give up rather than retry, or that may never see the
+ * write end.
+ */
+static inline unsigned raw_seqcount_begin(const seqcount_t *s)
+{
+	unsigned ret = ACCESS_ONCE(s->sequence);
+	smp_rmb();
+	return ret & ~1;
+}
+
 /**
  * __read_seqcount_retry - end a seq-read critical section (without barrier)
  * @s: pointer to seqcount_t
@@ -106,6 +106,16 @@ int kmem_cache_shrink(struct kmem_cache *);
 void kmem_cache_free(struct kmem_cache *, void *);
 unsigned int kmem_cache_size(struct kmem_cache *);
 
+/*
+ * Bulk allocation and freeing of objects of one cache. The allocators
+ * move the whole array in one critical section instead of paying for
+ * the per object entry and exit of kmem_cache_alloc()/kmem_cache_free().
+ * kmem_cache_alloc_bulk() allocates either all objects and returns their
+ * number, or none and returns 0.
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *, gfp_t, size_t, void **);
+void kmem_cache_free_bulk(struct kmem_cache *, size_t, void **);
+
 /*
  * Please use this macro to create slab caches. Simply specify the
  * name of the structure and maybe some flags that are listed above.
@@ -33,6 +33,12 @@ enum stat_item {
 	DEACTIVATE_REMOTE_FREES,/* Slab contained remotely freed objects */
 	ORDER_FALLBACK,		/* Number of times fallback was necessary */
 	CMPXCHG_DOUBLE_CPU_FAIL,/* Failure of this_cpu_cmpxchg_double */
+	CPU_PARTIAL_ALLOC,	/* Cpu slab taken from the cpu partial list */
+	CPU_PARTIAL_FREE,	/* Freeing put the slab on the cpu partial list */
+	CPU_PARTIAL_NODE,	/* Cpu partial list refilled from node partials */
+	CPU_PARTIAL_DRAIN,	/* Cpu partial list drained to node partials */
+	CMPXCHG_DOUBLE_FAIL,	/* Number of times that cmpxchg double did not match */
+	DEACTIVATE_BYPASS,	/* Implicit deactivation */
 	NR_SLUB_STAT_ITEMS };
 
 struct kmem_cache_cpu {
@@ -42,6 +48,8 @@ struct kmem_cache_cpu {
 #endif
 	struct page *page;	/* The slab from which we are allocating */
 	int node;		/* The node of the page (or -1 for debug) */
+	int nr_partial;		/* Number of slabs on the partial list */
+	struct list_head partial;	/* Frozen slabs to allocate from next */
 #ifdef CONFIG_SLUB_STATS
 	unsigned stat[NR_SLUB_STAT_ITEMS];
 #endif
@@ -75,6 +83,7 @@ struct kmem_cache {
 	/* Used for retriving partial slabs etc */
 	unsigned long flags;
 	unsigned long min_partial;
+	int cpu_partial;	/* Max slabs on each cpu partial list */
 	int size;		/* The size of an object including meta data */
 	int objsize;		/* The size of an object without meta data */
 	int offset;		/* Free pointer offset. */
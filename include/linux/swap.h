@@ -171,6 +171,24 @@ enum {
 #define COUNT_CONTINUED	0x80	/* See swap_map continuation for full count */
 #define SWAP_MAP_SHMEM	0xbf	/* Owned by shmem/tmpfs, in first swap_map */
 
+/*
+ * On solid state devices, every CPU allocates from a cluster of swap
+ * slots of its own, so that concurrent swapouts each write sequentially
+ * instead of interleaving.  Clusters with no slot in use are kept on a
+ * free list for the CPUs to pick from.
+ */
+struct swap_cluster_info {
+	struct list_head list;		/* on free_clusters when unused */
+	unsigned int usage;		/* slots of the cluster in use */
+};
+
+#define CLUSTER_NONE	(~0U)
+
+struct percpu_cluster {
+	unsigned int index;		/* cluster in use, or CLUSTER_NONE */
+	unsigned int next;		/* next slot to try in the cluster */
+};
+
 /*
  * The in-memory structure used to track swap areas.
  */
@@ -189,6 +207,9 @@ struct swap_info_struct {
 	unsigned int cluster_nr;	/* countdown to next cluster search */
 	unsigned int lowest_alloc;	/* while preparing discard cluster */
 	unsigned int highest_alloc;	/* while preparing discard cluster */
+	struct swap_cluster_info *cluster_info; /* solid state only */
+	struct list_head free_clusters;	/* clusters with no slot in use */
+	struct percpu_cluster __percpu *percpu_cluster;
 	struct swap_extent *curr_swap_extent;
 	struct swap_extent first_swap_extent;
 	struct block_device *bdev;	/* swap device or bdev of swap file */
@@ -248,6 +269,13 @@ static inline void lru_cache_add_file(struct page *page)
 #define ISOLATE_ACTIVE 1	/* Isolate active pages. */
 #define ISOLATE_BOTH 2		/* Isolate both active and inactive pages. */
 
+/* linux/mm/workingset.c */
+extern void workingset_eviction(struct address_space *mapping,
+				struct page *page);
+extern bool workingset_refault(struct address_space *mapping, pgoff_t index);
+extern void workingset_activation(struct page *page);
+extern void __init workingset_init(void);
+
 /* linux/mm/vmscan.c */
 extern unsigned long try_to_free_pages(struct zonelist *zonelist, int order,
 					gfp_t gfp_mask, nodemask_t *mask);
@@ -313,7 +341,9 @@ extern void mem_cgroup_get_shmem_target(struct inode *inode, pgoff_t pgoff,
 /* linux/mm/page_io.c */
 extern int swap_readpage(struct page *);
 extern int swap_writepage(struct page *page, struct writeback_control *wbc);
+extern int __swap_writepage(struct page *page, struct writeback_control *wbc);
 extern void end_swap_bio_read(struct bio *bio, int err);
+extern void end_swap_bio_write(struct bio *bio, int err);
 
 /* linux/mm/swap_state.c */
 extern struct address_space swapper_space;
@@ -325,18 +355,34 @@ extern void __delete_from_swap_cache(struct page *);
 extern void delete_from_swap_cache(struct page *);
 extern void free_page_and_swap_cache(struct page *);
 extern void free_pages_and_swap_cache(struct page **, int);
-extern struct page *lookup_swap_cache(swp_entry_t);
+extern struct page *lookup_swap_cache(swp_entry_t,
+			struct vm_area_struct *vma, unsigned long addr);
 extern struct page *read_swap_cache_async(swp_entry_t, gfp_t,
 			struct vm_area_struct *vma, unsigned long addr);
+extern struct page *__read_swap_cache_async(swp_entry_t, gfp_t,
+			struct vm_area_struct *vma, unsigned long addr,
+			bool *new_page_allocated);
 extern struct page *swapin_readahead(swp_entry_t, gfp_t,
 			struct vm_area_struct *vma, unsigned long addr);
+extern struct page *swap_cluster_readahead(swp_entry_t, gfp_t,
+			struct vm_area_struct *vma, unsigned long addr);
+extern int sysctl_swap_vma_readahead;
+
+/* linux/mm/swap_slots.c */
+extern void free_swap_slot(swp_entry_t);
+extern void disable_swap_slots_cache_lock(void);
+extern void reenable_swap_slots_cache_unlock(void);
 
 /* linux/mm/swapfile.c */
 extern long nr_swap_pages;
 extern long total_swap_pages;
+extern atomic_t nr_rotate_swap;
 extern void si_swapinfo(struct sysinfo *);
 extern swp_entry_t get_swap_page(void);
+extern int get_swap_pages(int, swp_entry_t *);
 extern swp_entry_t get_swap_page_of_type(int);
+extern void swapcache_free_entries(swp_entry_t *, int);
+extern int __swap_count(swp_entry_t);
 extern int valid_swaphandles(swp_entry_t, unsigned long *);
 extern int add_swap_count_continuation(swp_entry_t, gfp_t);
 extern void swap_shmem_alloc(swp_entry_t);
@@ -349,6 +395,7 @@ extern int swap_type_of(dev_t, sector_t, struct block_device **);
 extern unsigned int count_swap_pages(int, int);
 extern sector_t map_swap_page(struct page *, struct block_device **);
 extern sector_t swapdev_block(int, pgoff_t);
+extern bool swap_area_writeok(int);
 extern int reuse_swap_page(struct page *);
 extern int try_to_free_swap(struct page *);
 struct backing_dev_info;
@@ -442,12 +489,20 @@ static inline struct page *swapin_readahead(swp_entry_t swp, gfp_t gfp_mask,
 	return NULL;
 }
 
+static inline struct page *swap_cluster_readahead(swp_entry_t swp,
+			gfp_t gfp_mask, struct vm_area_struct *vma,
+			unsigned long addr)
+{
+	return NULL;
+}
+
 static inline int swap_writepage(struct page *p, struct writeback_control *wbc)
 {
 	return 0;
 }
 
-static inline struct page *lookup_swap_cache(swp_entry_t swp)
+static inline struct page *lookup_swap_cache(swp_entry_t swp,
+			struct vm_area_struct *vma, unsigned long addr)
 {
 	return NULL;
 }
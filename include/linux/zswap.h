@@ -0,0 +1,39 @@
+#ifndef _LINUX_ZSWAP_H
+#define _LINUX_ZSWAP_H
+
+#include <linux/types.h>
+
+struct page;
+
+#ifdef CONFIG_ZSWAP
+/* mm/zswap.c, hooked into mm/page_io.c and mm/swapfile.c */
+extern int zswap_store(struct page *page);
+extern int zswap_load(struct page *page);
+extern void zswap_invalidate_page(unsigned type, pgoff_t offset);
+extern void zswap_init_area(unsigned type);
+extern void zswap_invalidate_area(unsigned type);
+#else
+static inline int zswap_store(struct page *page)
+{
+	return -ENODEV;
+}
+
+static inline int zswap_load(struct page *page)
+{
+	return -ENODEV;
+}
+
+static inline void zswap_invalidate_page(unsigned type, pgoff_t offset)
+{
+}
+
+static inline void zswap_init_area(unsigned type)
+{
+}
+
+static inline void zswap_invalidate_area(unsigned type)
+{
+}
+#endif
+
+#endif /* _LINUX_ZSWAP_H */
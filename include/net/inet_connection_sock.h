@@ -262,6 +262,22 @@ extern void inet_csk_reqsk_queue_hash_add(struct sock *sk,
 					  struct request_sock *req,
 					  unsigned long timeout);
 
+struct inet_hashinfo;
+
+extern struct request_sock *inet_csk_reqsk_hash_lookup(struct sock *sk,
+						       const __be16 rport,
+						       const __be32 raddr,
+						       const __be32 laddr);
+extern void inet_csk_reqsk_hash_add(struct sock *sk, struct request_sock *req,
+				    unsigned long timeout);
+extern int inet_csk_reqsk_hash_unlink(struct request_sock *req);
+extern int inet_csk_reqsk_hash_pressure(const struct sock *sk);
+extern void inet_csk_reqsk_hash_init(struct inet_hashinfo *hashinfo,
+				     const char *name,
+				     unsigned long numentries,
+				     unsigned long timeout,
+				     unsigned long max_rto);
+
 static inline void inet_csk_reqsk_queue_removed(struct sock *sk,
 						struct request_sock *req)
 {
@@ -278,7 +294,7 @@ static inline void inet_csk_reqsk_queue_added(struct sock *sk,
 
 static inline int inet_csk_reqsk_queue_len(const struct sock *sk)
 {
-	return reqsk_queue_len(&inet_csk(sk)->icsk_accept_queue);
+	return reqsk_queue_qlen(&inet_csk(sk)->icsk_accept_queue);
 }
 
 static inline int inet_csk_reqsk_queue_young(const struct sock *sk)
@@ -19,6 +19,7 @@
 #include <linux/ip.h>
 #include <linux/ipv6.h>
 #include <linux/list.h>
+#include <linux/percpu_counter.h>
 #include <linux/slab.h>
 #include <linux/socket.h>
 #include <linux/spinlock.h>
@@ -112,6 +113,14 @@ struct inet_listen_hashbucket {
 	struct hlist_nulls_head	head;
 };
 
+/* Request sockets of all listeners, keyed by their full identity so that
+ * SYNs and handshake ACKs can find them without the listener lock.
+ */
+struct inet_reqsk_bucket {
+	spinlock_t		lock;
+	struct hlist_head	chain;
+};
+
 /* This is for listening sockets, thus all sockets which possess wildcards. */
 #define INET_LHTABLE_SIZE	32	/* Yes, really, this is all you need. */
 
@@ -138,6 +147,18 @@ struct inet_hashinfo {
 
 	struct kmem_cache		*bind_bucket_cachep;
 
+	/* Optional global request hash, see inet_csk_reqsk_hash_add().
+	 * reqsk_timeout and reqsk_max_rto drive SYN-ACK retransmission,
+	 * reqsk_max is the number of hashed requests above which a full
+	 * listener is considered to be under memory pressure.
+	 */
+	struct inet_reqsk_bucket	*reqhash;
+	unsigned int			reqhash_mask;
+	unsigned int			reqsk_max;
+	unsigned long			reqsk_timeout;
+	unsigned long			reqsk_max_rto;
+	struct percpu_counter		reqsk_count;
+
 	/* All the above members are written once at bootup and
 	 * never written again _or_ are predominantly read-access.
 	 *
@@ -19,6 +19,7 @@
 #include <asm/atomic.h>                 /* for struct atomic_t */
 #include <linux/compiler.h>
 #include <linux/timer.h>
+#include <linux/rcupdate.h>		/* for struct rcu_head */
 
 #include <net/checksum.h>
 #include <linux/netfilter.h>		/* for union nf_inet_addr */
@@ -533,6 +534,8 @@ struct ip_vs_conn {
 	const struct ip_vs_pe	*pe;
 	char			*pe_data;
 	__u8			pe_data_len;
+
+	struct rcu_head		rcu_head;
 };
 
 /*
@@ -635,6 +638,8 @@ struct ip_vs_service {
 
 	/* alternate persistence engine */
 	struct ip_vs_pe		*pe;
+
+	struct rcu_head		rcu_head;
 };
 
 
@@ -1008,6 +1013,12 @@ struct ip_vs_conn * ip_vs_conn_out_get_proto(int af, const struct sk_buff *skb,
 					     unsigned int proto_off,
 					     int inverse);
 
+/* get a reference to a conn found under RCU, fails if it is being freed */
+static inline bool __ip_vs_conn_get(struct ip_vs_conn *cp)
+{
+	return atomic_inc_not_zero(&cp->refcnt);
+}
+
 /* put back the conn without restarting its timer */
 static inline void __ip_vs_conn_put(struct ip_vs_conn *cp)
 {
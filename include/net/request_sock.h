@@ -17,6 +17,7 @@
 
 #include <linux/slab.h>
 #include <linux/spinlock.h>
+#include <linux/timer.h>
 #include <linux/types.h>
 #include <linux/bug.h>
 
@@ -65,14 +66,26 @@ struct request_sock {
 	struct sock			*sk;
 	u32				secid;
 	u32				peer_secid;
+	/* The following are only used by requests living in the global
+	 * request hash (see inet_csk_reqsk_hash_add()), which are looked
+	 * up and expired without the listener lock.
+	 */
+	struct sock			*rsk_listener;
+	struct hlist_node		rsk_hash_node;
+	struct timer_list		rsk_timer;
+	atomic_t			rsk_refcnt;
+	u32				rsk_hash;
+	u16				rsk_listen_gen;
 };
 
 static inline struct request_sock *reqsk_alloc(const struct request_sock_ops *ops)
 {
 	struct request_sock *req = kmem_cache_alloc(ops->slab, GFP_ATOMIC);
 
-	if (req != NULL)
+	if (req != NULL) {
 		req->rsk_ops = ops;
+		req->rsk_listener = NULL;
+	}
 
 	return req;
 }
@@ -88,17 +101,37 @@ static inline void reqsk_free(struct request_sock *req)
 	__reqsk_free(req);
 }
 
+/* Hashed requests are refcounted: the hash, a pending rsk_timer, every
+ * lookup and the accept queue each hold a reference.  The last one also
+ * drops the reference the request holds on its listener.
+ */
+static inline void reqsk_put(struct request_sock *req)
+{
+	if (atomic_dec_and_test(&req->rsk_refcnt)) {
+		struct sock *listener = req->rsk_listener;
+
+		reqsk_free(req);
+		sock_put(listener);
+	}
+}
+
+/* Release a request_sock whose child has been taken off the accept queue */
+static inline void reqsk_accepted_free(struct request_sock *req)
+{
+	if (req->rsk_listener != NULL)
+		reqsk_put(req);
+	else
+		__reqsk_free(req);
+}
+
 extern int sysctl_max_syn_backlog;
 
 /** struct listen_sock - listen state
  *
- * @max_qlen_log - log_2 of maximal queued SYNs/REQUESTs
+ * @qlen - number of requests in syn_table
  */
 struct listen_sock {
-	u8			max_qlen_log;
-	/* 3 bytes hole, try to use */
 	int			qlen;
-	int			qlen_young;
 	int			clock_hand;
 	u32			hash_rnd;
 	u32			nr_table_entries;
@@ -110,6 +143,11 @@ struct listen_sock {
  * @rskq_accept_head - FIFO head of established children
  * @rskq_accept_tail - FIFO tail of established children
  * @rskq_defer_accept - User waits for some data after accept()
+ * @max_qlen_log - log_2 of maximal queued SYNs/REQUESTs
+ * @listen_gen - bumped by every listen(), hashed requests of an earlier one
+ *		 are no longer accounted in @qlen and @young
+ * @qlen - all queued requests, in syn_table and in the global request hash
+ * @young - queued requests that have not retransmitted a SYN-ACK yet
  * @syn_wait_lock - serializer
  *
  * %syn_wait_lock is necessary only to avoid proc interface having to grab the main
@@ -126,7 +164,10 @@ struct request_sock_queue {
 	struct request_sock	*rskq_accept_tail;
 	rwlock_t		syn_wait_lock;
 	u8			rskq_defer_accept;
-	/* 3 bytes hole, try to pack */
+	u8			max_qlen_log;
+	u16			listen_gen;
+	atomic_t		qlen;
+	atomic_t		young;
 	struct listen_sock	*listen_opt;
 };
 
@@ -166,6 +207,8 @@ static inline void reqsk_queue_add(struct request_sock_queue *queue,
 {
 	req->sk = child;
 	sk_acceptq_added(parent);
+	if (req->rsk_listener != NULL)
+		atomic_inc(&req->rsk_refcnt);
 
 	if (queue->rskq_accept_head == NULL)
 		queue->rskq_accept_head = req;
@@ -198,44 +241,68 @@ static inline struct sock *reqsk_queue_get_child(struct request_sock_queue *queu
 	WARN_ON(child == NULL);
 
 	sk_acceptq_removed(parent);
-	__reqsk_free(req);
+	reqsk_accepted_free(req);
 	return child;
 }
 
-static inline int reqsk_queue_removed(struct request_sock_queue *queue,
-				      struct request_sock *req)
+/* Request accounting shared by syn_table and the global request hash.
+ * These counters live in the queue itself rather than in listen_opt so
+ * that they can be updated without the listener lock.
+ */
+static inline void __reqsk_queue_removed(struct request_sock_queue *queue,
+					 const struct request_sock *req)
 {
-	struct listen_sock *lopt = queue->listen_opt;
-
 	if (req->retrans == 0)
-		--lopt->qlen_young;
+		atomic_dec(&queue->young);
+	atomic_dec(&queue->qlen);
+}
 
-	return --lopt->qlen;
+static inline void __reqsk_queue_added(struct request_sock_queue *queue)
+{
+	atomic_inc(&queue->young);
+	atomic_inc(&queue->qlen);
+}
+
+static inline int reqsk_queue_removed(struct request_sock_queue *queue,
+				      struct request_sock *req)
+{
+	__reqsk_queue_removed(queue, req);
+	return --queue->listen_opt->qlen;
 }
 
 static inline int reqsk_queue_added(struct request_sock_queue *queue)
 {
-	struct listen_sock *lopt = queue->listen_opt;
-	const int prev_qlen = lopt->qlen;
+	__reqsk_queue_added(queue);
+	return queue->listen_opt->qlen++;
+}
 
-	lopt->qlen_young++;
-	lopt->qlen++;
-	return prev_qlen;
+/* Whether hashed @req was queued by the current listen() of its listener */
+static inline int reqsk_queue_current(const struct request_sock_queue *queue,
+				      const struct request_sock *req)
+{
+	return req->rsk_listen_gen == ACCESS_ONCE(queue->listen_gen);
 }
 
+/* Number of requests in syn_table */
 static inline int reqsk_queue_len(const struct request_sock_queue *queue)
 {
 	return queue->listen_opt != NULL ? queue->listen_opt->qlen : 0;
 }
 
+/* Number of requests queued on this listener, wherever they are hashed */
+static inline int reqsk_queue_qlen(const struct request_sock_queue *queue)
+{
+	return atomic_read(&queue->qlen);
+}
+
 static inline int reqsk_queue_len_young(const struct request_sock_queue *queue)
 {
-	return queue->listen_opt->qlen_young;
+	return atomic_read(&queue->young);
 }
 
 static inline int reqsk_queue_is_full(const struct request_sock_queue *queue)
 {
-	return queue->listen_opt->qlen >> queue->listen_opt->max_qlen_log;
+	return atomic_read(&queue->qlen) >> queue->max_qlen_log;
 }
 
 static inline void reqsk_queue_hash_req(struct request_sock_queue *queue,
@@ -503,6 +503,9 @@ typedef int (*sk_read_actor_t)(read_descriptor_t *, struct sk_buff *,
 extern int tcp_read_sock(struct sock *sk, read_descriptor_t *desc,
 			 sk_read_actor_t recv_actor);
 
+extern int tcp_mmap(struct file *file, struct socket *sock,
+		    struct vm_area_struct *vma);
+
 extern void tcp_initialize_rcv_mss(struct sock *sk);
 
 extern int tcp_mtu_to_mss(struct sock *sk, int pmtu);
@@ -0,0 +1,73 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM readahead
+
+#if !defined(_TRACE_READAHEAD_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _TRACE_READAHEAD_H
+
+#include <linux/types.h>
+#include <linux/tracepoint.h>
+#include <linux/fs.h>
+
+#define show_ra_pattern(pattern)					\
+	__print_symbolic(pattern,					\
+		{ RA_PATTERN_NONE,		"none" },		\
+		{ RA_PATTERN_SEQUENTIAL,	"sequential" },		\
+		{ RA_PATTERN_AROUND,		"around" },		\
+		{ RA_PATTERN_STRIDE,		"stride" },		\
+		{ RA_PATTERN_BACKWARD,		"backward" })
+
+TRACE_EVENT(readahead,
+
+	TP_PROTO(struct address_space *mapping, struct file_ra_state *ra,
+		pgoff_t offset, unsigned long req_size, int actual),
+
+	TP_ARGS(mapping, ra, offset, req_size, actual),
+
+	TP_STRUCT__entry(
+		__field(dev_t, dev)
+		__field(ino_t, ino)
+		__field(unsigned int, pattern)
+		__field(pgoff_t, offset)
+		__field(unsigned long, req_size)
+		__field(pgoff_t, start)
+		__field(unsigned int, size)
+		__field(unsigned int, async_size)
+		__field(long, stride)
+		__field(int, actual)
+		__field(unsigned long, hit)
+		__field(unsigned long, miss)
+		__field(unsigned long, waste)
+	),
+
+	TP_fast_assign(
+		__entry->dev = mapping->host->i_sb->s_dev;
+		__entry->ino = mapping->host->i_ino;
+		__entry->pattern = ra->pattern;
+		__entry->offset = offset;
+		__entry->req_size = req_size;
+		__entry->start = ra->start;
+		__entry->size = ra->size;
+		__entry->async_size = ra->async_size;
+		__entry->stride = ra->stride;
+		__entry->actual = actual;
+		__entry->hit = ra->hit;
+		__entry->miss = ra->miss;
+		__entry->waste = ra->waste;
+	),
+
+	TP_printk("dev=%d:%d ino=%lu pattern=%s offset=%lu req_size=%lu "
+		"start=%lu size=%u async_size=%u stride=%ld actual=%d "
+		"hit=%lu miss=%lu waste=%lu",
+		MAJOR(__entry->dev), MINOR(__entry->dev),
+		(unsigned long)__entry->ino,
+		show_ra_pattern(__entry->pattern),
+		(unsigned long)__entry->offset, __entry->req_size,
+		(unsigned long)__entry->start, __entry->size,
+		__entry->async_size, __entry->stride, __entry->actual,
+		__entry->hit, __entry->miss, __entry->waste)
+);
+
+#endif /* _TRACE_READAHEAD_H */
+
+/* This part must be outside protection */
+#include <trace/define_trace.h>
@@ -506,6 +506,7 @@ asmlinkage void __init start_kernel(void)
 	 */
 	pidhash_init();
 	vfs_caches_init_early();
+	workingset_init();
 	sort_main_extable();
 	trap_init();
 	mm_init();
@@ -17,75 +17,80 @@
 void res_counter_init(struct res_counter *counter, struct res_counter *parent)
 {
 	spin_lock_init(&counter->lock);
+	atomic64_set(&counter->usage, 0);
 	counter->limit = RESOURCE_MAX;
 	counter->soft_limit = RESOURCE_MAX;
 	counter->parent = parent;
 }
 
-int res_counter_charge_locked(struct res_counter *counter, unsigned long val)
+static void res_counter_uncharge_one(struct res_counter *counter,
+				     unsigned long val)
 {
-	if (counter->usage + val > counter->limit) {
+	long long usage = atomic64_sub_return(val, &counter->usage);
+
+	if (WARN_ON(usage < 0))
+		atomic64_sub(usage, &counter->usage);
+}
+
+/*
+ * The usage of a level is charged first, and only checked against the
+ * limit afterwards: a charge over the limit is then backed out, so that
+ * no lock is needed to serialize the charges against each other.
+ */
+static int res_counter_try_charge(struct res_counter *counter,
+				  unsigned long val)
+{
+	unsigned long long usage;
+	unsigned long flags;
+
+	usage = atomic64_add_return(val, &counter->usage);
+	if (unlikely(usage > res_counter_limit(counter))) {
+		res_counter_uncharge_one(counter, val);
+		spin_lock_irqsave(&counter->lock, flags);
 		counter->failcnt++;
+		spin_unlock_irqrestore(&counter->lock, flags);
 		return -ENOMEM;
 	}
 
-	counter->usage += val;
-	if (counter->usage > counter->max_usage)
-		counter->max_usage = counter->usage;
+	/* A racy update of the high watermark is good enough */
+	if (unlikely(usage > ACCESS_ONCE(counter->max_usage))) {
+#if BITS_PER_LONG == 64
+		counter->max_usage = usage;
+#else
+		spin_lock_irqsave(&counter->lock, flags);
+		if (usage > counter->max_usage)
+			counter->max_usage = usage;
+		spin_unlock_irqrestore(&counter->lock, flags);
+#endif
+	}
 	return 0;
 }
 
 int res_counter_charge(struct res_counter *counter, unsigned long val,
 			struct res_counter **limit_fail_at)
 {
-	int ret;
-	unsigned long flags;
 	struct res_counter *c, *u;
 
 	*limit_fail_at = NULL;
-	local_irq_save(flags);
 	for (c = counter; c != NULL; c = c->parent) {
-		spin_lock(&c->lock);
-		ret = res_counter_charge_locked(c, val);
-		spin_unlock(&c->lock);
-		if (ret < 0) {
+		if (res_counter_try_charge(c, val) < 0) {
 			*limit_fail_at = c;
 			goto undo;
 		}
 	}
-	ret = 0;
-	goto done;
+	return 0;
 undo:
-	for (u = counter; u != c; u = u->parent) {
-		spin_lock(&u->lock);
-		res_counter_uncharge_locked(u, val);
-		spin_unlock(&u->lock);
-	}
-done:
-	local_irq_restore(flags);
-	return ret;
-}
-
-void res_counter_uncharge_locked(struct res_counter *counter, unsigned long val)
-{
-	if (WARN_ON(counter->usage < val))
-		val = counter->usage;
-
-	counter->usage -= val;
+	for (u = counter; u != c; u = u->parent)
+		res_counter_uncharge_one(u, val);
+	return -ENOMEM;
 }
 
 void res_counter_uncharge(struct res_counter *counter, unsigned long val)
 {
-	unsigned long flags;
 	struct res_counter *c;
 
-	local_irq_save(flags);
-	for (c = counter; c != NULL; c = c->parent) {
-		spin_lock(&c->lock);
-		res_counter_uncharge_locked(c, val);
-		spin_unlock(&c->lock);
-	}
-	local_irq_restore(flags);
+	for (c = counter; c != NULL; c = c->parent)
+		res_counter_uncharge_one(c, val);
 }
 
 
@@ -93,8 +98,6 @@ static inline unsigned long long *
 res_counter_member(struct res_counter *counter, int member)
 {
 	switch (member) {
-	case RES_USAGE:
-		return &counter->usage;
 	case RES_MAX_USAGE:
 		return &counter->max_usage;
 	case RES_LIMIT:
@@ -113,11 +116,15 @@ ssize_t res_counter_read(struct res_counter *counter, int member,
 		const char __user *userbuf, size_t nbytes, loff_t *pos,
 		int (*read_strategy)(unsigned long long val, char *st_buf))
 {
-	unsigned long long *val;
+	unsigned long long *val, usage;
 	char buf[64], *s;
 
 	s = buf;
-	val = res_counter_member(counter, member);
+	if (member == RES_USAGE) {
+		usage = res_counter_usage(counter);
+		val = &usage;
+	} else
+		val = res_counter_member(counter, member);
 	if (read_strategy)
 		s += read_strategy(*val, s);
 	else
@@ -132,6 +139,9 @@ u64 res_counter_read_u64(struct res_counter *counter, int member)
 	unsigned long flags;
 	u64 ret;
 
+	if (member == RES_USAGE)
+		return res_counter_usage(counter);
+
 	spin_lock_irqsave(&counter->lock, flags);
 	ret = *res_counter_member(counter, member);
 	spin_unlock_irqrestore(&counter->lock, flags);
@@ -141,6 +151,8 @@ u64 res_counter_read_u64(struct res_counter *counter, int member)
 #else
 u64 res_counter_read_u64(struct res_counter *counter, int member)
 {
+	if (member == RES_USAGE)
+		return res_counter_usage(counter);
 	return *res_counter_member(counter, member);
 }
 #endif
@@ -175,6 +187,9 @@ int res_counter_write(struct res_counter *counter, int member,
 	unsigned long flags;
 	unsigned long long tmp, *val;
 
+	/* The usage is only changed by charges and uncharges */
+	if (member == RES_USAGE)
+		return -EINVAL;
 	if (write_strategy) {
 		if (write_strategy(buf, &tmp))
 			return -EINVAL;
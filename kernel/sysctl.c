@@ -1019,6 +1019,17 @@ static struct ctl_table vm_table[] = {
 		.proc_handler	= proc_dointvec_minmax,
 		.extra1		= &zero,
 	},
+#ifdef CONFIG_SWAP
+	{
+		.procname	= "swap_vma_readahead",
+		.data		= &sysctl_swap_vma_readahead,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &zero,
+		.extra2		= &one,
+	},
+#endif
 	{
 		.procname	= "dirty_background_ratio",
 		.data		= &dirty_background_ratio,
@@ -1145,6 +1156,15 @@ static struct ctl_table vm_table[] = {
 		.extra1		= &one,
 		.extra2		= &three,
 	},
+#ifdef CONFIG_MMU
+	{
+		.procname	= "fault_around_bytes",
+		.data		= &sysctl_fault_around_bytes,
+		.maxlen		= sizeof(sysctl_fault_around_bytes),
+		.mode		= 0644,
+		.proc_handler	= proc_doulongvec_minmax,
+	},
+#endif
 #ifdef CONFIG_COMPACTION
 	{
 		.procname	= "compact_memory",
@@ -1162,6 +1182,23 @@ static struct ctl_table vm_table[] = {
 		.extra1		= &min_extfrag_threshold,
 		.extra2		= &max_extfrag_threshold,
 	},
+	{
+		.procname	= "kcompactd_extfrag_threshold",
+		.data		= &sysctl_kcompactd_extfrag_threshold,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &min_extfrag_threshold,
+		.extra2		= &max_extfrag_threshold,
+	},
+	{
+		.procname	= "kcompactd_sleep_millisecs",
+		.data		= &sysctl_kcompactd_sleep_millisecs,
+		.maxlen		= sizeof(int),
+		.mode		= 0644,
+		.proc_handler	= proc_dointvec_minmax,
+		.extra1		= &one,
+	},
 
 #endif /* CONFIG_COMPACTION */
 	{
@@ -150,6 +150,7 @@ static ssize_t read_ahead_kb_store(struct device *dev,
 	read_ahead_kb = simple_strtoul(buf, &end, 10);
 	if (*buf && (end[0] == '\0' || (end[0] == '\n' && end[1] == '\0'))) {
 		bdi->ra_pages = read_ahead_kb >> (PAGE_SHIFT - 10);
+		bdi->ra_shift = 0;
 		ret = count;
 	}
 	return ret;
@@ -167,6 +168,7 @@ static ssize_t name##_show(struct device *dev,				\
 }
 
 BDI_SHOW(read_ahead_kb, K(bdi->ra_pages))
+BDI_SHOW(read_ahead_window_kb, K(bdi->ra_pages >> bdi->ra_shift))
 
 static ssize_t min_ratio_store(struct device *dev,
 		struct device_attribute *attr, const char *buf, size_t count)
@@ -208,6 +210,7 @@ BDI_SHOW(max_ratio, bdi->max_ratio)
 
 static struct device_attribute bdi_dev_attrs[] = {
 	__ATTR_RW(read_ahead_kb),
+	__ATTR(read_ahead_window_kb, 0444, read_ahead_window_kb_show, NULL),
 	__ATTR_RW(min_ratio),
 	__ATTR_RW(max_ratio),
 	__ATTR_NULL,
@@ -14,6 +14,8 @@
 #include <linux/backing-dev.h>
 #include <linux/sysctl.h>
 #include <linux/sysfs.h>
+#include <linux/kthread.h>
+#include <linux/freezer.h>
 #include "internal.h"
 
 #define CREATE_TRACE_POINTS
@@ -42,6 +44,7 @@ struct compact_control {
 	unsigned int order;		/* order a direct compactor needs */
 	int migratetype;		/* MOVABLE, RECLAIMABLE etc */
 	struct zone *zone;
+	bool proactive;			/* kcompactd run not asked for */
 };
 
 static unsigned long release_freepages(struct list_head *freelist)
@@ -251,6 +254,7 @@ static unsigned long isolate_migratepages(struct zone *zone,
 	unsigned long last_pageblock_nr = 0, pageblock_nr;
 	unsigned long nr_scanned = 0, nr_isolated = 0;
 	struct list_head *migratelist = &cc->migratepages;
+	spinlock_t *lru_lock;
 
 	/* Do not scan outside zone boundaries */
 	low_pfn = max(cc->migrate_pfn, zone->zone_start_pfn);
@@ -278,25 +282,33 @@ static unsigned long isolate_migratepages(struct zone *zone,
 
 	/* Time to isolate some pages for migration */
 	cond_resched();
-	spin_lock_irq(&zone->lru_lock);
+	lru_lock = &pfn_zone_lru(zone, low_pfn)->lock;
+	spin_lock_irq(lru_lock);
 	for (; low_pfn < end_pfn; low_pfn++) {
 		struct page *page;
 		bool locked = true;
 
+		/* An unaligned scan runs into the next pageblock's sub-list */
+		if (unlikely(&pfn_zone_lru(zone, low_pfn)->lock != lru_lock)) {
+			spin_unlock_irq(lru_lock);
+			lru_lock = &pfn_zone_lru(zone, low_pfn)->lock;
+			spin_lock_irq(lru_lock);
+		}
+
 		/* give a chance to irqs before checking need_resched() */
 		if (!((low_pfn+1) % SWAP_CLUSTER_MAX)) {
-			spin_unlock_irq(&zone->lru_lock);
+			spin_unlock_irq(lru_lock);
 			locked = false;
 		}
-		if (need_resched() || spin_is_contended(&zone->lru_lock)) {
+		if (need_resched() || spin_is_contended(lru_lock)) {
 			if (locked)
-				spin_unlock_irq(&zone->lru_lock);
+				spin_unlock_irq(lru_lock);
 			cond_resched();
-			spin_lock_irq(&zone->lru_lock);
+			spin_lock_irq(lru_lock);
 			if (fatal_signal_pending(current))
 				break;
 		} else if (!locked)
-			spin_lock_irq(&zone->lru_lock);
+			spin_lock_irq(lru_lock);
 
 		if (!pfn_valid_within(low_pfn))
 			continue;
@@ -353,7 +365,7 @@ static unsigned long isolate_migratepages(struct zone *zone,
 
 	acct_isolated(zone, cc);
 
-	spin_unlock_irq(&zone->lru_lock);
+	spin_unlock_irq(lru_lock);
 	cc->migrate_pfn = low_pfn;
 
 	trace_mm_compaction_isolate_migratepages(nr_scanned, nr_isolated);
@@ -448,14 +460,11 @@ static int compact_finished(struct zone *zone,
 	return COMPACT_CONTINUE;
 }
 
-/*
- * compaction_suitable: Is this suitable to run compaction on this zone now?
- * Returns
- *   COMPACT_SKIPPED  - If there are too few free pages for compaction
- *   COMPACT_PARTIAL  - If the allocation would succeed without compaction
- *   COMPACT_CONTINUE - If compaction should run now
- */
-unsigned long compaction_suitable(struct zone *zone, int order)
+int sysctl_kcompactd_extfrag_threshold = 500;
+int sysctl_kcompactd_sleep_millisecs = 500;
+
+static unsigned long __compaction_suitable(struct zone *zone, int order,
+					   int extfrag_threshold)
 {
 	int fragindex;
 	unsigned long watermark;
@@ -487,7 +496,7 @@ unsigned long compaction_suitable(struct zone *zone, int order)
 	 * Only compact if a failure would be due to fragmentation.
 	 */
 	fragindex = fragmentation_index(zone, order);
-	if (fragindex >= 0 && fragindex <= sysctl_extfrag_threshold)
+	if (fragindex >= 0 && fragindex <= extfrag_threshold)
 		return COMPACT_SKIPPED;
 
 	if (fragindex == -1 && zone_watermark_ok(zone, order, watermark, 0, 0))
@@ -496,11 +505,25 @@ unsigned long compaction_suitable(struct zone *zone, int order)
 	return COMPACT_CONTINUE;
 }
 
+/*
+ * compaction_suitable: Is this suitable to run compaction on this zone now?
+ * Returns
+ *   COMPACT_SKIPPED  - If there are too few free pages for compaction
+ *   COMPACT_PARTIAL  - If the allocation would succeed without compaction
+ *   COMPACT_CONTINUE - If compaction should run now
+ */
+unsigned long compaction_suitable(struct zone *zone, int order)
+{
+	return __compaction_suitable(zone, order, sysctl_extfrag_threshold);
+}
+
 static int compact_zone(struct zone *zone, struct compact_control *cc)
 {
 	int ret;
 
-	ret = compaction_suitable(zone, cc->order);
+	ret = __compaction_suitable(zone, cc->order, cc->proactive ?
+				    sysctl_kcompactd_extfrag_threshold :
+				    sysctl_extfrag_threshold);
 	switch (ret) {
 	case COMPACT_PARTIAL:
 	case COMPACT_SKIPPED:
@@ -692,6 +715,155 @@ int sysctl_extfrag_handler(struct ctl_table *table, int write,
 	return 0;
 }
 
+/*
+ * kcompactd compacts the zones of its node in the background: when woken
+ * for a high-order allocation that went into the slow path, and every
+ * kcompactd_sleep_millisecs when the fragmentation index of a zone for
+ * pageblock sized allocations is above kcompactd_extfrag_threshold, so
+ * that huge pages and other high-order allocations rarely have to wait
+ * for direct compaction.
+ */
+static void kcompactd_do_work(pg_data_t *pgdat)
+{
+	int order = pgdat->kcompactd_max_order;
+	enum zone_type classzone_idx = pgdat->kcompactd_classzone_idx;
+	bool proactive = !order;
+	int zoneid;
+
+	pgdat->kcompactd_max_order = 0;
+	pgdat->kcompactd_classzone_idx = 0;
+
+	if (proactive) {
+		order = pageblock_order;
+		classzone_idx = pgdat->nr_zones - 1;
+	} else
+		count_vm_event(COMPACTDAEMONWAKE);
+
+	for (zoneid = 0; zoneid <= classzone_idx; zoneid++) {
+		struct zone *zone = &pgdat->node_zones[zoneid];
+		struct compact_control cc = {
+			.nr_freepages = 0,
+			.nr_migratepages = 0,
+			.order = order,
+			.migratetype = MIGRATE_MOVABLE,
+			.zone = zone,
+			.sync = false,
+			.proactive = proactive,
+		};
+		int status;
+
+		if (!populated_zone(zone))
+			continue;
+
+		if (compaction_deferred(zone))
+			continue;
+
+		if (kthread_should_stop())
+			return;
+
+		INIT_LIST_HEAD(&cc.freepages);
+		INIT_LIST_HEAD(&cc.migratepages);
+
+		status = compact_zone(zone, &cc);
+
+		if (status == COMPACT_PARTIAL) {
+			zone->compact_considered = 0;
+			zone->compact_defer_shift = 0;
+		} else if (status == COMPACT_COMPLETE)
+			defer_compaction(zone);
+
+		VM_BUG_ON(!list_empty(&cc.freepages));
+		VM_BUG_ON(!list_empty(&cc.migratepages));
+	}
+}
+
+static int kcompactd(void *p)
+{
+	pg_data_t *pgdat = (pg_data_t *)p;
+	const struct cpumask *cpumask = cpumask_of_node(pgdat->node_id);
+
+	if (!cpumask_empty(cpumask))
+		set_cpus_allowed_ptr(current, cpumask);
+	set_freezable();
+
+	while (!kthread_should_stop()) {
+		wait_event_freezable_timeout(pgdat->kcompactd_wait,
+			pgdat->kcompactd_max_order || kthread_should_stop(),
+			msecs_to_jiffies(sysctl_kcompactd_sleep_millisecs));
+		kcompactd_do_work(pgdat);
+	}
+
+	return 0;
+}
+
+/*
+ * A high-order allocation could not be satisfied from the free lists of
+ * @zone: have kcompactd compact it if fragmentation is the reason.
+ */
+void wakeup_kcompactd(struct zone *zone, int order,
+		      enum zone_type classzone_idx)
+{
+	pg_data_t *pgdat;
+
+	if (!order || !populated_zone(zone))
+		return;
+
+	pgdat = zone->zone_pgdat;
+	if (!waitqueue_active(&pgdat->kcompactd_wait))
+		return;
+	if (compaction_suitable(zone, order) != COMPACT_CONTINUE)
+		return;
+
+	if (pgdat->kcompactd_max_order < order)
+		pgdat->kcompactd_max_order = order;
+	if (pgdat->kcompactd_classzone_idx < classzone_idx)
+		pgdat->kcompactd_classzone_idx = classzone_idx;
+	wake_up_interruptible(&pgdat->kcompactd_wait);
+}
+
+/*
+ * This kcompactd start function will be called by init and node-hot-add.
+ */
+int kcompactd_run(int nid)
+{
+	pg_data_t *pgdat = NODE_DATA(nid);
+	int ret = 0;
+
+	if (pgdat->kcompactd)
+		return 0;
+
+	pgdat->kcompactd = kthread_run(kcompactd, pgdat, "kcompactd%d", nid);
+	if (IS_ERR(pgdat->kcompactd)) {
+		printk(KERN_ERR "Failed to start kcompactd on node %d\n", nid);
+		pgdat->kcompactd = NULL;
+		ret = -1;
+	}
+	return ret;
+}
+
+/*
+ * Called by memory hotplug when all memory in a node is offlined.
+ */
+void kcompactd_stop(int nid)
+{
+	struct task_struct *kcompactd = NODE_DATA(nid)->kcompactd;
+
+	if (kcompactd) {
+		kthread_stop(kcompactd);
+		NODE_DATA(nid)->kcompactd = NULL;
+	}
+}
+
+static int __init kcompactd_init(void)
+{
+	int nid;
+
+	for_each_node_state(nid, N_HIGH_MEMORY)
+		kcompactd_run(nid);
+	return 0;
+}
+module_init(kcompactd_init)
+
 #if defined(CONFIG_SYSFS) && defined(CONFIG_NUMA)
 ssize_t sysfs_compact_node(struct sys_device *dev,
 			struct sysdev_attribute *attr,
@@ -34,6 +34,7 @@
 #include <linux/hardirq.h> /* for BUG_ON(!in_atomic()) only */
 #include <linux/memcontrol.h>
 #include <linux/mm_inline.h> /* for page_is_file_cache() */
+#include <trace/events/readahead.h>
 #include "internal.h"
 
 /*
@@ -94,8 +95,8 @@
  *    ->swap_lock		(try_to_unmap_one)
  *    ->private_lock		(try_to_unmap_one)
  *    ->tree_lock		(try_to_unmap_one)
- *    ->zone.lru_lock		(follow_page->mark_page_accessed)
- *    ->zone.lru_lock		(check_pte_range->isolate_lru_page)
+ *    ->zone_lru.lock		(follow_page->mark_page_accessed)
+ *    ->zone_lru.lock		(check_pte_range->isolate_lru_page)
  *    ->private_lock		(page_remove_rmap->set_page_dirty)
  *    ->tree_lock		(page_remove_rmap->set_page_dirty)
  *    inode_wb_list_lock	(page_remove_rmap->set_page_dirty)
@@ -503,10 +504,12 @@ int add_to_page_cache_lru(struct page *page, struct address_space *mapping,
 
 	ret = add_to_page_cache(page, mapping, offset, gfp_mask);
 	if (ret == 0) {
-		if (page_is_file_cache(page))
-			lru_cache_add_file(page);
-		else
+		if (!page_is_file_cache(page))
 			lru_cache_add_anon(page);
+		else if (workingset_refault(mapping, offset))
+			lru_cache_add_lru(page, LRU_ACTIVE_FILE);
+		else
+			lru_cache_add_file(page);
 	}
 	return ret;
 }
@@ -1513,6 +1516,20 @@ static int page_cache_read(struct file *file, pgoff_t offset)
 
 #define MMAP_LOTSAMISS  (100)
 
+/*
+ * A page of the file was mapped from the page cache. Faults are all we
+ * see of an mmap stream, so they also tell how much of the read-around
+ * window was used when it gets abandoned.
+ */
+static inline void ra_mmap_hit(struct file_ra_state *ra, pgoff_t offset)
+{
+	if (ra->mmap_miss > 0)
+		ra->mmap_miss--;
+	if (ra->pattern == RA_PATTERN_AROUND &&
+	    offset - ra->start < ra->size && ra->mmap_hit < ra->size)
+		ra->mmap_hit++;
+}
+
 /*
  * Synchronous readahead happens when we don't even find
  * a page in the page cache at all.
@@ -1536,6 +1553,7 @@ static void do_sync_mmap_readahead(struct vm_area_struct *vma,
 		return;
 	}
 
+	ra->miss++;
 	if (ra->mmap_miss < INT_MAX)
 		ra->mmap_miss++;
 
@@ -1551,10 +1569,16 @@ static void do_sync_mmap_readahead(struct vm_area_struct *vma,
 	 */
 	ra_pages = max_sane_readahead(ra->ra_pages);
 	if (ra_pages) {
+		int actual;
+
+		ra_window_abandon(mapping, ra);
+		ra->pattern = RA_PATTERN_AROUND;
 		ra->start = max_t(long, 0, offset - ra_pages/2);
 		ra->size = ra_pages;
 		ra->async_size = 0;
-		ra_submit(ra, mapping, file);
+		ra->mmap_hit = 1;	/* the faulting page */
+		actual = ra_submit(ra, mapping, file);
+		trace_readahead(mapping, ra, offset, ra_pages, actual);
 	}
 }
 
@@ -1573,8 +1597,7 @@ static void do_async_mmap_readahead(struct vm_area_struct *vma,
 	/* If we don't want any read-ahead, don't bother */
 	if (VM_RandomReadHint(vma))
 		return;
-	if (ra->mmap_miss > 0)
-		ra->mmap_miss--;
+	ra_mmap_hit(ra, offset);
 	if (PageReadahead(page))
 		page_cache_async_readahead(mapping, ra, file,
 					   page, offset, ra->ra_pages);
@@ -1713,8 +1736,74 @@ page_not_uptodate:
 }
 EXPORT_SYMBOL(filemap_fault);
 
+/**
+ * filemap_map_pages - map the cached pages around a read fault
+ * @vma:	vma in which the fault was taken
+ * @vmf:	fault-around window, see do_fault_around()
+ *
+ * Map the pages of the window that are uptodate in the page cache and
+ * can be locked without waiting, in ptes that are still none. Anything
+ * else, including the pages marked to trigger readahead, is left to
+ * filemap_fault(). Called with the pte lock held.
+ */
+void filemap_map_pages(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	struct file *file = vma->vm_file;
+	struct address_space *mapping = file->f_mapping;
+	unsigned long address = (unsigned long)vmf->virtual_address;
+	struct page *pages[PAGEVEC_SIZE];
+	pgoff_t index = vmf->pgoff;
+	pgoff_t size;
+	unsigned int nr, i;
+
+	size = (i_size_read(mapping->host) + PAGE_CACHE_SIZE - 1) >>
+							PAGE_CACHE_SHIFT;
+
+	while (index <= vmf->max_pgoff) {
+		nr = min_t(pgoff_t, vmf->max_pgoff - index + 1, PAGEVEC_SIZE);
+		nr = find_get_pages(mapping, index, nr, pages);
+		if (!nr)
+			break;
+		index = pages[nr - 1]->index + 1;
+
+		for (i = 0; i < nr; i++) {
+			struct page *page = pages[i];
+			pte_t *pte;
+
+			if (page->index > vmf->max_pgoff)
+				goto skip;
+			if (!PageUptodate(page) || PageReadahead(page) ||
+			    PageHWPoison(page))
+				goto skip;
+			if (!trylock_page(page))
+				goto skip;
+
+			if (page->mapping != mapping || !PageUptodate(page) ||
+			    page->index >= size)
+				goto unlock;
+
+			pte = vmf->pte + page->index - vmf->pgoff;
+			if (!pte_none(*pte))
+				goto unlock;
+
+			ra_mmap_hit(&file->f_ra, page->index);
+			do_set_pte(vma, address +
+				   ((page->index - vmf->pgoff) << PAGE_SHIFT),
+				   page, pte);
+			unlock_page(page);
+			continue;
+unlock:
+			unlock_page(page);
+skip:
+			page_cache_release(page);
+		}
+	}
+}
+EXPORT_SYMBOL(filemap_map_pages);
+
 const struct vm_operations_struct generic_file_vm_ops = {
 	.fault		= filemap_fault,
+	.map_pages	= filemap_map_pages,
 };
 
 /* This is used for a general mmap of a disk file */
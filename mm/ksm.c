@@ -23,7 +23,6 @@
 #include <linux/pagemap.h>
 #include <linux/rmap.h>
 #include <linux/spinlock.h>
-#include <linux/jhash.h>
 #include <linux/delay.h>
 #include <linux/kthread.h>
 #include <linux/wait.h>
@@ -77,6 +76,18 @@
  *    take 10 attempts to find a page in the unstable tree, once it is found,
  *    it is secured in the stable tree.  (When we scan a new page, we first
  *    compare it against the stable tree, and then against the unstable tree.)
+ *
+ * Both trees are ordered by a checksum of the page first, and by contents
+ * only among pages of equal checksum: so a search compares the contents of
+ * the few pages which have the same checksum, instead of one page per level
+ * of the tree, each of which had to be looked up by its virtual address in
+ * the unstable tree.
+ *
+ * The scan is shared by a number of ksmd threads, the workers: each takes
+ * the next mm_slot of the full scan, walks its mergeable areas and merges its
+ * pages; and the full scan is over when the last worker has completed its
+ * last mm_slot.  The walks and checksums run in parallel, the searches and
+ * updates of the trees are serialized by ksm_tree_mutex.
  */
 
 /**
@@ -95,18 +106,34 @@ struct mm_slot {
 
 /**
  * struct ksm_scan - cursor for scanning
- * @mm_slot: the current mm_slot we are scanning
- * @address: the next address inside that to be scanned
- * @rmap_list: link to the next rmap to be scanned in the rmap_list
+ * @mm_slot: the next mm_slot to be handed out to a worker
  * @seqnr: count of completed full scans (needed when removing unstable node)
+ * @nr_busy: number of workers scanning an mm_slot of this full scan
  *
- * There is only the one ksm_scan instance of this cursor structure.
+ * There is only the one ksm_scan instance of this cursor structure,
+ * protected by ksm_mmlist_lock.
  */
 struct ksm_scan {
+	struct mm_slot *mm_slot;
+	unsigned long seqnr;
+	unsigned int nr_busy;
+};
+
+/**
+ * struct ksm_worker - a ksmd thread and its place in the scan
+ * @thread: the ksmd thread, NULL when not running
+ * @mm_slot: the mm_slot it is scanning, NULL when between two
+ * @address: the next address inside that to be scanned
+ * @rmap_list: link to the next rmap to be scanned in the rmap_list
+ * @stale: rmap_items unlinked from the rmap_list, still to be removed
+ *	   from the trees and freed
+ */
+struct ksm_worker {
+	struct task_struct *thread;
 	struct mm_slot *mm_slot;
 	unsigned long address;
 	struct rmap_item **rmap_list;
-	unsigned long seqnr;
+	struct rmap_item *stale;
 };
 
 /**
@@ -114,11 +141,13 @@ struct ksm_scan {
  * @node: rb node of this ksm page in the stable tree
  * @hlist: hlist head of rmap_items using this ksm page
  * @kpfn: page frame number of this ksm page
+ * @checksum: checksum of the ksm page, the first key of the stable tree
  */
 struct stable_node {
 	struct rb_node node;
 	struct hlist_head hlist;
 	unsigned long kpfn;
+	u32 checksum;
 };
 
 /**
@@ -127,7 +156,8 @@ struct stable_node {
  * @anon_vma: pointer to anon_vma for this mm,address, when in stable tree
  * @mm: the memory structure this rmap_item is pointing into
  * @address: the virtual address this rmap_item tracks (+ flags in low bits)
- * @oldchecksum: previous checksum of the page at that virtual address
+ * @oldchecksum: previous checksum of the page at that virtual address,
+ *		 the first key of the unstable tree
  * @node: rb node of this rmap_item in the unstable tree
  * @head: pointer to stable_node heading this list in the stable tree
  * @hlist: link into hlist of rmap_items hanging off that stable_node
@@ -166,6 +196,9 @@ static struct ksm_scan ksm_scan = {
 	.mm_slot = &ksm_mm_head,
 };
 
+#define KSM_MAX_THREADS	32
+static struct ksm_worker ksm_workers[KSM_MAX_THREADS];
+
 static struct kmem_cache *rmap_item_cache;
 static struct kmem_cache *stable_node_cache;
 static struct kmem_cache *mm_slot_cache;
@@ -180,7 +213,7 @@ static unsigned long ksm_pages_sharing;
 static unsigned long ksm_pages_unshared;
 
 /* The number of rmap_items in use: to calculate pages_volatile */
-static unsigned long ksm_rmap_items;
+static atomic_long_t ksm_rmap_items = ATOMIC_LONG_INIT(0);
 
 /* Number of pages ksmd should scan in one batch */
 static unsigned int ksm_thread_pages_to_scan = 100;
@@ -188,13 +221,24 @@ static unsigned int ksm_thread_pages_to_scan = 100;
 /* Milliseconds ksmd should sleep between batches */
 static unsigned int ksm_thread_sleep_millisecs = 20;
 
+/* Number of ksmd threads sharing the scan */
+static unsigned int ksm_nr_threads = 1;
+
 #define KSM_RUN_STOP	0
 #define KSM_RUN_MERGE	1
 #define KSM_RUN_UNMERGE	2
 static unsigned int ksm_run = KSM_RUN_STOP;
 
+/*
+ * ksmd threads hold ksm_thread_sem for read while scanning a batch, the
+ * sysfs controls and memory hotremove take it for write to lock them all
+ * out.  Among the workers, the stable and unstable trees and their counts
+ * are serialized by ksm_tree_mutex.
+ */
 static DECLARE_WAIT_QUEUE_HEAD(ksm_thread_wait);
-static DEFINE_MUTEX(ksm_thread_mutex);
+static DECLARE_RWSEM(ksm_thread_sem);
+static DEFINE_MUTEX(ksm_tree_mutex);
+static DEFINE_MUTEX(ksm_nr_threads_mutex);
 static DEFINE_SPINLOCK(ksm_mmlist_lock);
 
 #define KSM_KMEM_CACHE(__struct, __flags) kmem_cache_create("ksm_"#__struct,\
@@ -239,13 +283,13 @@ static inline struct rmap_item *alloc_rmap_item(void)
 
 	rmap_item = kmem_cache_zalloc(rmap_item_cache, GFP_KERNEL);
 	if (rmap_item)
-		ksm_rmap_items++;
+		atomic_long_inc(&ksm_rmap_items);
 	return rmap_item;
 }
 
 static inline void free_rmap_item(struct rmap_item *rmap_item)
 {
-	ksm_rmap_items--;
+	atomic_long_dec(&ksm_rmap_items);
 	rmap_item->mm = NULL;	/* debug safety */
 	kmem_cache_free(rmap_item_cache, rmap_item);
 }
@@ -479,7 +523,7 @@ static void remove_node_from_stable_tree(struct stable_node *stable_node)
  * a page to put something that might look like our key in page->mapping.
  *
  * include/linux/pagemap.h page_cache_get_speculative() is a good reference,
- * but this is different - made simpler by ksm_thread_mutex being held, but
+ * but this is different - made simpler by ksm_tree_mutex being held, but
  * interesting for assuming that no other use of the struct page could ever
  * put our expected_mapping into page->mapping (or a field of the union which
  * coincides with page->mapping).  The RCU calls are not for KSM at all, but
@@ -518,6 +562,7 @@ stale:
 /*
  * Removing rmap_item from stable or unstable tree.
  * This function will clean the information from the stable/unstable tree.
+ * Called with ksm_tree_mutex held, or ksm_thread_sem held for write.
  */
 static void remove_rmap_item_from_tree(struct rmap_item *rmap_item)
 {
@@ -564,15 +609,37 @@ out:
 	cond_resched();		/* we're called from many long loops */
 }
 
-static void remove_trailing_rmap_items(struct mm_slot *mm_slot,
-				       struct rmap_item **rmap_list)
+/*
+ * A worker cannot remove an rmap_item from the trees while it holds the
+ * mmap_sem of the mm it is scanning: whoever holds ksm_tree_mutex may be
+ * waiting for that mmap_sem to merge a page of the mm, behind a writer.
+ * So the rmap_item is unlinked from the rmap_list, and removed from the
+ * trees by flush_stale_rmap_items() once mmap_sem has been dropped.
+ */
+static void stale_rmap_item(struct ksm_worker *w, struct rmap_item **rmap_list)
 {
-	while (*rmap_list) {
-		struct rmap_item *rmap_item = *rmap_list;
-		*rmap_list = rmap_item->rmap_list;
+	struct rmap_item *rmap_item = *rmap_list;
+
+	*rmap_list = rmap_item->rmap_list;
+	rmap_item->rmap_list = w->stale;
+	w->stale = rmap_item;
+}
+
+static void flush_stale_rmap_items(struct ksm_worker *w)
+{
+	struct rmap_item *rmap_item;
+
+	if (!w->stale)
+		return;
+
+	mutex_lock(&ksm_tree_mutex);
+	while (w->stale) {
+		rmap_item = w->stale;
+		w->stale = rmap_item->rmap_list;
 		remove_rmap_item_from_tree(rmap_item);
 		free_rmap_item(rmap_item);
 	}
+	mutex_unlock(&ksm_tree_mutex);
 }
 
 /*
@@ -606,6 +673,17 @@ static int unmerge_ksm_pages(struct vm_area_struct *vma,
 }
 
 #ifdef CONFIG_SYSFS
+static void remove_trailing_rmap_items(struct mm_slot *mm_slot,
+				       struct rmap_item **rmap_list)
+{
+	while (*rmap_list) {
+		struct rmap_item *rmap_item = *rmap_list;
+		*rmap_list = rmap_item->rmap_list;
+		remove_rmap_item_from_tree(rmap_item);
+		free_rmap_item(rmap_item);
+	}
+}
+
 /*
  * Only called through the sysfs control interface:
  */
@@ -615,8 +693,13 @@ static int unmerge_and_remove_all_rmap_items(void)
 	struct mm_struct *mm;
 	struct vm_area_struct *vma;
 	int err = 0;
+	int i;
 
 	spin_lock(&ksm_mmlist_lock);
+	/* The workers are locked out: forget the mm_slots they were on */
+	for (i = 0; i < KSM_MAX_THREADS; i++)
+		ksm_workers[i].mm_slot = NULL;
+	ksm_scan.nr_busy = 0;
 	ksm_scan.mm_slot = list_entry(ksm_mm_head.mm_list.next,
 						struct mm_slot, mm_list);
 	spin_unlock(&ksm_mmlist_lock);
@@ -668,13 +751,34 @@ error:
 }
 #endif /* CONFIG_SYSFS */
 
+/*
+ * The checksum only has to notice that a page changed between two scans,
+ * and to spread the pages over the trees: a collision costs one memcmp.
+ * So rather than a full hash of every byte, multiply in a word at a time,
+ * in four independent lanes to keep the multiplier busy.
+ */
 static u32 calc_checksum(struct page *page)
 {
-	u32 checksum;
-	void *addr = kmap_atomic(page, KM_USER0);
-	checksum = jhash2(addr, PAGE_SIZE / 4, 17);
+	unsigned long *addr = kmap_atomic(page, KM_USER0);
+	unsigned long h0 = 0, h1 = 0, h2 = 0, h3 = 0;
+	int i;
+
+	for (i = 0; i < PAGE_SIZE / sizeof(long); i += 4) {
+		h0 = (h0 ^ addr[i]) * GOLDEN_RATIO_PRIME;
+		h1 = (h1 ^ addr[i + 1]) * GOLDEN_RATIO_PRIME;
+		h2 = (h2 ^ addr[i + 2]) * GOLDEN_RATIO_PRIME;
+		h3 = (h3 ^ addr[i + 3]) * GOLDEN_RATIO_PRIME;
+	}
 	kunmap_atomic(addr, KM_USER0);
-	return checksum;
+
+	h0 = ((h0 * GOLDEN_RATIO_PRIME + h1) * GOLDEN_RATIO_PRIME + h2) *
+					GOLDEN_RATIO_PRIME + h3;
+	return hash_long(h0, 32);
+}
+
+static inline int cmp_checksums(u32 checksum1, u32 checksum2)
+{
+	return checksum1 < checksum2 ? -1 : checksum1 > checksum2;
 }
 
 static int memcmp_pages(struct page *page1, struct page *page2)
@@ -933,6 +1037,7 @@ static int try_to_merge_with_ksm_page(struct rmap_item *rmap_item,
 	err = try_to_merge_one_page(vma, page, kpage);
 	if (err)
 		goto out;
+	vma->ksm_pages_merged++;
 
 	/* Must get reference to anon_vma while still holding mmap_sem */
 	rmap_item->anon_vma = vma->anon_vma;
@@ -978,11 +1083,12 @@ static struct page *try_to_merge_two_pages(struct rmap_item *rmap_item,
  *
  * This function checks if there is a page inside the stable tree
  * with identical content to the page that we are scanning right now.
+ * Only the pages with the same checksum need to be compared with it.
  *
  * This function returns the stable tree node of identical content if found,
  * NULL otherwise.
  */
-static struct page *stable_tree_search(struct page *page)
+static struct page *stable_tree_search(struct page *page, u32 checksum)
 {
 	struct rb_node *node = root_stable_tree.rb_node;
 	struct stable_node *stable_node;
@@ -999,6 +1105,15 @@ static struct page *stable_tree_search(struct page *page)
 
 		cond_resched();
 		stable_node = rb_entry(node, struct stable_node, node);
+		ret = cmp_checksums(checksum, stable_node->checksum);
+		if (ret < 0) {
+			node = node->rb_left;
+			continue;
+		} else if (ret > 0) {
+			node = node->rb_right;
+			continue;
+		}
+
 		tree_page = get_ksm_page(stable_node);
 		if (!tree_page)
 			return NULL;
@@ -1030,6 +1145,10 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 	struct rb_node **new = &root_stable_tree.rb_node;
 	struct rb_node *parent = NULL;
 	struct stable_node *stable_node;
+	u32 checksum;
+
+	/* kpage is write-protected now: its checksum cannot go stale */
+	checksum = calc_checksum(kpage);
 
 	while (*new) {
 		struct page *tree_page;
@@ -1037,12 +1156,15 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 
 		cond_resched();
 		stable_node = rb_entry(*new, struct stable_node, node);
-		tree_page = get_ksm_page(stable_node);
-		if (!tree_page)
-			return NULL;
+		ret = cmp_checksums(checksum, stable_node->checksum);
+		if (!ret) {
+			tree_page = get_ksm_page(stable_node);
+			if (!tree_page)
+				return NULL;
 
-		ret = memcmp_pages(kpage, tree_page);
-		put_page(tree_page);
+			ret = memcmp_pages(kpage, tree_page);
+			put_page(tree_page);
+		}
 
 		parent = *new;
 		if (ret < 0)
@@ -1069,6 +1191,7 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
 	INIT_HLIST_HEAD(&stable_node->hlist);
 
 	stable_node->kpfn = page_to_pfn(kpage);
+	stable_node->checksum = checksum;
 	set_page_stable_node(kpage, stable_node);
 
 	return stable_node;
@@ -1080,7 +1203,9 @@ static struct stable_node *stable_tree_insert(struct page *kpage)
  *
  * This function searches for a page in the unstable tree identical to the
  * page currently being scanned; and if no identical page is found in the
- * tree, we insert rmap_item as a new object into the unstable tree.
+ * tree, we insert rmap_item as a new object into the unstable tree.  The
+ * page's checksum is rmap_item->oldchecksum, and only the pages with that
+ * same checksum have to be looked up and compared with it.
  *
  * This function returns pointer to rmap_item found to be identical
  * to the currently scanned page, NULL otherwise.
@@ -1104,6 +1229,17 @@ struct rmap_item *unstable_tree_search_insert(struct rmap_item *rmap_item,
 
 		cond_resched();
 		tree_rmap_item = rb_entry(*new, struct rmap_item, node);
+		ret = cmp_checksums(rmap_item->oldchecksum,
+				    tree_rmap_item->oldchecksum);
+		if (ret) {
+			parent = *new;
+			if (ret < 0)
+				new = &parent->rb_left;
+			else
+				new = &parent->rb_right;
+			continue;
+		}
+
 		tree_page = get_mergeable_page(tree_rmap_item);
 		if (IS_ERR_OR_NULL(tree_page))
 			return NULL;
@@ -1173,13 +1309,17 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	struct page *tree_page = NULL;
 	struct stable_node *stable_node;
 	struct page *kpage;
-	unsigned int checksum;
+	u32 checksum;
 	int err;
 
+	/* The checksum is the costly part, and needs no lock */
+	checksum = calc_checksum(page);
+
+	mutex_lock(&ksm_tree_mutex);
 	remove_rmap_item_from_tree(rmap_item);
 
 	/* We first start with searching the page inside the stable tree */
-	kpage = stable_tree_search(page);
+	kpage = stable_tree_search(page, checksum);
 	if (kpage) {
 		err = try_to_merge_with_ksm_page(rmap_item, page, kpage);
 		if (!err) {
@@ -1192,7 +1332,7 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			unlock_page(kpage);
 		}
 		put_page(kpage);
-		return;
+		goto out;
 	}
 
 	/*
@@ -1201,10 +1341,9 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 	 * don't want to insert it in the unstable tree, and we don't want
 	 * to waste our time searching for something identical to it there.
 	 */
-	checksum = calc_checksum(page);
 	if (rmap_item->oldchecksum != checksum) {
 		rmap_item->oldchecksum = checksum;
-		return;
+		goto out;
 	}
 
 	tree_rmap_item =
@@ -1241,9 +1380,11 @@ static void cmp_and_merge_page(struct page *page, struct rmap_item *rmap_item)
 			}
 		}
 	}
+out:
+	mutex_unlock(&ksm_tree_mutex);
 }
 
-static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
+static struct rmap_item *get_next_rmap_item(struct ksm_worker *w,
 					    struct rmap_item **rmap_list,
 					    unsigned long addr)
 {
@@ -1255,15 +1396,13 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 			return rmap_item;
 		if (rmap_item->address > addr)
 			break;
-		*rmap_list = rmap_item->rmap_list;
-		remove_rmap_item_from_tree(rmap_item);
-		free_rmap_item(rmap_item);
+		stale_rmap_item(w, rmap_list);
 	}
 
 	rmap_item = alloc_rmap_item();
 	if (rmap_item) {
 		/* It has already been zeroed */
-		rmap_item->mm = mm_slot->mm;
+		rmap_item->mm = w->mm_slot->mm;
 		rmap_item->address = addr;
 		rmap_item->rmap_list = *rmap_list;
 		*rmap_list = rmap_item;
@@ -1271,18 +1410,40 @@ static struct rmap_item *get_next_rmap_item(struct mm_slot *mm_slot,
 	return rmap_item;
 }
 
-static struct rmap_item *scan_get_next_rmap_item(struct page **page)
+/*
+ * Hand out the next mm_slot of the full scan to worker w, starting a new
+ * full scan if the last one is over.  Returns NULL if there is none left
+ * for this full scan, but other workers are still scanning theirs: the
+ * unstable tree cannot be reset until they are done with it.
+ */
+static struct mm_slot *get_next_mm_slot(struct ksm_worker *w)
 {
-	struct mm_struct *mm;
 	struct mm_slot *slot;
-	struct vm_area_struct *vma;
-	struct rmap_item *rmap_item;
-
-	if (list_empty(&ksm_mm_head.mm_list))
-		return NULL;
+	bool new_scan = false;
 
+	spin_lock(&ksm_mmlist_lock);
 	slot = ksm_scan.mm_slot;
 	if (slot == &ksm_mm_head) {
+		if (ksm_scan.nr_busy) {
+			spin_unlock(&ksm_mmlist_lock);
+			return NULL;
+		}
+		/* No worker is in the tree while none has an mm_slot */
+		root_unstable_tree = RB_ROOT;
+		slot = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
+		if (slot == &ksm_mm_head) {
+			spin_unlock(&ksm_mmlist_lock);
+			return NULL;
+		}
+		new_scan = true;
+	}
+	ksm_scan.mm_slot = list_entry(slot->mm_list.next,
+						struct mm_slot, mm_list);
+	ksm_scan.nr_busy++;
+	w->mm_slot = slot;
+	spin_unlock(&ksm_mmlist_lock);
+
+	if (new_scan) {
 		/*
 		 * A number of pages can hang around indefinitely on per-cpu
 		 * pagevecs, raised page count preventing write_protect_page
@@ -1294,16 +1455,63 @@ static struct rmap_item *scan_get_next_rmap_item(struct page **page)
 		 * so we don't IPI too often when pages_to_scan is set low).
 		 */
 		lru_add_drain_all();
+	}
+	return slot;
+}
 
-		root_unstable_tree = RB_ROOT;
+/*
+ * Worker w is done with its mm_slot: the full scan is over when the last
+ * mm_slot of it has been handed out and every worker is done with its own.
+ * Called with ksm_mmlist_lock held.
+ */
+static void put_mm_slot(struct ksm_worker *w)
+{
+	w->mm_slot = NULL;
+	if (!--ksm_scan.nr_busy && ksm_scan.mm_slot == &ksm_mm_head)
+		ksm_scan.seqnr++;
+}
 
-		spin_lock(&ksm_mmlist_lock);
-		slot = list_entry(slot->mm_list.next, struct mm_slot, mm_list);
-		ksm_scan.mm_slot = slot;
-		spin_unlock(&ksm_mmlist_lock);
+/*
+ * Is mm_slot being scanned by a worker?  Called with ksm_mmlist_lock held.
+ */
+static bool mm_slot_busy(struct mm_slot *mm_slot)
+{
+	int i;
+
+	for (i = 0; i < KSM_MAX_THREADS; i++)
+		if (ksm_workers[i].mm_slot == mm_slot)
+			return true;
+	return false;
+}
+
+/*
+ * Queue mm_slot to be handed out next in this full scan, or in the next
+ * full scan if this one is over.  Called with ksm_mmlist_lock held.
+ */
+static void requeue_mm_slot(struct mm_slot *mm_slot)
+{
+	list_move_tail(&mm_slot->mm_list, &ksm_scan.mm_slot->mm_list);
+	if (ksm_scan.mm_slot != &ksm_mm_head || ksm_scan.nr_busy)
+		ksm_scan.mm_slot = mm_slot;
+}
+
+static struct rmap_item *scan_get_next_rmap_item(struct ksm_worker *w,
+						 struct page **page)
+{
+	struct mm_struct *mm;
+	struct mm_slot *slot;
+	struct vm_area_struct *vma;
+	struct rmap_item *rmap_item;
+	bool free_slot;
+
+	slot = w->mm_slot;
+	if (!slot) {
 next_mm:
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		slot = get_next_mm_slot(w);
+		if (!slot)
+			return NULL;
+		w->address = 0;
+		w->rmap_list = &slot->rmap_list;
 	}
 
 	mm = slot->mm;
@@ -1311,60 +1519,59 @@ next_mm:
 	if (ksm_test_exit(mm))
 		vma = NULL;
 	else
-		vma = find_vma(mm, ksm_scan.address);
+		vma = find_vma(mm, w->address);
 
 	for (; vma; vma = vma->vm_next) {
 		if (!(vma->vm_flags & VM_MERGEABLE))
 			continue;
-		if (ksm_scan.address < vma->vm_start)
-			ksm_scan.address = vma->vm_start;
+		if (w->address < vma->vm_start)
+			w->address = vma->vm_start;
 		if (!vma->anon_vma)
-			ksm_scan.address = vma->vm_end;
+			w->address = vma->vm_end;
 
-		while (ksm_scan.address < vma->vm_end) {
+		while (w->address < vma->vm_end) {
 			if (ksm_test_exit(mm))
 				break;
-			*page = follow_page(vma, ksm_scan.address, FOLL_GET);
+			*page = follow_page(vma, w->address, FOLL_GET);
 			if (IS_ERR_OR_NULL(*page)) {
-				ksm_scan.address += PAGE_SIZE;
+				w->address += PAGE_SIZE;
 				cond_resched();
 				continue;
 			}
 			if (PageAnon(*page) ||
 			    page_trans_compound_anon(*page)) {
-				flush_anon_page(vma, *page, ksm_scan.address);
+				flush_anon_page(vma, *page, w->address);
 				flush_dcache_page(*page);
-				rmap_item = get_next_rmap_item(slot,
-					ksm_scan.rmap_list, ksm_scan.address);
+				rmap_item = get_next_rmap_item(w,
+					w->rmap_list, w->address);
 				if (rmap_item) {
-					ksm_scan.rmap_list =
-							&rmap_item->rmap_list;
-					ksm_scan.address += PAGE_SIZE;
+					w->rmap_list = &rmap_item->rmap_list;
+					w->address += PAGE_SIZE;
+					vma->ksm_pages_scanned++;
 				} else
 					put_page(*page);
 				up_read(&mm->mmap_sem);
 				return rmap_item;
 			}
 			put_page(*page);
-			ksm_scan.address += PAGE_SIZE;
+			w->address += PAGE_SIZE;
 			cond_resched();
 		}
 	}
 
 	if (ksm_test_exit(mm)) {
-		ksm_scan.address = 0;
-		ksm_scan.rmap_list = &slot->rmap_list;
+		w->address = 0;
+		w->rmap_list = &slot->rmap_list;
 	}
 	/*
 	 * Nuke all the rmap_items that are above this current rmap:
 	 * because there were no VM_MERGEABLE vmas with such addresses.
 	 */
-	remove_trailing_rmap_items(slot, ksm_scan.rmap_list);
+	while (*w->rmap_list)
+		stale_rmap_item(w, w->rmap_list);
 
-	spin_lock(&ksm_mmlist_lock);
-	ksm_scan.mm_slot = list_entry(slot->mm_list.next,
-						struct mm_slot, mm_list);
-	if (ksm_scan.address == 0) {
+	free_slot = (w->address == 0);
+	if (free_slot) {
 		/*
 		 * We've completed a full scan of all vmas, holding mmap_sem
 		 * throughout, and found no VM_MERGEABLE: so do the same as
@@ -1374,46 +1581,54 @@ next_mm:
 		 * or when all VM_MERGEABLE areas have been unmapped (and
 		 * mmap_sem then protects against race with MADV_MERGEABLE).
 		 */
+		spin_lock(&ksm_mmlist_lock);
 		hlist_del(&slot->link);
 		list_del(&slot->mm_list);
 		spin_unlock(&ksm_mmlist_lock);
 
-		free_mm_slot(slot);
 		clear_bit(MMF_VM_MERGEABLE, &mm->flags);
-		up_read(&mm->mmap_sem);
+	}
+	up_read(&mm->mmap_sem);
+
+	/*
+	 * The rmap_items must be off the trees before the mm can go, and
+	 * before put_mm_slot() may end the full scan they were tagged in.
+	 */
+	flush_stale_rmap_items(w);
+
+	spin_lock(&ksm_mmlist_lock);
+	put_mm_slot(w);
+	spin_unlock(&ksm_mmlist_lock);
+
+	if (free_slot) {
+		free_mm_slot(slot);
 		mmdrop(mm);
-	} else {
-		spin_unlock(&ksm_mmlist_lock);
-		up_read(&mm->mmap_sem);
 	}
 
 	/* Repeat until we've completed scanning the whole list */
-	slot = ksm_scan.mm_slot;
-	if (slot != &ksm_mm_head)
-		goto next_mm;
-
-	ksm_scan.seqnr++;
-	return NULL;
+	goto next_mm;
 }
 
 /**
  * ksm_do_scan  - the ksm scanner main worker function.
+ * @w - the worker scanning.
  * @scan_npages - number of pages we want to scan before we return.
  */
-static void ksm_do_scan(unsigned int scan_npages)
+static void ksm_do_scan(struct ksm_worker *w, unsigned int scan_npages)
 {
 	struct rmap_item *rmap_item;
 	struct page *uninitialized_var(page);
 
 	while (scan_npages-- && likely(!freezing(current))) {
 		cond_resched();
-		rmap_item = scan_get_next_rmap_item(&page);
+		rmap_item = scan_get_next_rmap_item(w, &page);
 		if (!rmap_item)
-			return;
+			break;
 		if (!PageKsm(page) || !in_stable_tree(rmap_item))
 			cmp_and_merge_page(page, rmap_item);
 		put_page(page);
 	}
+	flush_stale_rmap_items(w);
 }
 
 static int ksmd_should_run(void)
@@ -1421,16 +1636,18 @@ static int ksmd_should_run(void)
 	return (ksm_run & KSM_RUN_MERGE) && !list_empty(&ksm_mm_head.mm_list);
 }
 
-static int ksm_scan_thread(void *nothing)
+static int ksm_scan_thread(void *arg)
 {
+	struct ksm_worker *w = arg;
+
 	set_freezable();
 	set_user_nice(current, 5);
 
 	while (!kthread_should_stop()) {
-		mutex_lock(&ksm_thread_mutex);
+		down_read(&ksm_thread_sem);
 		if (ksmd_should_run())
-			ksm_do_scan(ksm_thread_pages_to_scan);
-		mutex_unlock(&ksm_thread_mutex);
+			ksm_do_scan(w, ksm_thread_pages_to_scan);
+		up_read(&ksm_thread_sem);
 
 		try_to_freeze();
 
@@ -1445,6 +1662,21 @@ static int ksm_scan_thread(void *nothing)
 	return 0;
 }
 
+static int ksm_start_thread(int nr)
+{
+	struct ksm_worker *w = &ksm_workers[nr];
+	struct task_struct *thread;
+
+	if (nr)
+		thread = kthread_run(ksm_scan_thread, w, "ksmd/%d", nr);
+	else
+		thread = kthread_run(ksm_scan_thread, w, "ksmd");
+	if (IS_ERR(thread))
+		return PTR_ERR(thread);
+	w->thread = thread;
+	return 0;
+}
+
 int ksm_madvise(struct vm_area_struct *vma, unsigned long start,
 		unsigned long end, int advice, unsigned long *vm_flags)
 {
@@ -1527,22 +1759,23 @@ void __ksm_exit(struct mm_struct *mm)
 	/*
 	 * This process is exiting: if it's straightforward (as is the
 	 * case when ksmd was never running), free mm_slot immediately.
-	 * But if it's at the cursor or has rmap_items linked to it, use
-	 * mmap_sem to synchronize with any break_cows before pagetables
-	 * are freed, and leave the mm_slot on the list for ksmd to free.
+	 * But if it's at the cursor, being scanned by a worker, or has
+	 * rmap_items linked to it, use mmap_sem to synchronize with any
+	 * break_cows before pagetables are freed, and leave the mm_slot
+	 * on the list for ksmd to free.
 	 * Beware: ksm may already have noticed it exiting and freed the slot.
 	 */
 
 	spin_lock(&ksm_mmlist_lock);
 	mm_slot = get_mm_slot(mm);
-	if (mm_slot && ksm_scan.mm_slot != mm_slot) {
+	if (mm_slot && ksm_scan.mm_slot != mm_slot &&
+	    !mm_slot_busy(mm_slot)) {
 		if (!mm_slot->rmap_list) {
 			hlist_del(&mm_slot->link);
 			list_del(&mm_slot->mm_list);
 			easy_to_free = 1;
 		} else {
-			list_move(&mm_slot->mm_list,
-				  &ksm_scan.mm_slot->mm_list);
+			requeue_mm_slot(mm_slot);
 		}
 	}
 	spin_unlock(&ksm_mmlist_lock);
@@ -1780,13 +2013,13 @@ static int ksm_memory_callback(struct notifier_block *self,
 		/*
 		 * Keep it very simple for now: just lock out ksmd and
 		 * MADV_UNMERGEABLE while any memory is going offline.
-		 * mutex_lock_nested() is necessary because lockdep was alarmed
-		 * that here we take ksm_thread_mutex inside notifier chain
+		 * down_write_nested() is necessary because lockdep was alarmed
+		 * that here we take ksm_thread_sem inside notifier chain
 		 * mutex, and later take notifier chain mutex inside
-		 * ksm_thread_mutex to unlock it.   But that's safe because both
+		 * ksm_thread_sem to unlock it.   But that's safe because both
 		 * are inside mem_hotplug_mutex.
 		 */
-		mutex_lock_nested(&ksm_thread_mutex, SINGLE_DEPTH_NESTING);
+		down_write_nested(&ksm_thread_sem, SINGLE_DEPTH_NESTING);
 		break;
 
 	case MEM_OFFLINE:
@@ -1801,7 +2034,7 @@ static int ksm_memory_callback(struct notifier_block *self,
 		/* fallthrough */
 
 	case MEM_CANCEL_OFFLINE:
-		mutex_unlock(&ksm_thread_mutex);
+		up_write(&ksm_thread_sem);
 		break;
 	}
 	return NOTIFY_OK;
@@ -1890,7 +2123,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 	 * on the list for when ksmd may be set running again).
 	 */
 
-	mutex_lock(&ksm_thread_mutex);
+	down_write(&ksm_thread_sem);
 	if (ksm_run != flags) {
 		ksm_run = flags;
 		if (flags & KSM_RUN_UNMERGE) {
@@ -1903,7 +2136,7 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 			}
 		}
 	}
-	mutex_unlock(&ksm_thread_mutex);
+	up_write(&ksm_thread_sem);
 
 	if (flags & KSM_RUN_MERGE)
 		wake_up_interruptible(&ksm_thread_wait);
@@ -1912,6 +2145,65 @@ static ssize_t run_store(struct kobject *kobj, struct kobj_attribute *attr,
 }
 KSM_ATTR(run);
 
+static ssize_t nr_threads_show(struct kobject *kobj,
+			       struct kobj_attribute *attr, char *buf)
+{
+	return sprintf(buf, "%u\n", ksm_nr_threads);
+}
+
+static ssize_t nr_threads_store(struct kobject *kobj,
+				struct kobj_attribute *attr,
+				const char *buf, size_t count)
+{
+	unsigned long nr_threads;
+	unsigned int i;
+	int err;
+
+	err = strict_strtoul(buf, 10, &nr_threads);
+	if (err || nr_threads < 1 || nr_threads > KSM_MAX_THREADS)
+		return -EINVAL;
+
+	mutex_lock(&ksm_nr_threads_mutex);
+	for (i = ksm_nr_threads; i < nr_threads; i++) {
+		err = ksm_start_thread(i);
+		if (err) {
+			count = err;
+			break;
+		}
+	}
+
+	if (nr_threads < ksm_nr_threads) {
+		for (i = nr_threads; i < ksm_nr_threads; i++) {
+			kthread_stop(ksm_workers[i].thread);
+			ksm_workers[i].thread = NULL;
+		}
+
+		/*
+		 * Hand the mm_slots the stopped workers were in the middle
+		 * of back to the others, to be scanned again from the start
+		 * in this same full scan.
+		 */
+		down_write(&ksm_thread_sem);
+		spin_lock(&ksm_mmlist_lock);
+		for (i = nr_threads; i < ksm_nr_threads; i++) {
+			struct ksm_worker *w = &ksm_workers[i];
+
+			if (w->mm_slot) {
+				requeue_mm_slot(w->mm_slot);
+				put_mm_slot(w);
+			}
+		}
+		spin_unlock(&ksm_mmlist_lock);
+		up_write(&ksm_thread_sem);
+		i = nr_threads;
+	}
+	ksm_nr_threads = i;
+	mutex_unlock(&ksm_nr_threads_mutex);
+
+	return count;
+}
+KSM_ATTR(nr_threads);
+
 static ssize_t pages_shared_show(struct kobject *kobj,
 				 struct kobj_attribute *attr, char *buf)
 {
@@ -1938,8 +2230,9 @@ static ssize_t pages_volatile_show(struct kobject *kobj,
 {
 	long ksm_pages_volatile;
 
-	ksm_pages_volatile = ksm_rmap_items - ksm_pages_shared
-				- ksm_pages_sharing - ksm_pages_unshared;
+	ksm_pages_volatile = atomic_long_read(&ksm_rmap_items)
+				- ksm_pages_shared - ksm_pages_sharing
+				- ksm_pages_unshared;
 	/*
 	 * It was not worth any locking to calculate that statistic,
 	 * but it might therefore sometimes be negative: conceal that.
@@ -1961,6 +2254,7 @@ static struct attribute *ksm_attrs[] = {
 	&sleep_millisecs_attr.attr,
 	&pages_to_scan_attr.attr,
 	&run_attr.attr,
+	&nr_threads_attr.attr,
 	&pages_shared_attr.attr,
 	&pages_sharing_attr.attr,
 	&pages_unshared_attr.attr,
@@ -1977,17 +2271,15 @@ static struct attribute_group ksm_attr_group = {
 
 static int __init ksm_init(void)
 {
-	struct task_struct *ksm_thread;
 	int err;
 
 	err = ksm_slab_init();
 	if (err)
 		goto out;
 
-	ksm_thread = kthread_run(ksm_scan_thread, NULL, "ksmd");
-	if (IS_ERR(ksm_thread)) {
+	err = ksm_start_thread(0);
+	if (err) {
 		printk(KERN_ERR "ksm: creating kthread failed\n");
-		err = PTR_ERR(ksm_thread);
 		goto out_free;
 	}
 
@@ -1995,7 +2287,7 @@ static int __init ksm_init(void)
 	err = sysfs_create_group(mm_kobj, &ksm_attr_group);
 	if (err) {
 		printk(KERN_ERR "ksm: register sysfs failed\n");
-		kthread_stop(ksm_thread);
+		kthread_stop(ksm_workers[0].thread);
 		goto out_free;
 	}
 #else
@@ -2005,7 +2297,7 @@ static int __init ksm_init(void)
 
 #ifdef CONFIG_MEMORY_HOTREMOVE
 	/*
-	 * Choose a high priority since the callback takes ksm_thread_mutex:
+	 * Choose a high priority since the callback takes ksm_thread_sem:
 	 * later callbacks could only be taking locks which nest within that.
 	 */
 	hotplug_memory_notifier(ksm_memory_callback, 100);
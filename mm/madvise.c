@@ -110,7 +110,9 @@ success:
 	/*
 	 * vm_flags is protected by the mmap_sem held in write mode.
 	 */
+	vma_write_begin(vma);
 	vma->vm_flags = new_flags;
+	vma_write_end(vma);
 
 out:
 	if (error == -ENOMEM)
@@ -48,6 +48,8 @@
 #include <linux/page_cgroup.h>
 #include <linux/cpu.h>
 #include <linux/oom.h>
+#include <linux/workqueue.h>
+#include <linux/ktime.h>
 #include "internal.h"
 
 #include <asm/uaccess.h>
@@ -90,10 +92,20 @@ enum mem_cgroup_stat_index {
 	MEM_CGROUP_STAT_NSTATS,
 };
 
+/*
+ * Reclaim latency is kept as a histogram of MEMCG_RECLAIM_LAT_BUCKETS
+ * buckets, the last one counting everything slower than the previous.
+ */
+#define MEMCG_RECLAIM_LAT_BUCKETS	5
+
 enum mem_cgroup_events_index {
 	MEM_CGROUP_EVENTS_PGPGIN,	/* # of pages paged in */
 	MEM_CGROUP_EVENTS_PGPGOUT,	/* # of pages paged out */
-	MEM_CGROUP_EVENTS_COUNT,	/* # of pages paged in/out */
+	MEM_CGROUP_EVENTS_DIRECT_RECLAIM, /* charge-time reclaim latency */
+	MEM_CGROUP_EVENTS_BG_RECLAIM =	/* background reclaim latency */
+		MEM_CGROUP_EVENTS_DIRECT_RECLAIM + MEMCG_RECLAIM_LAT_BUCKETS,
+	MEM_CGROUP_EVENTS_COUNT =	/* # of pages paged in/out */
+		MEM_CGROUP_EVENTS_BG_RECLAIM + MEMCG_RECLAIM_LAT_BUCKETS,
 	MEM_CGROUP_EVENTS_NSTATS,
 };
 /*
@@ -121,8 +133,12 @@ struct mem_cgroup_stat_cpu {
  */
 struct mem_cgroup_per_zone {
 	/*
-	 * spin_lock to protect the per cgroup LRU
+	 * spin_lock to protect the per cgroup LRU: every walk and change of
+	 * lists[] and count[] is done under it. Pages of one cgroup sit on
+	 * all the LRU sub-lists of the zone, so the sub-list lock the caller
+	 * holds is not enough. Nests inside the LRU sub-list locks.
 	 */
+	spinlock_t		lru_lock;
 	struct list_head	lists[NR_LRU_LISTS];
 	unsigned long		count[NR_LRU_LISTS];
 
@@ -206,10 +222,11 @@ static void mem_cgroup_oom_notify(struct mem_cgroup *mem);
  * statistics based on the statistics developed by Rik Van Riel for clock-pro,
  * to help the administrator determine what knobs to tune.
  *
- * TODO: Add a water mark for the memory controller. Reclaim will begin when
- * we hit the water mark. May be even add a low water mark, such that
- * no reclaim occurs from a cgroup at it's low water mark, this is
- * a feature that will be implemented much later in the future.
+ * Once usage goes above high_wmark, background reclaim is started so
+ * that charging tasks do not have to reclaim by themselves when the
+ * limit is hit. May be even add a low water mark, such that no reclaim
+ * occurs from a cgroup at it's low water mark, this is a feature that
+ * will be implemented much later in the future.
  */
 struct mem_cgroup {
 	struct cgroup_subsys_state css;
@@ -245,6 +262,13 @@ struct mem_cgroup {
 	/* set when res.limit == memsw.limit */
 	bool		memsw_is_minimum;
 
+	/*
+	 * usage above which background reclaim starts, RESOURCE_MAX when
+	 * disabled. bg_reclaim_work holds a css reference while queued.
+	 */
+	u64		high_wmark;
+	struct work_struct bg_reclaim_work;
+
 	/* protect arrays of thresholds */
 	struct mutex thresholds_lock;
 
@@ -669,6 +693,28 @@ static void __mem_cgroup_target_update(struct mem_cgroup *mem, int target)
 	this_cpu_write(mem->stat->targets[target], next);
 }
 
+static struct workqueue_struct *memcg_bg_reclaim_wq;
+
+/*
+ * Start background reclaim in every group of the hierarchy whose usage
+ * went above its high watermark. The queued work owns a css reference.
+ */
+static void mem_cgroup_check_high_wmark(struct mem_cgroup *mem)
+{
+	for (; mem; mem = parent_mem_cgroup(mem)) {
+		u64 usage = res_counter_read_u64(&mem->res, RES_USAGE);
+
+		if (usage <= mem->high_wmark)
+			continue;
+		if (work_pending(&mem->bg_reclaim_work))
+			continue;
+		if (!css_tryget(&mem->css))
+			continue;
+		if (!queue_work(memcg_bg_reclaim_wq, &mem->bg_reclaim_work))
+			css_put(&mem->css);
+	}
+}
+
 /*
  * Check events in order.
  *
@@ -678,6 +724,7 @@ static void memcg_check_events(struct mem_cgroup *mem, struct page *page)
 	/* threshold event is triggered in finer grain than soft limit */
 	if (unlikely(__memcg_event_check(mem, MEM_CGROUP_TARGET_THRESH))) {
 		mem_cgroup_threshold(mem);
+		mem_cgroup_check_high_wmark(mem);
 		__mem_cgroup_target_update(mem, MEM_CGROUP_TARGET_THRESH);
 		if (unlikely(__memcg_event_check(mem,
 			MEM_CGROUP_TARGET_SOFTLIMIT))){
@@ -827,6 +874,19 @@ static inline bool mem_cgroup_is_root(struct mem_cgroup *mem)
  * When moving account, the page is not on LRU. It's isolated.
  */
 
+/* Called with mz->lru_lock held, after PCG_ACCT_LRU has been cleared. */
+static void __mem_cgroup_del_lru_list(struct mem_cgroup_per_zone *mz,
+				      struct page_cgroup *pc,
+				      struct page *page, enum lru_list lru)
+{
+	/* huge page split is done under lru_lock. so, we have no races. */
+	MEM_CGROUP_ZSTAT(mz, lru) -= 1 << compound_order(page);
+	if (!mem_cgroup_is_root(pc->mem_cgroup)) {
+		VM_BUG_ON(list_empty(&pc->lru));
+		list_del_init(&pc->lru);
+	}
+}
+
 void mem_cgroup_del_lru_list(struct page *page, enum lru_list lru)
 {
 	struct page_cgroup *pc;
@@ -844,12 +904,9 @@ void mem_cgroup_del_lru_list(struct page *page, enum lru_list lru)
 	 * removed from global LRU.
 	 */
 	mz = page_cgroup_zoneinfo(pc->mem_cgroup, page);
-	/* huge page split is done under lru_lock. so, we have no races. */
-	MEM_CGROUP_ZSTAT(mz, lru) -= 1 << compound_order(page);
-	if (mem_cgroup_is_root(pc->mem_cgroup))
-		return;
-	VM_BUG_ON(list_empty(&pc->lru));
-	list_del_init(&pc->lru);
+	spin_lock(&mz->lru_lock);
+	__mem_cgroup_del_lru_list(mz, pc, page, lru);
+	spin_unlock(&mz->lru_lock);
 }
 
 void mem_cgroup_del_lru(struct page *page)
@@ -880,7 +937,9 @@ void mem_cgroup_rotate_reclaimable_page(struct page *page)
 	if (mem_cgroup_is_root(pc->mem_cgroup))
 		return;
 	mz = page_cgroup_zoneinfo(pc->mem_cgroup, page);
+	spin_lock(&mz->lru_lock);
 	list_move_tail(&pc->lru, &mz->lists[lru]);
+	spin_unlock(&mz->lru_lock);
 }
 
 void mem_cgroup_rotate_lru_list(struct page *page, enum lru_list lru)
@@ -900,7 +959,9 @@ void mem_cgroup_rotate_lru_list(struct page *page, enum lru_list lru)
 	if (mem_cgroup_is_root(pc->mem_cgroup))
 		return;
 	mz = page_cgroup_zoneinfo(pc->mem_cgroup, page);
+	spin_lock(&mz->lru_lock);
 	list_move(&pc->lru, &mz->lists[lru]);
+	spin_unlock(&mz->lru_lock);
 }
 
 void mem_cgroup_add_lru_list(struct page *page, enum lru_list lru)
@@ -917,24 +978,26 @@ void mem_cgroup_add_lru_list(struct page *page, enum lru_list lru)
 	/* Ensure pc->mem_cgroup is visible after reading PCG_USED. */
 	smp_rmb();
 	mz = page_cgroup_zoneinfo(pc->mem_cgroup, page);
+	spin_lock(&mz->lru_lock);
 	/* huge page split is done under lru_lock. so, we have no races. */
 	MEM_CGROUP_ZSTAT(mz, lru) += 1 << compound_order(page);
 	SetPageCgroupAcctLRU(pc);
-	if (mem_cgroup_is_root(pc->mem_cgroup))
-		return;
-	list_add(&pc->lru, &mz->lists[lru]);
+	if (!mem_cgroup_is_root(pc->mem_cgroup))
+		list_add(&pc->lru, &mz->lists[lru]);
+	spin_unlock(&mz->lru_lock);
 }
 
 /*
  * At handling SwapCache and other FUSE stuff, pc->mem_cgroup may be changed
  * while it's linked to lru because the page may be reused after it's fully
  * uncharged. To handle that, unlink page_cgroup from LRU when charge it again.
- * It's done under lock_page and expected that zone->lru_lock isnever held.
+ * It's done under lock_page and expected that the page's lru_lock is never
+ * held.
  */
 static void mem_cgroup_lru_del_before_commit(struct page *page)
 {
 	unsigned long flags;
-	struct zone *zone = page_zone(page);
+	spinlock_t *lru_lock = page_lru_lock(page);
 	struct page_cgroup *pc = lookup_page_cgroup(page);
 
 	/*
@@ -948,30 +1011,30 @@ static void mem_cgroup_lru_del_before_commit(struct page *page)
 	if (likely(!PageLRU(page)))
 		return;
 
-	spin_lock_irqsave(&zone->lru_lock, flags);
+	spin_lock_irqsave(lru_lock, flags);
 	/*
 	 * Forget old LRU when this page_cgroup is *not* used. This Used bit
 	 * is guarded by lock_page() because the page is SwapCache.
 	 */
 	if (!PageCgroupUsed(pc))
 		mem_cgroup_del_lru_list(page, page_lru(page));
-	spin_unlock_irqrestore(&zone->lru_lock, flags);
+	spin_unlock_irqrestore(lru_lock, flags);
 }
 
 static void mem_cgroup_lru_add_after_commit(struct page *page)
 {
 	unsigned long flags;
-	struct zone *zone = page_zone(page);
+	spinlock_t *lru_lock = page_lru_lock(page);
 	struct page_cgroup *pc = lookup_page_cgroup(page);
 
 	/* taking care of that the page is added to LRU while we commit it */
 	if (likely(!PageLRU(page)))
 		return;
-	spin_lock_irqsave(&zone->lru_lock, flags);
+	spin_lock_irqsave(lru_lock, flags);
 	/* link when the page is linked to LRU but page_cgroup isn't */
 	if (PageLRU(page) && !PageCgroupAcctLRU(pc))
 		mem_cgroup_add_lru_list(page, page_lru(page));
-	spin_unlock_irqrestore(&zone->lru_lock, flags);
+	spin_unlock_irqrestore(lru_lock, flags);
 }
 
 
@@ -1126,6 +1189,12 @@ unsigned long mem_cgroup_isolate_pages(unsigned long nr_to_scan,
 	mz = mem_cgroup_zoneinfo(mem_cont, nid, zid);
 	src = &mz->lists[lru];
 
+	/*
+	 * The caller holds all the LRU sub-list locks of the zone, which
+	 * keep the pages' LRU state stable, but the per cgroup list itself
+	 * is only protected by mz->lru_lock.
+	 */
+	spin_lock(&mz->lru_lock);
 	scan = 0;
 	list_for_each_entry_safe_reverse(pc, tmp, src, lru) {
 		if (scan >= nr_to_scan)
@@ -1144,17 +1213,20 @@ unsigned long mem_cgroup_isolate_pages(unsigned long nr_to_scan,
 		switch (ret) {
 		case 0:
 			list_move(&page->lru, dst);
-			mem_cgroup_del_lru(page);
+			if (TestClearPageCgroupAcctLRU(pc))
+				__mem_cgroup_del_lru_list(mz, pc, page,
+							  page_lru(page));
 			nr_taken += hpage_nr_pages(page);
 			break;
 		case -EBUSY:
 			/* we don't affect global LRU but rotate in our LRU */
-			mem_cgroup_rotate_lru_list(page, page_lru(page));
+			list_move(&pc->lru, &mz->lists[page_lru(page)]);
 			break;
 		default:
 			break;
 		}
 	}
+	spin_unlock(&mz->lru_lock);
 
 	*scanned = scan;
 
@@ -1508,6 +1580,54 @@ static int mem_cgroup_hierarchical_reclaim(struct mem_cgroup *root_mem,
 	return total;
 }
 
+/* upper bounds of all but the last reclaim latency bucket, in usecs */
+static const unsigned int
+memcg_reclaim_lat_usecs[MEMCG_RECLAIM_LAT_BUCKETS - 1] = {
+	100, 1000, 10000, 100000,
+};
+
+static void mem_cgroup_account_reclaim(struct mem_cgroup *mem,
+				       enum mem_cgroup_events_index idx,
+				       ktime_t time)
+{
+	s64 usecs = ktime_to_us(time);
+	int i;
+
+	for (i = 0; i < MEMCG_RECLAIM_LAT_BUCKETS - 1; i++)
+		if (usecs < memcg_reclaim_lat_usecs[i])
+			break;
+	this_cpu_inc(mem->stat->events[idx + i]);
+}
+
+/*
+ * Background reclaim stops once usage is this fraction of the high
+ * watermark below it, so that it is not restarted right away.
+ */
+#define MEMCG_BG_RECLAIM_SLACK_SHIFT	6
+
+static void mem_cgroup_bg_reclaim(struct work_struct *work)
+{
+	struct mem_cgroup *mem = container_of(work, struct mem_cgroup,
+					      bg_reclaim_work);
+	int nr_retries = MEM_CGROUP_RECLAIM_RETRIES;
+	u64 wmark = mem->high_wmark;
+	ktime_t start = ktime_get();
+
+	wmark -= wmark >> MEMCG_BG_RECLAIM_SLACK_SHIFT;
+	while (res_counter_read_u64(&mem->res, RES_USAGE) > wmark) {
+		if (css_is_removed(&mem->css))
+			break;
+		if (!mem_cgroup_hierarchical_reclaim(mem, NULL, GFP_KERNEL,
+						     MEM_CGROUP_RECLAIM_SHRINK) &&
+		    !--nr_retries)
+			break;
+		cond_resched();
+	}
+	mem_cgroup_account_reclaim(mem, MEM_CGROUP_EVENTS_BG_RECLAIM,
+				   ktime_sub(ktime_get(), start));
+	css_put(&mem->css);
+}
+
 /*
  * Check OOM-Killer is already running under our hierarchy.
  * If someone is running, return false.
@@ -1711,9 +1831,15 @@ EXPORT_SYMBOL(mem_cgroup_update_page_stat);
  * TODO: maybe necessary to use big numbers in big irons.
  */
 #define CHARGE_BATCH	32U
+/*
+ * Number of memcgs a cpu keeps charges cached for: tasks of different
+ * memcgs running on the same cpu should not drain each other's stock.
+ */
+#define MEMCG_STOCK_SLOTS	4
 struct memcg_stock_pcp {
-	struct mem_cgroup *cached; /* this never be root cgroup */
-	unsigned int nr_pages;
+	struct mem_cgroup *cached[MEMCG_STOCK_SLOTS]; /* never root cgroup */
+	unsigned int nr_pages[MEMCG_STOCK_SLOTS];
+	unsigned int victim; /* slot to reuse when all are taken */
 	struct work_struct work;
 };
 static DEFINE_PER_CPU(struct memcg_stock_pcp, memcg_stock);
@@ -1728,33 +1854,48 @@ static atomic_t memcg_drain_count;
 static bool consume_stock(struct mem_cgroup *mem)
 {
 	struct memcg_stock_pcp *stock;
-	bool ret = true;
+	bool ret = false;
+	int i;
 
 	stock = &get_cpu_var(memcg_stock);
-	if (mem == stock->cached && stock->nr_pages)
-		stock->nr_pages--;
-	else /* need to call res_counter_charge */
-		ret = false;
+	for (i = 0; i < MEMCG_STOCK_SLOTS; i++) {
+		if (mem == stock->cached[i] && stock->nr_pages[i]) {
+			stock->nr_pages[i]--;
+			ret = true;
+			break;
+		}
+	}
 	put_cpu_var(memcg_stock);
 	return ret;
 }
 
 /*
- * Returns stocks cached in percpu to res_counter and reset cached information.
+ * Returns the charges of a stock slot to res_counter and resets it.
  */
-static void drain_stock(struct memcg_stock_pcp *stock)
+static void drain_stock_slot(struct memcg_stock_pcp *stock, int i)
 {
-	struct mem_cgroup *old = stock->cached;
+	struct mem_cgroup *old = stock->cached[i];
 
-	if (stock->nr_pages) {
-		unsigned long bytes = stock->nr_pages * PAGE_SIZE;
+	if (stock->nr_pages[i]) {
+		unsigned long bytes = stock->nr_pages[i] * PAGE_SIZE;
 
 		res_counter_uncharge(&old->res, bytes);
 		if (do_swap_account)
 			res_counter_uncharge(&old->memsw, bytes);
-		stock->nr_pages = 0;
+		stock->nr_pages[i] = 0;
 	}
-	stock->cached = NULL;
+	stock->cached[i] = NULL;
+}
+
+/*
+ * Returns stocks cached in percpu to res_counter and reset cached information.
+ */
+static void drain_stock(struct memcg_stock_pcp *stock)
+{
+	int i;
+
+	for (i = 0; i < MEMCG_STOCK_SLOTS; i++)
+		drain_stock_slot(stock, i);
 }
 
 /*
@@ -1767,6 +1908,29 @@ static void drain_local_stock(struct work_struct *dummy)
 	drain_stock(stock);
 }
 
+/*
+ * Find the slot of @mem in the stock, or make one, draining the charges
+ * of another memcg if all are in use.
+ */
+static int stock_slot(struct memcg_stock_pcp *stock, struct mem_cgroup *mem)
+{
+	int i, free = -1;
+
+	for (i = 0; i < MEMCG_STOCK_SLOTS; i++) {
+		if (stock->cached[i] == mem)
+			return i;
+		if (!stock->cached[i] && free < 0)
+			free = i;
+	}
+	if (free < 0) {
+		free = stock->victim;
+		stock->victim = (free + 1) % MEMCG_STOCK_SLOTS;
+		drain_stock_slot(stock, free);
+	}
+	stock->cached[free] = mem;
+	return free;
+}
+
 /*
  * Cache charges(val) which is from res_counter, to local per_cpu area.
  * This will be consumed by consume_stock() function, later.
@@ -1775,12 +1939,35 @@ static void refill_stock(struct mem_cgroup *mem, unsigned int nr_pages)
 {
 	struct memcg_stock_pcp *stock = &get_cpu_var(memcg_stock);
 
-	if (stock->cached != mem) { /* reset if necessary */
-		drain_stock(stock);
-		stock->cached = mem;
-	}
-	stock->nr_pages += nr_pages;
+	stock->nr_pages[stock_slot(stock, mem)] += nr_pages;
+	put_cpu_var(memcg_stock);
+}
+
+/*
+ * Keep up to a charge batch of uncharged pages in the stock of this cpu
+ * rather than uncharging them from the whole hierarchy one by one: they
+ * will likely be charged again soon. Returns the number of pages taken.
+ *
+ * Only charges of both res and memsw can be stocked, and none while the
+ * memcg is out of memory: its OOM waiters want them back.
+ */
+static unsigned int uncharge_to_stock(struct mem_cgroup *mem,
+				      unsigned int nr_pages)
+{
+	struct memcg_stock_pcp *stock;
+	unsigned int room;
+	int i;
+
+	if (atomic_read(&mem->oom_lock) || test_thread_flag(TIF_MEMDIE))
+		return 0;
+
+	stock = &get_cpu_var(memcg_stock);
+	i = stock_slot(stock, mem);
+	room = CHARGE_BATCH - min(stock->nr_pages[i], CHARGE_BATCH);
+	nr_pages = min(nr_pages, room);
+	stock->nr_pages[i] += nr_pages;
 	put_cpu_var(memcg_stock);
+	return nr_pages;
 }
 
 /*
@@ -1892,12 +2079,14 @@ enum {
 };
 
 static int mem_cgroup_do_charge(struct mem_cgroup *mem, gfp_t gfp_mask,
-				unsigned int nr_pages, bool oom_check)
+				unsigned int nr_pages, bool oom_check,
+				ktime_t *reclaim_time)
 {
 	unsigned long csize = nr_pages * PAGE_SIZE;
 	struct mem_cgroup *mem_over_limit;
 	struct res_counter *fail_res;
 	unsigned long flags = 0;
+	ktime_t start;
 	int ret;
 
 	ret = res_counter_charge(&mem->res, csize, &fail_res);
@@ -1927,8 +2116,11 @@ static int mem_cgroup_do_charge(struct mem_cgroup *mem, gfp_t gfp_mask,
 	if (!(gfp_mask & __GFP_WAIT))
 		return CHARGE_WOULDBLOCK;
 
+	start = ktime_get();
 	ret = mem_cgroup_hierarchical_reclaim(mem_over_limit, NULL,
 					      gfp_mask, flags);
+	*reclaim_time = ktime_add(*reclaim_time,
+				  ktime_sub(ktime_get(), start));
 	if (mem_cgroup_margin(mem_over_limit) >= nr_pages)
 		return CHARGE_RETRY;
 	/*
@@ -1960,6 +2152,18 @@ static int mem_cgroup_do_charge(struct mem_cgroup *mem, gfp_t gfp_mask,
 	return CHARGE_RETRY;
 }
 
+/*
+ * The latency stats count charges, not reclaim passes: a charge is
+ * accounted once, with the time of all the reclaim it had to do.
+ */
+static void mem_cgroup_account_charge_reclaim(struct mem_cgroup *mem,
+					      ktime_t reclaim_time)
+{
+	if (mem && reclaim_time.tv64)
+		mem_cgroup_account_reclaim(mem, MEM_CGROUP_EVENTS_DIRECT_RECLAIM,
+					   reclaim_time);
+}
+
 /*
  * Unlike exported interface, "oom" parameter is added. if oom==true,
  * oom-killer can be invoked.
@@ -1973,6 +2177,7 @@ static int __mem_cgroup_try_charge(struct mm_struct *mm,
 	unsigned int batch = max(CHARGE_BATCH, nr_pages);
 	int nr_oom_retries = MEM_CGROUP_RECLAIM_RETRIES;
 	struct mem_cgroup *mem = NULL;
+	ktime_t reclaim_time = ktime_set(0, 0);
 	int ret;
 
 	/*
@@ -2046,6 +2251,7 @@ again:
 
 		/* If killed, bypass charge */
 		if (fatal_signal_pending(current)) {
+			mem_cgroup_account_charge_reclaim(mem, reclaim_time);
 			css_put(&mem->css);
 			goto bypass;
 		}
@@ -2056,7 +2262,8 @@ again:
 			nr_oom_retries = MEM_CGROUP_RECLAIM_RETRIES;
 		}
 
-		ret = mem_cgroup_do_charge(mem, gfp_mask, batch, oom_check);
+		ret = mem_cgroup_do_charge(mem, gfp_mask, batch, oom_check,
+					   &reclaim_time);
 		switch (ret) {
 		case CHARGE_OK:
 			break;
@@ -2066,10 +2273,13 @@ again:
 			mem = NULL;
 			goto again;
 		case CHARGE_WOULDBLOCK: /* !__GFP_WAIT */
+			mem_cgroup_account_charge_reclaim(mem, reclaim_time);
 			css_put(&mem->css);
 			goto nomem;
 		case CHARGE_NOMEM: /* OOM routine works */
 			if (!oom) {
+				mem_cgroup_account_charge_reclaim(mem,
+								  reclaim_time);
 				css_put(&mem->css);
 				goto nomem;
 			}
@@ -2077,6 +2287,7 @@ again:
 			nr_oom_retries--;
 			break;
 		case CHARGE_OOM_DIE: /* Killed by OOM Killer */
+			mem_cgroup_account_charge_reclaim(mem, reclaim_time);
 			css_put(&mem->css);
 			goto bypass;
 		}
@@ -2086,6 +2297,8 @@ again:
 		refill_stock(mem, batch - nr_pages);
 	css_put(&mem->css);
 done:
+	/* a retry after reclaim may end up here through the stock */
+	mem_cgroup_account_charge_reclaim(mem, reclaim_time);
 	*memcg = mem;
 	return 0;
 nomem:
@@ -2244,7 +2457,9 @@ void mem_cgroup_split_huge_fixup(struct page *head, struct page *tail)
 		 */
 		lru = page_lru(head);
 		mz = page_cgroup_zoneinfo(head_pc->mem_cgroup, head);
+		spin_lock(&mz->lru_lock);
 		MEM_CGROUP_ZSTAT(mz, lru) -= 1;
+		spin_unlock(&mz->lru_lock);
 	}
 	tail_pc->flags = head_pc->flags & ~PCGF_NOCOPY_AT_SPLIT;
 	move_unlock_page_cgroup(head_pc, &flags);
@@ -2673,9 +2888,14 @@ static void mem_cgroup_do_uncharge(struct mem_cgroup *mem,
 		batch->memsw_nr_pages++;
 	return;
 direct_uncharge:
-	res_counter_uncharge(&mem->res, nr_pages * PAGE_SIZE);
-	if (uncharge_memsw)
-		res_counter_uncharge(&mem->memsw, nr_pages * PAGE_SIZE);
+	if (uncharge_memsw || !do_swap_account)
+		nr_pages -= uncharge_to_stock(mem, nr_pages);
+	if (nr_pages) {
+		res_counter_uncharge(&mem->res, nr_pages * PAGE_SIZE);
+		if (uncharge_memsw)
+			res_counter_uncharge(&mem->memsw,
+					     nr_pages * PAGE_SIZE);
+	}
 	if (unlikely(batch->memcg != mem))
 		memcg_oom_recover(mem);
 	return;
@@ -2802,6 +3022,7 @@ void mem_cgroup_uncharge_start(void)
 void mem_cgroup_uncharge_end(void)
 {
 	struct memcg_batch_info *batch = &current->memcg_batch;
+	unsigned long stocked;
 
 	if (!batch->do_batch)
 		return;
@@ -2816,6 +3037,15 @@ void mem_cgroup_uncharge_end(void)
 	 * This "batch->memcg" is valid without any css_get/put etc...
 	 * bacause we hide charges behind us.
 	 */
+	stocked = batch->nr_pages;
+	if (do_swap_account)
+		stocked = min(stocked, batch->memsw_nr_pages);
+	if (stocked) {
+		stocked = uncharge_to_stock(batch->memcg, stocked);
+		batch->nr_pages -= stocked;
+		if (do_swap_account)
+			batch->memsw_nr_pages -= stocked;
+	}
 	if (batch->nr_pages)
 		res_counter_uncharge(&batch->memcg->res,
 				     batch->nr_pages * PAGE_SIZE);
@@ -3381,14 +3611,12 @@ unsigned long mem_cgroup_soft_limit_reclaim(struct zone *zone, int order,
 static int mem_cgroup_force_empty_list(struct mem_cgroup *mem,
 				int node, int zid, enum lru_list lru)
 {
-	struct zone *zone;
 	struct mem_cgroup_per_zone *mz;
 	struct page_cgroup *pc, *busy;
 	unsigned long flags, loop;
 	struct list_head *list;
 	int ret = 0;
 
-	zone = &NODE_DATA(node)->node_zones[zid];
 	mz = mem_cgroup_zoneinfo(mem, node, zid);
 	list = &mz->lists[lru];
 
@@ -3400,19 +3628,19 @@ static int mem_cgroup_force_empty_list(struct mem_cgroup *mem,
 		struct page *page;
 
 		ret = 0;
-		spin_lock_irqsave(&zone->lru_lock, flags);
+		spin_lock_irqsave(&mz->lru_lock, flags);
 		if (list_empty(list)) {
-			spin_unlock_irqrestore(&zone->lru_lock, flags);
+			spin_unlock_irqrestore(&mz->lru_lock, flags);
 			break;
 		}
 		pc = list_entry(list->prev, struct page_cgroup, lru);
 		if (busy == pc) {
 			list_move(&pc->lru, list);
 			busy = NULL;
-			spin_unlock_irqrestore(&zone->lru_lock, flags);
+			spin_unlock_irqrestore(&mz->lru_lock, flags);
 			continue;
 		}
-		spin_unlock_irqrestore(&zone->lru_lock, flags);
+		spin_unlock_irqrestore(&mz->lru_lock, flags);
 
 		page = lookup_cgroup_page(pc);
 
@@ -3483,7 +3711,7 @@ move_account:
 			goto try_to_free;
 		cond_resched();
 	/* "ret" should also be checked to ensure all lists are empty. */
-	} while (mem->res.usage > 0 || ret);
+	} while (res_counter_read_u64(&mem->res, RES_USAGE) > 0 || ret);
 out:
 	css_put(&mem->css);
 	return ret;
@@ -3498,7 +3726,7 @@ try_to_free:
 	lru_add_drain_all();
 	/* try to free all pages in this cgroup */
 	shrink = 1;
-	while (nr_retries && mem->res.usage > 0) {
+	while (nr_retries && res_counter_read_u64(&mem->res, RES_USAGE) > 0) {
 		int progress;
 
 		if (signal_pending(current)) {
@@ -3730,6 +3958,29 @@ static int mem_cgroup_reset(struct cgroup *cont, unsigned int event)
 	return 0;
 }
 
+static u64 mem_cgroup_high_wmark_read(struct cgroup *cont, struct cftype *cft)
+{
+	return mem_cgroup_from_cont(cont)->high_wmark;
+}
+
+static int mem_cgroup_high_wmark_write(struct cgroup *cont, struct cftype *cft,
+				       const char *buffer)
+{
+	struct mem_cgroup *memcg = mem_cgroup_from_cont(cont);
+	unsigned long long val;
+	int ret;
+
+	/* root is never charged, there is nothing to reclaim */
+	if (mem_cgroup_is_root(memcg))
+		return -EINVAL;
+	ret = res_counter_memparse_write_strategy(buffer, &val);
+	if (ret)
+		return ret;
+	memcg->high_wmark = val;
+	mem_cgroup_check_high_wmark(memcg);
+	return 0;
+}
+
 static u64 mem_cgroup_move_charge_read(struct cgroup *cgrp,
 					struct cftype *cft)
 {
@@ -3777,7 +4028,9 @@ enum {
 	MCS_INACTIVE_FILE,
 	MCS_ACTIVE_FILE,
 	MCS_UNEVICTABLE,
-	NR_MCS_STAT,
+	MCS_DIRECT_RECLAIM,
+	MCS_BG_RECLAIM = MCS_DIRECT_RECLAIM + MEMCG_RECLAIM_LAT_BUCKETS,
+	NR_MCS_STAT = MCS_BG_RECLAIM + MEMCG_RECLAIM_LAT_BUCKETS,
 };
 
 struct mcs_total_stat {
@@ -3798,7 +4051,17 @@ struct {
 	{"active_anon", "total_active_anon"},
 	{"inactive_file", "total_inactive_file"},
 	{"active_file", "total_active_file"},
-	{"unevictable", "total_unevictable"}
+	{"unevictable", "total_unevictable"},
+	{"direct_reclaim_lt_100us", "total_direct_reclaim_lt_100us"},
+	{"direct_reclaim_lt_1ms", "total_direct_reclaim_lt_1ms"},
+	{"direct_reclaim_lt_10ms", "total_direct_reclaim_lt_10ms"},
+	{"direct_reclaim_lt_100ms", "total_direct_reclaim_lt_100ms"},
+	{"direct_reclaim_ge_100ms", "total_direct_reclaim_ge_100ms"},
+	{"bg_reclaim_lt_100us", "total_bg_reclaim_lt_100us"},
+	{"bg_reclaim_lt_1ms", "total_bg_reclaim_lt_1ms"},
+	{"bg_reclaim_lt_10ms", "total_bg_reclaim_lt_10ms"},
+	{"bg_reclaim_lt_100ms", "total_bg_reclaim_lt_100ms"},
+	{"bg_reclaim_ge_100ms", "total_bg_reclaim_ge_100ms"},
 };
 
 
@@ -3806,6 +4069,7 @@ static void
 mem_cgroup_get_local_stat(struct mem_cgroup *mem, struct mcs_total_stat *s)
 {
 	s64 val;
+	int i;
 
 	/* per cpu stat */
 	val = mem_cgroup_read_stat(mem, MEM_CGROUP_STAT_CACHE);
@@ -3822,6 +4086,14 @@ mem_cgroup_get_local_stat(struct mem_cgroup *mem, struct mcs_total_stat *s)
 		val = mem_cgroup_read_stat(mem, MEM_CGROUP_STAT_SWAPOUT);
 		s->stat[MCS_SWAP] += val * PAGE_SIZE;
 	}
+	for (i = 0; i < MEMCG_RECLAIM_LAT_BUCKETS; i++) {
+		val = mem_cgroup_read_events(mem,
+				MEM_CGROUP_EVENTS_DIRECT_RECLAIM + i);
+		s->stat[MCS_DIRECT_RECLAIM + i] += val;
+		val = mem_cgroup_read_events(mem,
+				MEM_CGROUP_EVENTS_BG_RECLAIM + i);
+		s->stat[MCS_BG_RECLAIM + i] += val;
+	}
 
 	/* per zone stat */
 	val = mem_cgroup_get_local_zonestat(mem, LRU_INACTIVE_ANON);
@@ -3891,14 +4163,14 @@ static int mem_control_stat_show(struct cgroup *cont, struct cftype *cft,
 			for (zid = 0; zid < MAX_NR_ZONES; zid++) {
 				mz = mem_cgroup_zoneinfo(mem_cont, nid, zid);
 
-				recent_rotated[0] +=
-					mz->reclaim_stat.recent_rotated[0];
-				recent_rotated[1] +=
-					mz->reclaim_stat.recent_rotated[1];
-				recent_scanned[0] +=
-					mz->reclaim_stat.recent_scanned[0];
-				recent_scanned[1] +=
-					mz->reclaim_stat.recent_scanned[1];
+				recent_rotated[0] += atomic_long_read(
+					&mz->reclaim_stat.recent_rotated[0]);
+				recent_rotated[1] += atomic_long_read(
+					&mz->reclaim_stat.recent_rotated[1]);
+				recent_scanned[0] += atomic_long_read(
+					&mz->reclaim_stat.recent_scanned[0]);
+				recent_scanned[1] += atomic_long_read(
+					&mz->reclaim_stat.recent_scanned[1]);
 			}
 		cb->fill(cb, "recent_rotated_anon", recent_rotated[0]);
 		cb->fill(cb, "recent_rotated_file", recent_rotated[1]);
@@ -4304,6 +4576,11 @@ static struct cftype mem_cgroup_files[] = {
 		.write_string = mem_cgroup_write,
 		.read_u64 = mem_cgroup_read,
 	},
+	{
+		.name = "high_wmark_in_bytes",
+		.write_string = mem_cgroup_high_wmark_write,
+		.read_u64 = mem_cgroup_high_wmark_read,
+	},
 	{
 		.name = "failcnt",
 		.private = MEMFILE_PRIVATE(_MEM, RES_FAILCNT),
@@ -4409,6 +4686,7 @@ static int alloc_mem_cgroup_per_zone_info(struct mem_cgroup *mem, int node)
 	mem->info.nodeinfo[node] = pn;
 	for (zone = 0; zone < MAX_NR_ZONES; zone++) {
 		mz = &pn->zoneinfo[zone];
+		spin_lock_init(&mz->lru_lock);
 		for_each_lru(l)
 			INIT_LIST_HEAD(&mz->lists[l]);
 		mz->usage_in_excess = 0;
@@ -4569,6 +4847,10 @@ mem_cgroup_create(struct cgroup_subsys *ss, struct cgroup *cont)
 		root_mem_cgroup = mem;
 		if (mem_cgroup_soft_limit_tree_init())
 			goto free_out;
+		memcg_bg_reclaim_wq = alloc_workqueue("memcg_reclaim",
+						      WQ_UNBOUND, 0);
+		if (!memcg_bg_reclaim_wq)
+			goto free_out;
 		for_each_possible_cpu(cpu) {
 			struct memcg_stock_pcp *stock =
 						&per_cpu(memcg_stock, cpu);
@@ -4597,6 +4879,8 @@ mem_cgroup_create(struct cgroup_subsys *ss, struct cgroup *cont)
 	}
 	mem->last_scanned_child = 0;
 	INIT_LIST_HEAD(&mem->oom_notify);
+	mem->high_wmark = RESOURCE_MAX;
+	INIT_WORK(&mem->bg_reclaim_work, mem_cgroup_bg_reclaim);
 
 	if (parent)
 		mem->swappiness = get_swappiness(parent);
@@ -4615,6 +4899,9 @@ static int mem_cgroup_pre_destroy(struct cgroup_subsys *ss,
 {
 	struct mem_cgroup *mem = mem_cgroup_from_cont(cont);
 
+	/* a queued background reclaim holds a reference, drop it */
+	if (cancel_work_sync(&mem->bg_reclaim_work))
+		css_put(&mem->css);
 	return mem_cgroup_force_empty(mem, false);
 }
 
@@ -4845,7 +5132,7 @@ static int mem_cgroup_count_precharge_pte_range(pmd_t *pmd,
 	pte_t *pte;
 	spinlock_t *ptl;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd(vma, addr, pmd);
 
 	pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
 	for (; addr != end; pte++, addr += PAGE_SIZE)
@@ -5008,7 +5295,7 @@ static int mem_cgroup_move_charge_pte_range(pmd_t *pmd,
 	pte_t *pte;
 	spinlock_t *ptl;
 
-	split_huge_page_pmd(walk->mm, pmd);
+	split_huge_page_pmd(vma, addr, pmd);
 retry:
 	pte = pte_offset_map_lock(vma->vm_mm, pmd, addr, &ptl);
 	for (; addr != end; addr += PAGE_SIZE) {
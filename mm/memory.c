@@ -57,6 +57,7 @@
 #include <linux/swapops.h>
 #include <linux/elf.h>
 #include <linux/gfp.h>
+#include <linux/file.h>
 
 #include <asm/io.h>
 #include <asm/pgalloc.h>
@@ -919,6 +920,7 @@ static unsigned long zap_pte_range(struct mmu_gather *tlb,
 	init_rss_vec(rss);
 
 	pte = pte_offset_map_lock(mm, pmd, addr, &ptl);
+	flush_tlb_batched_pending(mm);
 	arch_enter_lazy_mmu_mode();
 	do {
 		pte_t ptent = *pte;
@@ -1018,7 +1020,7 @@ static inline unsigned long zap_pmd_range(struct mmu_gather *tlb,
 		if (pmd_trans_huge(*pmd)) {
 			if (next-addr != HPAGE_PMD_SIZE) {
 				VM_BUG_ON(!rwsem_is_locked(&tlb->mm->mmap_sem));
-				split_huge_page_pmd(vma->vm_mm, pmd);
+				split_huge_page_pmd(vma, addr, pmd);
 			} else if (zap_huge_pmd(tlb, vma, pmd)) {
 				(*zap_work)--;
 				continue;
@@ -1308,7 +1310,7 @@ struct page *follow_page(struct vm_area_struct *vma, unsigned long address,
 	}
 	if (pmd_trans_huge(*pmd)) {
 		if (flags & FOLL_SPLIT) {
-			split_huge_page_pmd(mm, pmd);
+			split_huge_page_pmd(vma, address, pmd);
 			goto split_fallthrough;
 		}
 		spin_lock(&mm->page_table_lock);
@@ -2798,7 +2800,7 @@ static int do_swap_page(struct mm_struct *mm, struct vm_area_struct *vma,
 		goto out;
 	}
 	delayacct_set_flag(DELAYACCT_PF_SWAPIN);
-	page = lookup_swap_cache(entry);
+	page = lookup_swap_cache(entry, vma, address);
 	if (!page) {
 		grab_swap_token(mm); /* Contend for token _before_ read-in */
 		page = swapin_readahead(entry,
@@ -2980,21 +2982,110 @@ static inline int check_stack_guard_page(struct vm_area_struct *vma, unsigned lo
 	return 0;
 }
 
+/*
+ * State of a speculative page fault, see handle_speculative_fault().
+ */
+struct spf_state {
+	unsigned int seq;	/* vma->vm_sequence the fault started from */
+	pmd_t orig_pmd;		/* pmd the pte was found under */
+};
+
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+static pmd_t *spf_walk_pmd(struct mm_struct *mm, unsigned long address)
+{
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+
+	pgd = pgd_offset(mm, address);
+	if (!pgd_present(*pgd))
+		return NULL;
+	pud = pud_offset(pgd, address);
+	if (!pud_present(*pud))
+		return NULL;
+	pmd = pmd_offset(pud, address);
+	if (!pmd_present(*pmd) || pmd_trans_huge(*pmd))
+		return NULL;
+	return pmd;
+}
+
+/*
+ * Without mmap_sem, the page table may be freed under us as soon as the
+ * vma is unmapped. Like gup_fast, walk it with interrupts disabled: the
+ * TLB flush IPI that precedes the freeing cannot be served meanwhile.
+ * Then, holding the pte lock, make sure the vma did not change since the
+ * fault started: from there on it cannot be zapped before we are done.
+ *
+ * The lock is only tried, as its holder may be waiting for the IPI.
+ */
+static pte_t *spf_pte_map_lock(struct mm_struct *mm,
+		struct vm_area_struct *vma, unsigned long address,
+		struct spf_state *spf, spinlock_t **ptlp)
+{
+	pte_t *pte = NULL;
+	spinlock_t *ptl;
+	pmd_t *pmd;
+
+	local_irq_disable();
+	pmd = spf_walk_pmd(mm, address);
+	if (!pmd || pmd_val(*pmd) != pmd_val(spf->orig_pmd))
+		goto out;
+
+	ptl = pte_lockptr(mm, pmd);
+	pte = pte_offset_map(pmd, address);
+	if (!spin_trylock(ptl)) {
+		pte_unmap(pte);
+		pte = NULL;
+		goto out;
+	}
+	if (read_seqcount_retry(&vma->vm_sequence, spf->seq)) {
+		pte_unmap_unlock(pte, ptl);
+		pte = NULL;
+		goto out;
+	}
+	*ptlp = ptl;
+out:
+	local_irq_enable();
+	return pte;
+}
+#else
+static inline pte_t *spf_pte_map_lock(struct mm_struct *mm,
+		struct vm_area_struct *vma, unsigned long address,
+		struct spf_state *spf, spinlock_t **ptlp)
+{
+	BUG();
+	return NULL;
+}
+#endif
+
+/*
+ * Map and lock the pte a fault is to be completed on, or return NULL if
+ * a speculative fault (spf != NULL) raced with a change of its vma.
+ */
+static inline pte_t *pte_map_lock(struct mm_struct *mm,
+		struct vm_area_struct *vma, unsigned long address,
+		pmd_t *pmd, struct spf_state *spf, spinlock_t **ptlp)
+{
+	if (!spf)
+		return pte_offset_map_lock(mm, pmd, address, ptlp);
+	return spf_pte_map_lock(mm, vma, address, spf, ptlp);
+}
+
 /*
  * We enter with non-exclusive mmap_sem (to exclude vma changes,
- * but allow concurrent faults), and pte mapped but not yet locked.
- * We return with mmap_sem still held, but pte unmapped and unlocked.
+ * but allow concurrent faults), or with a reference on the vma for
+ * a speculative fault, and pte unmapped.
+ * We return with mmap_sem still held, and pte unmapped and unlocked.
  */
 static int do_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
-		unsigned long address, pte_t *page_table, pmd_t *pmd,
-		unsigned int flags)
+		unsigned long address, pmd_t *pmd, unsigned int flags,
+		struct spf_state *spf)
 {
 	struct page *page;
 	spinlock_t *ptl;
+	pte_t *page_table;
 	pte_t entry;
 
-	pte_unmap(page_table);
-
 	/* Check if we need to add a guard page to the stack */
 	if (check_stack_guard_page(vma, address) < 0)
 		return VM_FAULT_SIGBUS;
@@ -3003,7 +3094,9 @@ static int do_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	if (!(flags & FAULT_FLAG_WRITE)) {
 		entry = pte_mkspecial(pfn_pte(my_zero_pfn(address),
 						vma->vm_page_prot));
-		page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
+		page_table = pte_map_lock(mm, vma, address, pmd, spf, &ptl);
+		if (!page_table)
+			return VM_FAULT_RETRY;
 		if (!pte_none(*page_table))
 			goto unlock;
 		goto setpte;
@@ -3024,7 +3117,12 @@ static int do_anonymous_page(struct mm_struct *mm, struct vm_area_struct *vma,
 	if (vma->vm_flags & VM_WRITE)
 		entry = pte_mkwrite(pte_mkdirty(entry));
 
-	page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
+	page_table = pte_map_lock(mm, vma, address, pmd, spf, &ptl);
+	if (!page_table) {
+		mem_cgroup_uncharge_page(page);
+		page_cache_release(page);
+		return VM_FAULT_RETRY;
+	}
 	if (!pte_none(*page_table))
 		goto release;
 
@@ -3048,6 +3146,70 @@ oom:
 	return VM_FAULT_OOM;
 }
 
+unsigned long sysctl_fault_around_bytes __read_mostly = 65536;
+
+/*
+ * The fault-around window in pages: a power of two, within one page
+ * table. One page or less disables fault-around.
+ */
+static unsigned long fault_around_pages(void)
+{
+	unsigned long nr_pages;
+
+	nr_pages = ACCESS_ONCE(sysctl_fault_around_bytes) >> PAGE_SHIFT;
+	nr_pages = min_t(unsigned long, nr_pages, PTRS_PER_PTE);
+	return nr_pages > 1 ? rounddown_pow_of_two(nr_pages) : nr_pages;
+}
+
+/*
+ * A read fault on a file mapping first lets ->map_pages() map the pages
+ * of the naturally aligned window around the address that are uptodate
+ * in the page cache, all under the one pte lock, so that reading through
+ * a cached file takes one fault per window instead of one per page.
+ *
+ * The window is clipped to the vma and to the page table. ->map_pages()
+ * is called from the first pte that is none, @pte being the pte of
+ * @address, mapped and locked.
+ */
+static void do_fault_around(struct vm_area_struct *vma, unsigned long address,
+		pte_t *pte, pgoff_t pgoff, unsigned int flags,
+		unsigned long nr_pages)
+{
+	unsigned long start_addr;
+	pgoff_t max_pgoff;
+	struct vm_fault vmf;
+	int off;
+
+	address &= PAGE_MASK;
+	start_addr = max(address & ~(nr_pages * PAGE_SIZE - 1), vma->vm_start);
+	off = ((address - start_addr) >> PAGE_SHIFT) & (PTRS_PER_PTE - 1);
+	pte -= off;
+	pgoff -= off;
+
+	/* up to the end of the page table, of the vma or of the window */
+	max_pgoff = pgoff - ((start_addr >> PAGE_SHIFT) & (PTRS_PER_PTE - 1)) +
+		PTRS_PER_PTE - 1;
+	max_pgoff = min3(max_pgoff, vma_pages(vma) + vma->vm_pgoff - 1,
+			 pgoff + nr_pages - 1);
+
+	while (!pte_none(*pte)) {
+		if (++pgoff > max_pgoff)
+			return;
+		start_addr += PAGE_SIZE;
+		if (start_addr >= vma->vm_end)
+			return;
+		pte++;
+	}
+
+	vmf.virtual_address = (void __user *)start_addr;
+	vmf.pte = pte;
+	vmf.pgoff = pgoff;
+	vmf.max_pgoff = max_pgoff;
+	vmf.flags = flags;
+	vmf.page = NULL;
+	vma->vm_ops->map_pages(vma, &vmf);
+}
+
 /*
  * __do_fault() tries to create a new page mapping. It aggressively
  * tries to share with existing pages, but makes a separate copy if
@@ -3058,12 +3220,14 @@ oom:
  * do not need to flush old virtual caches or the TLB.
  *
  * We enter with non-exclusive mmap_sem (to exclude vma changes,
- * but allow concurrent faults), and pte neither mapped nor locked.
+ * but allow concurrent faults), or with a reference on the vma and
+ * its file for a speculative fault, and pte neither mapped nor locked.
  * We return with mmap_sem still held, but pte unmapped and unlocked.
  */
 static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 		unsigned long address, pmd_t *pmd,
-		pgoff_t pgoff, unsigned int flags, pte_t orig_pte)
+		pgoff_t pgoff, unsigned int flags, pte_t orig_pte,
+		struct spf_state *spf)
 {
 	pte_t *page_table;
 	spinlock_t *ptl;
@@ -3075,6 +3239,22 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	struct vm_fault vmf;
 	int ret;
 	int page_mkwrite = 0;
+	unsigned long nr_pages;
+
+	nr_pages = vma->vm_ops->map_pages ? fault_around_pages() : 0;
+	if (!(flags & (FAULT_FLAG_WRITE | FAULT_FLAG_NONLINEAR)) &&
+	    nr_pages > 1) {
+		page_table = pte_map_lock(mm, vma, address, pmd, spf, &ptl);
+		if (page_table) {
+			do_fault_around(vma, address, page_table, pgoff, flags,
+					nr_pages);
+			ret = !pte_same(*page_table, orig_pte);
+			pte_unmap_unlock(page_table, ptl);
+			/* the page was there, or somebody beat us to it */
+			if (ret)
+				return 0;
+		}
+	}
 
 	vmf.virtual_address = (void __user *)(address & PAGE_MASK);
 	vmf.pgoff = pgoff;
@@ -3158,7 +3338,18 @@ static int __do_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 
 	}
 
-	page_table = pte_offset_map_lock(mm, pmd, address, &ptl);
+	page_table = pte_map_lock(mm, vma, address, pmd, spf, &ptl);
+	if (!page_table) {
+		/* A speculative fault lost the race, let the caller retry */
+		if (charged)
+			mem_cgroup_uncharge_page(page);
+		if (anon)
+			page_cache_release(page);
+		else
+			anon = 1; /* no anon but release faulted_page */
+		ret = VM_FAULT_RETRY;
+		goto out;
+	}
 
 	/*
 	 * This silly early PAGE_DIRTY setting removes a race
@@ -3234,6 +3425,25 @@ unwritable_page:
 	return ret;
 }
 
+/*
+ * Map a page cache page found by ->map_pages() read-only, the pte being
+ * locked and none. The reference held on the page goes to the mapping.
+ */
+void do_set_pte(struct vm_area_struct *vma, unsigned long address,
+		struct page *page, pte_t *pte)
+{
+	pte_t entry;
+
+	flush_icache_page(vma, page);
+	entry = mk_pte(page, vma->vm_page_prot);
+	inc_mm_counter_fast(vma->vm_mm, MM_FILEPAGES);
+	page_add_file_rmap(page);
+	set_pte_at(vma->vm_mm, address, pte, entry);
+
+	/* no need to invalidate: a not-present page won't be cached */
+	update_mmu_cache(vma, address, pte);
+}
+
 static int do_linear_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 		unsigned long address, pte_t *page_table, pmd_t *pmd,
 		unsigned int flags, pte_t orig_pte)
@@ -3242,7 +3452,7 @@ static int do_linear_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 			- vma->vm_start) >> PAGE_SHIFT) + vma->vm_pgoff;
 
 	pte_unmap(page_table);
-	return __do_fault(mm, vma, address, pmd, pgoff, flags, orig_pte);
+	return __do_fault(mm, vma, address, pmd, pgoff, flags, orig_pte, NULL);
 }
 
 /*
@@ -3274,7 +3484,7 @@ static int do_nonlinear_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	}
 
 	pgoff = pte_to_pgoff(orig_pte);
-	return __do_fault(mm, vma, address, pmd, pgoff, flags, orig_pte);
+	return __do_fault(mm, vma, address, pmd, pgoff, flags, orig_pte, NULL);
 }
 
 /*
@@ -3305,8 +3515,9 @@ int handle_pte_fault(struct mm_struct *mm,
 					return do_linear_fault(mm, vma, address,
 						pte, pmd, flags, entry);
 			}
+			pte_unmap(pte);
 			return do_anonymous_page(mm, vma, address,
-						 pte, pmd, flags);
+						 pmd, flags, NULL);
 		}
 		if (pte_file(entry))
 			return do_nonlinear_fault(mm, vma, address,
@@ -3409,6 +3620,122 @@ int handle_mm_fault(struct mm_struct *mm, struct vm_area_struct *vma,
 	return handle_pte_fault(mm, vma, address, pte, pmd, flags);
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * Try to handle a page fault without taking mmap_sem: the vma is looked
+ * up under RCU and pinned, and the fault is only completed, under the pte
+ * lock, if the vma's sequence count did not change meanwhile.
+ *
+ * Only the first touch of a page of an anonymous or page cache backed
+ * mapping whose page table is already present is handled, which is most
+ * of the faults of programs populating their heaps. Anything else, and
+ * any race, returns VM_FAULT_RETRY for the caller to take mmap_sem and
+ * go through handle_mm_fault().
+ */
+int handle_speculative_fault(struct mm_struct *mm, unsigned long address,
+			     unsigned int flags)
+{
+	struct vm_area_struct *vma;
+	struct file *file = NULL;
+	struct spf_state spf;
+	unsigned long vm_flags;
+	pmd_t *pmd;
+	pte_t *pte, entry;
+	int ret = VM_FAULT_RETRY;
+
+	/* The pte may not be locked long enough to wait for the file page */
+	flags &= ~(FAULT_FLAG_ALLOW_RETRY | FAULT_FLAG_RETRY_NOWAIT);
+
+	rcu_read_lock();
+	vma = find_vma_rcu(mm, address);
+	if (!vma)
+		goto out_unlock;
+	spf.seq = raw_seqcount_begin(&vma->vm_sequence);
+	vm_flags = ACCESS_ONCE(vma->vm_flags);
+
+	if (address < vma->vm_start || address >= vma->vm_end)
+		goto out_unlock;
+	if (vm_flags & (VM_HUGETLB | VM_NONLINEAR |
+			VM_GROWSDOWN | VM_GROWSUP))
+		goto out_unlock;
+	if (flags & FAULT_FLAG_WRITE) {
+		if (!(vm_flags & VM_WRITE) || (vm_flags & VM_SHARED))
+			goto out_unlock;
+		/* anon_vma_prepare() is not safe against munmap */
+		if (!vma->anon_vma)
+			goto out_unlock;
+	} else if (!(vm_flags & (VM_READ | VM_EXEC | VM_WRITE)))
+		goto out_unlock;
+	if (vma_policy(vma))
+		goto out_unlock;
+	if (vma->vm_ops) {
+		if (vma->vm_ops->fault != filemap_fault)
+			goto out_unlock;
+		file = ACCESS_ONCE(vma->vm_file);
+		if (!file || !atomic_long_inc_not_zero(&file->f_count)) {
+			file = NULL;
+			goto out_unlock;
+		}
+	}
+	if (!atomic_inc_not_zero(&vma->vm_ref_count))
+		goto out_unlock;
+	if (read_seqcount_retry(&vma->vm_sequence, spf.seq)) {
+		rcu_read_unlock();
+		goto out_put;
+	}
+	rcu_read_unlock();
+
+	/* See spf_pte_map_lock() */
+	local_irq_disable();
+	pmd = spf_walk_pmd(mm, address);
+	if (!pmd) {
+		local_irq_enable();
+		goto out_put;
+	}
+	spf.orig_pmd = *pmd;
+	pte = pte_offset_map(pmd, address);
+	entry = *pte;
+	pte_unmap(pte);
+	local_irq_enable();
+	if (!pte_none(entry))
+		goto out_put;
+
+	__set_current_state(TASK_RUNNING);
+	check_sync_rss_stat(current);
+
+	if (!file) {
+		ret = do_anonymous_page(mm, vma, address, NULL, flags, &spf);
+	} else {
+		pgoff_t pgoff = (((address & PAGE_MASK) - vma->vm_start)
+				 >> PAGE_SHIFT) + vma->vm_pgoff;
+
+		ret = __do_fault(mm, vma, address, NULL, pgoff, flags,
+				 entry, &spf);
+	}
+	/* Errors are reported by the regular path, if it agrees */
+	if (ret & VM_FAULT_ERROR)
+		ret = VM_FAULT_RETRY;
+
+out_put:
+	put_vma(vma);
+	if (file)
+		fput(file);
+	goto out;
+out_unlock:
+	rcu_read_unlock();
+	if (file)
+		fput(file);
+out:
+	if (ret & VM_FAULT_RETRY)
+		count_vm_event(SPECULATIVE_PGFAULT_ABORT);
+	else {
+		count_vm_event(PGFAULT);
+		count_vm_event(SPECULATIVE_PGFAULT);
+	}
+	return ret;
+}
+#endif /* CONFIG_SPECULATIVE_PAGE_FAULT */
+
 #ifndef __PAGETABLE_PUD_FOLDED
 /*
  * Allocate page upper directory.
@@ -770,8 +770,14 @@ static int unmap_and_move(new_page_t get_new_page, unsigned long private,
 		goto skip_unmap;
 	}
 
-	/* Establish migration ptes or remove ptes */
-	try_to_unmap(page, TTU_MIGRATION|TTU_IGNORE_MLOCK|TTU_IGNORE_ACCESS);
+	/*
+	 * Establish migration ptes or remove ptes, with a single TLB flush
+	 * for all the mms the page is mapped in. It has to be done before
+	 * the copy, which must not miss a write through a stale entry.
+	 */
+	try_to_unmap(page, TTU_MIGRATION|TTU_IGNORE_MLOCK|TTU_IGNORE_ACCESS|
+			   TTU_BATCH_FLUSH);
+	try_to_unmap_flush();
 
 skip_unmap:
 	if (!page_mapped(page))
@@ -354,10 +354,12 @@ success:
 	 * set VM_LOCKED, __mlock_vma_pages_range will bring it back.
 	 */
 
+	vma_write_begin(vma);
 	if (lock)
 		vma->vm_flags = newflags;
 	else
 		munlock_vma_pages_range(vma, start, end);
+	vma_write_end(vma);
 
 out:
 	*prev = vma;
@@ -30,6 +30,7 @@
 #include <linux/perf_event.h>
 #include <linux/audit.h>
 #include <linux/khugepaged.h>
+#include <linux/ksm.h>
 
 #include <asm/uaccess.h>
 #include <asm/cacheflush.h>
@@ -224,6 +225,37 @@ void unlink_file_vma(struct vm_area_struct *vma)
 	}
 }
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+static void __free_vma(struct rcu_head *head)
+{
+	struct vm_area_struct *vma =
+		container_of(head, struct vm_area_struct, vm_rcu_head);
+
+	kmem_cache_free(vm_area_cachep, vma);
+}
+
+/*
+ * Drop a reference to a vma taken by handle_speculative_fault(), or the
+ * one of the mm. The vma may still be looked at under rcu_read_lock()
+ * by find_vma_rcu(), so it is freed after a grace period.
+ */
+void put_vma(struct vm_area_struct *vma)
+{
+	if (atomic_dec_and_test(&vma->vm_ref_count))
+		call_rcu(&vma->vm_rcu_head, __free_vma);
+}
+
+static inline void free_vma(struct vm_area_struct *vma)
+{
+	put_vma(vma);
+}
+#else
+static inline void free_vma(struct vm_area_struct *vma)
+{
+	kmem_cache_free(vm_area_cachep, vma);
+}
+#endif
+
 /*
  * Close a vm structure and free it, returning the next.
  */
@@ -240,7 +272,7 @@ static struct vm_area_struct *remove_vma(struct vm_area_struct *vma)
 			removed_exe_file_vma(vma->vm_mm);
 	}
 	mpol_put(vma_policy(vma));
-	kmem_cache_free(vm_area_cachep, vma);
+	free_vma(vma);
 	return next;
 }
 
@@ -617,12 +649,16 @@ again:			remove_next = 1 + (end > next->vm_end);
 			vma_prio_tree_remove(next, root);
 	}
 
+	vma_write_begin(vma);
 	vma->vm_start = start;
 	vma->vm_end = end;
 	vma->vm_pgoff = pgoff;
+	vma_write_end(vma);
 	if (adjust_next) {
+		vma_write_begin(next);
 		next->vm_start += adjust_next << PAGE_SHIFT;
 		next->vm_pgoff += adjust_next;
+		vma_write_end(next);
 	}
 
 	if (root) {
@@ -636,7 +672,10 @@ again:			remove_next = 1 + (end > next->vm_end);
 		/*
 		 * vma_merge has merged next into vma, and needs
 		 * us to remove next before dropping the locks.
+		 * Its sequence is left odd: a speculative fault
+		 * still looking at it can only fail.
 		 */
+		vma_write_begin(next);
 		__vma_unlink(mm, next, vma);
 		if (file)
 			__remove_shared_vm_struct(next, file, mapping);
@@ -664,7 +703,7 @@ again:			remove_next = 1 + (end > next->vm_end);
 			anon_vma_merge(vma, next);
 		mm->map_count--;
 		mpol_put(vma_policy(next));
-		kmem_cache_free(vm_area_cachep, next);
+		free_vma(next);
 		/*
 		 * In mprotect's case 6 (see comments on vma_merge),
 		 * we must remove another next too. It would clutter
@@ -1296,6 +1335,7 @@ munmap_back:
 	}
 
 	vma->vm_mm = mm;
+	vma_init_sequence(vma);
 	vma->vm_start = addr;
 	vma->vm_end = addr + len;
 	vma->vm_flags = vm_flags;
@@ -1640,6 +1680,37 @@ struct vm_area_struct *find_vma(struct mm_struct *mm, unsigned long addr)
 
 EXPORT_SYMBOL(find_vma);
 
+#ifdef CONFIG_SPECULATIVE_PAGE_FAULT
+/*
+ * Look up the VMA containing addr without mmap_sem, NULL if none is found.
+ * Must be called under rcu_read_lock(), and the vma validated against its
+ * vm_sequence by the caller: the tree may be rebalanced under the walk,
+ * which may then miss the vma or, bounded, wander around.
+ */
+struct vm_area_struct *find_vma_rcu(struct mm_struct *mm, unsigned long addr)
+{
+	struct vm_area_struct *vma;
+	struct rb_node *rb_node;
+	int depth = 2 * BITS_PER_LONG;
+
+	vma = ACCESS_ONCE(mm->mmap_cache);
+	if (vma && vma->vm_start <= addr && vma->vm_end > addr)
+		return vma;
+
+	rb_node = ACCESS_ONCE(mm->mm_rb.rb_node);
+	while (rb_node && depth--) {
+		vma = rb_entry(rb_node, struct vm_area_struct, vm_rb);
+		if (vma->vm_end > addr) {
+			if (vma->vm_start <= addr)
+				return vma;
+			rb_node = ACCESS_ONCE(rb_node->rb_left);
+		} else
+			rb_node = ACCESS_ONCE(rb_node->rb_right);
+	}
+	return NULL;
+}
+#endif
+
 /* Same as find_vma, but also return a pointer to the previous VMA in *pprev. */
 struct vm_area_struct *
 find_vma_prev(struct mm_struct *mm, unsigned long addr,
@@ -1771,7 +1842,9 @@ int expand_upwards(struct vm_area_struct *vma, unsigned long address)
 		if (vma->vm_pgoff + (size >> PAGE_SHIFT) >= vma->vm_pgoff) {
 			error = acct_stack_growth(vma, size, grow);
 			if (!error) {
+				vma_write_begin(vma);
 				vma->vm_end = address;
+				vma_write_end(vma);
 				perf_event_mmap(vma);
 			}
 		}
@@ -1821,8 +1894,10 @@ static int expand_downwards(struct vm_area_struct *vma,
 		if (grow <= vma->vm_pgoff) {
 			error = acct_stack_growth(vma, size, grow);
 			if (!error) {
+				vma_write_begin(vma);
 				vma->vm_start = address;
 				vma->vm_pgoff -= grow;
+				vma_write_end(vma);
 				perf_event_mmap(vma);
 			}
 		}
@@ -1947,6 +2022,8 @@ detach_vmas_to_be_unmapped(struct mm_struct *mm, struct vm_area_struct *vma,
 	insertion_point = (prev ? &prev->vm_next : &mm->mmap);
 	vma->vm_prev = NULL;
 	do {
+		/* Fail the speculative faults on it from now on */
+		vma_write_begin(vma);
 		rb_erase(&vma->vm_rb, &mm->mm_rb);
 		mm->map_count--;
 		tail_vma = vma;
@@ -1985,6 +2062,7 @@ static int __split_vma(struct mm_struct * mm, struct vm_area_struct * vma,
 
 	/* most fields are the same, copy all, and then fixup */
 	*new = *vma;
+	vma_init_sequence(new);
 
 	INIT_LIST_HEAD(&new->anon_vma_chain);
 
@@ -2021,8 +2099,12 @@ static int __split_vma(struct mm_struct * mm, struct vm_area_struct * vma,
 		err = vma_adjust(vma, vma->vm_start, addr, vma->vm_pgoff, new);
 
 	/* Success. */
-	if (!err)
+	if (!err) {
+		/* neither part has the history of the whole */
+		ksm_vma_init(new);
+		ksm_vma_init(vma);
 		return 0;
+	}
 
 	/* Clean everything up if vma_adjust failed. */
 	if (new->vm_ops && new->vm_ops->close)
@@ -2250,6 +2332,7 @@ unsigned long do_brk(unsigned long addr, unsigned long len)
 
 	INIT_LIST_HEAD(&vma->anon_vma_chain);
 	vma->vm_mm = mm;
+	vma_init_sequence(vma);
 	vma->vm_start = addr;
 	vma->vm_end = addr + len;
 	vma->vm_pgoff = pgoff;
@@ -2385,6 +2468,8 @@ struct vm_area_struct *copy_vma(struct vm_area_struct **vmap,
 		new_vma = kmem_cache_alloc(vm_area_cachep, GFP_KERNEL);
 		if (new_vma) {
 			*new_vma = *vma;
+			vma_init_sequence(new_vma);
+			ksm_vma_init(new_vma);
 			pol = mpol_dup(vma_policy(vma));
 			if (IS_ERR(pol))
 				goto out_free_vma;
@@ -2492,6 +2577,7 @@ int install_special_mapping(struct mm_struct *mm,
 
 	INIT_LIST_HEAD(&vma->anon_vma_chain);
 	vma->vm_mm = mm;
+	vma_init_sequence(vma);
 	vma->vm_start = addr;
 	vma->vm_end = addr + len;
 
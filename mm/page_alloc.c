@@ -1967,6 +1967,18 @@ void wake_all_kswapd(unsigned int order, struct zonelist *zonelist,
 		wakeup_kswapd(zone, order, classzone_idx);
 }
 
+static inline
+void wake_all_kcompactd(unsigned int order, struct zonelist *zonelist,
+						enum zone_type high_zoneidx,
+						enum zone_type classzone_idx)
+{
+	struct zoneref *z;
+	struct zone *zone;
+
+	for_each_zone_zonelist(zone, z, zonelist, high_zoneidx)
+		wakeup_kcompactd(zone, order, classzone_idx);
+}
+
 static inline int
 gfp_to_alloc_flags(gfp_t gfp_mask)
 {
@@ -2049,6 +2061,15 @@ restart:
 		wake_all_kswapd(order, zonelist, high_zoneidx,
 						zone_idx(preferred_zone));
 
+	/*
+	 * Have high-order allocations defragmented in the background, also
+	 * the ones which may not wake kswapd such as transparent hugepages:
+	 * they fall back to small pages and get huge ones next time.
+	 */
+	if (order)
+		wake_all_kcompactd(order, zonelist, high_zoneidx,
+						zone_idx(preferred_zone));
+
 	/*
 	 * OK, we're below the kswapd watermark and have kicked background
 	 * reclaim. Now things get more complex, so set up alloc_flags according
@@ -4233,12 +4254,18 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 	pgdat->nr_zones = 0;
 	init_waitqueue_head(&pgdat->kswapd_wait);
 	pgdat->kswapd_max_order = 0;
+#ifdef CONFIG_COMPACTION
+	init_waitqueue_head(&pgdat->kcompactd_wait);
+	pgdat->kcompactd_max_order = 0;
+	pgdat->kcompactd_classzone_idx = 0;
+#endif
 	pgdat_page_cgroup_init(pgdat);
 	
 	for (j = 0; j < MAX_NR_ZONES; j++) {
 		struct zone *zone = pgdat->node_zones + j;
 		unsigned long size, realsize, memmap_pages;
 		enum lru_list l;
+		int i;
 
 		size = zone_spanned_pages_in_node(nid, j, zones_size);
 		realsize = size - zone_absent_pages_in_node(nid, j,
@@ -4283,19 +4310,23 @@ static void __paginginit free_area_init_core(struct pglist_data *pgdat,
 #endif
 		zone->name = zone_names[j];
 		spin_lock_init(&zone->lock);
-		spin_lock_init(&zone->lru_lock);
+		for (i = 0; i < LRU_SHARDS; i++) {
+			spin_lock_init(&zone->lru[i].lock);
+			for_each_lru(l)
+				INIT_LIST_HEAD(&zone->lru[i].list[l]);
+		}
+		zone->lru_scan_shard = 0;
 		zone_seqlock_init(zone);
 		zone->zone_pgdat = pgdat;
 
 		zone_pcp_init(zone);
-		for_each_lru(l) {
-			INIT_LIST_HEAD(&zone->lru[l].list);
+		for_each_lru(l)
 			zone->reclaim_stat.nr_saved_scan[l] = 0;
-		}
-		zone->reclaim_stat.recent_rotated[0] = 0;
-		zone->reclaim_stat.recent_rotated[1] = 0;
-		zone->reclaim_stat.recent_scanned[0] = 0;
-		zone->reclaim_stat.recent_scanned[1] = 0;
+		atomic_long_set(&zone->reclaim_stat.recent_rotated[0], 0);
+		atomic_long_set(&zone->reclaim_stat.recent_rotated[1], 0);
+		atomic_long_set(&zone->reclaim_stat.recent_scanned[0], 0);
+		atomic_long_set(&zone->reclaim_stat.recent_scanned[1], 0);
+		atomic_long_set(&zone->inactive_age, 0);
 		zap_zone_vm_stats(zone);
 		zone->flags = 0;
 		if (!size)
@@ -18,6 +18,9 @@
 #include <linux/pagevec.h>
 #include <linux/pagemap.h>
 
+#define CREATE_TRACE_POINTS
+#include <trace/events/readahead.h>
+
 /*
  * Initialise a struct file's readahead state.  Assumes that the caller has
  * memset *ra to zero.
@@ -245,6 +248,151 @@ unsigned long max_sane_readahead(unsigned long nr)
 		+ node_page_state(numa_node_id(), NR_FREE_PAGES)) / 2);
 }
 
+/*
+ * Every device keeps the share of its readahead pages that went unused.
+ * Each time RA_ADAPT_PERIOD pages have been accounted, the window of the
+ * device is halved if more than a quarter of them were wasted, down to
+ * an eighth of ra_pages, and doubled back if less than one in sixteen
+ * were.
+ */
+#define RA_ADAPT_PERIOD		1024
+#define RA_SHIFT_MAX		3
+
+static void bdi_ra_account(struct backing_dev_info *bdi,
+			   unsigned long used, unsigned long waste)
+{
+	long total;
+
+	if (waste)
+		atomic_long_add(waste, &bdi->ra_waste);
+	if (atomic_long_add_return(used + waste, &bdi->ra_accounted) <
+							RA_ADAPT_PERIOD)
+		return;
+
+	total = atomic_long_xchg(&bdi->ra_accounted, 0);
+	if (total < RA_ADAPT_PERIOD) {
+		/* another CPU closed the period under us */
+		atomic_long_add(total, &bdi->ra_accounted);
+		return;
+	}
+	waste = atomic_long_xchg(&bdi->ra_waste, 0);
+
+	if (waste * 4 > total) {
+		if (bdi->ra_shift < RA_SHIFT_MAX)
+			bdi->ra_shift++;
+	} else if (waste * 16 < total) {
+		if (bdi->ra_shift)
+			bdi->ra_shift--;
+	}
+}
+
+/*
+ * The readahead window of @ra as scaled for the hit rate of the device,
+ * but never below a few pages.
+ */
+static unsigned long ra_max_pages(struct address_space *mapping,
+				  struct file_ra_state *ra)
+{
+	unsigned long max;
+
+	max = ra->ra_pages >> mapping->backing_dev_info->ra_shift;
+	max = max_t(unsigned long, max, min(ra->ra_pages, 4U));
+
+	return max_sane_readahead(max);
+}
+
+/*
+ * A stride window is made of records of (size - 1) % stride + 1 pages,
+ * stride pages apart, the first one at start.
+ */
+static unsigned long ra_record_pages(struct file_ra_state *ra)
+{
+	return (ra->size - 1) % ra->stride + 1;
+}
+
+static unsigned long ra_nr_records(struct file_ra_state *ra)
+{
+	return (ra->size - 1) / ra->stride + 1;
+}
+
+static unsigned long ra_window_pages(struct file_ra_state *ra)
+{
+	if (ra->pattern == RA_PATTERN_STRIDE)
+		return ra_nr_records(ra) * ra_record_pages(ra);
+	return ra->size;
+}
+
+static void ra_account(struct address_space *mapping,
+		       struct file_ra_state *ra,
+		       unsigned long used, unsigned long waste)
+{
+	ra->hit += used;
+	ra->waste += waste;
+	bdi_ra_account(mapping->backing_dev_info, used, waste);
+}
+
+/*
+ * The stream moves on into the next window: all of the current one
+ * has been or is about to be used.
+ */
+static void ra_window_used(struct address_space *mapping,
+			   struct file_ra_state *ra)
+{
+	if (ra->pattern != RA_PATTERN_NONE)
+		ra_account(mapping, ra, ra_window_pages(ra), 0);
+}
+
+/**
+ * ra_window_abandon - account a readahead window the stream has left
+ * @mapping: address_space the window was read into
+ * @ra: file_ra_state which holds the window
+ *
+ * The pages of the window past the last read position, in the direction
+ * of the stream, are counted as wasted: most likely they will be evicted
+ * before anybody asks for them. A read-around window has no direction,
+ * only the pages of it that were faulted in count as used.
+ */
+void ra_window_abandon(struct address_space *mapping,
+		       struct file_ra_state *ra)
+{
+	pgoff_t last = ra->prev_pos >> PAGE_CACHE_SHIFT;
+	pgoff_t end = ra->start + ra->size;
+	unsigned long total = ra_window_pages(ra);
+	unsigned long used;
+
+	switch (ra->pattern) {
+	case RA_PATTERN_NONE:
+		return;
+	case RA_PATTERN_BACKWARD:
+		if (last >= end)
+			used = 0;
+		else if (last < ra->start)
+			used = total;
+		else
+			used = end - last;
+		break;
+	case RA_PATTERN_AROUND:
+		used = min_t(unsigned long, ra->mmap_hit, total);
+		break;
+	case RA_PATTERN_STRIDE:
+		if (last < ra->start)
+			used = 0;
+		else
+			used = min((last - ra->start) / ra->stride + 1,
+				   ra_nr_records(ra)) * ra_record_pages(ra);
+		break;
+	default:
+		if (last < ra->start)
+			used = 0;
+		else
+			used = min(last - ra->start + 1, total);
+		break;
+	}
+
+	ra->pattern = RA_PATTERN_NONE;
+	ra_account(mapping, ra, used, total - used);
+}
+
 /*
  * Submit IO for the read-ahead request in file_ra_state.
  */
@@ -327,6 +475,12 @@ static unsigned long get_next_ra_size(struct file_ra_state *ra,
  * for sequential patterns. Hence interleaved reads might be served as
  * sequential ones.
  *
+ * prev_miss and stride track the offset of the last synchronous miss and
+ * its distance from the one before. When the same distance shows up twice
+ * in a row, the stream is either strided, reading records with holes in
+ * between, or backward. Such windows are flagged in pattern and marked the
+ * same way, with the marker placed where the stream will get to it.
+ *
  * There is a special-case: if the first page which the application tries to
  * read happens to be the first page of the file, it is assumed that a linear
  * read is about to happen and the window is immediately set to the initial size
@@ -390,7 +544,68 @@ static int try_context_readahead(struct address_space *mapping,
 }
 
 /*
- * A minimal readahead algorithm for trivial sequential/random reads.
+ * Read @record pages at @offset and at every ra->stride pages after it,
+ * as many records as fit in @max pages. The first page of the middle
+ * record is marked, so that the next batch is read while the application
+ * works through the second half of this one.
+ */
+static unsigned long
+stride_readahead(struct address_space *mapping,
+		 struct file_ra_state *ra, struct file *filp,
+		 pgoff_t offset, unsigned long record, unsigned long max)
+{
+	unsigned long stride = ra->stride;
+	unsigned long nr, mark, i;
+	unsigned long ret = 0;
+
+	nr = max(max / record, 1UL);
+	nr = min(nr, (UINT_MAX - record) / stride + 1);
+	mark = nr / 2;
+
+	ra->pattern = RA_PATTERN_STRIDE;
+	ra->start = offset;
+	ra->size = (nr - 1) * stride + record;
+	ra->async_size = ra->size - mark * stride;
+
+	for (i = 0; i < nr; i++) {
+		pgoff_t index = offset + i * stride;
+
+		if (index < offset)
+			break;
+		ret += __do_page_cache_readahead(mapping, filp, index, record,
+						 i == mark ? record : 0);
+	}
+
+	return ret;
+}
+
+/*
+ * Read the @size pages below @end for a backward stream. The page half
+ * way down is marked, so that the window below is read before the
+ * application gets to the bottom of this one.
+ */
+static unsigned long
+backward_readahead(struct address_space *mapping,
+		   struct file_ra_state *ra, struct file *filp,
+		   pgoff_t end, unsigned long size)
+{
+	if (size > end)
+		size = end;
+
+	ra->pattern = RA_PATTERN_BACKWARD;
+	ra->start = end - size;
+	ra->size = size;
+	ra->async_size = size / 2;
+	if (!size)
+		return 0;
+
+	return __do_page_cache_readahead(mapping, filp, ra->start, size,
+					 size - ra->async_size);
+}
+
+/*
+ * A minimal readahead algorithm for trivial sequential/random reads,
+ * strided and backward streams.
  */
 static unsigned long
 ondemand_readahead(struct address_space *mapping,
@@ -398,7 +613,30 @@ ondemand_readahead(struct address_space *mapping,
 		   bool hit_readahead_marker, pgoff_t offset,
 		   unsigned long req_size)
 {
-	unsigned long max = max_sane_readahead(ra->ra_pages);
+	unsigned long max = ra_max_pages(mapping, ra);
+	long stride = offset - ra->prev_miss;
+	unsigned long ret;
+
+	/*
+	 * Hit the marker of a strided or backward window, push it on
+	 * in the direction of the stream.
+	 */
+	if (hit_readahead_marker && ra->pattern == RA_PATTERN_STRIDE &&
+	    offset == ra->start + ra->size - ra->async_size) {
+		unsigned long record = ra_record_pages(ra);
+		pgoff_t next = ra->start + ra->size - record + ra->stride;
+
+		ra_window_used(mapping, ra);
+		ret = stride_readahead(mapping, ra, filp, next, record, max);
+		goto out;
+	}
+	if (hit_readahead_marker && ra->pattern == RA_PATTERN_BACKWARD &&
+	    offset == ra->start + ra->async_size) {
+		ra_window_used(mapping, ra);
+		ret = backward_readahead(mapping, ra, filp, ra->start,
+					 get_next_ra_size(ra, max));
+		goto out;
+	}
 
 	/*
 	 * start of file
@@ -410,8 +648,11 @@ ondemand_readahead(struct address_space *mapping,
 	 * It's the expected callback offset, assume sequential access.
 	 * Ramp up sizes, and push forward the readahead window.
 	 */
-	if ((offset == (ra->start + ra->size - ra->async_size) ||
+	if (ra->pattern != RA_PATTERN_STRIDE &&
+	    ra->pattern != RA_PATTERN_BACKWARD &&
+	    (offset == (ra->start + ra->size - ra->async_size) ||
 	     offset == (ra->start + ra->size))) {
+		ra_window_used(mapping, ra);
 		ra->start += ra->size;
 		ra->size = get_next_ra_size(ra, max);
 		ra->async_size = ra->size;
@@ -434,6 +675,7 @@ ondemand_readahead(struct address_space *mapping,
 		if (!start || start - offset > max)
 			return 0;
 
+		ra_window_used(mapping, ra);
 		ra->start = start;
 		ra->size = start - offset;	/* old async_size */
 		ra->size += req_size;
@@ -454,6 +696,27 @@ ondemand_readahead(struct address_space *mapping,
 	if (offset - (ra->prev_pos >> PAGE_CACHE_SHIFT) <= 1UL)
 		goto initial_readahead;
 
+	ra_window_abandon(mapping, ra);
+
+	/*
+	 * The last three misses were the same distance apart: a strided
+	 * stream, which reads records with holes in between, or a stream
+	 * reading the file backwards.
+	 */
+	if (stride == ra->stride) {
+		if (stride > (long)req_size) {
+			ret = stride_readahead(mapping, ra, filp, offset,
+					       req_size, max);
+			goto out;
+		}
+		if (stride < 0 && -stride <= (long)req_size) {
+			ret = backward_readahead(mapping, ra, filp,
+					offset + req_size,
+					get_init_ra_size(req_size, max));
+			goto out;
+		}
+	}
+
 	/*
 	 * Query the page cache and look for the traces(cached history pages)
 	 * that a sequential stream would leave behind.
@@ -465,9 +728,11 @@ ondemand_readahead(struct address_space *mapping,
 	 * standalone, small random read
 	 * Read as is, and do not pollute the readahead state.
 	 */
-	return __do_page_cache_readahead(mapping, filp, offset, req_size, 0);
+	ret = __do_page_cache_readahead(mapping, filp, offset, req_size, 0);
+	goto out;
 
 initial_readahead:
+	ra_window_abandon(mapping, ra);
 	ra->start = offset;
 	ra->size = get_init_ra_size(req_size, max);
 	ra->async_size = ra->size > req_size ? ra->size - req_size : ra->size;
@@ -483,7 +748,15 @@ readit:
 		ra->size += ra->async_size;
 	}
 
-	return ra_submit(ra, mapping, filp);
+	ra->pattern = RA_PATTERN_SEQUENTIAL;
+	ret = ra_submit(ra, mapping, filp);
+out:
+	if (!hit_readahead_marker) {
+		ra->prev_miss = offset;
+		ra->stride = stride;
+	}
+	trace_readahead(mapping, ra, offset, req_size, ret);
+	return ret;
 }
 
 /**
@@ -504,6 +777,8 @@ void page_cache_sync_readahead(struct address_space *mapping,
 			       struct file_ra_state *ra, struct file *filp,
 			       pgoff_t offset, unsigned long req_size)
 {
+	ra->miss++;
+
 	/* no read-ahead */
 	if (!ra->ra_pages)
 		return;
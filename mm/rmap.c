@@ -27,7 +27,7 @@
  *       mapping->i_mmap_lock
  *         anon_vma->lock
  *           mm->page_table_lock or pte_lock
- *             zone->lru_lock (in mark_page_accessed, isolate_lru_page)
+ *             zone_lru->lock (in mark_page_accessed, isolate_lru_page)
  *             swap_lock (in swap_duplicate, swap_info_get)
  *               mmlist_lock (in mmput, drain_mmlist and others)
  *               mapping->private_lock (in __set_page_dirty_buffers)
@@ -1013,6 +1013,130 @@ void page_remove_rmap(struct page *page)
 	 */
 }
 
+#ifdef CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH
+/*
+ * Reclaim unmaps many pages in a row, from mms which are often running
+ * on many cpus: flushing the TLBs for every pte cleared sends as many
+ * rounds of IPIs. With TTU_BATCH_FLUSH the ptes are only cleared and the
+ * cpus that may cache them are collected in current->tlb_ubc, to be
+ * flushed all at once by try_to_unmap_flush() before the pages can be
+ * freed, and by try_to_unmap_flush_dirty() before a page that had a
+ * dirty pte is written out.
+ */
+void try_to_unmap_flush(void)
+{
+	struct tlbflush_unmap_batch *tlb_ubc = &current->tlb_ubc;
+
+	if (!tlb_ubc->flush_required)
+		return;
+
+	arch_tlbbatch_flush(&tlb_ubc->cpumask);
+	cpumask_clear(&tlb_ubc->cpumask);
+	tlb_ubc->flush_required = false;
+	tlb_ubc->writable = false;
+}
+
+void try_to_unmap_flush_dirty(void)
+{
+	if (current->tlb_ubc.writable)
+		try_to_unmap_flush();
+}
+
+/*
+ * mm->tlb_flush_batched is a pair of generations: the flushes owed in
+ * the low bits, bumped by reclaim for every pte it leaves in the TLBs,
+ * and the flushes done in the high bits, caught up by the flusher with
+ * the owed count it started from. Reclaim and the flusher hold the pte
+ * locks of different page tables, so a flush owed while another cpu is
+ * in flush_tlb_mm() must not be lost: the flusher only catches up if
+ * nothing was owed in between, otherwise the next caller flushes again.
+ * The owed count is reset before it can run into the high bits.
+ */
+#define TLB_FLUSH_BATCH_FLUSHED_SHIFT	16
+#define TLB_FLUSH_BATCH_PENDING_MASK	\
+	((1 << (TLB_FLUSH_BATCH_FLUSHED_SHIFT - 1)) - 1)
+#define TLB_FLUSH_BATCH_PENDING_LARGE	(TLB_FLUSH_BATCH_PENDING_MASK / 2)
+
+static void set_tlb_ubc_flush_pending(struct mm_struct *mm, bool writable)
+{
+	struct tlbflush_unmap_batch *tlb_ubc = &current->tlb_ubc;
+	int batch, old;
+
+	cpumask_or(&tlb_ubc->cpumask, &tlb_ubc->cpumask, mm_cpumask(mm));
+	tlb_ubc->flush_required = true;
+
+	/*
+	 * The pte must be seen cleared before the flush is owed. Resetting
+	 * to a single owed flush loses no flush: one is still owed.
+	 */
+	smp_mb__before_atomic_inc();
+	batch = atomic_read(&mm->tlb_flush_batched);
+retry:
+	if ((batch & TLB_FLUSH_BATCH_PENDING_MASK) >
+	    TLB_FLUSH_BATCH_PENDING_LARGE) {
+		old = atomic_cmpxchg(&mm->tlb_flush_batched, batch, 1);
+		if (old != batch) {
+			batch = old;
+			goto retry;
+		}
+	} else
+		atomic_inc(&mm->tlb_flush_batched);
+
+	if (writable)
+		tlb_ubc->writable = true;
+}
+
+/*
+ * The flush is only worth deferring if other cpus have to be flushed,
+ * a local flush costs nothing compared to the IPIs.
+ */
+static bool should_defer_flush(struct mm_struct *mm, enum ttu_flags flags)
+{
+	bool should_defer = false;
+
+	if (!(flags & TTU_BATCH_FLUSH))
+		return false;
+
+	if (cpumask_any_but(mm_cpumask(mm), get_cpu()) < nr_cpu_ids)
+		should_defer = true;
+	put_cpu();
+
+	return should_defer;
+}
+
+/*
+ * A pte cleared by reclaim may still be cached in the TLBs of other
+ * cpus when mprotect, munmap or mremap of the same mm find it empty and
+ * skip their own flush for it. They call this under the pte lock to
+ * get the stale entries out before they return.
+ */
+void flush_tlb_batched_pending(struct mm_struct *mm)
+{
+	int batch = atomic_read(&mm->tlb_flush_batched);
+	int pending = batch & TLB_FLUSH_BATCH_PENDING_MASK;
+	int flushed = batch >> TLB_FLUSH_BATCH_FLUSHED_SHIFT;
+
+	if (pending != flushed) {
+		flush_tlb_mm(mm);
+		/*
+		 * If a flush was owed meanwhile the cmpxchg fails, and it is
+		 * left to the next caller.
+		 */
+		atomic_cmpxchg(&mm->tlb_flush_batched, batch,
+			       pending | (pending << TLB_FLUSH_BATCH_FLUSHED_SHIFT));
+	}
+}
+#else
+static void set_tlb_ubc_flush_pending(struct mm_struct *mm, bool writable)
+{
+}
+
+static bool should_defer_flush(struct mm_struct *mm, enum ttu_flags flags)
+{
+	return false;
+}
+#endif /* CONFIG_ARCH_WANT_BATCHED_UNMAP_TLB_FLUSH */
+
 /*
  * Subfunctions of try_to_unmap: try_to_unmap_one called
  * repeatedly from either try_to_unmap_anon or try_to_unmap_file.
@@ -1051,7 +1175,16 @@ int try_to_unmap_one(struct page *page, struct vm_area_struct *vma,
 
 	/* Nuke the page table entry. */
 	flush_cache_page(vma, address, page_to_pfn(page));
-	pteval = ptep_clear_flush_notify(vma, address, pte);
+	if (should_defer_flush(mm, flags)) {
+		/*
+		 * Clear the pte now and leave the TLB flush to the caller,
+		 * which batches it with the flushes of the other pages.
+		 */
+		pteval = ptep_get_and_clear(mm, address, pte);
+		set_tlb_ubc_flush_pending(mm, pte_dirty(pteval));
+		mmu_notifier_invalidate_page(mm, address);
+	} else
+		pteval = ptep_clear_flush_notify(vma, address, pte);
 
 	/* Move the dirty bit to the physical page now the pte is gone. */
 	if (pte_dirty(pteval))
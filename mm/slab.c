@@ -3807,6 +3807,87 @@ void kmem_cache_free(struct kmem_cache *cachep, void *objp)
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+/**
+ * kmem_cache_free_bulk - Deallocate an array of objects
+ * @cachep: The cache the allocations were from.
+ * @size: The number of objects.
+ * @p: The previously allocated objects.
+ *
+ * Free the objects back into the per cpu array cache, disabling
+ * interrupts only once for all of them.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *cachep, size_t size, void **p)
+{
+	unsigned long flags;
+	size_t i;
+
+	local_irq_save(flags);
+	for (i = 0; i < size; i++) {
+		debug_check_no_locks_freed(p[i], obj_size(cachep));
+		if (!(cachep->flags & SLAB_DEBUG_OBJECTS))
+			debug_check_no_obj_freed(p[i], obj_size(cachep));
+		__cache_free(cachep, p[i]);
+	}
+	local_irq_restore(flags);
+
+	for (i = 0; i < size; i++)
+		trace_kmem_cache_free(_RET_IP_, p[i]);
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
+/**
+ * kmem_cache_alloc_bulk - Allocate an array of objects
+ * @cachep: The cache to allocate from.
+ * @flags: See kmalloc().
+ * @size: The number of objects.
+ * @p: The array to fill.
+ *
+ * Allocate @size objects from this cache, disabling interrupts only
+ * once for all of them. Returns @size, or 0 if not all the objects
+ * could be allocated, in which case none is.
+ */
+int kmem_cache_alloc_bulk(struct kmem_cache *cachep, gfp_t flags, size_t size,
+			  void **p)
+{
+	unsigned long save_flags;
+	size_t i, nr;
+
+	flags &= gfp_allowed_mask;
+
+	lockdep_trace_alloc(flags);
+
+	if (slab_should_failslab(cachep, flags))
+		return 0;
+
+	cache_alloc_debugcheck_before(cachep, flags);
+	local_irq_save(save_flags);
+	for (nr = 0; nr < size; nr++) {
+		p[nr] = __do_cache_alloc(cachep, flags);
+		if (unlikely(!p[nr]))
+			break;
+	}
+	local_irq_restore(save_flags);
+
+	for (i = 0; i < nr; i++) {
+		p[i] = cache_alloc_debugcheck_after(cachep, flags, p[i],
+						    __builtin_return_address(0));
+		kmemleak_alloc_recursive(p[i], obj_size(cachep), 1,
+					 cachep->flags, flags);
+		kmemcheck_slab_alloc(cachep, flags, p[i], obj_size(cachep));
+		if (unlikely(flags & __GFP_ZERO))
+			memset(p[i], 0, obj_size(cachep));
+		trace_kmem_cache_alloc(_RET_IP_, p[i], obj_size(cachep),
+				       cachep->buffer_size, flags);
+	}
+
+	if (unlikely(nr < size)) {
+		kmem_cache_free_bulk(cachep, nr, p);
+		return 0;
+	}
+	return nr;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
 /**
  * kfree - free previously allocated memory
  * @objp: pointer returned by kmalloc.
@@ -660,6 +660,35 @@ void kmem_cache_free(struct kmem_cache *c, void *b)
 }
 EXPORT_SYMBOL(kmem_cache_free);
 
+/*
+ * SLOB has no per cpu queues to move objects in bulk from, so the bulk
+ * interfaces simply loop.
+ */
+void kmem_cache_free_bulk(struct kmem_cache *c, size_t size, void **p)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++)
+		kmem_cache_free(c, p[i]);
+}
+EXPORT_SYMBOL(kmem_cache_free_bulk);
+
+int kmem_cache_alloc_bulk(struct kmem_cache *c, gfp_t flags, size_t size,
+			  void **p)
+{
+	size_t i;
+
+	for (i = 0; i < size; i++) {
+		p[i] = kmem_cache_alloc_node(c, flags, -1);
+		if (unlikely(!p[i])) {
+			kmem_cache_free_bulk(c, i, p);
+			return 0;
+		}
+	}
+	return size;
+}
+EXPORT_SYMBOL(kmem_cache_alloc_bulk);
+
 unsigned int kmem_cache_size(struct kmem_cache *c)
 {
 	return c->size;
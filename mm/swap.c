@@ -50,12 +50,13 @@ static void __page_cache_release(struct page *page)
 	if (PageLRU(page)) {
 		unsigned long flags;
 		struct zone *zone = page_zone(page);
+		spinlock_t *lock = page_lru_lock(page);
 
-		spin_lock_irqsave(&zone->lru_lock, flags);
+		spin_lock_irqsave(lock, flags);
 		VM_BUG_ON(!PageLRU(page));
 		__ClearPageLRU(page);
 		del_page_from_lru(zone, page);
-		spin_unlock_irqrestore(&zone->lru_lock, flags);
+		spin_unlock_irqrestore(lock, flags);
 	}
 }
 
@@ -183,25 +184,34 @@ static void pagevec_lru_move_fn(struct pagevec *pvec,
 				void (*move_fn)(struct page *page, void *arg),
 				void *arg)
 {
-	int i;
-	struct zone *zone = NULL;
-	unsigned long flags = 0;
+	int i, j;
+	unsigned long flags;
+	unsigned long done = 0;
 
+	/*
+	 * The pages may belong to different LRU sub-lists: take each lock
+	 * once and move all the pages it covers, instead of bouncing
+	 * between the locks in pagevec order.
+	 */
+	BUILD_BUG_ON(PAGEVEC_SIZE > BITS_PER_LONG);
 	for (i = 0; i < pagevec_count(pvec); i++) {
-		struct page *page = pvec->pages[i];
-		struct zone *pagezone = page_zone(page);
+		spinlock_t *lock;
 
-		if (pagezone != zone) {
-			if (zone)
-				spin_unlock_irqrestore(&zone->lru_lock, flags);
-			zone = pagezone;
-			spin_lock_irqsave(&zone->lru_lock, flags);
-		}
+		if (done & (1UL << i))
+			continue;
+
+		lock = page_lru_lock(pvec->pages[i]);
+		spin_lock_irqsave(lock, flags);
+		for (j = i; j < pagevec_count(pvec); j++) {
+			struct page *page = pvec->pages[j];
 
-		(*move_fn)(page, arg);
+			if ((done & (1UL << j)) || page_lru_lock(page) != lock)
+				continue;
+			(*move_fn)(page, arg);
+			done |= 1UL << j;
+		}
+		spin_unlock_irqrestore(lock, flags);
 	}
-	if (zone)
-		spin_unlock_irqrestore(&zone->lru_lock, flags);
 	release_pages(pvec->pages, pvec->nr, pvec->cold);
 	pagevec_reinit(pvec);
 }
@@ -209,11 +219,10 @@ static void pagevec_lru_move_fn(struct pagevec *pvec,
 static void pagevec_move_tail_fn(struct page *page, void *arg)
 {
 	int *pgmoved = arg;
-	struct zone *zone = page_zone(page);
 
 	if (PageLRU(page) && !PageActive(page) && !PageUnevictable(page)) {
 		enum lru_list lru = page_lru_base_type(page);
-		list_move_tail(&page->lru, &zone->lru[lru].list);
+		list_move_tail(&page->lru, &page_zone_lru(page)->list[lru]);
 		mem_cgroup_rotate_reclaimable_page(page);
 		(*pgmoved)++;
 	}
@@ -260,16 +269,16 @@ static void update_page_reclaim_stat(struct zone *zone, struct page *page,
 
 	memcg_reclaim_stat = mem_cgroup_get_reclaim_stat_from_page(page);
 
-	reclaim_stat->recent_scanned[file]++;
+	atomic_long_inc(&reclaim_stat->recent_scanned[file]);
 	if (rotated)
-		reclaim_stat->recent_rotated[file]++;
+		atomic_long_inc(&reclaim_stat->recent_rotated[file]);
 
 	if (!memcg_reclaim_stat)
 		return;
 
-	memcg_reclaim_stat->recent_scanned[file]++;
+	atomic_long_inc(&memcg_reclaim_stat->recent_scanned[file]);
 	if (rotated)
-		memcg_reclaim_stat->recent_rotated[file]++;
+		atomic_long_inc(&memcg_reclaim_stat->recent_rotated[file]);
 }
 
 /*
@@ -278,8 +287,9 @@ static void update_page_reclaim_stat(struct zone *zone, struct page *page,
 void activate_page(struct page *page)
 {
 	struct zone *zone = page_zone(page);
+	spinlock_t *lock = page_lru_lock(page);
 
-	spin_lock_irq(&zone->lru_lock);
+	spin_lock_irq(lock);
 	if (PageLRU(page) && !PageActive(page) && !PageUnevictable(page)) {
 		int file = page_is_file_cache(page);
 		int lru = page_lru_base_type(page);
@@ -292,7 +302,7 @@ void activate_page(struct page *page)
 
 		update_page_reclaim_stat(zone, page, file, 1);
 	}
-	spin_unlock_irq(&zone->lru_lock);
+	spin_unlock_irq(lock);
 }
 
 /*
@@ -308,6 +318,7 @@ void mark_page_accessed(struct page *page)
 			PageReferenced(page) && PageLRU(page)) {
 		activate_page(page);
 		ClearPageReferenced(page);
+		workingset_activation(page);
 	} else if (!PageReferenced(page)) {
 		SetPageReferenced(page);
 	}
@@ -358,12 +369,13 @@ void lru_cache_add_lru(struct page *page, enum lru_list lru)
 void add_page_to_unevictable_list(struct page *page)
 {
 	struct zone *zone = page_zone(page);
+	spinlock_t *lock = page_lru_lock(page);
 
-	spin_lock_irq(&zone->lru_lock);
+	spin_lock_irq(lock);
 	SetPageUnevictable(page);
 	SetPageLRU(page);
 	add_page_to_lru_list(zone, page, LRU_UNEVICTABLE);
-	spin_unlock_irq(&zone->lru_lock);
+	spin_unlock_irq(lock);
 }
 
 /*
@@ -424,7 +436,7 @@ static void lru_deactivate_fn(struct page *page, void *arg)
 		 * The page's writeback ends up during pagevec
 		 * We moves tha page into tail of inactive.
 		 */
-		list_move_tail(&page->lru, &zone->lru[lru].list);
+		list_move_tail(&page->lru, &page_zone_lru(page)->list[lru]);
 		mem_cgroup_rotate_reclaimable_page(page);
 		__count_vm_event(PGROTATED);
 	}
@@ -509,8 +521,8 @@ int lru_add_drain_all(void)
  * passed pages.  If it fell to zero then remove the page from the LRU and
  * free it.
  *
- * Avoid taking zone->lru_lock if possible, but if it is taken, retain it
- * for the remainder of the operation.
+ * Avoid taking an LRU lock if possible, but if it is taken, retain it
+ * for as long as the pages are on the same LRU sub-list.
  *
  * The locking in this function is against shrink_inactive_list(): we recheck
  * the page count inside the lock to see whether shrink_inactive_list()
@@ -521,7 +533,7 @@ void release_pages(struct page **pages, int nr, int cold)
 {
 	int i;
 	struct pagevec pages_to_free;
-	struct zone *zone = NULL;
+	spinlock_t *lock = NULL;
 	unsigned long uninitialized_var(flags);
 
 	pagevec_init(&pages_to_free, cold);
@@ -529,9 +541,9 @@ void release_pages(struct page **pages, int nr, int cold)
 		struct page *page = pages[i];
 
 		if (unlikely(PageCompound(page))) {
-			if (zone) {
-				spin_unlock_irqrestore(&zone->lru_lock, flags);
-				zone = NULL;
+			if (lock) {
+				spin_unlock_irqrestore(lock, flags);
+				lock = NULL;
 			}
 			put_compound_page(page);
 			continue;
@@ -541,31 +553,30 @@ void release_pages(struct page **pages, int nr, int cold)
 			continue;
 
 		if (PageLRU(page)) {
-			struct zone *pagezone = page_zone(page);
-
-			if (pagezone != zone) {
-				if (zone)
-					spin_unlock_irqrestore(&zone->lru_lock,
-									flags);
-				zone = pagezone;
-				spin_lock_irqsave(&zone->lru_lock, flags);
+			spinlock_t *pagelock = page_lru_lock(page);
+
+			if (pagelock != lock) {
+				if (lock)
+					spin_unlock_irqrestore(lock, flags);
+				lock = pagelock;
+				spin_lock_irqsave(lock, flags);
 			}
 			VM_BUG_ON(!PageLRU(page));
 			__ClearPageLRU(page);
-			del_page_from_lru(zone, page);
+			del_page_from_lru(page_zone(page), page);
 		}
 
 		if (!pagevec_add(&pages_to_free, page)) {
-			if (zone) {
-				spin_unlock_irqrestore(&zone->lru_lock, flags);
-				zone = NULL;
+			if (lock) {
+				spin_unlock_irqrestore(lock, flags);
+				lock = NULL;
 			}
 			__pagevec_free(&pages_to_free);
 			pagevec_reinit(&pages_to_free);
   		}
 	}
-	if (zone)
-		spin_unlock_irqrestore(&zone->lru_lock, flags);
+	if (lock)
+		spin_unlock_irqrestore(lock, flags);
 
 	pagevec_free(&pages_to_free);
 }
@@ -602,7 +613,9 @@ void lru_add_page_tail(struct zone* zone,
 	VM_BUG_ON(!PageHead(page));
 	VM_BUG_ON(PageCompound(page_tail));
 	VM_BUG_ON(PageLRU(page_tail));
-	VM_BUG_ON(!spin_is_locked(&zone->lru_lock));
+	VM_BUG_ON(!spin_is_locked(page_lru_lock(page)));
+	/* see __split_huge_page() */
+	VM_BUG_ON(page_lru_lock(page_tail) != page_lru_lock(page));
 
 	SetPageLRU(page_tail);
 
@@ -619,7 +632,7 @@ void lru_add_page_tail(struct zone* zone,
 		if (likely(PageLRU(page)))
 			head = page->lru.prev;
 		else
-			head = &zone->lru[lru].list;
+			head = &page_zone_lru(page_tail)->list[lru];
 		__add_page_to_lru_list(zone, page_tail, lru, head);
 	} else {
 		SetPageUnevictable(page_tail);
@@ -0,0 +1,169 @@
+/*
+ * Per-cpu caches of swap slots
+ *
+ * Allocating a swap slot takes swap_lock and scans the swap map, and
+ * freeing one takes swap_lock again to give it back: with fast swap
+ * devices, swapping out on many CPUs at once mostly waits for swap_lock.
+ *
+ * So every CPU keeps a small cache of preallocated slots, refilled in
+ * batch under a single hold of swap_lock, and hands them out without
+ * taking swap_lock at all.  Likewise, the slots whose last reference
+ * goes away are collected in a per-cpu return cache and given back in
+ * batch.  They stay marked SWAP_HAS_CACHE until then, so that they are
+ * not reallocated in the meantime.
+ *
+ * Swapoff needs every slot of its area to be either free or owned by a
+ * page, so it disables the caches and drains them all while it runs.
+ */
+
+#include <linux/swap.h>
+#include <linux/cpu.h>
+#include <linux/percpu.h>
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/notifier.h>
+#include <linux/init.h>
+
+#define SWAP_SLOTS_CACHE_SIZE	64
+
+struct swap_slots_cache {
+	struct mutex	alloc_lock;	/* protects slots, cur and nr */
+	swp_entry_t	slots[SWAP_SLOTS_CACHE_SIZE];
+	int		cur;		/* next slot to hand out */
+	int		nr;		/* slots left in the cache */
+	spinlock_t	free_lock;	/* protects slots_ret and n_ret */
+	swp_entry_t	slots_ret[SWAP_SLOTS_CACHE_SIZE];
+	int		n_ret;
+};
+
+static DEFINE_PER_CPU(struct swap_slots_cache, swp_slots);
+static DEFINE_MUTEX(swap_slots_cache_mutex);
+static bool swap_slots_cache_enabled __read_mostly;
+
+/*
+ * Stay out of the way when swap is nearly full, lest one CPU fails to
+ * find a slot while others sit on a cache full of them.
+ */
+static bool swap_slots_cache_active(void)
+{
+	return swap_slots_cache_enabled &&
+		nr_swap_pages > num_online_cpus() * SWAP_SLOTS_CACHE_SIZE * 2;
+}
+
+static void drain_slots_cache_cpu(unsigned int cpu)
+{
+	struct swap_slots_cache *cache = &per_cpu(swp_slots, cpu);
+
+	mutex_lock(&cache->alloc_lock);
+	if (cache->nr) {
+		swapcache_free_entries(cache->slots + cache->cur, cache->nr);
+		cache->cur = 0;
+		cache->nr = 0;
+	}
+	mutex_unlock(&cache->alloc_lock);
+
+	spin_lock(&cache->free_lock);
+	if (cache->n_ret) {
+		swapcache_free_entries(cache->slots_ret, cache->n_ret);
+		cache->n_ret = 0;
+	}
+	spin_unlock(&cache->free_lock);
+}
+
+/*
+ * Disable the caches and give back all the slots they hold.  The caches
+ * stay disabled until reenable_swap_slots_cache_unlock().
+ */
+void disable_swap_slots_cache_lock(void)
+{
+	unsigned int cpu;
+
+	mutex_lock(&swap_slots_cache_mutex);
+	swap_slots_cache_enabled = false;
+	for_each_possible_cpu(cpu)
+		drain_slots_cache_cpu(cpu);
+}
+
+void reenable_swap_slots_cache_unlock(void)
+{
+	swap_slots_cache_enabled = true;
+	mutex_unlock(&swap_slots_cache_mutex);
+}
+
+/**
+ * get_swap_page - allocate a swap slot for the swap cache
+ *
+ * Returns the slot, or an entry of 0 if there is no free swap.
+ */
+swp_entry_t get_swap_page(void)
+{
+	struct swap_slots_cache *cache = __this_cpu_ptr(&swp_slots);
+	swp_entry_t entry;
+
+	/*
+	 * The cache may belong to another CPU by the time we lock it: no
+	 * matter, the mutex is all that protects it.
+	 */
+	mutex_lock(&cache->alloc_lock);
+	if (!cache->nr && swap_slots_cache_active()) {
+		cache->cur = 0;
+		cache->nr = get_swap_pages(SWAP_SLOTS_CACHE_SIZE, cache->slots);
+	}
+	if (cache->nr) {
+		entry = cache->slots[cache->cur++];
+		cache->nr--;
+		mutex_unlock(&cache->alloc_lock);
+		return entry;
+	}
+	mutex_unlock(&cache->alloc_lock);
+
+	entry.val = 0;
+	get_swap_pages(1, &entry);
+	return entry;
+}
+
+/**
+ * free_swap_slot - give back a swap slot without reference
+ * @entry: the slot, left marked SWAP_HAS_CACHE by swap_entry_free()
+ */
+void free_swap_slot(swp_entry_t entry)
+{
+	struct swap_slots_cache *cache = __this_cpu_ptr(&swp_slots);
+
+	spin_lock(&cache->free_lock);
+	if (!swap_slots_cache_active()) {
+		spin_unlock(&cache->free_lock);
+		swapcache_free_entries(&entry, 1);
+		return;
+	}
+	if (cache->n_ret == SWAP_SLOTS_CACHE_SIZE) {
+		swapcache_free_entries(cache->slots_ret, cache->n_ret);
+		cache->n_ret = 0;
+	}
+	cache->slots_ret[cache->n_ret++] = entry;
+	spin_unlock(&cache->free_lock);
+}
+
+static int __cpuinit swap_slots_cpu_callback(struct notifier_block *nfb,
+					     unsigned long action, void *hcpu)
+{
+	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN)
+		drain_slots_cache_cpu((long)hcpu);
+	return NOTIFY_OK;
+}
+
+static int __init swap_slots_init(void)
+{
+	unsigned int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct swap_slots_cache *cache = &per_cpu(swp_slots, cpu);
+
+		mutex_init(&cache->alloc_lock);
+		spin_lock_init(&cache->free_lock);
+	}
+	hotcpu_notifier(swap_slots_cpu_callback, 0);
+	swap_slots_cache_enabled = true;
+	return 0;
+}
+module_init(swap_slots_init)
@@ -19,6 +19,7 @@
 #include <linux/pagevec.h>
 #include <linux/migrate.h>
 #include <linux/page_cgroup.h>
+#include <linux/pfn.h>
 
 #include <asm/pgtable.h>
 
@@ -254,37 +255,93 @@ void free_pages_and_swap_cache(struct page **pages, int nr)
 	}
 }
 
+/*
+ * With VMA based readahead, every VMA remembers the address of its last
+ * swap fault, the size of the readahead window then, and the number of
+ * readahead pages used since, packed in its swap_readahead_info.
+ */
+#define SWAP_RA_WIN_SHIFT	(PAGE_SHIFT / 2)
+#define SWAP_RA_HITS_MASK	((1UL << SWAP_RA_WIN_SHIFT) - 1)
+#define SWAP_RA_HITS_MAX	SWAP_RA_HITS_MASK
+#define SWAP_RA_WIN_MASK	(~PAGE_MASK & ~SWAP_RA_HITS_MASK)
+
+#define SWAP_RA_HITS(v)		((v) & SWAP_RA_HITS_MASK)
+#define SWAP_RA_WIN(v)		(((v) & SWAP_RA_WIN_MASK) >> SWAP_RA_WIN_SHIFT)
+#define SWAP_RA_ADDR(v)		((v) & PAGE_MASK)
+
+#define SWAP_RA_VAL(addr, win, hits)				\
+	(((addr) & PAGE_MASK) |					\
+	 (((win) << SWAP_RA_WIN_SHIFT) & SWAP_RA_WIN_MASK) |	\
+	 ((hits) & SWAP_RA_HITS_MASK))
+
+/* Upper bound on the window, whatever page_cluster says */
+#define SWAP_RA_ORDER_CEILING	5
+
+int sysctl_swap_vma_readahead __read_mostly = 1;
+
+/*
+ * Reading ahead by virtual address scatters the reads over the swap
+ * area, which only pays off when no swap device has to seek.
+ */
+static bool swap_use_vma_readahead(void)
+{
+	return sysctl_swap_vma_readahead && !atomic_read(&nr_rotate_swap);
+}
+
 /*
  * Lookup a swap entry in the swap cache. A found page will be returned
  * unlocked and with its refcount incremented - we rely on the kernel
  * lock getting page table operations atomic even if we drop the page
  * lock before returning.
+ *
+ * @vma and @addr, if given, are those of the fault the page is looked
+ * up for: readahead pages found that way count as hits of the VMA.
  */
-struct page * lookup_swap_cache(swp_entry_t entry)
+struct page *lookup_swap_cache(swp_entry_t entry, struct vm_area_struct *vma,
+			       unsigned long addr)
 {
 	struct page *page;
 
 	page = find_get_page(&swapper_space, entry.val);
 
-	if (page)
+	if (page) {
 		INC_CACHE_INFO(find_success);
+		if (TestClearPageReadahead(page)) {
+			count_vm_event(SWAP_RA_HIT);
+			if (vma && swap_use_vma_readahead()) {
+				unsigned long ra_val;
+				unsigned int hits;
+
+				ra_val = atomic_long_read(&vma->swap_readahead_info);
+				hits = SWAP_RA_HITS(ra_val);
+				if (hits < SWAP_RA_HITS_MAX)
+					hits++;
+				atomic_long_set(&vma->swap_readahead_info,
+					SWAP_RA_VAL(addr, SWAP_RA_WIN(ra_val), hits));
+			}
+		}
+	}
 
 	INC_CACHE_INFO(find_total);
 	return page;
 }
 
-/* 
+/*
  * Locate a page of swap in physical memory, reserving swap cache space
- * and reading the disk if it is not already cached.
+ * for a new, locked page if it is not already cached. The caller fills
+ * the new page, *new_page_allocated tells it which case it got.
  * A failure return means that either the page allocation failed or that
  * the swap entry is no longer in use.
  */
-struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
-			struct vm_area_struct *vma, unsigned long addr)
+struct page *__read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr,
+			bool *new_page_allocated)
 {
 	struct page *found_page, *new_page = NULL;
 	int err;
 
+	*new_page_allocated = false;
+
 	do {
 		/*
 		 * First check the swap cache.  Since this is normally
@@ -317,6 +374,14 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 		err = swapcache_prepare(entry);
 		if (err == -EEXIST) {	/* seems racy */
 			radix_tree_preload_end();
+			/*
+			 * Without any reference, the entry is being freed,
+			 * or only just allocated to a page: nobody can want
+			 * its data, and it may be a while before the cache
+			 * flag goes, as freed slots are given back in batch.
+			 */
+			if (!__swap_count(entry))
+				break;
 			continue;
 		}
 		if (err) {		/* swp entry is obsolete ? */
@@ -330,11 +395,8 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 		err = __add_to_swap_cache(new_page, entry);
 		if (likely(!err)) {
 			radix_tree_preload_end();
-			/*
-			 * Initiate read into locked page and return.
-			 */
 			lru_cache_add_anon(new_page);
-			swap_readpage(new_page);
+			*new_page_allocated = true;
 			return new_page;
 		}
 		radix_tree_preload_end();
@@ -352,8 +414,55 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
 	return found_page;
 }
 
+/*
+ * Locate a page of swap in physical memory, reserving swap cache space
+ * and reading the disk if it is not already cached.
+ * A failure return means that either the page allocation failed or that
+ * the swap entry is no longer in use.
+ */
+struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr)
+{
+	bool page_was_allocated;
+	struct page *page = __read_swap_cache_async(entry, gfp_mask,
+					vma, addr, &page_was_allocated);
+
+	/*
+	 * Initiate read into locked page and return.
+	 */
+	if (page_was_allocated)
+		swap_readpage(page);
+	return page;
+}
+
+/*
+ * Start reading a page of a readahead window.  All but the page of the
+ * fault itself are marked, so that lookup_swap_cache() can tell when
+ * they get used.
+ */
+static void swap_readahead_page(swp_entry_t entry, gfp_t gfp_mask,
+				struct vm_area_struct *vma, unsigned long addr,
+				bool readahead)
+{
+	bool page_was_allocated;
+	struct page *page;
+
+	page = __read_swap_cache_async(entry, gfp_mask, vma, addr,
+				       &page_was_allocated);
+	if (!page)
+		return;
+	if (page_was_allocated) {
+		if (readahead) {
+			SetPageReadahead(page);
+			count_vm_event(SWAP_RA);
+		}
+		swap_readpage(page);
+	}
+	page_cache_release(page);
+}
+
 /**
- * swapin_readahead - swap in pages in hope we need them soon
+ * swap_cluster_readahead - swap in pages in hope we need them soon
  * @entry: swap entry of this memory
  * @gfp_mask: memory allocation flags
  * @vma: user vma this address belongs to
@@ -371,11 +480,10 @@ struct page *read_swap_cache_async(swp_entry_t entry, gfp_t gfp_mask,
  *
  * Caller must hold down_read on the vma->vm_mm if vma is not NULL.
  */
-struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
+struct page *swap_cluster_readahead(swp_entry_t entry, gfp_t gfp_mask,
 			struct vm_area_struct *vma, unsigned long addr)
 {
 	int nr_pages;
-	struct page *page;
 	unsigned long offset;
 	unsigned long end_offset;
 
@@ -388,13 +496,141 @@ struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
 	 */
 	nr_pages = valid_swaphandles(entry, &offset);
 	for (end_offset = offset + nr_pages; offset < end_offset; offset++) {
-		/* Ok, do the async read-ahead now */
-		page = read_swap_cache_async(swp_entry(swp_type(entry), offset),
-						gfp_mask, vma, addr);
-		if (!page)
-			break;
-		page_cache_release(page);
+		/*
+		 * Ok, do the async read-ahead now.  Slots being freed fail,
+		 * but may well be followed by good ones.
+		 */
+		swap_readahead_page(swp_entry(swp_type(entry), offset),
+				    gfp_mask, vma, addr,
+				    offset != swp_offset(entry));
 	}
 	lru_add_drain();	/* Push any new pages onto the LRU now */
 	return read_swap_cache_async(entry, gfp_mask, vma, addr);
 }
+
+/*
+ * Size the readahead window of a fault from the hits of the previous
+ * window: grow it while its pages get used, shrink it by half at most
+ * at a time, and without any hit read ahead only for adjacent faults.
+ */
+static unsigned int swap_ra_window(unsigned long prev_pfn, unsigned long pfn,
+				   unsigned int hits, unsigned int prev_win,
+				   unsigned int max_win)
+{
+	unsigned int win;
+
+	if (!hits)
+		win = (pfn == prev_pfn + 1 || pfn + 1 == prev_pfn) ? 2 : 1;
+	else
+		win = max(roundup_pow_of_two(hits + 2), 4UL);
+	win = max(win, prev_win / 2);
+	return min(win, max_win);
+}
+
+/**
+ * swap_vma_readahead - swap in the pages around a fault in hope we need them
+ * @fentry: swap entry of the faulting address
+ * @gfp_mask: memory allocation flags
+ * @vma: vma of the fault
+ * @faddr: faulting address
+ *
+ * Unlike swap_cluster_readahead(), this reads the swap entries found in
+ * the page tables around the fault, rather than those around its entry
+ * in the swap area, which belong to whichever process was swapped out at
+ * the same time.  The window stays within the vma and the page table of
+ * the fault, follows the direction of consecutive faults, and is sized
+ * by swap_ra_window().
+ *
+ * Caller must hold down_read on the vma->vm_mm.
+ */
+static struct page *swap_vma_readahead(swp_entry_t fentry, gfp_t gfp_mask,
+				       struct vm_area_struct *vma,
+				       unsigned long faddr)
+{
+	pte_t ptes[1 << SWAP_RA_ORDER_CEILING];
+	unsigned long ra_val, prev_pfn, fpfn, lpfn, rpfn, start, end, pfn;
+	unsigned int win, max_win;
+	pgd_t *pgd;
+	pud_t *pud;
+	pmd_t *pmd;
+	pte_t *pte;
+	int i, nr;
+
+	max_win = 1 << min(page_cluster, SWAP_RA_ORDER_CEILING);
+	ra_val = atomic_long_read(&vma->swap_readahead_info);
+	prev_pfn = PFN_DOWN(SWAP_RA_ADDR(ra_val));
+	fpfn = PFN_DOWN(faddr);
+	win = swap_ra_window(prev_pfn, fpfn, SWAP_RA_HITS(ra_val),
+			     SWAP_RA_WIN(ra_val), max_win);
+	atomic_long_set(&vma->swap_readahead_info,
+			SWAP_RA_VAL(faddr, win, 0));
+	if (win == 1)
+		goto skip;
+
+	if (fpfn == prev_pfn + 1) {
+		lpfn = fpfn;
+		rpfn = fpfn + win;
+	} else if (fpfn + 1 == prev_pfn) {
+		lpfn = fpfn - min_t(unsigned long, fpfn, win - 1);
+		rpfn = fpfn + 1;
+	} else {
+		lpfn = fpfn - min_t(unsigned long, fpfn, (win - 1) / 2);
+		rpfn = lpfn + win;
+	}
+	start = max3(lpfn, PFN_DOWN(vma->vm_start), PFN_DOWN(faddr & PMD_MASK));
+	end = min3(rpfn, PFN_DOWN(vma->vm_end),
+		   PFN_DOWN((faddr & PMD_MASK) + PMD_SIZE));
+
+	pgd = pgd_offset(vma->vm_mm, faddr);
+	if (pgd_none(*pgd) || unlikely(pgd_bad(*pgd)))
+		goto skip;
+	pud = pud_offset(pgd, faddr);
+	if (pud_none(*pud) || unlikely(pud_bad(*pud)))
+		goto skip;
+	pmd = pmd_offset(pud, faddr);
+	if (pmd_none(*pmd) || pmd_trans_huge(*pmd) || unlikely(pmd_bad(*pmd)))
+		goto skip;
+
+	/* Copy the ptes out: the reads below may sleep */
+	nr = end - start;
+	pte = pte_offset_map(pmd, start << PAGE_SHIFT);
+	for (i = 0; i < nr; i++)
+		ptes[i] = pte[i];
+	pte_unmap(pte);
+
+	for (i = 0, pfn = start; i < nr; i++, pfn++) {
+		swp_entry_t entry;
+
+		if (!is_swap_pte(ptes[i]))
+			continue;
+		entry = pte_to_swp_entry(ptes[i]);
+		if (unlikely(non_swap_entry(entry)))
+			continue;
+		swap_readahead_page(entry, gfp_mask, vma, pfn << PAGE_SHIFT,
+				    pfn != fpfn);
+	}
+	lru_add_drain();	/* Push any new pages onto the LRU now */
+skip:
+	return read_swap_cache_async(fentry, gfp_mask, vma, faddr);
+}
+
+/**
+ * swapin_readahead - swap in pages in hope we need them soon
+ * @entry: swap entry of this memory
+ * @gfp_mask: memory allocation flags
+ * @vma: user vma this address belongs to
+ * @addr: target address for mempolicy
+ *
+ * Returns the struct page for entry and addr, after queueing swapin.
+ * Reads ahead by virtual address when the swap_vma_readahead sysctl is
+ * set and no swap device is rotational, by swap offset otherwise.
+ *
+ * Caller must hold down_read on the vma->vm_mm.
+ */
+struct page *swapin_readahead(swp_entry_t entry, gfp_t gfp_mask,
+			struct vm_area_struct *vma, unsigned long addr)
+{
+	if (swap_use_vma_readahead())
+		return swap_vma_readahead(entry, gfp_mask, vma, addr);
+	return swap_cluster_readahead(entry, gfp_mask, vma, addr);
+}
@@ -31,6 +31,7 @@
 #include <linux/syscalls.h>
 #include <linux/memcontrol.h>
 #include <linux/poll.h>
+#include <linux/zswap.h>
 
 #include <asm/pgtable.h>
 #include <asm/tlbflush.h>
@@ -46,6 +47,7 @@ static DEFINE_SPINLOCK(swap_lock);
 static unsigned int nr_swapfiles;
 long nr_swap_pages;
 long total_swap_pages;
+atomic_t nr_rotate_swap = ATOMIC_INIT(0);	/* swap areas that seek */
 static int least_priority;
 
 static const char Bad_file[] = "Bad swap file entry ";
@@ -179,6 +181,91 @@ static int wait_for_discard(void *word)
 #define SWAPFILE_CLUSTER	256
 #define LATENCY_LIMIT		256
 
+static void inc_cluster_info_page(struct swap_info_struct *si,
+				  unsigned long offset)
+{
+	struct swap_cluster_info *ci;
+
+	if (!si->cluster_info)
+		return;
+	ci = &si->cluster_info[offset / SWAPFILE_CLUSTER];
+	if (!ci->usage++)
+		list_del_init(&ci->list);
+}
+
+static void dec_cluster_info_page(struct swap_info_struct *si,
+				  unsigned long offset)
+{
+	struct swap_cluster_info *ci;
+
+	if (!si->cluster_info)
+		return;
+	ci = &si->cluster_info[offset / SWAPFILE_CLUSTER];
+	VM_BUG_ON(!ci->usage);
+	if (!--ci->usage)
+		list_add_tail(&ci->list, &si->free_clusters);
+}
+
+/*
+ * Take the next free slot of this CPU's cluster, moving on to a cluster
+ * from the free list once it is used up.  Returns false when there is no
+ * free cluster left: the caller then falls back to first-free allocation.
+ * Called with swap_lock held; it is dropped while discarding a cluster.
+ */
+static bool scan_swap_map_try_ssd_cluster(struct swap_info_struct *si,
+					  unsigned long *offset)
+{
+	struct percpu_cluster *cluster;
+	struct swap_cluster_info *ci;
+	unsigned long tmp, end;
+
+new_cluster:
+	cluster = this_cpu_ptr(si->percpu_cluster);
+	if (cluster->index == CLUSTER_NONE) {
+		if (list_empty(&si->free_clusters))
+			return false;
+		ci = list_first_entry(&si->free_clusters,
+				      struct swap_cluster_info, list);
+		list_del_init(&ci->list);
+		tmp = (ci - si->cluster_info) * SWAPFILE_CLUSTER;
+
+		if (si->flags & SWP_DISCARDABLE) {
+			/*
+			 * Discard the old data of the whole cluster before
+			 * using it.  Mark its slots bad meanwhile, so that
+			 * first-free allocations leave them alone.
+			 */
+			memset(si->swap_map + tmp, SWAP_MAP_BAD,
+			       SWAPFILE_CLUSTER);
+			spin_unlock(&swap_lock);
+			discard_swap_cluster(si, tmp, SWAPFILE_CLUSTER);
+			spin_lock(&swap_lock);
+			memset(si->swap_map + tmp, 0, SWAPFILE_CLUSTER);
+			/* We may be running on another CPU by now */
+			cluster = this_cpu_ptr(si->percpu_cluster);
+		}
+		cluster->index = ci - si->cluster_info;
+		cluster->next = tmp;
+	}
+
+	/*
+	 * Other CPUs take slots from our cluster when they ran out of free
+	 * clusters, and slots we allocated may still be in use: skip them.
+	 */
+	tmp = cluster->next;
+	end = min_t(unsigned long, si->max,
+		    (unsigned long)(cluster->index + 1) * SWAPFILE_CLUSTER);
+	while (tmp < end && si->swap_map[tmp])
+		tmp++;
+	if (tmp >= end) {
+		cluster->index = CLUSTER_NONE;
+		goto new_cluster;
+	}
+	cluster->next = tmp + 1;
+	*offset = tmp;
+	return true;
+}
+
 static unsigned long scan_swap_map(struct swap_info_struct *si,
 				   unsigned char usage)
 {
@@ -200,6 +287,18 @@ static unsigned long scan_swap_map(struct swap_info_struct *si,
 	 */
 
 	si->flags += SWP_SCANNING;
+
+	/*
+	 * Solid state devices allocate from per-cpu clusters instead,
+	 * and only fall back to first-free once all clusters are in use.
+	 */
+	if (si->cluster_info) {
+		if (!scan_swap_map_try_ssd_cluster(si, &offset))
+			offset = si->cluster_next;
+		scan_base = offset;
+		goto checks;
+	}
+
 	scan_base = offset = si->cluster_next;
 
 	if (unlikely(!si->cluster_nr--)) {
@@ -312,6 +411,7 @@ checks:
 		si->highest_bit = 0;
 	}
 	si->swap_map[offset] = usage;
+	inc_cluster_info_page(si, offset);
 	si->cluster_next = offset + 1;
 	si->flags -= SWP_SCANNING;
 
@@ -408,17 +508,24 @@ no_page:
 	return 0;
 }
 
-swp_entry_t get_swap_page(void)
+/*
+ * Allocate up to @n swap slots for the swap cache into @entries, under a
+ * single hold of swap_lock: returns the number of slots allocated.
+ */
+int get_swap_pages(int n, swp_entry_t *entries)
 {
 	struct swap_info_struct *si;
 	pgoff_t offset;
 	int type, next;
 	int wrapped = 0;
+	int n_ret = 0;
 
 	spin_lock(&swap_lock);
 	if (nr_swap_pages <= 0)
 		goto noswap;
-	nr_swap_pages--;
+	if (n > nr_swap_pages)
+		n = nr_swap_pages;
+	nr_swap_pages -= n;
 
 	for (type = swap_list.next; type >= 0 && wrapped < 2; type = next) {
 		si = swap_info[type];
@@ -436,18 +543,21 @@ swp_entry_t get_swap_page(void)
 
 		swap_list.next = next;
 		/* This is called for allocating swap entry for cache */
-		offset = scan_swap_map(si, SWAP_HAS_CACHE);
-		if (offset) {
-			spin_unlock(&swap_lock);
-			return swp_entry(type, offset);
+		while (n_ret < n) {
+			offset = scan_swap_map(si, SWAP_HAS_CACHE);
+			if (!offset)
+				break;
+			entries[n_ret++] = swp_entry(type, offset);
 		}
+		if (n_ret == n)
+			break;
 		next = swap_list.next;
 	}
 
-	nr_swap_pages++;
+	nr_swap_pages += n - n_ret;
 noswap:
 	spin_unlock(&swap_lock);
-	return (swp_entry_t) {0};
+	return n_ret;
 }
 
 /* The only caller of this function is now susupend routine */
@@ -542,28 +652,77 @@ static unsigned char swap_entry_free(struct swap_info_struct *p,
 		mem_cgroup_uncharge_swap(entry);
 
 	usage = count | has_cache;
-	p->swap_map[offset] = usage;
-
-	/* free if no reference */
-	if (!usage) {
-		struct gendisk *disk = p->bdev->bd_disk;
-		if (offset < p->lowest_bit)
-			p->lowest_bit = offset;
-		if (offset > p->highest_bit)
-			p->highest_bit = offset;
-		if (swap_list.next >= 0 &&
-		    p->prio > swap_info[swap_list.next]->prio)
-			swap_list.next = p->type;
-		nr_swap_pages++;
-		p->inuse_pages--;
-		if ((p->flags & SWP_BLKDEV) &&
-				disk->fops->swap_slot_free_notify)
-			disk->fops->swap_slot_free_notify(p->bdev, offset);
-	}
+	/*
+	 * Without any reference left, the slot stays marked SWAP_HAS_CACHE
+	 * until the caller has dropped swap_lock and passed it on to
+	 * free_swap_slot(), which gives it back in batch.
+	 */
+	p->swap_map[offset] = usage ? usage : SWAP_HAS_CACHE;
 
 	return usage;
 }
 
+static void swap_entry_notify_free(struct swap_info_struct *p,
+				   unsigned long offset)
+{
+	struct gendisk *disk = p->bdev->bd_disk;
+
+	zswap_invalidate_page(p->type, offset);
+	if ((p->flags & SWP_BLKDEV) && disk->fops->swap_slot_free_notify)
+		disk->fops->swap_slot_free_notify(p->bdev, offset);
+}
+
+static void swap_range_free(struct swap_info_struct *p, unsigned long offset)
+{
+	VM_BUG_ON(p->swap_map[offset] != SWAP_HAS_CACHE);
+	p->swap_map[offset] = 0;
+	dec_cluster_info_page(p, offset);
+	if (offset < p->lowest_bit)
+		p->lowest_bit = offset;
+	if (offset > p->highest_bit)
+		p->highest_bit = offset;
+	if (swap_list.next >= 0 &&
+	    p->prio > swap_info[swap_list.next]->prio)
+		swap_list.next = p->type;
+	nr_swap_pages++;
+	p->inuse_pages--;
+}
+
+/**
+ * swapcache_free_entries - give back swap slots without reference
+ * @entries: the slots, marked SWAP_HAS_CACHE by swap_entry_free()
+ * @n: number of slots
+ *
+ * The compressed copies and the block device are told first, without
+ * swap_lock, and then all the slots are released under a single hold
+ * of it.
+ */
+void swapcache_free_entries(swp_entry_t *entries, int n)
+{
+	int i;
+
+	for (i = 0; i < n; i++)
+		swap_entry_notify_free(swap_info[swp_type(entries[i])],
+				       swp_offset(entries[i]));
+
+	spin_lock(&swap_lock);
+	for (i = 0; i < n; i++)
+		swap_range_free(swap_info[swp_type(entries[i])],
+				swp_offset(entries[i]));
+	spin_unlock(&swap_lock);
+}
+
+/*
+ * Swap count of an entry, not counting the swap cache.  Read without
+ * swap_lock: only a hint, for callers that can cope with a stale one.
+ */
+int __swap_count(swp_entry_t entry)
+{
+	struct swap_info_struct *p = swap_info[swp_type(entry)];
+
+	return swap_count(p->swap_map[swp_offset(entry)]);
+}
+
 /*
  * Caller has made sure that the swapdevice corresponding to entry
  * is still around or has not been recycled.
@@ -574,7 +733,11 @@ void swap_free(swp_entry_t entry)
 
 	p = swap_info_get(entry);
 	if (p) {
-		swap_entry_free(p, entry, 1);
+		if (!swap_entry_free(p, entry, 1)) {
+			spin_unlock(&swap_lock);
+			free_swap_slot(entry);
+			return;
+		}
 		spin_unlock(&swap_lock);
 	}
 }
@@ -593,6 +756,8 @@ void swapcache_free(swp_entry_t entry, struct page *page)
 		if (page)
 			mem_cgroup_uncharge_swapcache(page, entry, count != 0);
 		spin_unlock(&swap_lock);
+		if (!count)
+			free_swap_slot(entry);
 	}
 }
 
@@ -692,7 +857,9 @@ int free_swap_and_cache(swp_entry_t entry)
 
 	p = swap_info_get(entry);
 	if (p) {
-		if (swap_entry_free(p, entry, 1) == SWAP_HAS_CACHE) {
+		unsigned char count = swap_entry_free(p, entry, 1);
+
+		if (count == SWAP_HAS_CACHE) {
 			page = find_get_page(&swapper_space, entry.val);
 			if (page && !trylock_page(page)) {
 				page_cache_release(page);
@@ -700,6 +867,8 @@ int free_swap_and_cache(swp_entry_t entry)
 			}
 		}
 		spin_unlock(&swap_lock);
+		if (!count)
+			free_swap_slot(entry);
 	}
 	if (page) {
 		/*
@@ -814,6 +983,25 @@ sector_t swapdev_block(int type, pgoff_t offset)
 	return map_swap_entry(swp_entry(type, offset), &bdev);
 }
 
+/*
+ * Whether pages may still be written to the swap area of given type: not
+ * once swapoff has started on it. For writers which do not come through
+ * get_swap_page(), like zswap writeback.
+ */
+bool swap_area_writeok(int type)
+{
+	struct swap_info_struct *si;
+	bool ret = false;
+
+	spin_lock(&swap_lock);
+	if ((unsigned int)type < nr_swapfiles) {
+		si = swap_info[type];
+		ret = si->flags & SWP_WRITEOK;
+	}
+	spin_unlock(&swap_lock);
+	return ret;
+}
+
 /*
  * Return either the total number of swap pages of given type, or the number
  * of free pages of that type (depending on @free)
@@ -1112,9 +1300,11 @@ static int try_to_unuse(unsigned int type)
 			 * Either swap_duplicate() failed because entry
 			 * has been freed independently, and will not be
 			 * reused since sys_swapoff() already disabled
-			 * allocation from here, or alloc_page() failed.
+			 * allocation from here, or the entry is held by
+			 * nothing but a racing swap cache insertion or
+			 * release, or alloc_page() failed.
 			 */
-			if (!*swap_map)
+			if (!swap_count(*swap_map))
 				continue;
 			retval = -ENOMEM;
 			break;
@@ -1551,6 +1741,8 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 {
 	struct swap_info_struct *p = NULL;
 	unsigned char *swap_map;
+	struct swap_cluster_info *cluster_info;
+	struct percpu_cluster __percpu *percpu_cluster;
 	struct file *swap_file, *victim;
 	struct address_space *mapping;
 	struct inode *inode;
@@ -1613,9 +1805,15 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	p->flags &= ~SWP_WRITEOK;
 	spin_unlock(&swap_lock);
 
+	/*
+	 * Slots parked in the per-cpu caches are neither free nor in use
+	 * by a page: give them all back and bypass the caches meanwhile.
+	 */
+	disable_swap_slots_cache_lock();
 	current->flags |= PF_OOM_ORIGIN;
 	err = try_to_unuse(type);
 	current->flags &= ~PF_OOM_ORIGIN;
+	reenable_swap_slots_cache_unlock();
 
 	if (err) {
 		/*
@@ -1629,6 +1827,8 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 		goto out_dput;
 	}
 
+	if (!(p->flags & SWP_SOLIDSTATE))
+		atomic_dec(&nr_rotate_swap);
 	destroy_swap_extents(p);
 	if (p->flags & SWP_CONTINUED)
 		free_swap_count_continuations(p);
@@ -1650,10 +1850,17 @@ SYSCALL_DEFINE1(swapoff, const char __user *, specialfile)
 	p->max = 0;
 	swap_map = p->swap_map;
 	p->swap_map = NULL;
+	cluster_info = p->cluster_info;
+	p->cluster_info = NULL;
+	percpu_cluster = p->percpu_cluster;
+	p->percpu_cluster = NULL;
 	p->flags = 0;
 	spin_unlock(&swap_lock);
 	mutex_unlock(&swapon_mutex);
 	vfree(swap_map);
+	vfree(cluster_info);
+	free_percpu(percpu_cluster);
+	zswap_invalidate_area(type);
 	/* Destroy swap account informatin */
 	swap_cgroup_swapoff(type);
 
@@ -2012,6 +2219,43 @@ static int setup_swap_map_and_extents(struct swap_info_struct *p,
 	return nr_extents;
 }
 
+/*
+ * Set up the per-cpu cluster allocation of a solid state device, once
+ * its swap_map is complete.
+ */
+static int setup_cluster_info(struct swap_info_struct *p,
+			      unsigned char *swap_map)
+{
+	unsigned long nr_clusters = DIV_ROUND_UP(p->max, SWAPFILE_CLUSTER);
+	struct swap_cluster_info *ci;
+	unsigned long i;
+	int cpu;
+
+	p->cluster_info = vzalloc(nr_clusters * sizeof(*ci));
+	p->percpu_cluster = alloc_percpu(struct percpu_cluster);
+	if (!p->cluster_info || !p->percpu_cluster)
+		return -ENOMEM;
+
+	for_each_possible_cpu(cpu)
+		per_cpu_ptr(p->percpu_cluster, cpu)->index = CLUSTER_NONE;
+
+	INIT_LIST_HEAD(&p->free_clusters);
+	for (i = 0; i < nr_clusters * SWAPFILE_CLUSTER; i++) {
+		ci = &p->cluster_info[i / SWAPFILE_CLUSTER];
+		if (i % SWAPFILE_CLUSTER == 0)
+			INIT_LIST_HEAD(&ci->list);
+		/* The tail of the last cluster counts as always in use */
+		if (i >= p->max || swap_map[i])
+			ci->usage++;
+	}
+	for (i = 0; i < nr_clusters; i++) {
+		ci = &p->cluster_info[i];
+		if (!ci->usage)
+			list_add_tail(&ci->list, &p->free_clusters);
+	}
+	return 0;
+}
+
 SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 {
 	struct swap_info_struct *p;
@@ -2116,6 +2360,15 @@ SYSCALL_DEFINE2(swapon, const char __user *, specialfile, int, swap_flags)
 			p->flags |= SWP_DISCARDABLE;
 	}
 
+	if (p->flags & SWP_SOLIDSTATE) {
+		error = setup_cluster_info(p, swap_map);
+		if (error)
+			goto bad_swap;
+	} else
+		atomic_inc(&nr_rotate_swap);
+
+	zswap_init_area(p->type);
+
 	mutex_lock(&swapon_mutex);
 	prio = -1;
 	if (swap_flags & SWAP_FLAG_PREFER)
@@ -2150,6 +2403,10 @@ bad_swap:
 	p->flags = 0;
 	spin_unlock(&swap_lock);
 	vfree(swap_map);
+	vfree(p->cluster_info);
+	p->cluster_info = NULL;
+	free_percpu(p->percpu_cluster);
+	p->percpu_cluster = NULL;
 	if (swap_file) {
 		if (inode && S_ISREG(inode->i_mode)) {
 			mutex_unlock(&inode->i_mutex);
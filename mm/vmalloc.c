@@ -254,6 +254,8 @@ struct vmap_area {
 	unsigned long va_end;
 	unsigned long flags;
 	struct rb_node rb_node;		/* address sorted rbtree */
+	unsigned long hole;		/* free space below va_start */
+	unsigned long subtree_hole;	/* largest hole in the subtree */
 	struct list_head list;		/* address sorted list */
 	struct list_head purge_list;	/* "lazy purge" list */
 	void *private;
@@ -264,14 +266,100 @@ static DEFINE_SPINLOCK(vmap_area_lock);
 static LIST_HEAD(vmap_area_list);
 static struct rb_root vmap_area_root = RB_ROOT;
 
-/* The vmap cache globals are protected by vmap_area_lock */
-static struct rb_node *free_vmap_cache;
-static unsigned long cached_hole_size;
-static unsigned long cached_vstart;
-static unsigned long cached_align;
-
 static unsigned long vmap_area_pcpu_hole;
 
+/*
+ * Areas freed lazily, waiting for the next purge to flush the TLB.
+ */
+static DEFINE_SPINLOCK(vmap_lazy_lock);
+static LIST_HEAD(vmap_lazy_list);
+
+/*
+ * Per cpu caches of small areas handed back by the lazy purge. Their
+ * TLB entries are flushed and their page tables are still populated,
+ * so they can be reused for an allocation of the same size without
+ * vmap_area_lock or a tree search. They stay in the tree while cached.
+ */
+#define VMAP_CACHE_MAX_PAGES	16
+#define VMAP_CACHE_SIZE		8
+
+struct vmap_area_cache {
+	spinlock_t lock;
+	unsigned int nr;
+	struct vmap_area *areas[VMAP_CACHE_SIZE];
+};
+
+static DEFINE_PER_CPU(struct vmap_area_cache, vmap_area_cache);
+
+static struct vmap_area *vmap_cache_get(unsigned long size,
+				unsigned long align,
+				unsigned long vstart, unsigned long vend)
+{
+	struct vmap_area_cache *vc;
+	struct vmap_area *va = NULL;
+	int i;
+
+	if (size > VMAP_CACHE_MAX_PAGES << PAGE_SHIFT)
+		return NULL;
+
+	vc = &get_cpu_var(vmap_area_cache);
+	spin_lock(&vc->lock);
+	for (i = vc->nr - 1; i >= 0; i--) {
+		struct vmap_area *tmp = vc->areas[i];
+
+		if (tmp->va_end - tmp->va_start == size &&
+		    tmp->va_start >= vstart && tmp->va_end <= vend &&
+		    !(tmp->va_start & (align - 1))) {
+			va = tmp;
+			vc->areas[i] = vc->areas[--vc->nr];
+			break;
+		}
+	}
+	spin_unlock(&vc->lock);
+	put_cpu_var(vmap_area_cache);
+
+	return va;
+}
+
+static bool vmap_cache_put(struct vmap_area *va)
+{
+	struct vmap_area_cache *vc;
+	bool cached = false;
+
+	if (va->va_end - va->va_start > VMAP_CACHE_MAX_PAGES << PAGE_SHIFT)
+		return false;
+
+	vc = &get_cpu_var(vmap_area_cache);
+	spin_lock(&vc->lock);
+	if (vc->nr < VMAP_CACHE_SIZE) {
+		va->flags = 0;
+		va->private = NULL;
+		vc->areas[vc->nr++] = va;
+		cached = true;
+	}
+	spin_unlock(&vc->lock);
+	put_cpu_var(vmap_area_cache);
+
+	return cached;
+}
+
+/*
+ * Take the areas out of all the caches, for freeing them into the tree.
+ */
+static void vmap_cache_drain(struct list_head *list)
+{
+	int cpu;
+
+	for_each_possible_cpu(cpu) {
+		struct vmap_area_cache *vc = &per_cpu(vmap_area_cache, cpu);
+
+		spin_lock(&vc->lock);
+		while (vc->nr)
+			list_add_tail(&vc->areas[--vc->nr]->purge_list, list);
+		spin_unlock(&vc->lock);
+	}
+}
+
 static struct vmap_area *__find_vmap_area(unsigned long addr)
 {
 	struct rb_node *n = vmap_area_root.rb_node;
@@ -291,11 +379,43 @@ static struct vmap_area *__find_vmap_area(unsigned long addr)
 	return NULL;
 }
 
+/*
+ * Every node of the tree records the hole between its area and the
+ * previous one, and the largest such hole in its subtree, so that the
+ * allocator can descend straight to the lowest hole that is big enough.
+ */
+static unsigned long vmap_subtree_hole(struct rb_node *n)
+{
+	return n ? rb_entry(n, struct vmap_area, rb_node)->subtree_hole : 0;
+}
+
+static void vmap_area_augment_cb(struct rb_node *n, void *unused)
+{
+	struct vmap_area *va = rb_entry(n, struct vmap_area, rb_node);
+
+	va->subtree_hole = max3(va->hole, vmap_subtree_hole(n->rb_left),
+				vmap_subtree_hole(n->rb_right));
+}
+
+/*
+ * The hole below an area changes with its predecessor: recompute it and
+ * propagate it up to the root.
+ */
+static void vmap_area_update_hole(struct rb_node *n, unsigned long prev_end)
+{
+	struct vmap_area *va = rb_entry(n, struct vmap_area, rb_node);
+
+	va->hole = va->va_start - prev_end;
+	for (; n; n = rb_parent(n))
+		vmap_area_augment_cb(n, NULL);
+}
+
 static void __insert_vmap_area(struct vmap_area *va)
 {
 	struct rb_node **p = &vmap_area_root.rb_node;
 	struct rb_node *parent = NULL;
 	struct rb_node *tmp;
+	struct vmap_area *prev = NULL;
 
 	while (*p) {
 		struct vmap_area *tmp_va;
@@ -311,18 +431,109 @@ static void __insert_vmap_area(struct vmap_area *va)
 	}
 
 	rb_link_node(&va->rb_node, parent, p);
+	tmp = rb_prev(&va->rb_node);
+	if (tmp)
+		prev = rb_entry(tmp, struct vmap_area, rb_node);
+	va->hole = va->va_start - (prev ? prev->va_end : 0);
+	va->subtree_hole = va->hole;
 	rb_insert_color(&va->rb_node, &vmap_area_root);
+	rb_augment_insert(&va->rb_node, vmap_area_augment_cb, NULL);
+
+	tmp = rb_next(&va->rb_node);
+	if (tmp)
+		vmap_area_update_hole(tmp, va->va_end);
 
 	/* address-sort this list so it is usable like the vmlist */
-	tmp = rb_prev(&va->rb_node);
-	if (tmp) {
-		struct vmap_area *prev;
-		prev = rb_entry(tmp, struct vmap_area, rb_node);
+	if (prev)
 		list_add_rcu(&va->list, &prev->list);
-	} else
+	else
 		list_add_rcu(&va->list, &vmap_area_list);
 }
 
+/*
+ * Can [addr, addr + size) go into the hole below @va? Like between any
+ * two areas, a guard page is left on both sides.
+ */
+static bool vmap_hole_fits(struct vmap_area *va, unsigned long size,
+			   unsigned long align, unsigned long vstart,
+			   unsigned long *addrp)
+{
+	unsigned long addr;
+
+	addr = ALIGN(va->va_start - va->hole + PAGE_SIZE, align);
+	addr = max(addr, ALIGN(vstart, align));
+	if (addr + size - 1 < addr || addr + size >= va->va_start)
+		return false;
+
+	*addrp = addr;
+	return true;
+}
+
+/*
+ * Find the lowest hole at or above vstart for size and align, in order,
+ * skipping the subtrees whose holes are all smaller than need. The walk
+ * is exact as long as need does not exceed the smallest hole that can
+ * fit the request, size plus the two guard pages.
+ */
+static struct vmap_area *__find_vmap_lowest_hole(unsigned long size,
+				unsigned long align, unsigned long vstart,
+				unsigned long need, unsigned long *addrp)
+{
+	struct rb_node *n = vmap_area_root.rb_node;
+
+	while (n) {
+		struct vmap_area *va = rb_entry(n, struct vmap_area, rb_node);
+		struct rb_node *child;
+
+		/* lower addresses first, if there is room down there */
+		if (va->va_start > vstart &&
+		    vmap_subtree_hole(n->rb_left) >= need) {
+			n = n->rb_left;
+			continue;
+		}
+
+		/* then this hole, the right subtree, and on up in order */
+		while (n) {
+			va = rb_entry(n, struct vmap_area, rb_node);
+			if (vmap_hole_fits(va, size, align, vstart, addrp))
+				return va;
+			if (vmap_subtree_hole(n->rb_right) >= need) {
+				n = n->rb_right;
+				break;
+			}
+			do {
+				child = n;
+				n = rb_parent(n);
+			} while (n && n->rb_right == child);
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * The subtree hole sizes cannot tell where a larger alignment falls, so
+ * first look for a hole large enough for the worst case, which skips the
+ * most subtrees and finds one in O(log n). Only if there is none, walk
+ * all the holes that could fit the request once aligned.
+ */
+static struct vmap_area *find_vmap_lowest_hole(unsigned long size,
+				unsigned long align, unsigned long vstart,
+				unsigned long *addrp)
+{
+	unsigned long need = size + 2 * PAGE_SIZE;
+	struct vmap_area *va;
+
+	if (align <= PAGE_SIZE)
+		return __find_vmap_lowest_hole(size, align, vstart, need, addrp);
+
+	va = __find_vmap_lowest_hole(size, align, vstart,
+				     need - PAGE_SIZE + align, addrp);
+	if (!va)
+		va = __find_vmap_lowest_hole(size, align, vstart, need, addrp);
+	return va;
+}
+
 static void purge_vmap_area_lazy(void);
 
 /*
@@ -344,6 +555,10 @@ static struct vmap_area *alloc_vmap_area(unsigned long size,
 	BUG_ON(size & ~PAGE_MASK);
 	BUG_ON(!is_power_of_2(align));
 
+	va = vmap_cache_get(size, align, vstart, vend);
+	if (va)
+		return va;
+
 	va = kmalloc_node(sizeof(struct vmap_area),
 			gfp_mask & GFP_RECLAIM_MASK, node);
 	if (unlikely(!va))
@@ -351,76 +566,19 @@ static struct vmap_area *alloc_vmap_area(unsigned long size,
 
 retry:
 	spin_lock(&vmap_area_lock);
-	/*
-	 * Invalidate cache if we have more permissive parameters.
-	 * cached_hole_size notes the largest hole noticed _below_
-	 * the vmap_area cached in free_vmap_cache: if size fits
-	 * into that hole, we want to scan from vstart to reuse
-	 * the hole instead of allocating above free_vmap_cache.
-	 * Note that __free_vmap_area may update free_vmap_cache
-	 * without updating cached_hole_size or cached_align.
-	 */
-	if (!free_vmap_cache ||
-			size < cached_hole_size ||
-			vstart < cached_vstart ||
-			align < cached_align) {
-nocache:
-		cached_hole_size = 0;
-		free_vmap_cache = NULL;
-	}
-	/* record if we encounter less permissive parameters */
-	cached_vstart = vstart;
-	cached_align = align;
-
-	/* find starting point for our search */
-	if (free_vmap_cache) {
-		first = rb_entry(free_vmap_cache, struct vmap_area, rb_node);
-		addr = ALIGN(first->va_end + PAGE_SIZE, align);
-		if (addr < vstart)
-			goto nocache;
-		if (addr + size - 1 < addr)
-			goto overflow;
-
-	} else {
+	first = find_vmap_lowest_hole(size, align, vstart, &addr);
+	if (!first) {
+		/* nothing below the last area, try above it */
 		addr = ALIGN(vstart, align);
-		if (addr + size - 1 < addr)
-			goto overflow;
-
-		n = vmap_area_root.rb_node;
-		first = NULL;
-
-		while (n) {
-			struct vmap_area *tmp;
-			tmp = rb_entry(n, struct vmap_area, rb_node);
-			if (tmp->va_end >= addr) {
-				first = tmp;
-				if (tmp->va_start <= addr)
-					break;
-				n = n->rb_left;
-			} else
-				n = n->rb_right;
+		n = rb_last(&vmap_area_root);
+		if (n) {
+			first = rb_entry(n, struct vmap_area, rb_node);
+			addr = max(addr, ALIGN(first->va_end + PAGE_SIZE, align));
 		}
-
-		if (!first)
-			goto found;
-	}
-
-	/* from the starting point, walk areas until a suitable hole is found */
-	while (addr + size >= first->va_start && addr + size <= vend) {
-		if (addr + cached_hole_size < first->va_start)
-			cached_hole_size = first->va_start - addr;
-		addr = ALIGN(first->va_end + PAGE_SIZE, align);
 		if (addr + size - 1 < addr)
 			goto overflow;
-
-		n = rb_next(&first->rb_node);
-		if (n)
-			first = rb_entry(n, struct vmap_area, rb_node);
-		else
-			goto found;
 	}
 
-found:
 	if (addr + size > vend)
 		goto overflow;
 
@@ -428,7 +586,6 @@ found:
 	va->va_end = addr + size;
 	va->flags = 0;
 	__insert_vmap_area(va);
-	free_vmap_cache = &va->rb_node;
 	spin_unlock(&vmap_area_lock);
 
 	BUG_ON(va->va_start & (align-1));
@@ -461,25 +618,19 @@ static void rcu_free_va(struct rcu_head *head)
 
 static void __free_vmap_area(struct vmap_area *va)
 {
+	struct rb_node *prev, *next, *deepest;
+
 	BUG_ON(RB_EMPTY_NODE(&va->rb_node));
 
-	if (free_vmap_cache) {
-		if (va->va_end < cached_vstart) {
-			free_vmap_cache = NULL;
-		} else {
-			struct vmap_area *cache;
-			cache = rb_entry(free_vmap_cache, struct vmap_area, rb_node);
-			if (va->va_start <= cache->va_start) {
-				free_vmap_cache = rb_prev(&va->rb_node);
-				/*
-				 * We don't try to update cached_hole_size or
-				 * cached_align, but it won't go very wrong.
-				 */
-			}
-		}
-	}
+	prev = rb_prev(&va->rb_node);
+	next = rb_next(&va->rb_node);
+	deepest = rb_augment_erase_begin(&va->rb_node);
 	rb_erase(&va->rb_node, &vmap_area_root);
+	rb_augment_erase_end(deepest, vmap_area_augment_cb, NULL);
 	RB_CLEAR_NODE(&va->rb_node);
+	if (next)
+		vmap_area_update_hole(next, prev ?
+			rb_entry(prev, struct vmap_area, rb_node)->va_end : 0);
 	list_del_rcu(&va->list);
 
 	/*
@@ -587,6 +738,7 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 {
 	static DEFINE_SPINLOCK(purge_lock);
 	LIST_HEAD(valist);
+	LIST_HEAD(freelist);
 	struct vmap_area *va;
 	struct vmap_area *n_va;
 	int nr = 0;
@@ -602,23 +754,24 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 	} else
 		spin_lock(&purge_lock);
 
-	if (sync)
+	if (sync) {
 		purge_fragmented_blocks_allcpus();
+		vmap_cache_drain(&freelist);
+	}
 
-	rcu_read_lock();
-	list_for_each_entry_rcu(va, &vmap_area_list, list) {
-		if (va->flags & VM_LAZY_FREE) {
-			if (va->va_start < *start)
-				*start = va->va_start;
-			if (va->va_end > *end)
-				*end = va->va_end;
-			nr += (va->va_end - va->va_start) >> PAGE_SHIFT;
-			list_add_tail(&va->purge_list, &valist);
-			va->flags |= VM_LAZY_FREEING;
-			va->flags &= ~VM_LAZY_FREE;
-		}
+	spin_lock(&vmap_lazy_lock);
+	list_splice_init(&vmap_lazy_list, &valist);
+	spin_unlock(&vmap_lazy_lock);
+
+	list_for_each_entry(va, &valist, purge_list) {
+		if (va->va_start < *start)
+			*start = va->va_start;
+		if (va->va_end > *end)
+			*end = va->va_end;
+		nr += (va->va_end - va->va_start) >> PAGE_SHIFT;
+		va->flags |= VM_LAZY_FREEING;
+		va->flags &= ~VM_LAZY_FREE;
 	}
-	rcu_read_unlock();
 
 	if (nr)
 		atomic_sub(nr, &vmap_lazy_nr);
@@ -626,9 +779,15 @@ static void __purge_vmap_area_lazy(unsigned long *start, unsigned long *end,
 	if (nr || force_flush)
 		flush_tlb_kernel_range(*start, *end);
 
-	if (nr) {
+	/* keep some of the small areas for reuse, unless space is short */
+	list_for_each_entry_safe(va, n_va, &valist, purge_list) {
+		if (sync || !vmap_cache_put(va))
+			list_move_tail(&va->purge_list, &freelist);
+	}
+
+	if (!list_empty(&freelist)) {
 		spin_lock(&vmap_area_lock);
-		list_for_each_entry_safe(va, n_va, &valist, purge_list)
+		list_for_each_entry_safe(va, n_va, &freelist, purge_list)
 			__free_vmap_area(va);
 		spin_unlock(&vmap_area_lock);
 	}
@@ -663,7 +822,10 @@ static void purge_vmap_area_lazy(void)
  */
 static void free_vmap_area_noflush(struct vmap_area *va)
 {
+	spin_lock(&vmap_lazy_lock);
 	va->flags |= VM_LAZY_FREE;
+	list_add_tail(&va->purge_list, &vmap_lazy_list);
+	spin_unlock(&vmap_lazy_lock);
 	atomic_add((va->va_end - va->va_start) >> PAGE_SHIFT, &vmap_lazy_nr);
 	if (unlikely(atomic_read(&vmap_lazy_nr) > lazy_max_pages()))
 		try_purge_vmap_area_lazy();
@@ -1168,6 +1330,7 @@ void __init vmalloc_init(void)
 		vbq = &per_cpu(vmap_block_queue, i);
 		spin_lock_init(&vbq->lock);
 		INIT_LIST_HEAD(&vbq->free);
+		spin_lock_init(&per_cpu(vmap_area_cache, i).lock);
 	}
 
 	/* Import existing vmlist entries. */
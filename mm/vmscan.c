@@ -515,6 +515,8 @@ static int __remove_mapping(struct address_space *mapping, struct page *page)
 
 		freepage = mapping->a_ops->freepage;
 
+		if (page_is_file_cache(page))
+			workingset_eviction(mapping, page);
 		__delete_from_page_cache(page);
 		spin_unlock_irq(&mapping->tree_lock);
 		mem_cgroup_uncharge_cache_page(page);
@@ -795,7 +797,7 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 		 * processes. Try to unmap it here.
 		 */
 		if (page_mapped(page) && mapping) {
-			switch (try_to_unmap(page, TTU_UNMAP)) {
+			switch (try_to_unmap(page, TTU_UNMAP|TTU_BATCH_FLUSH)) {
 			case SWAP_FAIL:
 				goto activate_locked;
 			case SWAP_AGAIN:
@@ -817,7 +819,12 @@ static unsigned long shrink_page_list(struct list_head *page_list,
 			if (!sc->may_writepage)
 				goto keep_locked;
 
-			/* Page is dirty, try to write it out here */
+			/*
+			 * Page is dirty, try to write it out here. Writes
+			 * through a TLB entry of a pte cleared above would
+			 * not dirty it again: flush them first.
+			 */
+			try_to_unmap_flush_dirty();
 			switch (pageout(page, mapping, sc)) {
 			case PAGE_KEEP:
 				nr_congested++;
@@ -910,6 +917,7 @@ free_it:
 cull_mlocked:
 		if (PageSwapCache(page))
 			try_to_free_swap(page);
+		try_to_unmap_flush_dirty();
 		unlock_page(page);
 		putback_lru_page(page);
 		reset_reclaim_mode(sc);
@@ -923,6 +931,8 @@ activate_locked:
 		SetPageActive(page);
 		pgactivate++;
 keep_locked:
+		/* writeback may start once unlocked, see pageout() above */
+		try_to_unmap_flush_dirty();
 		unlock_page(page);
 keep:
 		reset_reclaim_mode(sc);
@@ -940,6 +950,8 @@ keep_lumpy:
 	if (nr_dirty && nr_dirty == nr_congested && scanning_global_lru(sc))
 		zone_set_flag(zone, ZONE_CONGESTED);
 
+	/* no stale TLB entry may outlive the unmapped pages */
+	try_to_unmap_flush();
 	free_page_list(&free_pages);
 
 	list_splice(&ret_pages, page_list);
@@ -1000,7 +1012,7 @@ int __isolate_lru_page(struct page *page, int mode, int file)
 }
 
 /*
- * zone->lru_lock is heavily contended.  Some of the functions that
+ * The LRU locks are heavily contended.  Some of the functions that
  * shrink the lists perform better by taking out a batch of pages
  * and working on them outside the LRU lock.
  *
@@ -1091,6 +1103,14 @@ static unsigned long isolate_lru_pages(unsigned long nr_to_scan,
 			if (unlikely(page_zone_id(cursor_page) != zone_id))
 				break;
 
+			/*
+			 * Only the sub-list of the tag page is locked, which
+			 * covers its whole pageblock but not beyond.
+			 */
+			if (unlikely(page_zone_lru(cursor_page) !=
+				     page_zone_lru(page)))
+				break;
+
 			/*
 			 * If we don't have enough swap space, reclaiming of
 			 * anon page which don't already have a swap slot is
@@ -1134,7 +1154,7 @@ static unsigned long isolate_lru_pages(unsigned long nr_to_scan,
 static unsigned long isolate_pages_global(unsigned long nr,
 					struct list_head *dst,
 					unsigned long *scanned, int order,
-					int mode, struct zone *z,
+					int mode, struct zone_lru *zlru,
 					int active, int file)
 {
 	int lru = LRU_BASE;
@@ -1142,10 +1162,74 @@ static unsigned long isolate_pages_global(unsigned long nr,
 		lru += LRU_ACTIVE;
 	if (file)
 		lru += LRU_FILE;
-	return isolate_lru_pages(nr, &z->lru[lru].list, dst, scanned, order,
+	return isolate_lru_pages(nr, &zlru->list[lru], dst, scanned, order,
 								mode, file);
 }
 
+/*
+ * Global reclaim isolates each batch from one LRU sub-list of the zone,
+ * going round-robin over those that have pages on @lru, so that only one
+ * sub-list lock is held at a time and the pages are aged evenly.
+ */
+static struct zone_lru *zone_lru_scan_shard(struct zone *zone,
+					    enum lru_list lru)
+{
+	unsigned int start = zone->lru_scan_shard;
+	unsigned int i;
+
+	for (i = 0; i < LRU_SHARDS - 1; i++) {
+		if (!list_empty(&zone->lru[(start + i) % LRU_SHARDS].list[lru]))
+			break;
+	}
+	zone->lru_scan_shard = start + i + 1;
+	return &zone->lru[(start + i) % LRU_SHARDS];
+}
+
+/*
+ * Lock the LRU for isolating a batch of pages off @lru.  memcg reclaim
+ * walks the per-cgroup lists, which link pages of all the sub-lists of
+ * the zone, and so has to take all their locks: NULL is returned then.
+ */
+static struct zone_lru *lock_lru_for_scan(struct zone *zone,
+					  struct scan_control *sc,
+					  enum lru_list lru)
+{
+	struct zone_lru *zlru;
+
+	if (!scanning_global_lru(sc)) {
+		zone_lru_lock_all_irq(zone);
+		return NULL;
+	}
+	zlru = zone_lru_scan_shard(zone, lru);
+	spin_lock_irq(&zlru->lock);
+	return zlru;
+}
+
+static void unlock_lru_for_scan(struct zone *zone, struct zone_lru *zlru)
+{
+	if (zlru)
+		spin_unlock_irq(&zlru->lock);
+	else
+		zone_lru_unlock_all_irq(zone);
+}
+
+/*
+ * Pages going back to the LRU after reclaim may belong to any sub-list of
+ * the zone.  Switch from the lock held, if any, to the one of @page; the
+ * caller keeps interrupts disabled.
+ */
+static spinlock_t *relock_page_lru(spinlock_t *locked, struct page *page)
+{
+	spinlock_t *lru_lock = page_lru_lock(page);
+
+	if (lru_lock != locked) {
+		if (locked)
+			spin_unlock(locked);
+		spin_lock(lru_lock);
+	}
+	return lru_lock;
+}
+
 /*
  * clear_active_flags() is a helper for shrink_active_list(), clearing
  * any active bits from the pages in the list.
@@ -1203,8 +1287,9 @@ int isolate_lru_page(struct page *page)
 
 	if (PageLRU(page)) {
 		struct zone *zone = page_zone(page);
+		spinlock_t *lru_lock = page_lru_lock(page);
 
-		spin_lock_irq(&zone->lru_lock);
+		spin_lock_irq(lru_lock);
 		if (PageLRU(page) && get_page_unless_zero(page)) {
 			int lru = page_lru(page);
 			ret = 0;
@@ -1212,7 +1297,7 @@ int isolate_lru_page(struct page *page)
 
 			del_page_from_lru_list(zone, page, lru);
 		}
-		spin_unlock_irq(&zone->lru_lock);
+		spin_unlock_irq(lru_lock);
 	}
 	return ret;
 }
@@ -1244,6 +1329,8 @@ static int too_many_isolated(struct zone *zone, int file,
 
 /*
  * TODO: Try merging with migrations version of putback_lru_pages
+ *
+ * Called with interrupts disabled, which are enabled again on return.
  */
 static noinline_for_stack void
 putback_lru_pages(struct zone *zone, struct scan_control *sc,
@@ -1253,42 +1340,50 @@ putback_lru_pages(struct zone *zone, struct scan_control *sc,
 	struct page *page;
 	struct pagevec pvec;
 	struct zone_reclaim_stat *reclaim_stat = get_reclaim_stat(zone, sc);
+	spinlock_t *lru_lock = NULL;
 
 	pagevec_init(&pvec, 1);
 
 	/*
 	 * Put back any unfreeable pages.
 	 */
-	spin_lock(&zone->lru_lock);
 	while (!list_empty(page_list)) {
 		int lru;
 		page = lru_to_page(page_list);
 		VM_BUG_ON(PageLRU(page));
 		list_del(&page->lru);
 		if (unlikely(!page_evictable(page, NULL))) {
-			spin_unlock_irq(&zone->lru_lock);
+			if (lru_lock)
+				spin_unlock(lru_lock);
+			lru_lock = NULL;
+			local_irq_enable();
 			putback_lru_page(page);
-			spin_lock_irq(&zone->lru_lock);
+			local_irq_disable();
 			continue;
 		}
+		lru_lock = relock_page_lru(lru_lock, page);
 		SetPageLRU(page);
 		lru = page_lru(page);
 		add_page_to_lru_list(zone, page, lru);
 		if (is_active_lru(lru)) {
 			int file = is_file_lru(lru);
 			int numpages = hpage_nr_pages(page);
-			reclaim_stat->recent_rotated[file] += numpages;
+			atomic_long_add(numpages,
+					&reclaim_stat->recent_rotated[file]);
 		}
 		if (!pagevec_add(&pvec, page)) {
-			spin_unlock_irq(&zone->lru_lock);
+			spin_unlock_irq(lru_lock);
+			lru_lock = NULL;
 			__pagevec_release(&pvec);
-			spin_lock_irq(&zone->lru_lock);
+			local_irq_disable();
 		}
 	}
 	__mod_zone_page_state(zone, NR_ISOLATED_ANON, -nr_anon);
 	__mod_zone_page_state(zone, NR_ISOLATED_FILE, -nr_file);
 
-	spin_unlock_irq(&zone->lru_lock);
+	if (lru_lock)
+		spin_unlock(lru_lock);
+	local_irq_enable();
 	pagevec_release(&pvec);
 }
 
@@ -1319,8 +1414,8 @@ static noinline_for_stack void update_isolated_counts(struct zone *zone,
 	__mod_zone_page_state(zone, NR_ISOLATED_ANON, *nr_anon);
 	__mod_zone_page_state(zone, NR_ISOLATED_FILE, *nr_file);
 
-	reclaim_stat->recent_scanned[0] += *nr_anon;
-	reclaim_stat->recent_scanned[1] += *nr_file;
+	atomic_long_add(*nr_anon, &reclaim_stat->recent_scanned[0]);
+	atomic_long_add(*nr_file, &reclaim_stat->recent_scanned[1]);
 }
 
 /*
@@ -1378,6 +1473,7 @@ shrink_inactive_list(unsigned long nr_to_scan, struct zone *zone,
 	unsigned long nr_taken;
 	unsigned long nr_anon;
 	unsigned long nr_file;
+	struct zone_lru *zlru;
 
 	while (unlikely(too_many_isolated(zone, file, sc))) {
 		congestion_wait(BLK_RW_ASYNC, HZ/10);
@@ -1389,14 +1485,14 @@ shrink_inactive_list(unsigned long nr_to_scan, struct zone *zone,
 
 	set_reclaim_mode(priority, sc, false);
 	lru_add_drain();
-	spin_lock_irq(&zone->lru_lock);
+	zlru = lock_lru_for_scan(zone, sc, LRU_BASE + file * LRU_FILE);
 
 	if (scanning_global_lru(sc)) {
 		nr_taken = isolate_pages_global(nr_to_scan,
 			&page_list, &nr_scanned, sc->order,
 			sc->reclaim_mode & RECLAIM_MODE_LUMPYRECLAIM ?
 					ISOLATE_BOTH : ISOLATE_INACTIVE,
-			zone, 0, file);
+			zlru, 0, file);
 		zone->pages_scanned += nr_scanned;
 		if (current_is_kswapd())
 			__count_zone_vm_events(PGSCAN_KSWAPD, zone,
@@ -1418,13 +1514,13 @@ shrink_inactive_list(unsigned long nr_to_scan, struct zone *zone,
 	}
 
 	if (nr_taken == 0) {
-		spin_unlock_irq(&zone->lru_lock);
+		unlock_lru_for_scan(zone, zlru);
 		return 0;
 	}
 
 	update_isolated_counts(zone, sc, &nr_anon, &nr_file, &page_list);
 
-	spin_unlock_irq(&zone->lru_lock);
+	unlock_lru_for_scan(zone, zlru);
 
 	nr_reclaimed = shrink_page_list(&page_list, zone, sc);
 
@@ -1456,9 +1552,9 @@ shrink_inactive_list(unsigned long nr_to_scan, struct zone *zone,
  * processes, from rmap.
  *
  * If the pages are mostly unmapped, the processing is fast and it is
- * appropriate to hold zone->lru_lock across the whole operation.  But if
+ * appropriate to hold the LRU lock across the whole operation.  But if
  * the pages are mapped, the processing is slow (page_referenced()) so we
- * should drop zone->lru_lock around each page.  It's impossible to balance
+ * should drop the LRU lock around each page.  It's impossible to balance
  * this, so instead we remove the pages from the LRU while processing them.
  * It is safe to rely on PG_active against the non-LRU pages in here because
  * nobody will play with that bit on a non-LRU page.
@@ -1467,6 +1563,7 @@ shrink_inactive_list(unsigned long nr_to_scan, struct zone *zone,
  * But we had to alter page->flags anyway.
  */
 
+/* Called and returns with interrupts disabled and no LRU lock held */
 static void move_active_pages_to_lru(struct zone *zone,
 				     struct list_head *list,
 				     enum lru_list lru)
@@ -1474,6 +1571,7 @@ static void move_active_pages_to_lru(struct zone *zone,
 	unsigned long pgmoved = 0;
 	struct pagevec pvec;
 	struct page *page;
+	spinlock_t *lru_lock = NULL;
 
 	pagevec_init(&pvec, 1);
 
@@ -1481,18 +1579,20 @@ static void move_active_pages_to_lru(struct zone *zone,
 		page = lru_to_page(list);
 
 		VM_BUG_ON(PageLRU(page));
+		lru_lock = relock_page_lru(lru_lock, page);
 		SetPageLRU(page);
 
-		list_move(&page->lru, &zone->lru[lru].list);
+		list_move(&page->lru, &page_zone_lru(page)->list[lru]);
 		mem_cgroup_add_lru_list(page, lru);
 		pgmoved += hpage_nr_pages(page);
 
 		if (!pagevec_add(&pvec, page) || list_empty(list)) {
-			spin_unlock_irq(&zone->lru_lock);
+			spin_unlock_irq(lru_lock);
+			lru_lock = NULL;
 			if (buffer_heads_over_limit)
 				pagevec_strip(&pvec);
 			__pagevec_release(&pvec);
-			spin_lock_irq(&zone->lru_lock);
+			local_irq_disable();
 		}
 	}
 	__mod_zone_page_state(zone, NR_LRU_BASE + lru, pgmoved);
@@ -1512,13 +1612,14 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 	struct page *page;
 	struct zone_reclaim_stat *reclaim_stat = get_reclaim_stat(zone, sc);
 	unsigned long nr_rotated = 0;
+	struct zone_lru *zlru;
 
 	lru_add_drain();
-	spin_lock_irq(&zone->lru_lock);
+	zlru = lock_lru_for_scan(zone, sc, LRU_ACTIVE + file * LRU_FILE);
 	if (scanning_global_lru(sc)) {
 		nr_taken = isolate_pages_global(nr_pages, &l_hold,
 						&pgscanned, sc->order,
-						ISOLATE_ACTIVE, zone,
+						ISOLATE_ACTIVE, zlru,
 						1, file);
 		zone->pages_scanned += pgscanned;
 	} else {
@@ -1532,7 +1633,7 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 		 */
 	}
 
-	reclaim_stat->recent_scanned[file] += nr_taken;
+	atomic_long_add(nr_taken, &reclaim_stat->recent_scanned[file]);
 
 	__count_zone_vm_events(PGREFILL, zone, pgscanned);
 	if (file)
@@ -1540,7 +1641,7 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 	else
 		__mod_zone_page_state(zone, NR_ACTIVE_ANON, -nr_taken);
 	__mod_zone_page_state(zone, NR_ISOLATED_ANON + file, nr_taken);
-	spin_unlock_irq(&zone->lru_lock);
+	unlock_lru_for_scan(zone, zlru);
 
 	while (!list_empty(&l_hold)) {
 		cond_resched();
@@ -1576,21 +1677,21 @@ static void shrink_active_list(unsigned long nr_pages, struct zone *zone,
 	/*
 	 * Move pages back to the lru list.
 	 */
-	spin_lock_irq(&zone->lru_lock);
+	local_irq_disable();
 	/*
 	 * Count referenced pages from currently used mappings as rotated,
 	 * even though only some of them are actually re-activated.  This
 	 * helps balance scan pressure between file and anonymous pages in
 	 * get_scan_ratio.
 	 */
-	reclaim_stat->recent_rotated[file] += nr_rotated;
+	atomic_long_add(nr_rotated, &reclaim_stat->recent_rotated[file]);
 
 	move_active_pages_to_lru(zone, &l_active,
 						LRU_ACTIVE + file * LRU_FILE);
 	move_active_pages_to_lru(zone, &l_inactive,
 						LRU_BASE   + file * LRU_FILE);
 	__mod_zone_page_state(zone, NR_ISOLATED_ANON + file, -nr_taken);
-	spin_unlock_irq(&zone->lru_lock);
+	local_irq_enable();
 }
 
 #ifdef CONFIG_SWAP
@@ -1719,6 +1820,18 @@ static unsigned long nr_scan_try_batch(unsigned long nr_to_scan,
 	return nr;
 }
 
+static void decay_reclaim_stat(struct zone_reclaim_stat *reclaim_stat,
+			       int file, unsigned long limit)
+{
+	atomic_long_t *scanned = &reclaim_stat->recent_scanned[file];
+	atomic_long_t *rotated = &reclaim_stat->recent_rotated[file];
+
+	if (unlikely(atomic_long_read(scanned) > limit)) {
+		atomic_long_set(scanned, atomic_long_read(scanned) / 2);
+		atomic_long_set(rotated, atomic_long_read(rotated) / 2);
+	}
+}
+
 /*
  * Determine how aggressively the anon and file LRU lists should be
  * scanned.  The relative value of each set of LRU lists is determined
@@ -1781,29 +1894,26 @@ static void get_scan_count(struct zone *zone, struct scan_control *sc,
 	 * up weighing recent references more than old ones.
 	 *
 	 * anon in [0], file in [1]
+	 *
+	 * The statistics are updated under different LRU sub-list locks, so
+	 * they are atomic and the decay below may race with updates.  That
+	 * only loses a few recent events, which is fine for an average.
 	 */
-	spin_lock_irq(&zone->lru_lock);
-	if (unlikely(reclaim_stat->recent_scanned[0] > anon / 4)) {
-		reclaim_stat->recent_scanned[0] /= 2;
-		reclaim_stat->recent_rotated[0] /= 2;
-	}
-
-	if (unlikely(reclaim_stat->recent_scanned[1] > file / 4)) {
-		reclaim_stat->recent_scanned[1] /= 2;
-		reclaim_stat->recent_rotated[1] /= 2;
-	}
+	decay_reclaim_stat(reclaim_stat, 0, anon / 4);
+	decay_reclaim_stat(reclaim_stat, 1, file / 4);
 
 	/*
 	 * The amount of pressure on anon vs file pages is inversely
 	 * proportional to the fraction of recently scanned pages on
 	 * each list that were recently referenced and in active use.
 	 */
-	ap = (anon_prio + 1) * (reclaim_stat->recent_scanned[0] + 1);
-	ap /= reclaim_stat->recent_rotated[0] + 1;
+	ap = (anon_prio + 1) *
+		(atomic_long_read(&reclaim_stat->recent_scanned[0]) + 1);
+	ap /= atomic_long_read(&reclaim_stat->recent_rotated[0]) + 1;
 
-	fp = (file_prio + 1) * (reclaim_stat->recent_scanned[1] + 1);
-	fp /= reclaim_stat->recent_rotated[1] + 1;
-	spin_unlock_irq(&zone->lru_lock);
+	fp = (file_prio + 1) *
+		(atomic_long_read(&reclaim_stat->recent_scanned[1]) + 1);
+	fp /= atomic_long_read(&reclaim_stat->recent_rotated[1]) + 1;
 
 	fraction[0] = ap;
 	fraction[1] = fp;
@@ -3122,8 +3232,8 @@ int page_evictable(struct page *page, struct vm_area_struct *vma)
  * Checks a page for evictability and moves the page to the appropriate
  * zone lru list.
  *
- * Restrictions: zone->lru_lock must be held, page must be on LRU and must
- * have PageUnevictable set.
+ * Restrictions: the page's lru_lock must be held, page must be on LRU and
+ * must have PageUnevictable set.
  */
 static void check_move_unevictable_page(struct page *page, struct zone *zone)
 {
@@ -3135,7 +3245,7 @@ retry:
 		enum lru_list l = page_lru_base_type(page);
 
 		__dec_zone_state(zone, NR_UNEVICTABLE);
-		list_move(&page->lru, &zone->lru[l].list);
+		list_move(&page->lru, &page_zone_lru(page)->list[l]);
 		mem_cgroup_move_lists(page, LRU_UNEVICTABLE, l);
 		__inc_zone_state(zone, NR_INACTIVE_ANON + l);
 		__count_vm_event(UNEVICTABLE_PGRESCUED);
@@ -3144,7 +3254,8 @@ retry:
 		 * rotate unevictable list
 		 */
 		SetPageUnevictable(page);
-		list_move(&page->lru, &zone->lru[LRU_UNEVICTABLE].list);
+		list_move(&page->lru,
+			  &page_zone_lru(page)->list[LRU_UNEVICTABLE]);
 		mem_cgroup_rotate_lru_list(page, LRU_UNEVICTABLE);
 		if (page_evictable(page, NULL))
 			goto retry;
@@ -3163,7 +3274,7 @@ void scan_mapping_unevictable_pages(struct address_space *mapping)
 	pgoff_t next = 0;
 	pgoff_t end   = (i_size_read(mapping->host) + PAGE_CACHE_SIZE - 1) >>
 			 PAGE_CACHE_SHIFT;
-	struct zone *zone;
+	spinlock_t *lru_lock;
 	struct pagevec pvec;
 
 	if (mapping->nrpages == 0)
@@ -3175,30 +3286,27 @@ void scan_mapping_unevictable_pages(struct address_space *mapping)
 		int i;
 		int pg_scanned = 0;
 
-		zone = NULL;
+		lru_lock = NULL;
+		local_irq_disable();
 
 		for (i = 0; i < pagevec_count(&pvec); i++) {
 			struct page *page = pvec.pages[i];
 			pgoff_t page_index = page->index;
-			struct zone *pagezone = page_zone(page);
 
 			pg_scanned++;
 			if (page_index > next)
 				next = page_index;
 			next++;
 
-			if (pagezone != zone) {
-				if (zone)
-					spin_unlock_irq(&zone->lru_lock);
-				zone = pagezone;
-				spin_lock_irq(&zone->lru_lock);
-			}
+			lru_lock = relock_page_lru(lru_lock, page);
 
 			if (PageLRU(page) && PageUnevictable(page))
-				check_move_unevictable_page(page, zone);
+				check_move_unevictable_page(page,
+							    page_zone(page));
 		}
-		if (zone)
-			spin_unlock_irq(&zone->lru_lock);
+		if (lru_lock)
+			spin_unlock(lru_lock);
+		local_irq_enable();
 		pagevec_release(&pvec);
 
 		count_vm_events(UNEVICTABLE_PGSCANNED, pg_scanned);
@@ -3215,35 +3323,53 @@ void scan_mapping_unevictable_pages(struct address_space *mapping)
  * become candidates for reclaim, unless shrink_inactive_zone() decides
  * to reactivate them.  Pages that are still unevictable are rotated
  * back onto @zone's unevictable list.
+ *
+ * Only the zone total is known, so each sub-list is scanned for at most
+ * that many pages.
  */
 #define SCAN_UNEVICTABLE_BATCH_SIZE 16UL /* arbitrary lock hold batch size */
 static void scan_zone_unevictable_pages(struct zone *zone)
 {
-	struct list_head *l_unevictable = &zone->lru[LRU_UNEVICTABLE].list;
 	unsigned long scan;
-	unsigned long nr_to_scan = zone_page_state(zone, NR_UNEVICTABLE);
+	int i;
 
-	while (nr_to_scan > 0) {
-		unsigned long batch_size = min(nr_to_scan,
+	for (i = 0; i < LRU_SHARDS; i++) {
+		struct zone_lru *zlru = &zone->lru[i];
+		struct list_head *l_unevictable = &zlru->list[LRU_UNEVICTABLE];
+		unsigned long nr_to_scan = zone_page_state(zone,
+							   NR_UNEVICTABLE);
+
+		while (nr_to_scan > 0) {
+			unsigned long batch_size = min(nr_to_scan,
 						SCAN_UNEVICTABLE_BATCH_SIZE);
 
-		spin_lock_irq(&zone->lru_lock);
-		for (scan = 0;  scan < batch_size; scan++) {
-			struct page *page = lru_to_page(l_unevictable);
+			spin_lock_irq(&zlru->lock);
+			for (scan = 0;  scan < batch_size; scan++) {
+				struct page *page;
 
-			if (!trylock_page(page))
-				continue;
+				if (list_empty(l_unevictable))
+					break;
+				page = lru_to_page(l_unevictable);
+
+				if (!trylock_page(page))
+					continue;
 
-			prefetchw_prev_lru_page(page, l_unevictable, flags);
+				prefetchw_prev_lru_page(page, l_unevictable,
+							flags);
 
-			if (likely(PageLRU(page) && PageUnevictable(page)))
-				check_move_unevictable_page(page, zone);
+				if (likely(PageLRU(page) &&
+					   PageUnevictable(page)))
+					check_move_unevictable_page(page,
+								    zone);
 
-			unlock_page(page);
-		}
-		spin_unlock_irq(&zone->lru_lock);
+				unlock_page(page);
+			}
+			spin_unlock_irq(&zlru->lock);
 
-		nr_to_scan -= batch_size;
+			if (scan < batch_size)
+				break;
+			nr_to_scan -= batch_size;
+		}
 	}
 }
 
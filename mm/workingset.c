@@ -0,0 +1,183 @@
+/*
+ * Workingset detection
+ *
+ * The file LRU is split into an inactive list, where new pages start
+ * out, and an active list, which pages are promoted to when they are
+ * referenced a second time while on the inactive list. This protects
+ * the frequently used pages from use-once streams, but a set of
+ * frequently used pages that is bigger than the inactive list is
+ * evicted before its second reference ever comes, and stays out for
+ * as long as the stream runs.
+ *
+ * To tell such pages apart, every zone counts the pages leaving its
+ * inactive file list, by eviction or activation, in zone->inactive_age.
+ * When a page cache page is reclaimed, a shadow entry recording the
+ * zone and the current age is left behind for its mapping and index.
+ * When the page is read in again, the difference between the age then
+ * and now is its refault distance: the number of pages that left the
+ * inactive list while the page was out, i.e. how many more slots the
+ * inactive list would have needed for the page to stay resident.
+ *
+ * Those slots could only come from the active list. So if the refault
+ * distance is not larger than the active file list, the page would have
+ * been kept had it competed with the active pages instead, and it is
+ * put on the active list right away. Pages of a stream never refault
+ * and those of a working set too big for memory refault from a distance
+ * larger than the active list: neither disturb the active pages.
+ *
+ * The shadow entries are kept in a fixed size hash table rather than in
+ * the page cache radix trees, which would have to learn about non-page
+ * entries in every lookup and to be pruned under memory pressure. The
+ * table holds about one entry per page of memory in buckets of one
+ * cacheline, entries are replaced at random within a bucket, and a hash
+ * collision at worst activates one page that should not have been.
+ */
+
+#include <linux/mm.h>
+#include <linux/swap.h>
+#include <linux/mm_inline.h>
+#include <linux/hash.h>
+#include <linux/bootmem.h>
+#include <linux/init.h>
+
+#define SHADOW_BUCKET_SHIFT	3
+#define SHADOW_BUCKET_SIZE	(1 << SHADOW_BUCKET_SHIFT)
+
+struct shadow_bucket {
+	unsigned long entry[SHADOW_BUCKET_SIZE];
+};
+
+/*
+ * A shadow entry is laid out as
+ *
+ *	| eviction age | zone | tag | 1 |
+ *
+ * where the tag is made of the key hash bits not used to select the
+ * bucket, and the low bit tells an entry from an empty slot.
+ */
+#define SHADOW_TAG_BITS		(BITS_PER_LONG / 4)
+#define SHADOW_TAG_MASK		((1UL << SHADOW_TAG_BITS) - 1)
+#define SHADOW_ZONE_BITS	(NODES_SHIFT + ZONES_SHIFT)
+#define SHADOW_AGE_SHIFT	(1 + SHADOW_TAG_BITS + SHADOW_ZONE_BITS)
+#define SHADOW_AGE_MASK		(~0UL >> SHADOW_AGE_SHIFT)
+
+static struct shadow_bucket *shadow_table __read_mostly;
+static unsigned int shadow_hash_shift __read_mostly;
+static unsigned int shadow_hash_mask __read_mostly;
+
+static unsigned long shadow_key(struct address_space *mapping, pgoff_t index)
+{
+	unsigned long hash = hash_long(index, BITS_PER_LONG);
+
+	return hash_long((unsigned long)mapping ^ hash, BITS_PER_LONG);
+}
+
+static unsigned long shadow_tag(unsigned long key)
+{
+	return (key >> shadow_hash_shift) & SHADOW_TAG_MASK;
+}
+
+static unsigned long pack_shadow(unsigned long eviction, struct zone *zone,
+				 unsigned long tag)
+{
+	unsigned long entry;
+
+	entry = eviction & SHADOW_AGE_MASK;
+	entry = (entry << NODES_SHIFT) | zone_to_nid(zone);
+	entry = (entry << ZONES_SHIFT) | zone_idx(zone);
+	entry = (entry << SHADOW_TAG_BITS) | tag;
+	return (entry << 1) | 1;
+}
+
+static void unpack_shadow(unsigned long entry, struct zone **zone,
+			  unsigned long *eviction)
+{
+	int zid, nid;
+
+	entry >>= 1 + SHADOW_TAG_BITS;
+	zid = entry & ((1UL << ZONES_SHIFT) - 1);
+	entry >>= ZONES_SHIFT;
+	nid = entry & ((1UL << NODES_SHIFT) - 1);
+	entry >>= NODES_SHIFT;
+
+	*zone = NODE_DATA(nid)->node_zones + zid;
+	*eviction = entry;
+}
+
+/**
+ * workingset_eviction - note the eviction of a page cache page
+ * @mapping: address space the page was backing
+ * @page: the page being evicted
+ *
+ * Called by reclaim under the mapping's tree_lock, with the page still
+ * locked and its index valid.
+ */
+void workingset_eviction(struct address_space *mapping, struct page *page)
+{
+	struct zone *zone = page_zone(page);
+	struct shadow_bucket *bucket;
+	unsigned long key, eviction;
+
+	eviction = atomic_long_inc_return(&zone->inactive_age);
+	key = shadow_key(mapping, page->index);
+	bucket = &shadow_table[key & shadow_hash_mask];
+	bucket->entry[eviction & (SHADOW_BUCKET_SIZE - 1)] =
+		pack_shadow(eviction, zone, shadow_tag(key));
+}
+
+/**
+ * workingset_refault - evaluate the refault of a page cache page
+ * @mapping: address space the page is added to
+ * @index: index of the page in @mapping
+ *
+ * Consumes the shadow entry left by the eviction of the page, if any,
+ * and returns true if the page should go straight to the active list.
+ */
+bool workingset_refault(struct address_space *mapping, pgoff_t index)
+{
+	unsigned long key = shadow_key(mapping, index);
+	unsigned long tag = shadow_tag(key);
+	struct shadow_bucket *bucket = &shadow_table[key & shadow_hash_mask];
+	int i;
+
+	for (i = 0; i < SHADOW_BUCKET_SIZE; i++) {
+		unsigned long entry = ACCESS_ONCE(bucket->entry[i]);
+		unsigned long eviction, refault_distance;
+		struct zone *zone;
+
+		if (!entry || ((entry >> 1) & SHADOW_TAG_MASK) != tag)
+			continue;
+		bucket->entry[i] = 0;
+
+		unpack_shadow(entry, &zone, &eviction);
+		refault_distance = (atomic_long_read(&zone->inactive_age) -
+				    eviction) & SHADOW_AGE_MASK;
+
+		inc_zone_state(zone, WORKINGSET_REFAULT);
+		if (refault_distance <= zone_page_state(zone, NR_ACTIVE_FILE)) {
+			inc_zone_state(zone, WORKINGSET_ACTIVATE);
+			return true;
+		}
+		return false;
+	}
+	return false;
+}
+
+/**
+ * workingset_activation - note a page moving to the active list
+ * @page: page that is being activated
+ */
+void workingset_activation(struct page *page)
+{
+	if (page_is_file_cache(page))
+		atomic_long_inc(&page_zone(page)->inactive_age);
+}
+
+void __init workingset_init(void)
+{
+	shadow_table = alloc_large_system_hash("Workingset shadow",
+					sizeof(struct shadow_bucket), 0,
+					PAGE_SHIFT + SHADOW_BUCKET_SHIFT,
+					HASH_EARLY, &shadow_hash_shift,
+					&shadow_hash_mask, 0);
+}
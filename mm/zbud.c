@@ -0,0 +1,351 @@
+/*
+ * zbud.c - allocator for compressed pages, at most two per page
+ *
+ * zbud stores up to two compressed objects ("buddies") in one page: one
+ * at the start of the page, right after a small header, and one at its
+ * end. Free space is tracked in chunks of PAGE_SIZE/64 bytes; pages with
+ * only one buddy are kept on lists indexed by their number of free
+ * chunks, so that a new object is paired with the best fitting one.
+ *
+ * This gives a worst case density of one object per page and a typical
+ * one close to two for swap pages. In exchange the layout is trivial:
+ * a handle is the object's address, a page can always be freed by
+ * evicting at most two objects, and the pages are kept in LRU order
+ * for that.
+ *
+ * This software may be redistributed and/or modified under the terms of
+ * the GNU General Public License ("GPL") version 2 as published by the
+ * Free Software Foundation.
+ */
+
+#include <linux/kernel.h>
+#include <linux/list.h>
+#include <linux/mm.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/zbud.h>
+
+#define NCHUNKS_ORDER	6
+
+#define CHUNK_SHIFT	(PAGE_SHIFT - NCHUNKS_ORDER)
+#define CHUNK_SIZE	(1 << CHUNK_SHIFT)
+#define NCHUNKS		(PAGE_SIZE >> CHUNK_SHIFT)
+#define ZHDR_SIZE_ALIGNED CHUNK_SIZE
+
+/*
+ * struct zbud_pool - a pool of zbud pages
+ * @lock:	protects all the lists and counters of the pool
+ * @unbuddied:	pages with a single buddy, indexed by their free chunks
+ * @buddied:	pages with both buddies in use
+ * @lru:	all the pages, most recently allocated into first
+ * @pages_nr:	number of pages in the pool
+ * @ops:	eviction callback, used by zbud_reclaim_page()
+ */
+struct zbud_pool {
+	spinlock_t lock;
+	struct list_head unbuddied[NCHUNKS];
+	struct list_head buddied;
+	struct list_head lru;
+	u64 pages_nr;
+	struct zbud_ops *ops;
+};
+
+/*
+ * struct zbud_header - zbud page metadata, in the first chunk of the page
+ * @buddy:	links the page into the unbuddied/buddied lists
+ * @lru:	links the page into the pool LRU
+ * @first_chunks: size of the first buddy in chunks, 0 if free
+ * @last_chunks: size of the last buddy in chunks, 0 if free
+ * @under_reclaim: the buddies are being evicted, leave the page alone
+ */
+struct zbud_header {
+	struct list_head buddy;
+	struct list_head lru;
+	unsigned int first_chunks;
+	unsigned int last_chunks;
+	bool under_reclaim;
+};
+
+enum buddy {
+	FIRST,
+	LAST
+};
+
+static int size_to_chunks(int size)
+{
+	return (size + CHUNK_SIZE - 1) >> CHUNK_SHIFT;
+}
+
+static struct zbud_header *init_zbud_page(struct page *page)
+{
+	struct zbud_header *zhdr = page_address(page);
+
+	zhdr->first_chunks = 0;
+	zhdr->last_chunks = 0;
+	INIT_LIST_HEAD(&zhdr->buddy);
+	INIT_LIST_HEAD(&zhdr->lru);
+	zhdr->under_reclaim = false;
+	return zhdr;
+}
+
+static void free_zbud_page(struct zbud_header *zhdr)
+{
+	__free_page(virt_to_page(zhdr));
+}
+
+/* The handle of a buddy is simply its address */
+static unsigned long encode_handle(struct zbud_header *zhdr, enum buddy bud)
+{
+	unsigned long handle = (unsigned long)zhdr;
+
+	if (bud == FIRST)
+		handle += ZHDR_SIZE_ALIGNED;
+	else
+		handle += PAGE_SIZE - (zhdr->last_chunks << CHUNK_SHIFT);
+	return handle;
+}
+
+static struct zbud_header *handle_to_zbud_header(unsigned long handle)
+{
+	return (struct zbud_header *)(handle & PAGE_MASK);
+}
+
+/* Free chunks in the page, not counting the header */
+static int num_free_chunks(struct zbud_header *zhdr)
+{
+	return NCHUNKS - zhdr->first_chunks - zhdr->last_chunks - 1;
+}
+
+/* Put a page that is not empty back on the list matching its buddies */
+static void zbud_relink(struct zbud_pool *pool, struct zbud_header *zhdr)
+{
+	if (zhdr->first_chunks == 0 || zhdr->last_chunks == 0)
+		list_add(&zhdr->buddy, &pool->unbuddied[num_free_chunks(zhdr)]);
+	else
+		list_add(&zhdr->buddy, &pool->buddied);
+}
+
+/**
+ * zbud_create_pool() - create a new zbud pool
+ * @gfp:	gfp flags for the pool structure itself
+ * @ops:	eviction callback, may be NULL if the pool is never reclaimed
+ */
+struct zbud_pool *zbud_create_pool(gfp_t gfp, struct zbud_ops *ops)
+{
+	struct zbud_pool *pool;
+	int i;
+
+	pool = kmalloc(sizeof(struct zbud_pool), gfp);
+	if (!pool)
+		return NULL;
+	spin_lock_init(&pool->lock);
+	for (i = 0; i < NCHUNKS; i++)
+		INIT_LIST_HEAD(&pool->unbuddied[i]);
+	INIT_LIST_HEAD(&pool->buddied);
+	INIT_LIST_HEAD(&pool->lru);
+	pool->pages_nr = 0;
+	pool->ops = ops;
+	return pool;
+}
+
+/**
+ * zbud_destroy_pool() - destroy an empty zbud pool
+ * @pool:	pool to destroy
+ */
+void zbud_destroy_pool(struct zbud_pool *pool)
+{
+	WARN_ON(pool->pages_nr);
+	kfree(pool);
+}
+
+/**
+ * zbud_alloc() - allocate a region of @size bytes in the pool
+ * @pool:	pool to allocate from
+ * @size:	size of the region
+ * @gfp:	gfp flags used if a new page is needed, must not be highmem
+ * @handle:	where the handle of the region is returned
+ *
+ * Returns 0 on success, -ENOSPC if @size does not fit in a zbud page,
+ * -ENOMEM if no page could be allocated and -EINVAL for bad arguments.
+ */
+int zbud_alloc(struct zbud_pool *pool, int size, gfp_t gfp,
+	       unsigned long *handle)
+{
+	int chunks, i;
+	struct zbud_header *zhdr = NULL;
+	enum buddy bud;
+	struct page *page;
+
+	if (size <= 0 || gfp & __GFP_HIGHMEM)
+		return -EINVAL;
+	if (size > PAGE_SIZE - ZHDR_SIZE_ALIGNED - CHUNK_SIZE)
+		return -ENOSPC;
+	chunks = size_to_chunks(size);
+	spin_lock(&pool->lock);
+
+	/* First, try to pair it with the best fitting single buddy */
+	for (i = chunks; i < NCHUNKS; i++) {
+		if (!list_empty(&pool->unbuddied[i])) {
+			zhdr = list_first_entry(&pool->unbuddied[i],
+					struct zbud_header, buddy);
+			list_del(&zhdr->buddy);
+			if (zhdr->first_chunks == 0)
+				bud = FIRST;
+			else
+				bud = LAST;
+			goto found;
+		}
+	}
+
+	/* Couldn't find one, allocate a new page */
+	spin_unlock(&pool->lock);
+	page = alloc_page(gfp);
+	if (!page)
+		return -ENOMEM;
+	spin_lock(&pool->lock);
+	pool->pages_nr++;
+	zhdr = init_zbud_page(page);
+	bud = FIRST;
+
+found:
+	if (bud == FIRST)
+		zhdr->first_chunks = chunks;
+	else
+		zhdr->last_chunks = chunks;
+	zbud_relink(pool, zhdr);
+
+	/* Move the page to the head of the LRU */
+	if (!list_empty(&zhdr->lru))
+		list_del(&zhdr->lru);
+	list_add(&zhdr->lru, &pool->lru);
+
+	*handle = encode_handle(zhdr, bud);
+	spin_unlock(&pool->lock);
+
+	return 0;
+}
+
+/**
+ * zbud_free() - free the region of @handle
+ * @pool:	pool the region was allocated from
+ * @handle:	handle returned by zbud_alloc()
+ *
+ * The page is freed once both its buddies are, unless it is under
+ * reclaim: zbud_reclaim_page() then takes care of it.
+ */
+void zbud_free(struct zbud_pool *pool, unsigned long handle)
+{
+	struct zbud_header *zhdr;
+
+	spin_lock(&pool->lock);
+	zhdr = handle_to_zbud_header(handle);
+
+	/* The first buddy always starts right after the header */
+	if ((handle - ZHDR_SIZE_ALIGNED) & ~PAGE_MASK)
+		zhdr->last_chunks = 0;
+	else
+		zhdr->first_chunks = 0;
+
+	if (zhdr->under_reclaim) {
+		spin_unlock(&pool->lock);
+		return;
+	}
+
+	list_del(&zhdr->buddy);
+	if (zhdr->first_chunks == 0 && zhdr->last_chunks == 0) {
+		list_del(&zhdr->lru);
+		free_zbud_page(zhdr);
+		pool->pages_nr--;
+	} else {
+		zbud_relink(pool, zhdr);
+	}
+
+	spin_unlock(&pool->lock);
+}
+
+/**
+ * zbud_reclaim_page() - evict the buddies of the least recently used page
+ * @pool:	pool to reclaim from
+ * @retries:	number of pages to try before giving up
+ *
+ * The ->evict() callback is called for each buddy of the page. It must
+ * write the object out and free it with zbud_free(), or return non-zero
+ * if it cannot. Returns 0 once a page was freed, -EAGAIN if none could be
+ * and -EINVAL if the pool has no eviction callback or is empty.
+ */
+int zbud_reclaim_page(struct zbud_pool *pool, unsigned int retries)
+{
+	int i, ret;
+	struct zbud_header *zhdr;
+	unsigned long first_handle, last_handle;
+
+	spin_lock(&pool->lock);
+	if (!pool->ops || !pool->ops->evict || list_empty(&pool->lru) ||
+			retries == 0) {
+		spin_unlock(&pool->lock);
+		return -EINVAL;
+	}
+	for (i = 0; i < retries; i++) {
+		zhdr = list_entry(pool->lru.prev, struct zbud_header, lru);
+		list_del(&zhdr->lru);
+		list_del(&zhdr->buddy);
+		/* Keep zbud_free() from freeing the page under us */
+		zhdr->under_reclaim = true;
+
+		first_handle = 0;
+		last_handle = 0;
+		if (zhdr->first_chunks)
+			first_handle = encode_handle(zhdr, FIRST);
+		if (zhdr->last_chunks)
+			last_handle = encode_handle(zhdr, LAST);
+		spin_unlock(&pool->lock);
+
+		if (first_handle) {
+			ret = pool->ops->evict(pool, first_handle);
+			if (ret)
+				goto next;
+		}
+		if (last_handle) {
+			ret = pool->ops->evict(pool, last_handle);
+			if (ret)
+				goto next;
+		}
+next:
+		spin_lock(&pool->lock);
+		zhdr->under_reclaim = false;
+		if (zhdr->first_chunks == 0 && zhdr->last_chunks == 0) {
+			free_zbud_page(zhdr);
+			pool->pages_nr--;
+			spin_unlock(&pool->lock);
+			return 0;
+		}
+		zbud_relink(pool, zhdr);
+		/* Both buddies could not be evicted, rotate the page */
+		list_add(&zhdr->lru, &pool->lru);
+	}
+	spin_unlock(&pool->lock);
+	return -EAGAIN;
+}
+
+/**
+ * zbud_map() - get the address of the region of @handle
+ *
+ * zbud pages are never highmem, this is only here so that users need
+ * not know that.
+ */
+void *zbud_map(struct zbud_pool *pool, unsigned long handle)
+{
+	return (void *)(handle);
+}
+
+void zbud_unmap(struct zbud_pool *pool, unsigned long handle)
+{
+}
+
+/**
+ * zbud_get_pool_size() - number of pages in the pool
+ */
+u64 zbud_get_pool_size(struct zbud_pool *pool)
+{
+	return pool->pages_nr;
+}
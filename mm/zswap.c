@@ -0,0 +1,727 @@
+/*
+ * zswap.c - compressed cache for swap pages
+ *
+ * zswap sits between swap_writepage() and the swap device. Pages being
+ * swapped out are LZO compressed into a zbud pool instead of being
+ * written, and swap_readpage() decompresses them from there. The pool
+ * grows with the memory pressure up to max_pool_percent of the RAM;
+ * only when it hits that limit, i.e. when the pressure is sustained,
+ * are its least recently used pages written back to the swap device
+ * to make room.
+ *
+ * The compressed pages are indexed per swap area, by swap offset, in
+ * an rbtree. An entry lives until its swap slot is freed, written back
+ * or overwritten by a newer version of the page.
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ */
+
+#define pr_fmt(fmt) KBUILD_MODNAME ": " fmt
+
+#include <linux/module.h>
+#include <linux/cpu.h>
+#include <linux/highmem.h>
+#include <linux/slab.h>
+#include <linux/spinlock.h>
+#include <linux/types.h>
+#include <linux/atomic.h>
+#include <linux/wait.h>
+#include <linux/rbtree.h>
+#include <linux/swap.h>
+#include <linux/swapops.h>
+#include <linux/pagemap.h>
+#include <linux/writeback.h>
+#include <linux/lzo.h>
+#include <linux/zbud.h>
+#include <linux/zswap.h>
+#include <linux/debugfs.h>
+
+/*********************************
+* statistics
+**********************************/
+/* Number of memory pages used by the compressed pool */
+static u64 zswap_pool_pages;
+/* The number of compressed pages currently stored in zswap */
+static atomic_t zswap_stored_pages = ATOMIC_INIT(0);
+
+/*
+ * The statistics below are not protected from concurrent access for
+ * performance reasons so they may not be 100% accurate.
+ */
+
+/* Pool limit was hit, we need to write back pages */
+static u64 zswap_pool_limit_hit;
+/* Pages written back when the pool limit was reached */
+static u64 zswap_written_back_pages;
+/* Store failed because the pool could not be shrunk below its limit */
+static u64 zswap_reject_reclaim_fail;
+/* Store failed because no pool memory could be allocated */
+static u64 zswap_reject_alloc_fail;
+/* Store failed because the entry metadata could not be allocated */
+static u64 zswap_reject_kmemcache_fail;
+/* Compressed page was too big for the allocator to store */
+static u64 zswap_reject_compress_poor;
+/* Store replaced an older version of the same swap slot */
+static u64 zswap_duplicate_entry;
+
+/*********************************
+* tunables
+**********************************/
+/* Enable/disable zswap (disabled by default) */
+static bool zswap_enabled;
+module_param_named(enabled, zswap_enabled, bool, 0644);
+
+/* The maximum percentage of memory that the compressed pool can occupy */
+static unsigned int zswap_max_pool_percent = 20;
+module_param_named(max_pool_percent, zswap_max_pool_percent, uint, 0644);
+
+/* zbud pages to try to free when the pool is full */
+#define ZSWAP_RECLAIM_RETRIES	8
+
+/*********************************
+* compression buffers
+**********************************/
+/* Room for the worst case LZO expansion of a page */
+#define ZSWAP_DSTMEM_SIZE	(PAGE_SIZE * 2)
+
+static DEFINE_PER_CPU(u8 *, zswap_dstmem);
+static DEFINE_PER_CPU(void *, zswap_wrkmem);
+
+static int zswap_cpu_init(int cpu)
+{
+	u8 *dst;
+	void *wrk;
+
+	dst = kmalloc_node(ZSWAP_DSTMEM_SIZE, GFP_KERNEL, cpu_to_node(cpu));
+	wrk = kmalloc_node(LZO1X_MEM_COMPRESS, GFP_KERNEL, cpu_to_node(cpu));
+	if (!dst || !wrk) {
+		kfree(dst);
+		kfree(wrk);
+		return -ENOMEM;
+	}
+	per_cpu(zswap_dstmem, cpu) = dst;
+	per_cpu(zswap_wrkmem, cpu) = wrk;
+	return 0;
+}
+
+static void zswap_cpu_free(int cpu)
+{
+	kfree(per_cpu(zswap_dstmem, cpu));
+	kfree(per_cpu(zswap_wrkmem, cpu));
+	per_cpu(zswap_dstmem, cpu) = NULL;
+	per_cpu(zswap_wrkmem, cpu) = NULL;
+}
+
+/*********************************
+* data structures
+**********************************/
+/*
+ * struct zswap_entry
+ *
+ * rbnode - links the entry into the rbtree of its swap area
+ * offset - the swap offset of the page, the rbtree key
+ * refcount - the tree holds one reference, loads and writeback take
+ *            another one while they use the entry without the tree lock
+ * length - the length in bytes of the compressed page data
+ * handle - zbud handle of the compressed data, which is preceded by
+ *          a struct zswap_header
+ */
+struct zswap_entry {
+	struct rb_node rbnode;
+	pgoff_t offset;
+	int refcount;
+	unsigned int length;
+	unsigned long handle;
+};
+
+/* Written in front of the compressed data so that eviction finds its slot */
+struct zswap_header {
+	swp_entry_t swpentry;
+};
+
+/*
+ * The tree lock protects the rbtree and the entry refcounts. It nests
+ * outside of the zbud pool lock.
+ *
+ * The pool is shared by all the swap areas, so writeback may work on an
+ * entry of an area that is being swapped off. It pins the tree with
+ * writebacks, and swapoff waits for them before freeing the tree.
+ */
+struct zswap_tree {
+	struct rb_root rbroot;
+	spinlock_t lock;
+	int writebacks;		/* under zswap_trees_lock */
+};
+
+/* protects zswap_trees[] against writeback, and the tree writebacks */
+static DEFINE_SPINLOCK(zswap_trees_lock);
+static DECLARE_WAIT_QUEUE_HEAD(zswap_writeback_wait);
+static struct zswap_tree *zswap_trees[MAX_SWAPFILES];
+static struct zbud_pool *zswap_pool;
+static struct kmem_cache *zswap_entry_cache;
+
+/*********************************
+* entry functions
+**********************************/
+static struct zswap_entry *zswap_entry_cache_alloc(gfp_t gfp)
+{
+	struct zswap_entry *entry;
+
+	entry = kmem_cache_alloc(zswap_entry_cache, gfp);
+	if (!entry)
+		return NULL;
+	entry->refcount = 1;
+	RB_CLEAR_NODE(&entry->rbnode);
+	return entry;
+}
+
+static void zswap_entry_cache_free(struct zswap_entry *entry)
+{
+	kmem_cache_free(zswap_entry_cache, entry);
+}
+
+static struct zswap_entry *zswap_rb_search(struct rb_root *root, pgoff_t offset)
+{
+	struct rb_node *node = root->rb_node;
+	struct zswap_entry *entry;
+
+	while (node) {
+		entry = rb_entry(node, struct zswap_entry, rbnode);
+		if (entry->offset > offset)
+			node = node->rb_left;
+		else if (entry->offset < offset)
+			node = node->rb_right;
+		else
+			return entry;
+	}
+	return NULL;
+}
+
+/*
+ * In the case that an entry with the same offset is found, a pointer to
+ * the existing entry is stored in dupentry and -EEXIST is returned.
+ */
+static int zswap_rb_insert(struct rb_root *root, struct zswap_entry *entry,
+			struct zswap_entry **dupentry)
+{
+	struct rb_node **link = &root->rb_node, *parent = NULL;
+	struct zswap_entry *myentry;
+
+	while (*link) {
+		parent = *link;
+		myentry = rb_entry(parent, struct zswap_entry, rbnode);
+		if (myentry->offset > entry->offset)
+			link = &(*link)->rb_left;
+		else if (myentry->offset < entry->offset)
+			link = &(*link)->rb_right;
+		else {
+			*dupentry = myentry;
+			return -EEXIST;
+		}
+	}
+	rb_link_node(&entry->rbnode, parent, link);
+	rb_insert_color(&entry->rbnode, root);
+	return 0;
+}
+
+static void zswap_rb_erase(struct rb_root *root, struct zswap_entry *entry)
+{
+	if (!RB_EMPTY_NODE(&entry->rbnode)) {
+		rb_erase(&entry->rbnode, root);
+		RB_CLEAR_NODE(&entry->rbnode);
+	}
+}
+
+/* caller must hold the tree lock */
+static void zswap_entry_get(struct zswap_entry *entry)
+{
+	entry->refcount++;
+}
+
+/*
+ * caller must hold the tree lock; the entry is freed along with its
+ * compressed data when the last reference goes away
+ */
+static void zswap_entry_put(struct zswap_entry *entry)
+{
+	if (--entry->refcount)
+		return;
+
+	zbud_free(zswap_pool, entry->handle);
+	zswap_entry_cache_free(entry);
+	atomic_dec(&zswap_stored_pages);
+	zswap_pool_pages = zbud_get_pool_size(zswap_pool);
+}
+
+/*********************************
+* helpers
+**********************************/
+static bool zswap_is_full(void)
+{
+	return totalram_pages * zswap_max_pool_percent / 100 <
+		zbud_get_pool_size(zswap_pool);
+}
+
+static int zswap_decompress(struct zswap_entry *entry, struct page *page)
+{
+	size_t dlen = PAGE_SIZE;
+	u8 *src, *dst;
+	int ret;
+
+	src = (u8 *)zbud_map(zswap_pool, entry->handle) +
+		sizeof(struct zswap_header);
+	dst = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_decompress_safe(src, entry->length, dst, &dlen);
+	kunmap_atomic(dst, KM_USER0);
+	zbud_unmap(zswap_pool, entry->handle);
+
+	return (ret == LZO_E_OK && dlen == PAGE_SIZE) ? 0 : -EIO;
+}
+
+/*********************************
+* writeback code
+**********************************/
+static struct zswap_tree *zswap_writeback_get_tree(unsigned type)
+{
+	struct zswap_tree *tree;
+
+	spin_lock(&zswap_trees_lock);
+	tree = zswap_trees[type];
+	if (tree)
+		tree->writebacks++;
+	spin_unlock(&zswap_trees_lock);
+	return tree;
+}
+
+static void zswap_writeback_put_tree(struct zswap_tree *tree)
+{
+	spin_lock(&zswap_trees_lock);
+	if (!--tree->writebacks)
+		wake_up_all(&zswap_writeback_wait);
+	spin_unlock(&zswap_trees_lock);
+}
+
+static bool zswap_tree_busy(struct zswap_tree *tree)
+{
+	bool busy;
+
+	spin_lock(&zswap_trees_lock);
+	busy = tree->writebacks;
+	spin_unlock(&zswap_trees_lock);
+	return busy;
+}
+
+/*
+ * Attempts to free an entry by adding a page to the swap cache,
+ * decompressing the entry data into the page, and issuing a
+ * bio write to write the page back to the swap device.
+ *
+ * This can be thought of as a "resumed writeback" of the page
+ * to the swap device. We are basically resuming the same swap
+ * writeback path that was intercepted with zswap_store()
+ * in the first place. After the page has been decompressed into
+ * the swap cache, the compressed version stored by zswap can be
+ * freed.
+ */
+static int zswap_writeback_entry(struct zbud_pool *pool, unsigned long handle)
+{
+	struct zswap_header *zhdr;
+	swp_entry_t swpentry;
+	struct zswap_tree *tree;
+	pgoff_t offset;
+	struct zswap_entry *entry;
+	struct page *page;
+	bool page_was_allocated;
+	int ret;
+	struct writeback_control wbc = {
+		.sync_mode = WB_SYNC_NONE,
+	};
+
+	/* extract the swap entry from the header of the data */
+	zhdr = zbud_map(pool, handle);
+	swpentry = zhdr->swpentry;
+	zbud_unmap(pool, handle);
+	offset = swp_offset(swpentry);
+
+	/*
+	 * Leave the entries of an area being swapped off alone, swapoff
+	 * frees them.
+	 */
+	tree = zswap_writeback_get_tree(swp_type(swpentry));
+	if (!tree)
+		return -EAGAIN;
+	if (!swap_area_writeok(swp_type(swpentry))) {
+		ret = -EAGAIN;
+		goto out;
+	}
+
+	/* find and ref the entry, it may have been freed meanwhile */
+	spin_lock(&tree->lock);
+	entry = zswap_rb_search(&tree->rbroot, offset);
+	if (!entry || entry->handle != handle) {
+		spin_unlock(&tree->lock);
+		ret = 0;
+		goto out;
+	}
+	zswap_entry_get(entry);
+	spin_unlock(&tree->lock);
+
+	page = __read_swap_cache_async(swpentry, GFP_KERNEL, NULL, 0,
+				       &page_was_allocated);
+	if (!page) {
+		/* out of memory, or the swap slot was freed */
+		ret = -ENOMEM;
+		goto fail;
+	}
+	if (!page_was_allocated) {
+		/* the page is already in the swap cache, leave it alone */
+		page_cache_release(page);
+		ret = -EEXIST;
+		goto fail;
+	}
+
+	ret = zswap_decompress(entry, page);
+	BUG_ON(ret);
+	SetPageUptodate(page);
+
+	/* move it to the tail of the inactive list after end_writeback */
+	SetPageReclaim(page);
+
+	/* start writeback, this unlocks the page */
+	__swap_writepage(page, &wbc);
+	page_cache_release(page);
+	zswap_written_back_pages++;
+
+	spin_lock(&tree->lock);
+	/* drop the tree's reference unless the entry was freed meanwhile */
+	if (entry == zswap_rb_search(&tree->rbroot, offset)) {
+		zswap_rb_erase(&tree->rbroot, entry);
+		zswap_entry_put(entry);
+	}
+	/* drop our reference, freeing the compressed data */
+	zswap_entry_put(entry);
+	spin_unlock(&tree->lock);
+	ret = 0;
+	goto out;
+
+fail:
+	spin_lock(&tree->lock);
+	zswap_entry_put(entry);
+	spin_unlock(&tree->lock);
+out:
+	zswap_writeback_put_tree(tree);
+	return ret;
+}
+
+static struct zbud_ops zswap_zbud_ops = {
+	.evict = zswap_writeback_entry
+};
+
+/*********************************
+* swap hooks
+**********************************/
+/**
+ * zswap_store() - compress and store a page being swapped out
+ * @page:	locked swap cache page
+ *
+ * Returns 0 if the page was stored, in which case it must not be
+ * written to the swap device. Any older copy of the page is dropped
+ * either way, so a failed store cannot leave stale data behind.
+ */
+int zswap_store(struct page *page)
+{
+	swp_entry_t swpentry = { .val = page_private(page), };
+	unsigned type = swp_type(swpentry);
+	pgoff_t offset = swp_offset(swpentry);
+	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_entry *entry, *dupentry;
+	struct zswap_header *zhdr;
+	size_t dlen;
+	int ret;
+	unsigned long handle;
+	u8 *src, *dst, *buf;
+
+	if (!zswap_enabled || !zswap_pool || !tree) {
+		ret = -ENODEV;
+		goto reject;
+	}
+
+	/* make room by writing back the oldest pages if needed */
+	if (zswap_is_full()) {
+		zswap_pool_limit_hit++;
+		if (zbud_reclaim_page(zswap_pool, ZSWAP_RECLAIM_RETRIES)) {
+			zswap_reject_reclaim_fail++;
+			ret = -ENOMEM;
+			goto reject;
+		}
+	}
+
+	entry = zswap_entry_cache_alloc(GFP_KERNEL);
+	if (!entry) {
+		zswap_reject_kmemcache_fail++;
+		ret = -ENOMEM;
+		goto reject;
+	}
+
+	/* compress */
+	dst = get_cpu_var(zswap_dstmem);
+	src = kmap_atomic(page, KM_USER0);
+	ret = lzo1x_1_compress(src, PAGE_SIZE, dst, &dlen,
+			       __get_cpu_var(zswap_wrkmem));
+	kunmap_atomic(src, KM_USER0);
+	if (ret != LZO_E_OK) {
+		ret = -EINVAL;
+		goto freepage;
+	}
+
+	/* store, we cannot sleep with the per-cpu buffers */
+	ret = zbud_alloc(zswap_pool, sizeof(*zhdr) + dlen,
+			 __GFP_NORETRY | __GFP_NOWARN, &handle);
+	if (ret == -ENOSPC) {
+		zswap_reject_compress_poor++;
+		goto freepage;
+	}
+	if (ret) {
+		zswap_reject_alloc_fail++;
+		goto freepage;
+	}
+	zhdr = zbud_map(zswap_pool, handle);
+	zhdr->swpentry = swpentry;
+	buf = (u8 *)(zhdr + 1);
+	memcpy(buf, dst, dlen);
+	zbud_unmap(zswap_pool, handle);
+	put_cpu_var(zswap_dstmem);
+
+	/* populate entry */
+	entry->offset = offset;
+	entry->handle = handle;
+	entry->length = dlen;
+
+	/* map */
+	spin_lock(&tree->lock);
+	do {
+		ret = zswap_rb_insert(&tree->rbroot, entry, &dupentry);
+		if (ret == -EEXIST) {
+			zswap_duplicate_entry++;
+			/* remove the older version of the page */
+			zswap_rb_erase(&tree->rbroot, dupentry);
+			zswap_entry_put(dupentry);
+		}
+	} while (ret == -EEXIST);
+	spin_unlock(&tree->lock);
+
+	/* update stats */
+	atomic_inc(&zswap_stored_pages);
+	zswap_pool_pages = zbud_get_pool_size(zswap_pool);
+
+	return 0;
+
+freepage:
+	put_cpu_var(zswap_dstmem);
+	zswap_entry_cache_free(entry);
+reject:
+	/* the page goes to the swap device, forget about older copies */
+	zswap_invalidate_page(type, offset);
+	return ret;
+}
+
+/**
+ * zswap_load() - fill a swap cache page from zswap
+ * @page:	locked, not uptodate swap cache page
+ *
+ * Returns 0 if the page was found and decompressed. The entry stays in
+ * zswap until its swap slot is freed.
+ */
+int zswap_load(struct page *page)
+{
+	swp_entry_t swpentry = { .val = page_private(page), };
+	struct zswap_tree *tree = zswap_trees[swp_type(swpentry)];
+	struct zswap_entry *entry;
+	int ret;
+
+	if (!tree)
+		return -ENODEV;
+
+	/* find */
+	spin_lock(&tree->lock);
+	entry = zswap_rb_search(&tree->rbroot, swp_offset(swpentry));
+	if (!entry) {
+		/* entry was written back, or was never stored */
+		spin_unlock(&tree->lock);
+		return -ENOENT;
+	}
+	zswap_entry_get(entry);
+	spin_unlock(&tree->lock);
+
+	/* decompress */
+	ret = zswap_decompress(entry, page);
+	BUG_ON(ret);
+
+	spin_lock(&tree->lock);
+	zswap_entry_put(entry);
+	spin_unlock(&tree->lock);
+
+	return 0;
+}
+
+/**
+ * zswap_invalidate_page() - drop the copy of a freed swap slot
+ *
+ * Called under swap_lock when the slot is freed.
+ */
+void zswap_invalidate_page(unsigned type, pgoff_t offset)
+{
+	struct zswap_tree *tree = zswap_trees[type];
+	struct zswap_entry *entry;
+
+	if (!tree)
+		return;
+
+	spin_lock(&tree->lock);
+	entry = zswap_rb_search(&tree->rbroot, offset);
+	if (entry) {
+		zswap_rb_erase(&tree->rbroot, entry);
+		zswap_entry_put(entry);
+	}
+	spin_unlock(&tree->lock);
+}
+
+/**
+ * zswap_invalidate_area() - drop all the copies of a swap area
+ *
+ * Called by swapoff once all the slots are unused.
+ */
+void zswap_invalidate_area(unsigned type)
+{
+	struct zswap_tree *tree;
+	struct rb_node *node;
+
+	spin_lock(&zswap_trees_lock);
+	tree = zswap_trees[type];
+	zswap_trees[type] = NULL;
+	spin_unlock(&zswap_trees_lock);
+	if (!tree)
+		return;
+
+	/* reclaim of the other areas may be writing back one of ours */
+	wait_event(zswap_writeback_wait, !zswap_tree_busy(tree));
+
+	spin_lock(&tree->lock);
+	while ((node = rb_first(&tree->rbroot))) {
+		struct zswap_entry *entry;
+
+		entry = rb_entry(node, struct zswap_entry, rbnode);
+		zswap_rb_erase(&tree->rbroot, entry);
+		zswap_entry_put(entry);
+	}
+	spin_unlock(&tree->lock);
+	kfree(tree);
+}
+
+/**
+ * zswap_init_area() - set up the index of a new swap area
+ *
+ * Called by swapon. If this fails, the area just bypasses zswap.
+ */
+void zswap_init_area(unsigned type)
+{
+	struct zswap_tree *tree;
+
+	tree = kzalloc(sizeof(struct zswap_tree), GFP_KERNEL);
+	if (!tree) {
+		pr_err("alloc failed, zswap disabled for swap type %d\n", type);
+		return;
+	}
+
+	tree->rbroot = RB_ROOT;
+	spin_lock_init(&tree->lock);
+	spin_lock(&zswap_trees_lock);
+	zswap_trees[type] = tree;
+	spin_unlock(&zswap_trees_lock);
+}
+
+/*********************************
+* debugfs functions
+**********************************/
+#ifdef CONFIG_DEBUG_FS
+
+static struct dentry *zswap_debugfs_root;
+
+static int __init zswap_debugfs_init(void)
+{
+	if (!debugfs_initialized())
+		return -ENODEV;
+
+	zswap_debugfs_root = debugfs_create_dir("zswap", NULL);
+	if (!zswap_debugfs_root)
+		return -ENOMEM;
+
+	debugfs_create_u64("pool_limit_hit", S_IRUGO,
+			zswap_debugfs_root, &zswap_pool_limit_hit);
+	debugfs_create_u64("reject_reclaim_fail", S_IRUGO,
+			zswap_debugfs_root, &zswap_reject_reclaim_fail);
+	debugfs_create_u64("reject_alloc_fail", S_IRUGO,
+			zswap_debugfs_root, &zswap_reject_alloc_fail);
+	debugfs_create_u64("reject_kmemcache_fail", S_IRUGO,
+			zswap_debugfs_root, &zswap_reject_kmemcache_fail);
+	debugfs_create_u64("reject_compress_poor", S_IRUGO,
+			zswap_debugfs_root, &zswap_reject_compress_poor);
+	debugfs_create_u64("written_back_pages", S_IRUGO,
+			zswap_debugfs_root, &zswap_written_back_pages);
+	debugfs_create_u64("duplicate_entry", S_IRUGO,
+			zswap_debugfs_root, &zswap_duplicate_entry);
+	debugfs_create_u64("pool_pages", S_IRUGO,
+			zswap_debugfs_root, &zswap_pool_pages);
+	debugfs_create_u32("stored_pages", S_IRUGO,
+			zswap_debugfs_root, (u32 *)&zswap_stored_pages);
+
+	return 0;
+}
+#else
+static int __init zswap_debugfs_init(void)
+{
+	return 0;
+}
+#endif
+
+/*********************************
+* module init
+**********************************/
+static int __init init_zswap(void)
+{
+	int cpu;
+
+	zswap_entry_cache = KMEM_CACHE(zswap_entry, 0);
+	if (!zswap_entry_cache)
+		goto error;
+
+	for_each_possible_cpu(cpu) {
+		if (zswap_cpu_init(cpu))
+			goto cpufail;
+	}
+
+	/* only set up last, the swap hooks do nothing until then */
+	zswap_pool = zbud_create_pool(GFP_KERNEL, &zswap_zbud_ops);
+	if (!zswap_pool)
+		goto cpufail;
+
+	pr_info("using lzo compressor\n");
+	if (zswap_debugfs_init())
+		pr_warn("debugfs initialization failed\n");
+	return 0;
+
+cpufail:
+	for_each_possible_cpu(cpu)
+		zswap_cpu_free(cpu);
+	kmem_cache_destroy(zswap_entry_cache);
+error:
+	pr_err("initialization failed, zswap disabled\n");
+	return -ENOMEM;
+}
+late_initcall(init_zswap);
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("Compressed cache for swap pages");
@@ -129,6 +129,7 @@
 #include <linux/vmalloc.h>
 #include <linux/unistd.h>
 #include <linux/string.h>
+#include <linux/ctype.h>
 #include <linux/ptrace.h>
 #include <linux/errno.h>
 #include <linux/ioport.h>
@@ -196,6 +197,11 @@
 #define F_QUEUE_MAP_RND (1<<13)	/* queue map Random */
 #define F_QUEUE_MAP_CPU (1<<14)	/* queue map mirrors smp_processor_id() */
 #define F_NODE          (1<<15)	/* Node memory alloc*/
+#define F_RX_SEQ        (1<<16)	/* Check per-flow sequence on receive */
+
+/* Xmit modes */
+#define M_START_XMIT		0	/* Default normal TX */
+#define M_NETIF_RECEIVE		1	/* Inject packets into the stack */
 
 /* Thread control flag bits */
 #define T_STOP        (1<<0)	/* Stop run */
@@ -215,12 +221,17 @@ static struct proc_dir_entry *pg_proc_dir;
 
 #define MAX_CFLOWS  65536
 
+#define MAX_IMIX_ENTRIES 20
+#define IMIX_PRECISION 100 /* Precision of IMIX distribution */
+
 #define VLAN_TAG_SIZE(x) ((x)->vlan_id == 0xffff ? 0 : 4)
 #define SVLAN_TAG_SIZE(x) ((x)->svlan_id == 0xffff ? 0 : 4)
 
 struct flow_state {
 	__be32 cur_daddr;
 	int count;
+	__u16 tx_seq;		/* next sequence to stamp (M_NETIF_RECEIVE) */
+	__u16 rx_seq;		/* next sequence expected by the checker */
 #ifdef CONFIG_XFRM
 	struct xfrm_state *x;
 #endif
@@ -230,6 +241,12 @@ struct flow_state {
 /* flow flag bits */
 #define F_INIT   (1<<0)		/* flow has been initialized */
 
+struct imix_pkt {
+	__u32 size;
+	__u64 weight;
+	__u64 count_so_far;
+};
+
 struct pktgen_dev {
 	/*
 	 * Try to keep frequent/infrequent used vars. separated.
@@ -249,6 +266,11 @@ struct pktgen_dev {
 
 	int min_pkt_size;	/* = ETH_ZLEN; */
 	int max_pkt_size;	/* = ETH_ZLEN; */
+	unsigned int n_imix;
+	struct imix_pkt imix_entries[MAX_IMIX_ENTRIES];
+	/* Maps 0-IMIX_PRECISION range to imix_entries based on weight */
+	__u8 imix_distribution[IMIX_PRECISION];
+	__u8 xmit_mode;		/* M_START_XMIT or M_NETIF_RECEIVE */
 	int pkt_overhead;	/* overhead for MPLS, VLANs, IPSEC etc */
 	int nfrags;
 	struct page *page;
@@ -259,6 +281,16 @@ struct pktgen_dev {
 	__u64 tx_bytes;		/* How many bytes we've transmitted */
 	__u64 errors;		/* Errors when trying to transmit, */
 
+	/* M_NETIF_RECEIVE sequence checker, see pktgen_rx_check() */
+	struct packet_type rx_ptype;
+	spinlock_t rx_lock;
+	int rx_check;		/* rx_ptype is registered */
+	__u64 rx_seen;
+	__u64 rx_in_order;
+	__u64 rx_lost;		/* sum of sequence gaps */
+	__u64 rx_reordered;	/* arrived after a later packet of its flow */
+	__u64 rx_dup;
+
 	/* runtime counters relating to clone_skb */
 
 	__u64 allocated_skbs;
@@ -538,6 +570,18 @@ static int pktgen_if_show(struct seq_file *seq, void *v)
 		   (unsigned long long)pkt_dev->count, pkt_dev->min_pkt_size,
 		   pkt_dev->max_pkt_size);
 
+	if (pkt_dev->n_imix) {
+		unsigned i;
+
+		seq_puts(seq, "     imix_weights: ");
+		for (i = 0; i < pkt_dev->n_imix; i++)
+			seq_printf(seq, "%u,%llu ",
+				   pkt_dev->imix_entries[i].size,
+				   (unsigned long long)
+				   pkt_dev->imix_entries[i].weight);
+		seq_puts(seq, "\n");
+	}
+
 	seq_printf(seq,
 		   "     frags: %d  delay: %llu  clone_skb: %d  ifname: %s\n",
 		   pkt_dev->nfrags, (unsigned long long) pkt_dev->delay,
@@ -546,6 +590,10 @@ static int pktgen_if_show(struct seq_file *seq, void *v)
 	seq_printf(seq, "     flows: %u flowlen: %u\n", pkt_dev->cflows,
 		   pkt_dev->lflow);
 
+	seq_printf(seq, "     xmit_mode: %s\n",
+		   pkt_dev->xmit_mode == M_NETIF_RECEIVE ?
+		   "netif_receive" : "start_xmit");
+
 	seq_printf(seq,
 		   "     queue_map_min: %u  queue_map_max: %u\n",
 		   pkt_dev->queue_map_min,
@@ -682,6 +730,9 @@ static int pktgen_if_show(struct seq_file *seq, void *v)
 	if (pkt_dev->flags & F_NODE)
 		seq_printf(seq, "NODE_ALLOC  ");
 
+	if (pkt_dev->flags & F_RX_SEQ)
+		seq_printf(seq, "RX_SEQ  ");
+
 	seq_puts(seq, "\n");
 
 	/* not really stopped, more like last-running-at */
@@ -694,6 +745,26 @@ static int pktgen_if_show(struct seq_file *seq, void *v)
 		   (unsigned long long)pkt_dev->sofar,
 		   (unsigned long long)pkt_dev->errors);
 
+	if (pkt_dev->n_imix) {
+		unsigned i;
+
+		seq_puts(seq, "     imix_size_counts: ");
+		for (i = 0; i < pkt_dev->n_imix; i++)
+			seq_printf(seq, "%u,%llu ",
+				   pkt_dev->imix_entries[i].size,
+				   (unsigned long long)pkt_dev->imix_entries[i].count_so_far);
+		seq_puts(seq, "\n");
+	}
+
+	if (pkt_dev->flags & F_RX_SEQ)
+		seq_printf(seq,
+			   "     rx_seen: %llu  in_order: %llu  lost: %llu  reordered: %llu  dup: %llu\n",
+			   (unsigned long long)pkt_dev->rx_seen,
+			   (unsigned long long)pkt_dev->rx_in_order,
+			   (unsigned long long)pkt_dev->rx_lost,
+			   (unsigned long long)pkt_dev->rx_reordered,
+			   (unsigned long long)pkt_dev->rx_dup);
+
 	seq_printf(seq,
 		   "     started: %lluus  stopped: %lluus idle: %lluus\n",
 		   (unsigned long long) ktime_to_us(pkt_dev->started_at),
@@ -848,6 +919,100 @@ static ssize_t get_labels(const char __user *buffer, struct pktgen_dev *pkt_dev)
 	return i;
 }
 
+/* Parses "size,weight size,weight ..." for the imix_weights command */
+static ssize_t get_imix_entries(const char __user *buffer,
+				struct pktgen_dev *pkt_dev)
+{
+	unsigned n = 0;
+	char c;
+	ssize_t i = 0;
+	int len;
+
+	pkt_dev->n_imix = 0;
+	do {
+		unsigned long size, weight;
+
+		len = num_arg(&buffer[i], 10, &size);
+		if (len < 0)
+			return len;
+		if (len == 0) {
+			/* trailing blank */
+			if (n)
+				break;
+			return -EINVAL;
+		}
+		i += len;
+		if (get_user(c, &buffer[i]))
+			return -EFAULT;
+		/* Check for comma between size and weight */
+		if (c != ',')
+			return -EINVAL;
+		i++;
+
+		len = num_arg(&buffer[i], 10, &weight);
+		if (len <= 0)
+			return len ? len : -EINVAL;
+		/*
+		 * Bounded so that neither the sum of the weights nor a weight
+		 * times IMIX_PRECISION can wrap in fill_imix_distribution().
+		 */
+		if (weight == 0 || weight > UINT_MAX)
+			return -EINVAL;
+		i += len;
+
+		if (size < 14 + 20 + 8)
+			size = 14 + 20 + 8;
+		pkt_dev->imix_entries[n].size = size;
+		pkt_dev->imix_entries[n].weight = weight;
+		pkt_dev->imix_entries[n].count_so_far = 0;
+
+		if (get_user(c, &buffer[i]))
+			return -EFAULT;
+		i++;
+		n++;
+		if (n >= MAX_IMIX_ENTRIES && c == ' ') {
+			ssize_t j = i;
+
+			/* blanks may trail the last entry, another entry not */
+			do {
+				if (get_user(c, &buffer[j++]))
+					return -EFAULT;
+			} while (c == ' ' || c == '\t');
+			if (isdigit(c))
+				return -E2BIG;
+			break;
+		}
+	} while (c == ' ');
+
+	pkt_dev->n_imix = n;
+	return i;
+}
+
+/*
+ * Spread IMIX_PRECISION slots over the entries in proportion to their
+ * weight, so picking a size at run time is a single random lookup.
+ */
+static void fill_imix_distribution(struct pktgen_dev *pkt_dev)
+{
+	__u64 cumulative_prob = 0;
+	__u64 total_weight = 0;
+	int entry = 0;
+	int i;
+
+	for (i = 0; i < pkt_dev->n_imix; i++)
+		total_weight += pkt_dev->imix_entries[i].weight;
+
+	/* Fill cumulative_probabilities with sum of normalized probabilities */
+	for (i = 0; i < pkt_dev->n_imix - 1; i++) {
+		cumulative_prob += div64_u64(pkt_dev->imix_entries[i].weight *
+					     IMIX_PRECISION, total_weight);
+		for (; entry < cumulative_prob; entry++)
+			pkt_dev->imix_distribution[entry] = i;
+	}
+	for (; entry < IMIX_PRECISION; entry++)
+		pkt_dev->imix_distribution[entry] = pkt_dev->n_imix - 1;
+}
+
 static ssize_t pktgen_if_write(struct file *file,
 			       const char __user * user_buffer, size_t count,
 			       loff_t * offset)
@@ -1242,12 +1407,18 @@ static ssize_t pktgen_if_write(struct file *file,
 		else if (strcmp(f, "!NODE_ALLOC") == 0)
 			pkt_dev->flags &= ~F_NODE;
 
+		else if (strcmp(f, "RX_SEQ") == 0)
+			pkt_dev->flags |= F_RX_SEQ;
+
+		else if (strcmp(f, "!RX_SEQ") == 0)
+			pkt_dev->flags &= ~F_RX_SEQ;
+
 		else {
 			sprintf(pg_result,
 				"Flag -:%s:- unknown\nAvailable flags, (prepend ! to un-set flag):\n%s",
 				f,
 				"IPSRC_RND, IPDST_RND, UDPSRC_RND, UDPDST_RND, "
-				"MACSRC_RND, MACDST_RND, TXSIZE_RND, IPV6, MPLS_RND, VID_RND, SVID_RND, FLOW_SEQ, IPSEC, NODE_ALLOC\n");
+				"MACSRC_RND, MACDST_RND, TXSIZE_RND, IPV6, MPLS_RND, VID_RND, SVID_RND, FLOW_SEQ, IPSEC, NODE_ALLOC, RX_SEQ\n");
 			return count;
 		}
 		sprintf(pg_result, "OK: flags=0x%x", pkt_dev->flags);
@@ -1532,6 +1703,51 @@ static ssize_t pktgen_if_write(struct file *file,
 		return count;
 	}
 
+	if (!strcmp(name, "imix_weights")) {
+		if (pkt_dev->running)
+			return -EBUSY;
+
+		len = get_imix_entries(&user_buffer[i], pkt_dev);
+		if (len < 0) {
+			pkt_dev->n_imix = 0;
+			return len;
+		}
+		i += len;
+		fill_imix_distribution(pkt_dev);
+		sprintf(pg_result, "OK: imix_weights=%u entries",
+			pkt_dev->n_imix);
+		return count;
+	}
+
+	if (!strcmp(name, "xmit_mode")) {
+		char f[32];
+
+		memset(f, 0, 32);
+		len = strn_len(&user_buffer[i], sizeof(f) - 1);
+		if (len < 0)
+			return len;
+
+		if (copy_from_user(f, &user_buffer[i], len))
+			return -EFAULT;
+		i += len;
+
+		if (pkt_dev->running)
+			return -EBUSY;
+
+		if (strcmp(f, "start_xmit") == 0) {
+			pkt_dev->xmit_mode = M_START_XMIT;
+		} else if (strcmp(f, "netif_receive") == 0) {
+			pkt_dev->xmit_mode = M_NETIF_RECEIVE;
+		} else {
+			sprintf(pg_result,
+				"xmit_mode -:%s:- unknown\nAvailable modes: %s",
+				f, "start_xmit, netif_receive\n");
+			return count;
+		}
+		sprintf(pg_result, "OK: xmit_mode=%s", f);
+		return count;
+	}
+
 	if (!strcmp(name, "queue_map_min")) {
 		len = num_arg(&user_buffer[i], 5, &value);
 		if (len < 0)
@@ -2086,6 +2302,11 @@ static void pktgen_setup_inject(struct pktgen_dev *pkt_dev)
 	/* Set up Dest MAC */
 	memcpy(&(pkt_dev->hh[0]), pkt_dev->dst_mac, ETH_ALEN);
 
+	/* Injected packets must look like they are for us, not PACKET_OTHERHOST */
+	if (pkt_dev->xmit_mode == M_NETIF_RECEIVE &&
+	    is_zero_ether_addr(pkt_dev->dst_mac))
+		memcpy(&(pkt_dev->hh[0]), pkt_dev->odev->dev_addr, ETH_ALEN);
+
 	/* Set up pkt size */
 	pkt_dev->cur_pkt_size = pkt_dev->min_pkt_size;
 
@@ -2489,7 +2710,13 @@ static void mod_cur_headers(struct pktgen_dev *pkt_dev)
 		}
 	}
 
-	if (pkt_dev->min_pkt_size < pkt_dev->max_pkt_size) {
+	if (pkt_dev->n_imix) {
+		__u8 entry_index =
+			pkt_dev->imix_distribution[random32() % IMIX_PRECISION];
+
+		pkt_dev->cur_pkt_size = pkt_dev->imix_entries[entry_index].size;
+		pkt_dev->imix_entries[entry_index].count_so_far++;
+	} else if (pkt_dev->min_pkt_size < pkt_dev->max_pkt_size) {
 		__u32 t;
 		if (pkt_dev->flags & F_TXSIZE_RND) {
 			t = random32() %
@@ -2686,7 +2913,15 @@ static void pktgen_finalize_skb(struct pktgen_dev *pkt_dev, struct sk_buff *skb,
 	 * convert them to network byte order
 	 */
 	pgh->pgh_magic = htonl(PKTGEN_MAGIC);
-	pgh->seq_num = htonl(pkt_dev->seq_num);
+	if (pkt_dev->xmit_mode == M_NETIF_RECEIVE &&
+	    (pkt_dev->flags & F_RX_SEQ)) {
+		/* flow index in the upper, per-flow sequence in the lower half */
+		int flow = pkt_dev->cflows ? pkt_dev->curfl : 0;
+
+		pgh->seq_num = htonl(flow << 16 |
+				     pkt_dev->flows[flow].tx_seq++);
+	} else
+		pgh->seq_num = htonl(pkt_dev->seq_num);
 
 	do_gettimeofday(&timestamp);
 	pgh->tv_sec = htonl(timestamp.tv_sec);
@@ -3116,11 +3351,95 @@ static struct sk_buff *fill_packet(struct net_device *odev,
 
 static void pktgen_clear_counters(struct pktgen_dev *pkt_dev)
 {
+	int i;
+
 	pkt_dev->seq_num = 1;
 	pkt_dev->idle_acc = 0;
 	pkt_dev->sofar = 0;
 	pkt_dev->tx_bytes = 0;
 	pkt_dev->errors = 0;
+
+	for (i = 0; i < pkt_dev->n_imix; i++)
+		pkt_dev->imix_entries[i].count_so_far = 0;
+
+	spin_lock_bh(&pkt_dev->rx_lock);
+	pkt_dev->rx_seen = 0;
+	pkt_dev->rx_in_order = 0;
+	pkt_dev->rx_lost = 0;
+	pkt_dev->rx_reordered = 0;
+	pkt_dev->rx_dup = 0;
+	/*
+	 * Only the flows in use: counters are cleared whenever the device
+	 * is started, and the sender does not look beyond cflows.
+	 */
+	for (i = 0; i < max_t(unsigned, pkt_dev->cflows, 1); i++) {
+		pkt_dev->flows[i].tx_seq = 0;
+		pkt_dev->flows[i].rx_seq = 0;
+	}
+	spin_unlock_bh(&pkt_dev->rx_lock);
+}
+
+/*
+ * Sequence checker for M_NETIF_RECEIVE.  It sits in ptype_base next to
+ * ip_rcv()/ipv6_rcv(), so it sees the injected packets in the order the
+ * stack gets them, i.e. after RPS steering and the per-cpu backlogs.
+ */
+static int pktgen_rx_check(struct sk_buff *skb, struct net_device *dev,
+			   struct packet_type *pt, struct net_device *orig_dev)
+{
+	struct pktgen_dev *pkt_dev = container_of(pt, struct pktgen_dev,
+						  rx_ptype);
+	const struct pktgen_hdr *pgh;
+	struct pktgen_hdr _pgh;
+	struct flow_state *f;
+	unsigned int off;
+	u16 delta;
+	u32 seq;
+
+	if (skb->protocol == htons(ETH_P_IP)) {
+		const struct iphdr *iph;
+		struct iphdr _iph;
+
+		iph = skb_header_pointer(skb, 0, sizeof(_iph), &_iph);
+		if (!iph || iph->protocol != IPPROTO_UDP)
+			goto out;
+		off = iph->ihl * 4;
+	} else {
+		const struct ipv6hdr *ip6h;
+		struct ipv6hdr _ip6h;
+
+		ip6h = skb_header_pointer(skb, 0, sizeof(_ip6h), &_ip6h);
+		if (!ip6h || ip6h->nexthdr != IPPROTO_UDP)
+			goto out;
+		off = sizeof(_ip6h);
+	}
+
+	pgh = skb_header_pointer(skb, off + sizeof(struct udphdr),
+				 sizeof(_pgh), &_pgh);
+	if (!pgh || pgh->pgh_magic != htonl(PKTGEN_MAGIC))
+		goto out;
+
+	seq = ntohl(pgh->seq_num);
+	f = &pkt_dev->flows[seq >> 16];
+
+	spin_lock(&pkt_dev->rx_lock);
+	pkt_dev->rx_seen++;
+	delta = (u16)seq - f->rx_seq;
+	if (delta == 0) {
+		pkt_dev->rx_in_order++;
+		f->rx_seq++;
+	} else if (delta < 0x8000) {
+		pkt_dev->rx_lost += delta;
+		f->rx_seq = (u16)seq + 1;
+	} else if (delta == 0xffff) {
+		pkt_dev->rx_dup++;
+	} else {
+		pkt_dev->rx_reordered++;
+	}
+	spin_unlock(&pkt_dev->rx_lock);
+out:
+	kfree_skb(skb);
+	return NET_RX_SUCCESS;
 }
 
 /* Set up structure for sending pkts, clear counters */
@@ -3142,6 +3461,16 @@ static void pktgen_run(struct pktgen_thread *t)
 
 		if (pkt_dev->odev) {
 			pktgen_clear_counters(pkt_dev);
+			if (pkt_dev->xmit_mode == M_NETIF_RECEIVE &&
+			    (pkt_dev->flags & F_RX_SEQ) && !pkt_dev->rx_check) {
+				pkt_dev->rx_ptype.type = htons(
+					pkt_dev->flags & F_IPV6 ?
+					ETH_P_IPV6 : ETH_P_IP);
+				pkt_dev->rx_ptype.dev = pkt_dev->odev;
+				pkt_dev->rx_ptype.func = pktgen_rx_check;
+				dev_add_pack(&pkt_dev->rx_ptype);
+				pkt_dev->rx_check = 1;
+			}
 			pkt_dev->running = 1;	/* Cranke yeself! */
 			pkt_dev->skb = NULL;
 			pkt_dev->started_at =
@@ -3237,6 +3566,12 @@ static void pktgen_run_all_threads(void)
 
 	mutex_unlock(&pktgen_thread_lock);
 
+	/*
+	 * Sequence checkers unhooked by the previous run must be out of
+	 * ptype_base readers' sight before pktgen_run() links them again.
+	 */
+	synchronize_net();
+
 	/* Propagate thread->control  */
 	schedule_timeout_interruptible(msecs_to_jiffies(125));
 
@@ -3289,6 +3624,14 @@ static void show_results(struct pktgen_dev *pkt_dev, int nr_frags)
 		     (unsigned long long)mbps,
 		     (unsigned long long)bps,
 		     (unsigned long long)pkt_dev->errors);
+
+	if (pkt_dev->flags & F_RX_SEQ)
+		p += sprintf(p, "\n  rx_seen: %llu in_order: %llu lost: %llu reordered: %llu dup: %llu",
+			     (unsigned long long)pkt_dev->rx_seen,
+			     (unsigned long long)pkt_dev->rx_in_order,
+			     (unsigned long long)pkt_dev->rx_lost,
+			     (unsigned long long)pkt_dev->rx_reordered,
+			     (unsigned long long)pkt_dev->rx_dup);
 }
 
 /* Set stopped-at timer, remove from running list, do counters & statistics */
@@ -3307,6 +3650,13 @@ static int pktgen_stop_device(struct pktgen_dev *pkt_dev)
 	pkt_dev->stopped_at = ktime_now();
 	pkt_dev->running = 0;
 
+	/* May be called under if_lock; pktgen_run_all_threads() and
+	 * pktgen_remove_device() wait for the grace period. */
+	if (pkt_dev->rx_check) {
+		__dev_remove_pack(&pkt_dev->rx_ptype);
+		pkt_dev->rx_check = 0;
+	}
+
 	show_results(pkt_dev, nr_frags);
 
 	return 0;
@@ -3523,6 +3873,73 @@ unlock:
 	}
 }
 
+/*
+ * M_NETIF_RECEIVE: hand the packet to the stack as if odev had received
+ * it, to load the RX path (RPS, netfilter, routing, sockets) without an
+ * external generator.  A clone is injected when clone_skb is set, as the
+ * stack consumes and modifies what it is given.
+ */
+static void pktgen_receive(struct pktgen_dev *pkt_dev)
+{
+	struct net_device *odev = pkt_dev->odev;
+	struct sk_buff *skb;
+	int ret;
+
+	/* If device is offline, then don't inject */
+	if (unlikely(!netif_running(odev) || !netif_carrier_ok(odev))) {
+		pktgen_stop_device(pkt_dev);
+		return;
+	}
+
+	if (unlikely(pkt_dev->delay == ULLONG_MAX)) {
+		pkt_dev->next_tx = ktime_add_ns(ktime_now(), ULONG_MAX);
+		return;
+	}
+
+	if (pkt_dev->clone_skb) {
+		if (!pkt_dev->skb ||
+		    ++pkt_dev->clone_count >= pkt_dev->clone_skb) {
+			kfree_skb(pkt_dev->skb);
+			pkt_dev->skb = fill_packet(odev, pkt_dev);
+			if (pkt_dev->skb) {
+				pkt_dev->allocated_skbs++;
+				pkt_dev->clone_count = 0;
+			}
+		}
+		skb = pkt_dev->skb ? skb_clone(pkt_dev->skb, GFP_KERNEL) : NULL;
+	} else {
+		skb = fill_packet(odev, pkt_dev);
+		if (skb)
+			pkt_dev->allocated_skbs++;
+	}
+	if (skb == NULL) {
+		pr_err("ERROR: couldn't allocate skb in fill_packet\n");
+		schedule();
+		return;
+	}
+	pkt_dev->last_pkt_size = skb->len;
+
+	if (pkt_dev->delay)
+		spin(pkt_dev, pkt_dev->next_tx);
+
+	skb->protocol = eth_type_trans(skb, odev);
+
+	local_bh_disable();
+	ret = netif_receive_skb(skb);
+	local_bh_enable();
+
+	pkt_dev->sofar++;
+	pkt_dev->seq_num++;
+	if (ret == NET_RX_DROP)
+		pkt_dev->errors++;
+	else
+		pkt_dev->tx_bytes += pkt_dev->last_pkt_size;
+
+	/* If pkt_dev->count is zero, then run forever */
+	if ((pkt_dev->count != 0) && (pkt_dev->sofar >= pkt_dev->count))
+		pktgen_stop_device(pkt_dev);
+}
+
 /*
  * Main loop of the thread goes here
  */
@@ -3561,7 +3978,10 @@ static int pktgen_thread_worker(void *arg)
 		__set_current_state(TASK_RUNNING);
 
 		if (likely(pkt_dev)) {
-			pktgen_xmit(pkt_dev);
+			if (pkt_dev->xmit_mode == M_NETIF_RECEIVE)
+				pktgen_receive(pkt_dev);
+			else
+				pktgen_xmit(pkt_dev);
 
 			if (need_resched())
 				pktgen_resched(pkt_dev);
@@ -3710,6 +4130,7 @@ static int pktgen_add_device(struct pktgen_thread *t, const char *ifname)
 	pkt_dev->svlan_cfi = 0;
 	pkt_dev->svlan_id = 0xffff;
 	pkt_dev->node = -1;
+	spin_lock_init(&pkt_dev->rx_lock);
 
 	err = pktgen_setup_dev(pkt_dev, ifname);
 	if (err)
@@ -3832,6 +4253,10 @@ static int pktgen_remove_device(struct pktgen_thread *t,
 	if (pkt_dev->entry)
 		remove_proc_entry(pkt_dev->entry->name, pg_proc_dir);
 
+	/* pktgen_rx_check() may still be looking at us */
+	if (pkt_dev->rx_ptype.func)
+		synchronize_net();
+
 #ifdef CONFIG_XFRM
 	free_SAs(pkt_dev);
 #endif
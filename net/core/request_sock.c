@@ -52,10 +52,18 @@ int reqsk_queue_alloc(struct request_sock_queue *queue,
 	if (lopt == NULL)
 		return -ENOMEM;
 
-	for (lopt->max_qlen_log = 3;
-	     (1 << lopt->max_qlen_log) < nr_table_entries;
-	     lopt->max_qlen_log++);
+	for (queue->max_qlen_log = 3;
+	     (1 << queue->max_qlen_log) < nr_table_entries;
+	     queue->max_qlen_log++);
 
+	/* Hashed requests of an earlier listen() on this socket may still be
+	 * waiting for their timer: move to a new generation so that they no
+	 * longer count, and start the accounting afresh.
+	 */
+	queue->listen_gen++;
+	smp_wmb();
+	atomic_set(&queue->qlen, 0);
+	atomic_set(&queue->young, 0);
 	get_random_bytes(&lopt->hash_rnd, sizeof(lopt->hash_rnd));
 	rwlock_init(&queue->syn_wait_lock);
 	queue->rskq_accept_head = NULL;
@@ -117,6 +125,7 @@ void reqsk_queue_destroy(struct request_sock_queue *queue)
 			while ((req = lopt->syn_table[i]) != NULL) {
 				lopt->syn_table[i] = req->dl_next;
 				lopt->qlen--;
+				__reqsk_queue_removed(queue, req);
 				reqsk_free(req);
 			}
 		}
@@ -55,6 +55,7 @@
 #include <linux/cache.h>
 #include <linux/rtnetlink.h>
 #include <linux/init.h>
+#include <linux/cpu.h>
 #include <linux/scatterlist.h>
 #include <linux/errqueue.h>
 
@@ -146,12 +147,115 @@ static void skb_under_panic(struct sk_buff *skb, int sz, void *here)
 	BUG();
 }
 
+/*
+ * Per cpu cache of sk_buff heads for NAPI. Receive and transmit
+ * completion handle packets in bursts, so the heads are allocated and
+ * freed with the bulk slab interfaces, a batch at a time, and the heads
+ * of completed packets are handed straight to the next received ones.
+ */
+#define SKB_HEAD_CACHE_SIZE	64
+#define SKB_HEAD_CACHE_BULK	16
+
+struct skb_head_cache {
+	unsigned int count;
+	void *heads[SKB_HEAD_CACHE_SIZE];
+};
+
+static DEFINE_PER_CPU(struct skb_head_cache, skb_head_cache);
+
+/*
+ * The cache is protected by running in softirq context, or with bottom
+ * halves disabled. netpoll may call NAPI poll routines with interrupts
+ * disabled from any context, which must fall back to the slab.
+ */
+static inline bool skb_head_cache_usable(void)
+{
+	return in_softirq() && !in_irq() && !irqs_disabled();
+}
+
+static struct sk_buff *napi_skb_head_get(gfp_t gfp_mask)
+{
+	struct skb_head_cache *hc;
+
+	if (unlikely(!skb_head_cache_usable()))
+		return kmem_cache_alloc(skbuff_head_cache, gfp_mask);
+
+	hc = &__get_cpu_var(skb_head_cache);
+	if (unlikely(!hc->count)) {
+		hc->count = kmem_cache_alloc_bulk(skbuff_head_cache, gfp_mask,
+						  SKB_HEAD_CACHE_BULK,
+						  hc->heads);
+		if (unlikely(!hc->count))
+			return NULL;
+	}
+	return hc->heads[--hc->count];
+}
+
+static void napi_skb_head_put(struct sk_buff *skb)
+{
+	struct skb_head_cache *hc;
+
+	if (unlikely(!skb_head_cache_usable())) {
+		kmem_cache_free(skbuff_head_cache, skb);
+		return;
+	}
+
+	hc = &__get_cpu_var(skb_head_cache);
+	if (unlikely(hc->count == SKB_HEAD_CACHE_SIZE)) {
+		/* Keep the lower half for the next allocations */
+		hc->count -= SKB_HEAD_CACHE_SIZE / 2;
+		kmem_cache_free_bulk(skbuff_head_cache, SKB_HEAD_CACHE_SIZE / 2,
+				     hc->heads + hc->count);
+	}
+	hc->heads[hc->count++] = skb;
+}
+
+static int skb_cpu_callback(struct notifier_block *nfb,
+			    unsigned long action, void *ocpu)
+{
+	if (action == CPU_DEAD || action == CPU_DEAD_FROZEN) {
+		struct skb_head_cache *hc;
+
+		hc = &per_cpu(skb_head_cache, (unsigned long)ocpu);
+		kmem_cache_free_bulk(skbuff_head_cache, hc->count, hc->heads);
+		hc->count = 0;
+	}
+	return NOTIFY_OK;
+}
+
 /* 	Allocate a new skbuff. We do this ourselves so we can fill in a few
  *	'private' fields and also do memory statistics to find all the
  *	[BEEP] leaks.
  *
  */
 
+static void __alloc_skb_init(struct sk_buff *skb, u8 *data, unsigned int size)
+{
+	struct skb_shared_info *shinfo;
+
+	/*
+	 * Only clear those fields we need to clear, not those that we will
+	 * actually initialise below. Hence, don't put any more fields after
+	 * the tail pointer in struct sk_buff!
+	 */
+	memset(skb, 0, offsetof(struct sk_buff, tail));
+	skb->truesize = size + sizeof(struct sk_buff);
+	atomic_set(&skb->users, 1);
+	skb->head = data;
+	skb->data = data;
+	skb_reset_tail_pointer(skb);
+	skb->end = skb->tail + size;
+#ifdef NET_SKBUFF_DATA_USES_OFFSET
+	skb->mac_header = ~0U;
+#endif
+
+	/* make sure we initialize shinfo sequentially */
+	shinfo = skb_shinfo(skb);
+	memset(shinfo, 0, offsetof(struct skb_shared_info, dataref));
+	atomic_set(&shinfo->dataref, 1);
+	kmemcheck_annotate_variable(shinfo->destructor_arg);
+}
+
 /**
  *	__alloc_skb	-	allocate a network buffer
  *	@size: size to allocate
@@ -171,7 +275,6 @@ struct sk_buff *__alloc_skb(unsigned int size, gfp_t gfp_mask,
 			    int fclone, int node)
 {
 	struct kmem_cache *cache;
-	struct skb_shared_info *shinfo;
 	struct sk_buff *skb;
 	u8 *data;
 
@@ -190,27 +293,7 @@ struct sk_buff *__alloc_skb(unsigned int size, gfp_t gfp_mask,
 		goto nodata;
 	prefetchw(data + size);
 
-	/*
-	 * Only clear those fields we need to clear, not those that we will
-	 * actually initialise below. Hence, don't put any more fields after
-	 * the tail pointer in struct sk_buff!
-	 */
-	memset(skb, 0, offsetof(struct sk_buff, tail));
-	skb->truesize = size + sizeof(struct sk_buff);
-	atomic_set(&skb->users, 1);
-	skb->head = data;
-	skb->data = data;
-	skb_reset_tail_pointer(skb);
-	skb->end = skb->tail + size;
-#ifdef NET_SKBUFF_DATA_USES_OFFSET
-	skb->mac_header = ~0U;
-#endif
-
-	/* make sure we initialize shinfo sequentially */
-	shinfo = skb_shinfo(skb);
-	memset(shinfo, 0, offsetof(struct skb_shared_info, dataref));
-	atomic_set(&shinfo->dataref, 1);
-	kmemcheck_annotate_variable(shinfo->destructor_arg);
+	__alloc_skb_init(skb, data, size);
 
 	if (fclone) {
 		struct sk_buff *child = skb + 1;
@@ -259,6 +342,45 @@ struct sk_buff *__netdev_alloc_skb(struct net_device *dev,
 }
 EXPORT_SYMBOL(__netdev_alloc_skb);
 
+/**
+ *	__napi_alloc_skb - allocate an skbuff for rx in a NAPI poll routine
+ *	@napi: NAPI instance the buffer is received on
+ *	@length: length to allocate
+ *	@gfp_mask: get_free_pages mask, passed to alloc_skb
+ *
+ *	Like __netdev_alloc_skb(), with the sk_buff taken from the per cpu
+ *	cache of heads when called from the softirq context NAPI polls run
+ *	in. The buffer has NET_SKB_PAD + NET_IP_ALIGN bytes of headroom.
+ *
+ *	%NULL is returned if there is no free memory.
+ */
+struct sk_buff *__napi_alloc_skb(struct napi_struct *napi,
+		unsigned int length, gfp_t gfp_mask)
+{
+	unsigned int size = SKB_DATA_ALIGN(length + NET_SKB_PAD + NET_IP_ALIGN);
+	struct sk_buff *skb;
+	u8 *data;
+
+	skb = napi_skb_head_get(gfp_mask & ~__GFP_DMA);
+	if (unlikely(!skb))
+		return NULL;
+	prefetchw(skb);
+
+	data = kmalloc_track_caller(size + sizeof(struct skb_shared_info),
+				    gfp_mask);
+	if (unlikely(!data)) {
+		napi_skb_head_put(skb);
+		return NULL;
+	}
+	prefetchw(data + size);
+
+	__alloc_skb_init(skb, data, size);
+	skb_reserve(skb, NET_SKB_PAD + NET_IP_ALIGN);
+	skb->dev = napi->dev;
+	return skb;
+}
+EXPORT_SYMBOL(__napi_alloc_skb);
+
 void skb_add_rx_frag(struct sk_buff *skb, int i, struct page *page, int off,
 		int size)
 {
@@ -420,6 +542,24 @@ void __kfree_skb(struct sk_buff *skb)
 }
 EXPORT_SYMBOL(__kfree_skb);
 
+/**
+ *	__kfree_skb_defer - private function
+ *	@skb: buffer
+ *
+ *	Like __kfree_skb(), but the sk_buff head of an unshared buffer is
+ *	kept in the per cpu NAPI cache. For the softirq transmit completion
+ *	and receive paths.
+ */
+void __kfree_skb_defer(struct sk_buff *skb)
+{
+	skb_release_all(skb);
+	if (likely(skb->fclone == SKB_FCLONE_UNAVAILABLE))
+		napi_skb_head_put(skb);
+	else
+		kfree_skbmem(skb);
+}
+EXPORT_SYMBOL(__kfree_skb_defer);
+
 /**
  *	kfree_skb - free an sk_buff
  *	@skb: buffer to free
@@ -461,6 +601,33 @@ void consume_skb(struct sk_buff *skb)
 }
 EXPORT_SYMBOL(consume_skb);
 
+/**
+ *	napi_consume_skb - free an skbuff from transmit completion
+ *	@skb: buffer to free
+ *
+ *	Like consume_skb(), for drivers reclaiming transmitted buffers in
+ *	their NAPI poll routine: the sk_buff head goes to the per cpu cache,
+ *	from where it is reused for received packets or freed in bulk.
+ *	Safe to call from any context, outside of softirq it falls back to
+ *	dev_kfree_skb_any().
+ */
+void napi_consume_skb(struct sk_buff *skb)
+{
+	if (unlikely(!skb))
+		return;
+	if (unlikely(!skb_head_cache_usable())) {
+		dev_kfree_skb_any(skb);
+		return;
+	}
+	if (likely(atomic_read(&skb->users) == 1))
+		smp_rmb();
+	else if (likely(!atomic_dec_and_test(&skb->users)))
+		return;
+	trace_consume_skb(skb);
+	__kfree_skb_defer(skb);
+}
+EXPORT_SYMBOL(napi_consume_skb);
+
 /**
  *	skb_recycle_check - check if skb can be reused for receive
  *	@skb: buffer
@@ -2780,6 +2947,7 @@ void __init skb_init(void)
 						0,
 						SLAB_HWCACHE_ALIGN|SLAB_PANIC,
 						NULL);
+	hotcpu_notifier(skb_cpu_callback, 0);
 }
 
 /**
@@ -14,6 +14,7 @@
  */
 
 #include <linux/module.h>
+#include <linux/bootmem.h>
 #include <linux/jhash.h>
 
 #include <net/inet_connection_sock.h>
@@ -442,6 +443,184 @@ EXPORT_SYMBOL_GPL(inet_csk_reqsk_queue_hash_add);
 /* Only thing we need from tcp.h */
 extern int sysctl_tcp_synack_retries;
 
+static void inet_csk_reqsk_timer_handler(unsigned long data);
+
+static inline u32 inet_reqsk_hashfn(const __be32 laddr, const __be16 lport,
+				    const __be32 raddr, const __be16 rport)
+{
+	return jhash_3words((__force u32)laddr, (__force u32)raddr,
+			    ((u32)(__force u16)lport) << 16 | (__force u16)rport,
+			    inet_ehash_secret);
+}
+
+static inline struct inet_reqsk_bucket *
+	inet_reqsk_bucket(const struct inet_hashinfo *hashinfo, const u32 hash)
+{
+	return &hashinfo->reqhash[hash & hashinfo->reqhash_mask];
+}
+
+/*
+ * Look up a request of listener @sk in the global request hash.  Only the
+ * hash bucket is locked, so this can run in parallel with other SYN and
+ * ACK processing for the same listener.  The caller gets a reference on
+ * the request and must drop it with reqsk_put().
+ */
+struct request_sock *inet_csk_reqsk_hash_lookup(struct sock *sk,
+						const __be16 rport,
+						const __be32 raddr,
+						const __be32 laddr)
+{
+	struct inet_hashinfo *hashinfo = sk->sk_prot->h.hashinfo;
+	struct inet_reqsk_bucket *head;
+	struct request_sock *req;
+	struct hlist_node *node;
+	u32 hash;
+
+	if (hashinfo->reqhash == NULL)
+		return NULL;
+
+	hash = inet_reqsk_hashfn(laddr, inet_sk(sk)->inet_sport, raddr, rport);
+	head = inet_reqsk_bucket(hashinfo, hash);
+
+	spin_lock(&head->lock);
+	hlist_for_each_entry(req, node, &head->chain, rsk_hash_node) {
+		const struct inet_request_sock *ireq = inet_rsk(req);
+
+		if (req->rsk_listener == sk &&
+		    req->rsk_hash == hash &&
+		    reqsk_queue_current(&inet_csk(sk)->icsk_accept_queue, req) &&
+		    ireq->rmt_port == rport &&
+		    ireq->rmt_addr == raddr &&
+		    ireq->loc_addr == laddr &&
+		    AF_INET_FAMILY(req->rsk_ops->family)) {
+			atomic_inc(&req->rsk_refcnt);
+			goto out;
+		}
+	}
+	req = NULL;
+out:
+	spin_unlock(&head->lock);
+	return req;
+}
+EXPORT_SYMBOL_GPL(inet_csk_reqsk_hash_lookup);
+
+/*
+ * Queue @req for listener @sk in the global request hash.  The request
+ * takes a reference on its listener and gets its own SYN-ACK timer, so
+ * neither queueing nor retransmission needs the listener lock.
+ */
+void inet_csk_reqsk_hash_add(struct sock *sk, struct request_sock *req,
+			     unsigned long timeout)
+{
+	struct inet_hashinfo *hashinfo = sk->sk_prot->h.hashinfo;
+	const struct inet_request_sock *ireq = inet_rsk(req);
+	struct inet_reqsk_bucket *head;
+
+	req->expires = jiffies + timeout;
+	req->retrans = 0;
+	req->sk = NULL;
+	sock_hold(sk);
+	req->rsk_listener = sk;
+	req->rsk_listen_gen = inet_csk(sk)->icsk_accept_queue.listen_gen;
+	req->rsk_hash = inet_reqsk_hashfn(ireq->loc_addr, ireq->loc_port,
+					  ireq->rmt_addr, ireq->rmt_port);
+	setup_timer(&req->rsk_timer, inet_csk_reqsk_timer_handler,
+		    (unsigned long)req);
+	/* One reference for the hash, one for the pending timer */
+	atomic_set(&req->rsk_refcnt, 2);
+
+	__reqsk_queue_added(&inet_csk(sk)->icsk_accept_queue);
+	percpu_counter_inc(&hashinfo->reqsk_count);
+
+	head = inet_reqsk_bucket(hashinfo, req->rsk_hash);
+	spin_lock(&head->lock);
+	hlist_add_head(&req->rsk_hash_node, &head->chain);
+	mod_timer(&req->rsk_timer, req->expires);
+	spin_unlock(&head->lock);
+}
+EXPORT_SYMBOL_GPL(inet_csk_reqsk_hash_add);
+
+/*
+ * Remove @req from the global request hash and stop its timer.  Returns 1
+ * if we were the ones to unhash it, 0 if somebody (the timer, an RST, an
+ * ICMP error or a concurrent handshake) beat us to it.  The caller must
+ * hold its own reference on @req.
+ */
+int inet_csk_reqsk_hash_unlink(struct request_sock *req)
+{
+	struct sock *sk = req->rsk_listener;
+	struct inet_hashinfo *hashinfo = sk->sk_prot->h.hashinfo;
+	struct inet_reqsk_bucket *head = inet_reqsk_bucket(hashinfo,
+							   req->rsk_hash);
+	int found = 0;
+
+	spin_lock(&head->lock);
+	if (!hlist_unhashed(&req->rsk_hash_node)) {
+		hlist_del_init(&req->rsk_hash_node);
+		/* req->retrans only changes under this lock once hashed */
+		if (reqsk_queue_current(&inet_csk(sk)->icsk_accept_queue, req))
+			__reqsk_queue_removed(&inet_csk(sk)->icsk_accept_queue,
+					      req);
+		found = 1;
+	}
+	spin_unlock(&head->lock);
+
+	if (timer_pending(&req->rsk_timer) && del_timer(&req->rsk_timer))
+		reqsk_put(req);
+
+	if (found) {
+		percpu_counter_dec(&hashinfo->reqsk_count);
+		reqsk_put(req);
+	}
+	return found;
+}
+EXPORT_SYMBOL_GPL(inet_csk_reqsk_hash_unlink);
+
+/*
+ * A full listener is allowed to keep queueing hashed requests until the
+ * request hash as a whole grows past its limit or the protocol is under
+ * memory pressure; only then do we fall back to syncookies or drops.
+ */
+int inet_csk_reqsk_hash_pressure(const struct sock *sk)
+{
+	struct inet_hashinfo *hashinfo = sk->sk_prot->h.hashinfo;
+
+	if (sk->sk_prot->memory_pressure && *sk->sk_prot->memory_pressure)
+		return 1;
+	return percpu_counter_read_positive(&hashinfo->reqsk_count) >=
+	       hashinfo->reqsk_max;
+}
+EXPORT_SYMBOL_GPL(inet_csk_reqsk_hash_pressure);
+
+/* Size the global request hash and the limits derived from it */
+void __init inet_csk_reqsk_hash_init(struct inet_hashinfo *hashinfo,
+				     const char *name,
+				     unsigned long numentries,
+				     unsigned long timeout,
+				     unsigned long max_rto)
+{
+	unsigned int i;
+
+	hashinfo->reqhash =
+		alloc_large_system_hash(name,
+					sizeof(struct inet_reqsk_bucket),
+					numentries,
+					(totalram_pages >= 128 * 1024) ?
+					15 : 17,
+					0,
+					NULL,
+					&hashinfo->reqhash_mask,
+					64 * 1024);
+	for (i = 0; i <= hashinfo->reqhash_mask; i++) {
+		spin_lock_init(&hashinfo->reqhash[i].lock);
+		INIT_HLIST_HEAD(&hashinfo->reqhash[i].chain);
+	}
+	percpu_counter_init(&hashinfo->reqsk_count, 0);
+	hashinfo->reqsk_max = (hashinfo->reqhash_mask + 1) * 2;
+	hashinfo->reqsk_timeout = timeout;
+	hashinfo->reqsk_max_rto = max_rto;
+}
+
 
 /* Decide when to expire the request and when to resend SYN-ACK */
 static inline void syn_ack_recalc(struct request_sock *req, const int thresh,
@@ -477,7 +656,7 @@ void inet_csk_reqsk_queue_prune(struct sock *parent,
 	int thresh = max_retries;
 	unsigned long now = jiffies;
 	struct request_sock **reqp, *req;
-	int i, budget;
+	int i, budget, qlen;
 
 	if (lopt == NULL || lopt->qlen == 0)
 		return;
@@ -499,11 +678,12 @@ void inet_csk_reqsk_queue_prune(struct sock *parent,
 	 * embrions; and abort old ones without pity, if old
 	 * ones are about to clog our table.
 	 */
-	if (lopt->qlen>>(lopt->max_qlen_log-1)) {
-		int young = (lopt->qlen_young<<1);
+	qlen = reqsk_queue_qlen(queue);
+	if (qlen >> (queue->max_qlen_log - 1)) {
+		int young = reqsk_queue_len_young(queue) << 1;
 
 		while (thresh > 2) {
-			if (lopt->qlen < young)
+			if (qlen < young)
 				break;
 			thresh--;
 			young <<= 1;
@@ -534,7 +714,7 @@ void inet_csk_reqsk_queue_prune(struct sock *parent,
 					unsigned long timeo;
 
 					if (req->retrans++ == 0)
-						lopt->qlen_young--;
+						atomic_dec(&queue->young);
 					timeo = min((timeout << req->retrans), max_rto);
 					req->expires = now + timeo;
 					reqp = &req->dl_next;
@@ -561,6 +741,77 @@ void inet_csk_reqsk_queue_prune(struct sock *parent,
 }
 EXPORT_SYMBOL_GPL(inet_csk_reqsk_queue_prune);
 
+/*
+ * SYN-ACK timer of a hashed request, the per-request counterpart of
+ * inet_csk_reqsk_queue_prune().  Runs without the listener lock.
+ */
+static void inet_csk_reqsk_timer_handler(unsigned long data)
+{
+	struct request_sock *req = (struct request_sock *)data;
+	struct sock *sk = req->rsk_listener;
+	struct inet_connection_sock *icsk = inet_csk(sk);
+	struct request_sock_queue *queue = &icsk->icsk_accept_queue;
+	struct inet_hashinfo *hashinfo = sk->sk_prot->h.hashinfo;
+	struct inet_reqsk_bucket *head;
+	int max_retries, thresh, qlen, expire = 0, resend = 0;
+	u8 defer_accept;
+
+	if (sk->sk_state != TCP_LISTEN || hlist_unhashed(&req->rsk_hash_node) ||
+	    !reqsk_queue_current(queue, req))
+		goto drop;
+
+	max_retries = icsk->icsk_syn_retries ? : sysctl_tcp_synack_retries;
+	thresh = max_retries;
+	qlen = reqsk_queue_qlen(queue);
+	if (qlen >> (queue->max_qlen_log - 1)) {
+		int young = reqsk_queue_len_young(queue) << 1;
+
+		while (thresh > 2) {
+			if (qlen < young)
+				break;
+			thresh--;
+			young <<= 1;
+		}
+	}
+
+	defer_accept = ACCESS_ONCE(queue->rskq_defer_accept);
+	if (defer_accept)
+		max_retries = defer_accept;
+
+	syn_ack_recalc(req, thresh, max_retries, defer_accept,
+		       &expire, &resend);
+	if (req->rsk_ops->syn_ack_timeout)
+		req->rsk_ops->syn_ack_timeout(sk, req);
+	if (!expire &&
+	    (!resend ||
+	     !req->rsk_ops->rtx_syn_ack(sk, req, NULL) ||
+	     inet_rsk(req)->acked)) {
+		unsigned long timeo;
+
+		head = inet_reqsk_bucket(hashinfo, req->rsk_hash);
+		spin_lock(&head->lock);
+		if (hlist_unhashed(&req->rsk_hash_node) ||
+		    !reqsk_queue_current(queue, req)) {
+			spin_unlock(&head->lock);
+			goto drop;
+		}
+		if (req->retrans++ == 0)
+			atomic_dec(&queue->young);
+		spin_unlock(&head->lock);
+
+		/* The re-armed timer inherits our reference */
+		timeo = min(hashinfo->reqsk_timeout << req->retrans,
+			    hashinfo->reqsk_max_rto);
+		req->expires = jiffies + timeo;
+		mod_timer(&req->rsk_timer, req->expires);
+		return;
+	}
+
+drop:
+	inet_csk_reqsk_hash_unlink(req);
+	reqsk_put(req);
+}
+
 struct sock *inet_csk_clone(struct sock *sk, const struct request_sock *req,
 			    const gfp_t priority)
 {
@@ -702,7 +953,7 @@ void inet_csk_listen_stop(struct sock *sk)
 		sock_put(child);
 
 		sk_acceptq_removed(sk);
-		__reqsk_free(req);
+		reqsk_accepted_free(req);
 	}
 	WARN_ON(sk->sk_ack_backlog);
 }
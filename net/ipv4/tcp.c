@@ -1393,6 +1393,141 @@ int tcp_read_sock(struct sock *sk, read_descriptor_t *desc,
 }
 EXPORT_SYMBOL(tcp_read_sock);
 
+/*
+ * Zero-copy receive.  An application mmap()s a read-only window on the
+ * socket and then asks, via getsockopt(TCP_ZEROCOPY_RECEIVE), for the
+ * next bytes of the stream to be mapped at a page aligned address in that
+ * window.  Only skb fragments which hold exactly one full, page aligned
+ * page of payload can be remapped; everything else (protocol headers left
+ * in the linear area, split payload, frag lists) is reported through
+ * recv_skip_hint and must be read with an ordinary recvmsg() first.
+ */
+static int tcp_vm_fault(struct vm_area_struct *vma, struct vm_fault *vmf)
+{
+	/* Pages only ever get into this mapping via vm_insert_page(). */
+	return VM_FAULT_SIGBUS;
+}
+
+static const struct vm_operations_struct tcp_vm_ops = {
+	.fault		= tcp_vm_fault,
+};
+
+int tcp_mmap(struct file *file, struct socket *sock,
+	     struct vm_area_struct *vma)
+{
+	if (vma->vm_flags & (VM_WRITE | VM_EXEC))
+		return -EPERM;
+	vma->vm_flags &= ~(VM_MAYWRITE | VM_MAYEXEC);
+
+	/* Instruct mremap() not to grow the area behind our back. */
+	vma->vm_flags |= VM_DONTEXPAND;
+
+	vma->vm_ops = &tcp_vm_ops;
+	return 0;
+}
+EXPORT_SYMBOL(tcp_mmap);
+
+static int tcp_zerocopy_receive(struct sock *sk,
+				struct tcp_zerocopy_receive *zc)
+{
+	unsigned long address = (unsigned long)zc->address;
+	struct tcp_sock *tp = tcp_sk(sk);
+	const skb_frag_t *frags = NULL;
+	struct vm_area_struct *vma;
+	struct sk_buff *skb = NULL;
+	u32 length = 0, seq, offset;
+	int ret;
+
+	if (address != zc->address || (address & ~PAGE_MASK))
+		return -EINVAL;
+	if (sk->sk_state == TCP_LISTEN)
+		return -ENOTCONN;
+
+	down_read(&current->mm->mmap_sem);
+
+	ret = -EINVAL;
+	vma = find_vma(current->mm, address);
+	if (!vma || vma->vm_start > address || vma->vm_ops != &tcp_vm_ops)
+		goto out;
+	zc->length = min_t(unsigned long, zc->length, vma->vm_end - address);
+
+	seq = tp->copied_seq;
+	zc->length = min_t(u32, zc->length, tp->rcv_nxt - seq);
+	/* Never map past urgent data, recvmsg() has to deal with it. */
+	if (tp->urg_data) {
+		u32 urg_offset = tp->urg_seq - seq;
+
+		if (urg_offset < zc->length)
+			zc->length = urg_offset;
+	}
+	zc->length &= PAGE_MASK;
+	zc->recv_skip_hint = 0;
+
+	if (zc->length)
+		zap_page_range(vma, address, zc->length, NULL);
+
+	ret = 0;
+	while (length + PAGE_SIZE <= zc->length) {
+		if (zc->recv_skip_hint < PAGE_SIZE) {
+			if (skb) {
+				/* A partial page is left in this skb. */
+				if (zc->recv_skip_hint)
+					break;
+				skb = skb->next;
+				if (skb == (struct sk_buff *)&sk->sk_receive_queue)
+					break;
+				offset = seq - TCP_SKB_CB(skb)->seq;
+			} else {
+				skb = tcp_recv_skb(sk, seq, &offset);
+				if (!skb)
+					break;
+			}
+			zc->recv_skip_hint = skb->len - offset;
+			/* Linear data and frag lists take the copy path. */
+			if (offset < skb_headlen(skb) || skb_has_frag_list(skb))
+				break;
+			offset -= skb_headlen(skb);
+			frags = skb_shinfo(skb)->frags;
+			while (offset) {
+				if (frags->size > offset)
+					goto out;
+				offset -= frags->size;
+				frags++;
+			}
+		}
+		if (frags->size != PAGE_SIZE || frags->page_offset)
+			break;
+		ret = vm_insert_page(vma, address + length, frags->page);
+		if (ret)
+			break;
+		length += PAGE_SIZE;
+		seq += PAGE_SIZE;
+		zc->recv_skip_hint -= PAGE_SIZE;
+		frags++;
+	}
+out:
+	up_read(&current->mm->mmap_sem);
+
+	if (length) {
+		tp->copied_seq = seq;
+		/* Release the skbs whose payload is now fully mapped. */
+		while ((skb = skb_peek(&sk->sk_receive_queue)) != NULL &&
+		       !before(seq, TCP_SKB_CB(skb)->end_seq) &&
+		       !tcp_hdr(skb)->fin)
+			sk_eat_skb(sk, skb, 0);
+
+		tcp_rcv_space_adjust(sk);
+
+		/* Clean up data we have read: This will do ACK frames. */
+		tcp_cleanup_rbuf(sk, length);
+		ret = 0;
+		if (length == zc->length)
+			zc->recv_skip_hint = 0;
+	}
+	zc->length = length;
+	return ret;
+}
+
 /*
  *	This routine copies from a sock struct into the user buffer.
  *
@@ -2618,6 +2753,25 @@ static int do_tcp_getsockopt(struct sock *sk, int level,
 	case TCP_USER_TIMEOUT:
 		val = jiffies_to_msecs(icsk->icsk_user_timeout);
 		break;
+	case TCP_ZEROCOPY_RECEIVE: {
+		struct tcp_zerocopy_receive zc;
+		int err;
+
+		if (get_user(len, optlen))
+			return -EFAULT;
+		if (len != sizeof(zc))
+			return -EINVAL;
+		if (copy_from_user(&zc, optval, len))
+			return -EFAULT;
+
+		lock_sock(sk);
+		err = tcp_zerocopy_receive(sk, &zc);
+		release_sock(sk);
+
+		if (!err && copy_to_user(optval, &zc, len))
+			err = -EFAULT;
+		return err;
+	}
 	default:
 		return -ENOPROTOOPT;
 	}
@@ -3268,7 +3422,9 @@ void __init tcp_init(void)
 		spin_lock_init(&tcp_hashinfo.bhash[i].lock);
 		INIT_HLIST_HEAD(&tcp_hashinfo.bhash[i].chain);
 	}
-
+	inet_csk_reqsk_hash_init(&tcp_hashinfo, "TCP request",
+				 (tcp_hashinfo.ehash_mask + 1) / 4,
+				 TCP_TIMEOUT_INIT, TCP_RTO_MAX);
 
 	cnt = tcp_hashinfo.ehash_mask + 1;
 
@@ -3301,8 +3457,9 @@ void __init tcp_init(void)
 	sysctl_tcp_rmem[2] = max(87380, max_share);
 
 	printk(KERN_INFO "TCP: Hash tables configured "
-	       "(established %u bind %u)\n",
-	       tcp_hashinfo.ehash_mask + 1, tcp_hashinfo.bhash_size);
+	       "(established %u bind %u request %u)\n",
+	       tcp_hashinfo.ehash_mask + 1, tcp_hashinfo.bhash_size,
+	       tcp_hashinfo.reqhash_mask + 1);
 
 	tcp_register_congestion_control(&tcp_reno);
 
@@ -455,6 +455,17 @@ void tcp_v4_err(struct sk_buff *icmp_skb, u32 info)
 	switch (sk->sk_state) {
 		struct request_sock *req, **prev;
 	case TCP_LISTEN:
+		req = inet_csk_reqsk_hash_lookup(sk, th->dest,
+						 iph->daddr, iph->saddr);
+		if (req) {
+			if (seq != tcp_rsk(req)->snt_isn)
+				NET_INC_STATS_BH(net, LINUX_MIB_OUTOFWINDOWICMPS);
+			else
+				inet_csk_reqsk_hash_unlink(req);
+			reqsk_put(req);
+			goto out;
+		}
+
 		if (sock_owned_by_user(sk))
 			goto out;
 
@@ -1216,6 +1227,20 @@ static const struct tcp_request_sock_ops tcp_request_sock_ipv4_ops = {
 };
 #endif
 
+/* SYNs for most listeners are handled without the listener lock and their
+ * requests live in the global request hash.  MD5 keys, cookie transaction
+ * values and IP options are only stable under the listener lock, so
+ * listeners using them keep their requests in syn_table instead.
+ */
+static inline int tcp_v4_lockless_listener(struct sock *sk)
+{
+#ifdef CONFIG_TCP_MD5SIG
+	if (tcp_sk(sk)->md5sig_info != NULL)
+		return 0;
+#endif
+	return tcp_sk(sk)->cookie_values == NULL && inet_sk(sk)->opt == NULL;
+}
+
 int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 {
 	struct tcp_extend_values tmp_ext;
@@ -1228,6 +1253,7 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	__be32 saddr = ip_hdr(skb)->saddr;
 	__be32 daddr = ip_hdr(skb)->daddr;
 	__u32 isn = TCP_SKB_CB(skb)->when;
+	const int lockless = tcp_v4_lockless_listener(sk);
 #ifdef CONFIG_SYN_COOKIES
 	int want_cookie = 0;
 #else
@@ -1241,8 +1267,12 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	/* TW buckets are converted to open requests without
 	 * limitations, they conserve resources and peer is
 	 * evidently real one.
+	 *
+	 * Requests in the global request hash may overflow the
+	 * listener's queue until the hash itself is under pressure.
 	 */
-	if (inet_csk_reqsk_queue_is_full(sk) && !isn) {
+	if (inet_csk_reqsk_queue_is_full(sk) && !isn &&
+	    (!lockless || inet_csk_reqsk_hash_pressure(sk))) {
 		if (net_ratelimit())
 			syn_flood_warning(skb);
 #ifdef CONFIG_SYN_COOKIES
@@ -1383,7 +1413,10 @@ int tcp_v4_conn_request(struct sock *sk, struct sk_buff *skb)
 	    want_cookie)
 		goto drop_and_free;
 
-	inet_csk_reqsk_queue_hash_add(sk, req, TCP_TIMEOUT_INIT);
+	if (lockless)
+		inet_csk_reqsk_hash_add(sk, req, TCP_TIMEOUT_INIT);
+	else
+		inet_csk_reqsk_queue_hash_add(sk, req, TCP_TIMEOUT_INIT);
 	return 0;
 
 drop_and_release:
@@ -1491,9 +1524,16 @@ static struct sock *tcp_v4_hnd_req(struct sock *sk, struct sk_buff *skb)
 	const struct iphdr *iph = ip_hdr(skb);
 	struct sock *nsk;
 	struct request_sock **prev;
+	struct request_sock *req;
+
 	/* Find possible connection requests. */
-	struct request_sock *req = inet_csk_search_req(sk, &prev, th->source,
-						       iph->saddr, iph->daddr);
+	req = inet_csk_reqsk_hash_lookup(sk, th->source, iph->saddr, iph->daddr);
+	if (req) {
+		nsk = tcp_check_req(sk, skb, req, NULL);
+		reqsk_put(req);
+		return nsk;
+	}
+	req = inet_csk_search_req(sk, &prev, th->source, iph->saddr, iph->daddr);
 	if (req)
 		return tcp_check_req(sk, skb, req, prev);
 
@@ -1610,6 +1650,51 @@ csum_err:
 }
 EXPORT_SYMBOL(tcp_v4_do_rcv);
 
+/*
+ * Handle a SYN to a listener without taking the listener lock.  The new
+ * request goes to the global request hash, so SYNs for one listener are
+ * processed in parallel on the CPUs receiving them.  Returns 0 if the
+ * segment has to take the locked path after all.
+ */
+static int tcp_v4_rcv_listen_syn(struct sock *sk, struct sk_buff *skb)
+{
+	const struct tcphdr *th = tcp_hdr(skb);
+	const struct iphdr *iph = ip_hdr(skb);
+	struct request_sock *req;
+
+	if (!th->syn || th->ack || th->rst || !tcp_v4_lockless_listener(sk))
+		return 0;
+
+	/* An owned listener gets its segments through the backlog, as
+	 * before; checked unlocked, the locked path of tcp_v4_rcv() has the
+	 * final say.
+	 */
+	if (sock_owned_by_user(sk))
+		return 0;
+
+	/* A retransmitted SYN for a pending request is tcp_check_req()'s job */
+	req = inet_csk_reqsk_hash_lookup(sk, th->source, iph->saddr, iph->daddr);
+	if (req) {
+		reqsk_put(req);
+		return 0;
+	}
+
+#ifdef CONFIG_TCP_MD5SIG
+	if (tcp_v4_inbound_md5_hash(sk, skb))
+		goto discard;
+#endif
+	if (skb->len < tcp_hdrlen(skb) || tcp_checksum_complete(skb)) {
+		TCP_INC_STATS_BH(sock_net(sk), TCP_MIB_INERRS);
+		goto discard;
+	}
+
+	if (inet_csk(sk)->icsk_af_ops->conn_request(sk, skb) < 0)
+		tcp_v4_send_reset(sk, skb);
+discard:
+	kfree_skb(skb);
+	return 1;
+}
+
 /*
  *	From tcp_input.c
  */
@@ -1677,6 +1762,11 @@ process:
 
 	skb->dev = NULL;
 
+	if (sk->sk_state == TCP_LISTEN && tcp_v4_rcv_listen_syn(sk, skb)) {
+		sock_put(sk);
+		return 0;
+	}
+
 	bh_lock_sock_nested(sk);
 	ret = 0;
 	if (!sock_owned_by_user(sk)) {
@@ -731,8 +731,14 @@ struct sock *tcp_check_req(struct sock *sk, struct sk_buff *skb,
 	if (child == NULL)
 		goto listen_overflow;
 
-	inet_csk_reqsk_queue_unlink(sk, req, prev);
-	inet_csk_reqsk_queue_removed(sk, req);
+	/* A NULL prev means req lives in the global request hash.  Should
+	 * its timer have expired it meanwhile, the child is still good.
+	 */
+	if (prev != NULL) {
+		inet_csk_reqsk_queue_unlink(sk, req, prev);
+		inet_csk_reqsk_queue_removed(sk, req);
+	} else
+		inet_csk_reqsk_hash_unlink(req);
 
 	inet_csk_reqsk_queue_add(sk, req, child);
 	return child;
@@ -748,7 +754,10 @@ embryonic_reset:
 	if (!(flg & TCP_FLAG_RST))
 		req->rsk_ops->send_reset(sk, skb);
 
-	inet_csk_reqsk_queue_drop(sk, req, prev);
+	if (prev != NULL)
+		inet_csk_reqsk_queue_drop(sk, req, prev);
+	else
+		inet_csk_reqsk_hash_unlink(req);
 	return NULL;
 }
 EXPORT_SYMBOL(tcp_check_req);
@@ -0,0 +1,161 @@
+/*
+ * Quick & dirty lookup benchmark for IP sets.
+ *
+ * It fills an existing, empty IPv4 set through the kernel side add
+ * interface and measures the time of the test interface, used by the
+ * "set" match, for growing set sizes:
+ *
+ *	ipset create bench hash:ip hashsize 1048576 maxelem 2000000
+ *	modprobe ip_set_bench setname=bench sizes=1000,100000,1000000
+ *
+ * Half of the looked up addresses are in the set. The results are
+ * printed to the kernel log; the module does not stay loaded and the
+ * set is left filled.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License version 2 as
+ * published by the Free Software Foundation.
+ */
+
+#include <linux/module.h>
+#include <linux/moduleparam.h>
+#include <linux/kernel.h>
+#include <linux/ip.h>
+#include <linux/skbuff.h>
+#include <linux/vmalloc.h>
+#include <linux/random.h>
+#include <linux/ktime.h>
+#include <linux/sched.h>
+
+#include <linux/netfilter.h>
+#include <linux/netfilter/ipset/ip_set.h>
+
+MODULE_LICENSE("GPL");
+MODULE_DESCRIPTION("IP set lookup benchmark");
+
+static char *setname;
+module_param(setname, charp, 0);
+MODULE_PARM_DESC(setname, "empty IPv4 set to fill and test");
+
+static unsigned int sizes[16] = { 1000, 10000, 100000, 1000000 };
+static unsigned int nr_sizes = 4;
+module_param_array(sizes, uint, &nr_sizes, 0);
+MODULE_PARM_DESC(sizes, "increasing set sizes to measure at");
+
+static unsigned int lookups = 1000000;
+module_param(lookups, uint, 0);
+MODULE_PARM_DESC(lookups, "number of lookups per set size");
+
+/* Elements are 10.0.0.0 + i */
+#define BENCH_BASE	0x0a000000
+
+static int
+bench_fill(ip_set_id_t index, struct sk_buff *skb, u32 from, u32 to)
+{
+	struct iphdr *iph = ip_hdr(skb);
+	int ret;
+
+	for (; from < to; from++) {
+		iph->saddr = htonl(BENCH_BASE + from);
+		ret = ip_set_add(index, skb, NFPROTO_IPV4, 1,
+				 IPSET_DIM_ONE_SRC);
+		if (ret < 0 && ret != -IPSET_ERR_EXIST) {
+			pr_err("adding element %u failed: %d\n", from, ret);
+			return ret;
+		}
+		cond_resched();
+	}
+	return 0;
+}
+
+static void
+bench_lookup(ip_set_id_t index, struct sk_buff *skb, const u32 *addrs,
+	     u32 size)
+{
+	struct iphdr *iph = ip_hdr(skb);
+	unsigned int i, hits = 0;
+	ktime_t start;
+	s64 ns;
+
+	start = ktime_get();
+	for (i = 0; i < lookups; i++) {
+		iph->saddr = addrs[i];
+		hits += ip_set_test(index, skb, NFPROTO_IPV4, 1,
+				    IPSET_DIM_ONE_SRC);
+	}
+	ns = ktime_to_ns(ktime_sub(ktime_get(), start));
+
+	pr_info("%s: %u elements: %llu ns/lookup, %u/%u hits\n",
+		setname, size,
+		(unsigned long long)div_s64(ns, lookups), hits, lookups);
+}
+
+static int __init
+ip_set_bench_init(void)
+{
+	struct ip_set *set;
+	struct sk_buff *skb;
+	ip_set_id_t index;
+	u32 *addrs, filled = 0;
+	unsigned int i, j;
+	int ret = 0;
+
+	if (!setname || !lookups) {
+		pr_err("setname and lookups must be given\n");
+		return -EINVAL;
+	}
+
+	index = ip_set_get_byname(setname, &set);
+	if (index == IPSET_INVALID_ID) {
+		pr_err("set %s not found\n", setname);
+		return -ENOENT;
+	}
+	if (set->family != AF_INET) {
+		pr_err("set %s is not an IPv4 set\n", setname);
+		ret = -EINVAL;
+		goto put;
+	}
+
+	skb = alloc_skb(sizeof(struct iphdr), GFP_KERNEL);
+	addrs = vmalloc(lookups * sizeof(u32));
+	if (!skb || !addrs) {
+		ret = -ENOMEM;
+		goto free;
+	}
+	skb_reset_network_header(skb);
+	memset(skb_put(skb, sizeof(struct iphdr)), 0, sizeof(struct iphdr));
+	ip_hdr(skb)->version = 4;
+	ip_hdr(skb)->ihl = 5;
+
+	for (i = 0; i < nr_sizes; i++) {
+		if (sizes[i] < filled)
+			continue;
+		ret = bench_fill(index, skb, filled, sizes[i]);
+		if (ret < 0)
+			goto free;
+		filled = sizes[i];
+
+		/* Addresses from twice the set size: every other one hits */
+		for (j = 0; j < lookups; j++)
+			addrs[j] = htonl(BENCH_BASE +
+					 random32() % (2 * filled ? : 1));
+		bench_lookup(index, skb, addrs, filled);
+	}
+
+	/* We do not want to stay loaded, cf. tcrypt */
+	ret = -EAGAIN;
+free:
+	vfree(addrs);
+	kfree_skb(skb);
+put:
+	ip_set_put_byindex(index);
+	return ret;
+}
+
+static void __exit
+ip_set_bench_fini(void)
+{
+}
+
+module_init(ip_set_bench_init);
+module_exit(ip_set_bench_fini);
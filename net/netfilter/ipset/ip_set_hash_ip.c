@@ -389,9 +389,7 @@ hash_ip_create(struct ip_set *set, struct nlattr *tb[], u32 flags)
 	h->timeout = IPSET_NO_TIMEOUT;
 
 	hbits = htable_bits(hashsize);
-	h->table = ip_set_alloc(
-			sizeof(struct htable)
-			+ jhash_size(hbits) * sizeof(struct hbucket));
+	h->table = ip_set_alloc(htable_size(hbits));
 	if (!h->table) {
 		kfree(h);
 		return -ENOMEM;
@@ -36,6 +36,11 @@
 #include <linux/seq_file.h>
 #include <linux/jhash.h>
 #include <linux/random.h>
+#include <linux/rculist.h>
+#include <linux/percpu.h>
+#include <linux/percpu_counter.h>
+#include <linux/workqueue.h>
+#include <linux/mutex.h>
 
 #include <net/net_namespace.h>
 #include <net/ip_vs.h>
@@ -46,85 +51,108 @@
 #endif
 
 /*
- * Connection hash size. Default is what was selected at compile time.
-*/
+ *  Fine locking granularity for big connection hash table
+ */
+#define CT_LOCKARRAY_BITS  8
+#define CT_LOCKARRAY_SIZE  (1<<CT_LOCKARRAY_BITS)
+#define CT_LOCKARRAY_MASK  (CT_LOCKARRAY_SIZE-1)
+
+/*
+ * Connection hash size. Default is what was selected at compile time,
+ * the table grows from there with the number of connections, up to
+ * conn_tab_max_bits, and shrinks back when they go away.
+ */
 static int ip_vs_conn_tab_bits = CONFIG_IP_VS_TAB_BITS;
 module_param_named(conn_tab_bits, ip_vs_conn_tab_bits, int, 0444);
 MODULE_PARM_DESC(conn_tab_bits, "Set connections' hash size");
 
-/* size and mask values */
+static int ip_vs_conn_tab_max_bits = 20;
+module_param_named(conn_tab_max_bits, ip_vs_conn_tab_max_bits, int, 0444);
+MODULE_PARM_DESC(conn_tab_max_bits, "Set connections' maximum hash size");
+
+/* size value of the current table */
 int ip_vs_conn_tab_size __read_mostly;
-static int ip_vs_conn_tab_mask __read_mostly;
 
 /*
- *  Connection hash table: for input and output packets lookups of IPVS
+ *  Connection hash table: for input and output packets lookups of IPVS.
+ *  Lookups run under RCU. While the table is being resized, ->next
+ *  points to the new table: new entries are hashed there and the old
+ *  buckets are moved over one by one, so lookups search both tables.
  */
-static struct hlist_head *ip_vs_conn_tab __read_mostly;
+struct ip_vs_conn_table {
+	struct ip_vs_conn_table __rcu	*next;
+	unsigned int			size;
+	unsigned int			mask;
+	struct hlist_head		buckets[0];
+};
+
+static struct ip_vs_conn_table __rcu *ip_vs_conn_tab __read_mostly;
+
+/* number of hashed entries, drives the resizing */
+static struct percpu_counter ip_vs_conn_tab_entries;
+
+static void ip_vs_conn_tab_resize(struct work_struct *work);
+static DECLARE_WORK(ip_vs_conn_resize_work, ip_vs_conn_tab_resize);
+/* serializes resizing against itself and against table walkers */
+static DEFINE_MUTEX(ip_vs_conn_resize_mutex);
 
 /*  SLAB cache for IPVS connections */
 static struct kmem_cache *ip_vs_conn_cachep __read_mostly;
 
+/*
+ *  Small per-CPU stacks of free connections in front of the SLAB cache,
+ *  so that the connection setup rate is not bound by the allocator.
+ */
+#define IP_VS_CONN_PCPU_CACHE	32
+
+struct ip_vs_conn_pcpu_cache {
+	unsigned int		count;
+	struct ip_vs_conn	*objs[IP_VS_CONN_PCPU_CACHE];
+};
+
+static DEFINE_PER_CPU(struct ip_vs_conn_pcpu_cache, ip_vs_conn_pcpu);
+
 /*  counter for no client port connections */
 static atomic_t ip_vs_conn_no_cport_cnt = ATOMIC_INIT(0);
 
 /* random value for IPVS connection hash */
 static unsigned int ip_vs_conn_rnd __read_mostly;
 
-/*
- *  Fine locking granularity for big connection hash table
- */
-#define CT_LOCKARRAY_BITS  5
-#define CT_LOCKARRAY_SIZE  (1<<CT_LOCKARRAY_BITS)
-#define CT_LOCKARRAY_MASK  (CT_LOCKARRAY_SIZE-1)
-
 struct ip_vs_aligned_lock
 {
-	rwlock_t	l;
+	spinlock_t	l;
 } __attribute__((__aligned__(SMP_CACHE_BYTES)));
 
-/* lock array for conn table */
+/*
+ * lock array for conn table, indexed by the low bits of the hash value.
+ * The table never gets smaller than the lock array, so a lock covers the
+ * same entries in the old and the new table during a resize.
+ */
 static struct ip_vs_aligned_lock
 __ip_vs_conntbl_lock_array[CT_LOCKARRAY_SIZE] __cacheline_aligned;
 
-static inline void ct_read_lock(unsigned key)
-{
-	read_lock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_read_unlock(unsigned key)
-{
-	read_unlock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_write_lock(unsigned key)
-{
-	write_lock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_write_unlock(unsigned key)
-{
-	write_unlock(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
-
-static inline void ct_read_lock_bh(unsigned key)
+static inline void ct_write_lock_bh(unsigned key)
 {
-	read_lock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
+	spin_lock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
 }
 
-static inline void ct_read_unlock_bh(unsigned key)
+static inline void ct_write_unlock_bh(unsigned key)
 {
-	read_unlock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
+	spin_unlock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
 }
 
-static inline void ct_write_lock_bh(unsigned key)
+/* Walk the current table and the one being filled by a resize, if any */
+static inline struct ip_vs_conn_table *
+ip_vs_conn_tab_next(struct ip_vs_conn_table *t)
 {
-	write_lock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
+	/* Entries we missed in t were moved before we load ->next */
+	smp_rmb();
+	return rcu_dereference(t->next);
 }
 
-static inline void ct_write_unlock_bh(unsigned key)
-{
-	write_unlock_bh(&__ip_vs_conntbl_lock_array[key&CT_LOCKARRAY_MASK].l);
-}
+#define for_each_conn_table(t)						\
+	for (t = rcu_dereference(ip_vs_conn_tab); t;			\
+	     t = ip_vs_conn_tab_next(t))
 
 
 /*
@@ -136,13 +164,13 @@ static unsigned int ip_vs_conn_hashkey(struct net *net, int af, unsigned proto,
 {
 #ifdef CONFIG_IP_VS_IPV6
 	if (af == AF_INET6)
-		return (jhash_3words(jhash(addr, 16, ip_vs_conn_rnd),
+		return jhash_3words(jhash(addr, 16, ip_vs_conn_rnd),
 				    (__force u32)port, proto, ip_vs_conn_rnd) ^
-			((size_t)net>>8)) & ip_vs_conn_tab_mask;
+			((size_t)net>>8);
 #endif
-	return (jhash_3words((__force u32)addr->ip, (__force u32)port, proto,
+	return jhash_3words((__force u32)addr->ip, (__force u32)port, proto,
 			    ip_vs_conn_rnd) ^
-		((size_t)net>>8)) & ip_vs_conn_tab_mask;
+		((size_t)net>>8);
 }
 
 static unsigned int ip_vs_conn_hashkey_param(const struct ip_vs_conn_param *p,
@@ -152,8 +180,7 @@ static unsigned int ip_vs_conn_hashkey_param(const struct ip_vs_conn_param *p,
 	__be16 port;
 
 	if (p->pe_data && p->pe->hashkey_raw)
-		return p->pe->hashkey_raw(p, ip_vs_conn_rnd, inverse) &
-			ip_vs_conn_tab_mask;
+		return p->pe->hashkey_raw(p, ip_vs_conn_rnd, inverse);
 
 	if (likely(!inverse)) {
 		addr = p->caddr;
@@ -182,12 +209,24 @@ static unsigned int ip_vs_conn_hashkey_conn(const struct ip_vs_conn *cp)
 	return ip_vs_conn_hashkey_param(&p, false);
 }
 
+/* Kick a resize when the load factor strays too far from one */
+static inline void ip_vs_conn_tab_check(void)
+{
+	s64 n = percpu_counter_read_positive(&ip_vs_conn_tab_entries);
+	int size = ip_vs_conn_tab_size;
+
+	if ((n > 2 * size && size < (1 << ip_vs_conn_tab_max_bits)) ||
+	    (n < size / 8 && size > (1 << ip_vs_conn_tab_bits)))
+		schedule_work(&ip_vs_conn_resize_work);
+}
+
 /*
  *	Hashes ip_vs_conn in ip_vs_conn_tab by netns,proto,addr,port.
  *	returns bool success.
  */
 static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 {
+	struct ip_vs_conn_table *t, *nt;
 	unsigned hash;
 	int ret;
 
@@ -197,11 +236,17 @@ static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 	/* Hash by protocol, client address and port */
 	hash = ip_vs_conn_hashkey_conn(cp);
 
-	ct_write_lock(hash);
+	rcu_read_lock();
+	ct_write_lock_bh(hash);
 	spin_lock(&cp->lock);
 
 	if (!(cp->flags & IP_VS_CONN_F_HASHED)) {
-		hlist_add_head(&cp->c_list, &ip_vs_conn_tab[hash]);
+		/* New entries go to the table a resize is filling */
+		t = rcu_dereference(ip_vs_conn_tab);
+		nt = rcu_dereference(t->next);
+		if (nt)
+			t = nt;
+		hlist_add_head_rcu(&cp->c_list, &t->buckets[hash & t->mask]);
 		cp->flags |= IP_VS_CONN_F_HASHED;
 		atomic_inc(&cp->refcnt);
 		ret = 1;
@@ -212,7 +257,13 @@ static inline int ip_vs_conn_hash(struct ip_vs_conn *cp)
 	}
 
 	spin_unlock(&cp->lock);
-	ct_write_unlock(hash);
+	ct_write_unlock_bh(hash);
+	rcu_read_unlock();
+
+	if (ret) {
+		percpu_counter_inc(&ip_vs_conn_tab_entries);
+		ip_vs_conn_tab_check();
+	}
 
 	return ret;
 }
@@ -230,11 +281,11 @@ static inline int ip_vs_conn_unhash(struct ip_vs_conn *cp)
 	/* unhash it and decrease its reference counter */
 	hash = ip_vs_conn_hashkey_conn(cp);
 
-	ct_write_lock(hash);
+	ct_write_lock_bh(hash);
 	spin_lock(&cp->lock);
 
 	if (cp->flags & IP_VS_CONN_F_HASHED) {
-		hlist_del(&cp->c_list);
+		hlist_del_rcu(&cp->c_list);
 		cp->flags &= ~IP_VS_CONN_F_HASHED;
 		atomic_dec(&cp->refcnt);
 		ret = 1;
@@ -242,7 +293,47 @@ static inline int ip_vs_conn_unhash(struct ip_vs_conn *cp)
 		ret = 0;
 
 	spin_unlock(&cp->lock);
-	ct_write_unlock(hash);
+	ct_write_unlock_bh(hash);
+
+	if (ret)
+		percpu_counter_dec(&ip_vs_conn_tab_entries);
+
+	return ret;
+}
+
+/*
+ *	Unlinks ip_vs_conn from ip_vs_conn_tab if the table holds the last
+ *	reference, after which lookups can no longer take one.
+ *	returns bool success.
+ */
+static inline bool ip_vs_conn_unlink(struct ip_vs_conn *cp)
+{
+	unsigned hash;
+	bool ret, unhashed = false;
+
+	hash = ip_vs_conn_hashkey_conn(cp);
+
+	ct_write_lock_bh(hash);
+	spin_lock(&cp->lock);
+
+	if (cp->flags & IP_VS_CONN_F_HASHED) {
+		ret = false;
+		/* Decrease refcnt and unlink conn only if we are last user */
+		if (atomic_cmpxchg(&cp->refcnt, 1, 0) == 1) {
+			hlist_del_rcu(&cp->c_list);
+			cp->flags &= ~IP_VS_CONN_F_HASHED;
+			ret = unhashed = true;
+		}
+	} else
+		ret = atomic_read(&cp->refcnt) ? false : true;
+
+	spin_unlock(&cp->lock);
+	ct_write_unlock_bh(hash);
+
+	if (unhashed) {
+		percpu_counter_dec(&ip_vs_conn_tab_entries);
+		ip_vs_conn_tab_check();
+	}
 
 	return ret;
 }
@@ -258,29 +349,35 @@ static inline struct ip_vs_conn *
 __ip_vs_conn_in_get(const struct ip_vs_conn_param *p)
 {
 	unsigned hash;
+	struct ip_vs_conn_table *t;
 	struct ip_vs_conn *cp;
 	struct hlist_node *n;
 
 	hash = ip_vs_conn_hashkey_param(p, false);
 
-	ct_read_lock(hash);
-
-	hlist_for_each_entry(cp, n, &ip_vs_conn_tab[hash], c_list) {
-		if (cp->af == p->af &&
-		    p->cport == cp->cport && p->vport == cp->vport &&
-		    ip_vs_addr_equal(p->af, p->caddr, &cp->caddr) &&
-		    ip_vs_addr_equal(p->af, p->vaddr, &cp->vaddr) &&
-		    ((!p->cport) ^ (!(cp->flags & IP_VS_CONN_F_NO_CPORT))) &&
-		    p->protocol == cp->protocol &&
-		    ip_vs_conn_net_eq(cp, p->net)) {
-			/* HIT */
-			atomic_inc(&cp->refcnt);
-			ct_read_unlock(hash);
-			return cp;
+	rcu_read_lock();
+
+	for_each_conn_table(t) {
+		hlist_for_each_entry_rcu(cp, n, &t->buckets[hash & t->mask],
+					 c_list) {
+			if (cp->af == p->af &&
+			    p->cport == cp->cport && p->vport == cp->vport &&
+			    ip_vs_addr_equal(p->af, p->caddr, &cp->caddr) &&
+			    ip_vs_addr_equal(p->af, p->vaddr, &cp->vaddr) &&
+			    ((!p->cport) ^
+			     (!(cp->flags & IP_VS_CONN_F_NO_CPORT))) &&
+			    p->protocol == cp->protocol &&
+			    ip_vs_conn_net_eq(cp, p->net)) {
+				if (!__ip_vs_conn_get(cp))
+					continue;
+				/* HIT */
+				rcu_read_unlock();
+				return cp;
+			}
 		}
 	}
 
-	ct_read_unlock(hash);
+	rcu_read_unlock();
 
 	return NULL;
 }
@@ -345,39 +442,44 @@ EXPORT_SYMBOL_GPL(ip_vs_conn_in_get_proto);
 struct ip_vs_conn *ip_vs_ct_in_get(const struct ip_vs_conn_param *p)
 {
 	unsigned hash;
+	struct ip_vs_conn_table *t;
 	struct ip_vs_conn *cp;
 	struct hlist_node *n;
 
 	hash = ip_vs_conn_hashkey_param(p, false);
 
-	ct_read_lock(hash);
+	rcu_read_lock();
+
+	for_each_conn_table(t) {
+		hlist_for_each_entry_rcu(cp, n, &t->buckets[hash & t->mask],
+					 c_list) {
+			if (!ip_vs_conn_net_eq(cp, p->net))
+				continue;
+			if (p->pe_data && p->pe->ct_match) {
+				if (p->pe == cp->pe && p->pe->ct_match(p, cp) &&
+				    __ip_vs_conn_get(cp))
+					goto out;
+				continue;
+			}
 
-	hlist_for_each_entry(cp, n, &ip_vs_conn_tab[hash], c_list) {
-		if (!ip_vs_conn_net_eq(cp, p->net))
-			continue;
-		if (p->pe_data && p->pe->ct_match) {
-			if (p->pe == cp->pe && p->pe->ct_match(p, cp))
+			if (cp->af == p->af &&
+			    ip_vs_addr_equal(p->af, p->caddr, &cp->caddr) &&
+			    /* protocol should only be IPPROTO_IP if
+			     * p->vaddr is a fwmark */
+			    ip_vs_addr_equal(p->protocol == IPPROTO_IP ?
+					     AF_UNSPEC : p->af,
+					     p->vaddr, &cp->vaddr) &&
+			    p->cport == cp->cport && p->vport == cp->vport &&
+			    cp->flags & IP_VS_CONN_F_TEMPLATE &&
+			    p->protocol == cp->protocol &&
+			    __ip_vs_conn_get(cp))
 				goto out;
-			continue;
 		}
-
-		if (cp->af == p->af &&
-		    ip_vs_addr_equal(p->af, p->caddr, &cp->caddr) &&
-		    /* protocol should only be IPPROTO_IP if
-		     * p->vaddr is a fwmark */
-		    ip_vs_addr_equal(p->protocol == IPPROTO_IP ? AF_UNSPEC :
-				     p->af, p->vaddr, &cp->vaddr) &&
-		    p->cport == cp->cport && p->vport == cp->vport &&
-		    cp->flags & IP_VS_CONN_F_TEMPLATE &&
-		    p->protocol == cp->protocol)
-			goto out;
 	}
 	cp = NULL;
 
   out:
-	if (cp)
-		atomic_inc(&cp->refcnt);
-	ct_read_unlock(hash);
+	rcu_read_unlock();
 
 	IP_VS_DBG_BUF(9, "template lookup/in %s %s:%d->%s:%d %s\n",
 		      ip_vs_proto_name(p->protocol),
@@ -395,6 +497,7 @@ struct ip_vs_conn *ip_vs_ct_in_get(const struct ip_vs_conn_param *p)
 struct ip_vs_conn *ip_vs_conn_out_get(const struct ip_vs_conn_param *p)
 {
 	unsigned hash;
+	struct ip_vs_conn_table *t;
 	struct ip_vs_conn *cp, *ret=NULL;
 	struct hlist_node *n;
 
@@ -403,23 +506,28 @@ struct ip_vs_conn *ip_vs_conn_out_get(const struct ip_vs_conn_param *p)
 	 */
 	hash = ip_vs_conn_hashkey_param(p, true);
 
-	ct_read_lock(hash);
-
-	hlist_for_each_entry(cp, n, &ip_vs_conn_tab[hash], c_list) {
-		if (cp->af == p->af &&
-		    p->vport == cp->cport && p->cport == cp->dport &&
-		    ip_vs_addr_equal(p->af, p->vaddr, &cp->caddr) &&
-		    ip_vs_addr_equal(p->af, p->caddr, &cp->daddr) &&
-		    p->protocol == cp->protocol &&
-		    ip_vs_conn_net_eq(cp, p->net)) {
-			/* HIT */
-			atomic_inc(&cp->refcnt);
-			ret = cp;
-			break;
+	rcu_read_lock();
+
+	for_each_conn_table(t) {
+		hlist_for_each_entry_rcu(cp, n, &t->buckets[hash & t->mask],
+					 c_list) {
+			if (cp->af == p->af &&
+			    p->vport == cp->cport && p->cport == cp->dport &&
+			    ip_vs_addr_equal(p->af, p->vaddr, &cp->caddr) &&
+			    ip_vs_addr_equal(p->af, p->caddr, &cp->daddr) &&
+			    p->protocol == cp->protocol &&
+			    ip_vs_conn_net_eq(cp, p->net)) {
+				if (!__ip_vs_conn_get(cp))
+					continue;
+				/* HIT */
+				ret = cp;
+				goto out;
+			}
 		}
 	}
 
-	ct_read_unlock(hash);
+  out:
+	rcu_read_unlock();
 
 	IP_VS_DBG_BUF(9, "lookup/out %s %s:%d->%s:%d %s\n",
 		      ip_vs_proto_name(p->protocol),
@@ -740,6 +848,47 @@ int ip_vs_check_template(struct ip_vs_conn *ct)
 	return 1;
 }
 
+static struct ip_vs_conn *ip_vs_conn_alloc(void)
+{
+	struct ip_vs_conn_pcpu_cache *c;
+	struct ip_vs_conn *cp = NULL;
+
+	local_bh_disable();
+	c = &__get_cpu_var(ip_vs_conn_pcpu);
+	if (c->count)
+		cp = c->objs[--c->count];
+	local_bh_enable();
+
+	if (!cp) {
+		cp = kmem_cache_alloc(ip_vs_conn_cachep, GFP_ATOMIC);
+		if (!cp)
+			return NULL;
+	}
+	memset(cp, 0, sizeof(*cp));
+	return cp;
+}
+
+static void ip_vs_conn_rcu_free(struct rcu_head *head)
+{
+	struct ip_vs_conn *cp = container_of(head, struct ip_vs_conn,
+					     rcu_head);
+	struct ip_vs_conn_pcpu_cache *c;
+
+	/* lookups may still be looking at it through ->ct_match() */
+	kfree(cp->pe_data);
+
+	local_bh_disable();
+	c = &__get_cpu_var(ip_vs_conn_pcpu);
+	if (c->count < IP_VS_CONN_PCPU_CACHE) {
+		c->objs[c->count++] = cp;
+		cp = NULL;
+	}
+	local_bh_enable();
+
+	if (cp)
+		kmem_cache_free(ip_vs_conn_cachep, cp);
+}
+
 static void ip_vs_conn_expire(unsigned long data)
 {
 	struct ip_vs_conn *cp = (struct ip_vs_conn *)data;
@@ -747,11 +896,6 @@ static void ip_vs_conn_expire(unsigned long data)
 
 	cp->timeout = 60*HZ;
 
-	/*
-	 *	hey, I'm using it
-	 */
-	atomic_inc(&cp->refcnt);
-
 	/*
 	 *	do I control anybody?
 	 */
@@ -759,15 +903,10 @@ static void ip_vs_conn_expire(unsigned long data)
 		goto expire_later;
 
 	/*
-	 *	unhash it if it is hashed in the conn table
+	 *	unlink it if nobody but the conn table refers to it,
+	 *	lookups cannot get a new reference after that
 	 */
-	if (!ip_vs_conn_unhash(cp) && !(cp->flags & IP_VS_CONN_F_ONE_PACKET))
-		goto expire_later;
-
-	/*
-	 *	refcnt==1 implies I'm the only one referrer
-	 */
-	if (likely(atomic_read(&cp->refcnt) == 1)) {
+	if (likely(ip_vs_conn_unlink(cp))) {
 		/* delete the timer if it is activated by other users */
 		if (timer_pending(&cp->timer))
 			del_timer(&cp->timer);
@@ -780,7 +919,6 @@ static void ip_vs_conn_expire(unsigned long data)
 			ip_vs_conn_drop_conntrack(cp);
 
 		ip_vs_pe_put(cp->pe);
-		kfree(cp->pe_data);
 		if (unlikely(cp->app != NULL))
 			ip_vs_unbind_app(cp);
 		ip_vs_unbind_dest(cp);
@@ -788,26 +926,29 @@ static void ip_vs_conn_expire(unsigned long data)
 			atomic_dec(&ip_vs_conn_no_cport_cnt);
 		atomic_dec(&ipvs->conn_count);
 
-		kmem_cache_free(ip_vs_conn_cachep, cp);
+		call_rcu(&cp->rcu_head, ip_vs_conn_rcu_free);
 		return;
 	}
 
-	/* hash it back to the table */
-	ip_vs_conn_hash(cp);
-
   expire_later:
-	IP_VS_DBG(7, "delayed: conn->refcnt-1=%d conn->n_control=%d\n",
-		  atomic_read(&cp->refcnt)-1,
+	IP_VS_DBG(7, "delayed: conn->refcnt=%d conn->n_control=%d\n",
+		  atomic_read(&cp->refcnt),
 		  atomic_read(&cp->n_control));
 
+	atomic_inc(&cp->refcnt);
 	ip_vs_conn_put(cp);
 }
 
 
 void ip_vs_conn_expire_now(struct ip_vs_conn *cp)
 {
-	if (del_timer(&cp->timer))
-		mod_timer(&cp->timer, jiffies);
+	/*
+	 * Only touch a pending timer: cp may be found under RCU after
+	 * its final ip_vs_conn_expire() and must not be rearmed then.
+	 */
+	if (timer_pending(&cp->timer) &&
+	    time_after(cp->timer.expires, jiffies))
+		mod_timer_pending(&cp->timer, jiffies);
 }
 
 
@@ -824,7 +965,7 @@ ip_vs_conn_new(const struct ip_vs_conn_param *p,
 	struct ip_vs_proto_data *pd = ip_vs_proto_data_get(p->net,
 							   p->protocol);
 
-	cp = kmem_cache_zalloc(ip_vs_conn_cachep, GFP_ATOMIC);
+	cp = ip_vs_conn_alloc();
 	if (cp == NULL) {
 		IP_VS_ERR_RL("%s(): no memory\n", __func__);
 		return NULL;
@@ -907,35 +1048,42 @@ ip_vs_conn_new(const struct ip_vs_conn_param *p,
 #ifdef CONFIG_PROC_FS
 struct ip_vs_iter_state {
 	struct seq_net_private	p;
+	struct ip_vs_conn_table	*t;
 	struct hlist_head	*l;
 };
 
+/* Entries moved by a concurrent resize may be missed or shown twice */
 static void *ip_vs_conn_array(struct seq_file *seq, loff_t pos)
 {
 	int idx;
+	struct ip_vs_conn_table *t;
 	struct ip_vs_conn *cp;
 	struct ip_vs_iter_state *iter = seq->private;
 	struct hlist_node *n;
 
-	for (idx = 0; idx < ip_vs_conn_tab_size; idx++) {
-		ct_read_lock_bh(idx);
-		hlist_for_each_entry(cp, n, &ip_vs_conn_tab[idx], c_list) {
-			if (pos-- == 0) {
-				iter->l = &ip_vs_conn_tab[idx];
-				return cp;
+	for_each_conn_table(t) {
+		for (idx = 0; idx < t->size; idx++) {
+			hlist_for_each_entry_rcu(cp, n, &t->buckets[idx],
+						 c_list) {
+				if (pos-- == 0) {
+					iter->t = t;
+					iter->l = &t->buckets[idx];
+					return cp;
+				}
 			}
 		}
-		ct_read_unlock_bh(idx);
 	}
 
 	return NULL;
 }
 
 static void *ip_vs_conn_seq_start(struct seq_file *seq, loff_t *pos)
+	__acquires(RCU)
 {
 	struct ip_vs_iter_state *iter = seq->private;
 
 	iter->l = NULL;
+	rcu_read_lock();
 	return *pos ? ip_vs_conn_array(seq, *pos - 1) :SEQ_START_TOKEN;
 }
 
@@ -943,8 +1091,8 @@ static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 {
 	struct ip_vs_conn *cp = v;
 	struct ip_vs_iter_state *iter = seq->private;
+	struct ip_vs_conn_table *t = iter->t;
 	struct hlist_node *e;
-	struct hlist_head *l = iter->l;
 	int idx;
 
 	++*pos;
@@ -952,31 +1100,29 @@ static void *ip_vs_conn_seq_next(struct seq_file *seq, void *v, loff_t *pos)
 		return ip_vs_conn_array(seq, 0);
 
 	/* more on same hash chain? */
-	if ((e = cp->c_list.next))
+	if ((e = rcu_dereference(hlist_next_rcu(&cp->c_list))))
 		return hlist_entry(e, struct ip_vs_conn, c_list);
 
-	idx = l - ip_vs_conn_tab;
-	ct_read_unlock_bh(idx);
-
-	while (++idx < ip_vs_conn_tab_size) {
-		ct_read_lock_bh(idx);
-		hlist_for_each_entry(cp, e, &ip_vs_conn_tab[idx], c_list) {
-			iter->l = &ip_vs_conn_tab[idx];
-			return cp;
+	idx = iter->l - t->buckets;
+	do {
+		while (++idx < t->size) {
+			hlist_for_each_entry_rcu(cp, e, &t->buckets[idx],
+						 c_list) {
+				iter->t = t;
+				iter->l = &t->buckets[idx];
+				return cp;
+			}
 		}
-		ct_read_unlock_bh(idx);
-	}
+		idx = -1;
+	} while ((t = ip_vs_conn_tab_next(t)));
 	iter->l = NULL;
 	return NULL;
 }
 
 static void ip_vs_conn_seq_stop(struct seq_file *seq, void *v)
+	__releases(RCU)
 {
-	struct ip_vs_iter_state *iter = seq->private;
-	struct hlist_head *l = iter->l;
-
-	if (l)
-		ct_read_unlock_bh(l - ip_vs_conn_tab);
+	rcu_read_unlock();
 }
 
 static int ip_vs_conn_seq_show(struct seq_file *seq, void *v)
@@ -1155,21 +1301,20 @@ static inline int todrop_entry(struct ip_vs_conn *cp)
 void ip_vs_random_dropentry(struct net *net)
 {
 	int idx;
-	struct ip_vs_conn *cp;
+	struct ip_vs_conn_table *t;
+	struct ip_vs_conn *cp, *cp_c;
+
+	rcu_read_lock();
+	t = rcu_dereference(ip_vs_conn_tab);
 
 	/*
 	 * Randomly scan 1/32 of the whole table every second
 	 */
-	for (idx = 0; idx < (ip_vs_conn_tab_size>>5); idx++) {
-		unsigned hash = net_random() & ip_vs_conn_tab_mask;
+	for (idx = 0; idx < (t->size>>5); idx++) {
+		unsigned hash = net_random() & t->mask;
 		struct hlist_node *n;
 
-		/*
-		 *  Lock is actually needed in this loop.
-		 */
-		ct_write_lock_bh(hash);
-
-		hlist_for_each_entry(cp, n, &ip_vs_conn_tab[hash], c_list) {
+		hlist_for_each_entry_rcu(cp, n, &t->buckets[hash], c_list) {
 			if (cp->flags & IP_VS_CONN_F_TEMPLATE)
 				/* connection template */
 				continue;
@@ -1196,13 +1341,16 @@ void ip_vs_random_dropentry(struct net *net)
 
 			IP_VS_DBG(4, "del connection\n");
 			ip_vs_conn_expire_now(cp);
-			if (cp->control) {
+			cp_c = cp->control;
+			/* cp->control is valid only with reference to cp */
+			if (cp_c && __ip_vs_conn_get(cp)) {
 				IP_VS_DBG(4, "del conn template\n");
-				ip_vs_conn_expire_now(cp->control);
+				ip_vs_conn_expire_now(cp_c);
+				__ip_vs_conn_put(cp);
 			}
 		}
-		ct_write_unlock_bh(hash);
 	}
+	rcu_read_unlock();
 }
 
 
@@ -1212,30 +1360,36 @@ void ip_vs_random_dropentry(struct net *net)
 static void ip_vs_conn_flush(struct net *net)
 {
 	int idx;
-	struct ip_vs_conn *cp;
+	struct ip_vs_conn_table *t;
+	struct ip_vs_conn *cp, *cp_c;
 	struct netns_ipvs *ipvs = net_ipvs(net);
 
 flush_again:
-	for (idx = 0; idx < ip_vs_conn_tab_size; idx++) {
+	/* the tables stay in place while we hold the resize mutex */
+	mutex_lock(&ip_vs_conn_resize_mutex);
+	t = rcu_dereference_protected(ip_vs_conn_tab,
+			lockdep_is_held(&ip_vs_conn_resize_mutex));
+	for (idx = 0; idx < t->size; idx++) {
 		struct hlist_node *n;
 
-		/*
-		 *  Lock is actually needed in this loop.
-		 */
-		ct_write_lock_bh(idx);
-
-		hlist_for_each_entry(cp, n, &ip_vs_conn_tab[idx], c_list) {
+		rcu_read_lock();
+		hlist_for_each_entry_rcu(cp, n, &t->buckets[idx], c_list) {
 			if (!ip_vs_conn_net_eq(cp, net))
 				continue;
 			IP_VS_DBG(4, "del connection\n");
 			ip_vs_conn_expire_now(cp);
-			if (cp->control) {
+			cp_c = cp->control;
+			/* cp->control is valid only with reference to cp */
+			if (cp_c && __ip_vs_conn_get(cp)) {
 				IP_VS_DBG(4, "del conn template\n");
-				ip_vs_conn_expire_now(cp->control);
+				ip_vs_conn_expire_now(cp_c);
+				__ip_vs_conn_put(cp);
 			}
 		}
-		ct_write_unlock_bh(idx);
+		rcu_read_unlock();
+		cond_resched();
 	}
+	mutex_unlock(&ip_vs_conn_resize_mutex);
 
 	/* the counter may be not NULL, because maybe some conn entries
 	   are run by slow timer handler or unhashed but still referred */
@@ -1244,6 +1398,107 @@ flush_again:
 		goto flush_again;
 	}
 }
+
+/*
+ *	Allocate a connection table of 2^bits buckets
+ */
+static struct ip_vs_conn_table *ip_vs_conn_tab_alloc(int bits)
+{
+	struct ip_vs_conn_table *t;
+	unsigned int idx, size = 1 << bits;
+
+	t = vmalloc(sizeof(*t) + size * sizeof(struct hlist_head));
+	if (!t)
+		return NULL;
+
+	t->next = NULL;
+	t->size = size;
+	t->mask = size - 1;
+	for (idx = 0; idx < size; idx++)
+		INIT_HLIST_HEAD(&t->buckets[idx]);
+
+	return t;
+}
+
+/*
+ *	Table size for the current number of connections: about one
+ *	entry per bucket, within the configured limits.
+ */
+static int ip_vs_conn_tab_want_bits(void)
+{
+	s64 n = percpu_counter_sum_positive(&ip_vs_conn_tab_entries);
+	int bits = ip_vs_conn_tab_bits;
+
+	while (bits < ip_vs_conn_tab_max_bits && (1LL << bits) < n)
+		bits++;
+	return bits;
+}
+
+/*
+ *	Move all the entries into a table sized for the current number
+ *	of connections. Runs from a work item kicked by the hash/unlink
+ *	paths, lookups and updates go on meanwhile.
+ */
+static void ip_vs_conn_tab_resize(struct work_struct *work)
+{
+	struct ip_vs_conn_table *old, *new;
+	struct ip_vs_conn *cp;
+	struct hlist_node *n, *last;
+	unsigned int idx, hash;
+	int bits;
+
+	mutex_lock(&ip_vs_conn_resize_mutex);
+	old = rcu_dereference_protected(ip_vs_conn_tab,
+			lockdep_is_held(&ip_vs_conn_resize_mutex));
+
+	bits = ip_vs_conn_tab_want_bits();
+	if ((1U << bits) == old->size)
+		goto out;
+
+	new = ip_vs_conn_tab_alloc(bits);
+	if (!new) {
+		IP_VS_ERR_RL("%s(): no memory for %u buckets\n",
+			     __func__, 1U << bits);
+		goto out;
+	}
+
+	/* From now on ip_vs_conn_hash() puts new entries there */
+	rcu_assign_pointer(old->next, new);
+
+	for (idx = 0; idx < old->size; idx++) {
+		ct_write_lock_bh(idx);
+		/*
+		 * Move the chain from its tail: a lookup walking it then
+		 * never misses entries that are still to be moved, only
+		 * those it finds in the new table afterwards.
+		 */
+		while (!hlist_empty(&old->buckets[idx])) {
+			last = NULL;
+			hlist_for_each(n, &old->buckets[idx])
+				last = n;
+			cp = hlist_entry(last, struct ip_vs_conn, c_list);
+			hash = ip_vs_conn_hashkey_conn(cp);
+			hlist_del_rcu(&cp->c_list);
+			hlist_add_head_rcu(&cp->c_list,
+					   &new->buckets[hash & new->mask]);
+		}
+		ct_write_unlock_bh(idx);
+		cond_resched();
+	}
+
+	rcu_assign_pointer(ip_vs_conn_tab, new);
+	ip_vs_conn_tab_size = new->size;
+
+	/* wait for the lookups still walking the old table */
+	synchronize_rcu();
+	vfree(old);
+
+	IP_VS_DBG(2, "Connection hash table resized to %u buckets\n",
+		  new->size);
+out:
+	mutex_unlock(&ip_vs_conn_resize_mutex);
+}
+
 /*
  * per netns init and exit
  */
@@ -1268,40 +1523,48 @@ void __net_exit __ip_vs_conn_cleanup(struct net *net)
 
 int __init ip_vs_conn_init(void)
 {
+	struct ip_vs_conn_table *t;
 	int idx;
 
-	/* Compute size and mask */
-	ip_vs_conn_tab_size = 1 << ip_vs_conn_tab_bits;
-	ip_vs_conn_tab_mask = ip_vs_conn_tab_size - 1;
+	/* The lock array must not cover more than one bucket per lock */
+	ip_vs_conn_tab_bits = clamp(ip_vs_conn_tab_bits, CT_LOCKARRAY_BITS, 20);
+	ip_vs_conn_tab_max_bits = clamp(ip_vs_conn_tab_max_bits,
+					ip_vs_conn_tab_bits, 24);
 
 	/*
 	 * Allocate the connection hash table and initialize its list heads
 	 */
-	ip_vs_conn_tab = vmalloc(ip_vs_conn_tab_size * sizeof(*ip_vs_conn_tab));
-	if (!ip_vs_conn_tab)
+	t = ip_vs_conn_tab_alloc(ip_vs_conn_tab_bits);
+	if (!t)
 		return -ENOMEM;
 
+	if (percpu_counter_init(&ip_vs_conn_tab_entries, 0)) {
+		vfree(t);
+		return -ENOMEM;
+	}
+
 	/* Allocate ip_vs_conn slab cache */
 	ip_vs_conn_cachep = kmem_cache_create("ip_vs_conn",
 					      sizeof(struct ip_vs_conn), 0,
 					      SLAB_HWCACHE_ALIGN, NULL);
 	if (!ip_vs_conn_cachep) {
-		vfree(ip_vs_conn_tab);
+		percpu_counter_destroy(&ip_vs_conn_tab_entries);
+		vfree(t);
 		return -ENOMEM;
 	}
 
+	ip_vs_conn_tab_size = t->size;
+	RCU_INIT_POINTER(ip_vs_conn_tab, t);
+
 	pr_info("Connection hash table configured "
-		"(size=%d, memory=%ldKbytes)\n",
-		ip_vs_conn_tab_size,
-		(long)(ip_vs_conn_tab_size*sizeof(struct list_head))/1024);
+		"(size=%d, max size=%d, memory=%ldKbytes)\n",
+		ip_vs_conn_tab_size, 1 << ip_vs_conn_tab_max_bits,
+		(long)(ip_vs_conn_tab_size*sizeof(struct hlist_head))/1024);
 	IP_VS_DBG(0, "Each connection entry needs %Zd bytes at least\n",
 		  sizeof(struct ip_vs_conn));
 
-	for (idx = 0; idx < ip_vs_conn_tab_size; idx++)
-		INIT_HLIST_HEAD(&ip_vs_conn_tab[idx]);
-
 	for (idx = 0; idx < CT_LOCKARRAY_SIZE; idx++)  {
-		rwlock_init(&__ip_vs_conntbl_lock_array[idx].l);
+		spin_lock_init(&__ip_vs_conntbl_lock_array[idx].l);
 	}
 
 	/* calculate the random value for connection hash */
@@ -1312,7 +1575,21 @@ int __init ip_vs_conn_init(void)
 
 void ip_vs_conn_cleanup(void)
 {
+	int cpu;
+
+	cancel_work_sync(&ip_vs_conn_resize_work);
+
+	/* Wait for the connections still queued for freeing */
+	rcu_barrier();
+	for_each_possible_cpu(cpu) {
+		struct ip_vs_conn_pcpu_cache *c = &per_cpu(ip_vs_conn_pcpu, cpu);
+
+		while (c->count)
+			kmem_cache_free(ip_vs_conn_cachep, c->objs[--c->count]);
+	}
+
 	/* Release the empty cache */
 	kmem_cache_destroy(ip_vs_conn_cachep);
-	vfree(ip_vs_conn_tab);
+	percpu_counter_destroy(&ip_vs_conn_tab_entries);
+	vfree(rcu_dereference_protected(ip_vs_conn_tab, 1));
 }
@@ -58,6 +58,29 @@ static DEFINE_MUTEX(__ip_vs_mutex);
 /* lock for service table */
 static DEFINE_RWLOCK(__ip_vs_svc_lock);
 
+/*
+ * Service lookups run under RCU and only take svc->usecnt. Writers
+ * that wait for a service to have no users set ip_vs_svc_frozen under
+ * the write lock, lookups that race with them back off to the lock.
+ */
+static int ip_vs_svc_frozen;
+
+static inline void ip_vs_svc_freeze(void)
+{
+	write_lock_bh(&__ip_vs_svc_lock);
+	ip_vs_svc_frozen = 1;
+	/* pairs with the barrier in ip_vs_service_get() */
+	smp_mb();
+}
+
+static inline void ip_vs_svc_thaw(void)
+{
+	/* lookups that see us done also see the service unhashed */
+	smp_wmb();
+	ip_vs_svc_frozen = 0;
+	write_unlock_bh(&__ip_vs_svc_lock);
+}
+
 /* sysctl variables */
 
 #ifdef CONFIG_IP_VS_DEBUG
@@ -312,13 +335,13 @@ static int ip_vs_svc_hash(struct ip_vs_service *svc)
 		 */
 		hash = ip_vs_svc_hashkey(svc->net, svc->af, svc->protocol,
 					 &svc->addr, svc->port);
-		list_add(&svc->s_list, &ip_vs_svc_table[hash]);
+		list_add_rcu(&svc->s_list, &ip_vs_svc_table[hash]);
 	} else {
 		/*
 		 *  Hash it by fwmark in svc_fwm_table
 		 */
 		hash = ip_vs_svc_fwm_hashkey(svc->net, svc->fwmark);
-		list_add(&svc->f_list, &ip_vs_svc_fwm_table[hash]);
+		list_add_rcu(&svc->f_list, &ip_vs_svc_fwm_table[hash]);
 	}
 
 	svc->flags |= IP_VS_SVC_F_HASHED;
@@ -342,10 +365,10 @@ static int ip_vs_svc_unhash(struct ip_vs_service *svc)
 
 	if (svc->fwmark == 0) {
 		/* Remove it from the svc_table table */
-		list_del(&svc->s_list);
+		list_del_rcu(&svc->s_list);
 	} else {
 		/* Remove it from the svc_fwm_table table */
-		list_del(&svc->f_list);
+		list_del_rcu(&svc->f_list);
 	}
 
 	svc->flags &= ~IP_VS_SVC_F_HASHED;
@@ -367,7 +390,7 @@ __ip_vs_service_find(struct net *net, int af, __u16 protocol,
 	/* Check for "full" addressed entries */
 	hash = ip_vs_svc_hashkey(net, af, protocol, vaddr, vport);
 
-	list_for_each_entry(svc, &ip_vs_svc_table[hash], s_list){
+	list_for_each_entry_rcu(svc, &ip_vs_svc_table[hash], s_list){
 		if ((svc->af == af)
 		    && ip_vs_addr_equal(af, &svc->addr, vaddr)
 		    && (svc->port == vport)
@@ -394,7 +417,7 @@ __ip_vs_svc_fwm_find(struct net *net, int af, __u32 fwmark)
 	/* Check for fwmark addressed entries */
 	hash = ip_vs_svc_fwm_hashkey(net, fwmark);
 
-	list_for_each_entry(svc, &ip_vs_svc_fwm_table[hash], f_list) {
+	list_for_each_entry_rcu(svc, &ip_vs_svc_fwm_table[hash], f_list) {
 		if (svc->fwmark == fwmark && svc->af == af
 		    && net_eq(svc->net, net)) {
 			/* HIT */
@@ -405,22 +428,24 @@ __ip_vs_svc_fwm_find(struct net *net, int af, __u32 fwmark)
 	return NULL;
 }
 
-struct ip_vs_service *
-ip_vs_service_get(struct net *net, int af, __u32 fwmark, __u16 protocol,
-		  const union nf_inet_addr *vaddr, __be16 vport)
+/*
+ *	Get service by {fwmark} or {proto,addr,port}, also trying the
+ *	FTP and catch-all services. Called under RCU or the table lock.
+ */
+static struct ip_vs_service *
+__ip_vs_service_lookup(struct net *net, int af, __u32 fwmark, __u16 protocol,
+		       const union nf_inet_addr *vaddr, __be16 vport)
 {
 	struct ip_vs_service *svc;
 	struct netns_ipvs *ipvs = net_ipvs(net);
 
-	read_lock(&__ip_vs_svc_lock);
-
 	/*
 	 *	Check the table hashed by fwmark first
 	 */
 	if (fwmark) {
 		svc = __ip_vs_svc_fwm_find(net, af, fwmark);
 		if (svc)
-			goto out;
+			return svc;
 	}
 
 	/*
@@ -448,11 +473,45 @@ ip_vs_service_get(struct net *net, int af, __u32 fwmark, __u16 protocol,
 		svc = __ip_vs_service_find(net, af, protocol, vaddr, 0);
 	}
 
-  out:
+	return svc;
+}
+
+struct ip_vs_service *
+ip_vs_service_get(struct net *net, int af, __u32 fwmark, __u16 protocol,
+		  const union nf_inet_addr *vaddr, __be16 vport)
+{
+	struct ip_vs_service *svc;
+
+	rcu_read_lock();
+	svc = __ip_vs_service_lookup(net, af, fwmark, protocol, vaddr, vport);
+	if (svc) {
+		atomic_inc(&svc->usecnt);
+		smp_mb__after_atomic_inc();
+		/*
+		 * A writer may be waiting for the service to be unused or
+		 * may have unhashed it since we found it: let it go and
+		 * look it up again under the lock.
+		 */
+		if (unlikely(ACCESS_ONCE(ip_vs_svc_frozen)))
+			goto retry;
+		smp_rmb();
+		if (unlikely(!(svc->flags & IP_VS_SVC_F_HASHED)))
+			goto retry;
+	}
+	rcu_read_unlock();
+	goto out;
+
+  retry:
+	atomic_dec(&svc->usecnt);
+	rcu_read_unlock();
+
+	read_lock(&__ip_vs_svc_lock);
+	svc = __ip_vs_service_lookup(net, af, fwmark, protocol, vaddr, vport);
 	if (svc)
 		atomic_inc(&svc->usecnt);
 	read_unlock(&__ip_vs_svc_lock);
 
+  out:
 	IP_VS_DBG_BUF(9, "lookup service: fwm %u %s %s:%u %s\n",
 		      fwmark, ip_vs_proto_name(protocol),
 		      IP_VS_DBG_ADDR(af, vaddr), ntohs(vport),
@@ -469,6 +528,16 @@ __ip_vs_bind_svc(struct ip_vs_dest *dest, struct ip_vs_service *svc)
 	dest->svc = svc;
 }
 
+/* Lookups may still be looking at an unhashed service under RCU */
+static void ip_vs_service_rcu_free(struct rcu_head *head)
+{
+	struct ip_vs_service *svc = container_of(head, struct ip_vs_service,
+						 rcu_head);
+
+	free_percpu(svc->stats.cpustats);
+	kfree(svc);
+}
+
 static void
 __ip_vs_unbind_svc(struct ip_vs_dest *dest)
 {
@@ -480,8 +549,7 @@ __ip_vs_unbind_svc(struct ip_vs_dest *dest)
 			      svc->fwmark,
 			      IP_VS_DBG_ADDR(svc->af, &svc->addr),
 			      ntohs(svc->port), atomic_read(&svc->usecnt));
-		free_percpu(svc->stats.cpustats);
-		kfree(svc);
+		call_rcu(&svc->rcu_head, ip_vs_service_rcu_free);
 	}
 }
 
@@ -810,7 +878,7 @@ __ip_vs_update_dest(struct ip_vs_service *svc, struct ip_vs_dest *dest,
 	if (add)
 		ip_vs_start_estimator(svc->net, &dest->stats);
 
-	write_lock_bh(&__ip_vs_svc_lock);
+	ip_vs_svc_freeze();
 
 	/* Wait until all other svc users go away */
 	IP_VS_WAIT_WHILE(atomic_read(&svc->usecnt) > 0);
@@ -824,7 +892,7 @@ __ip_vs_update_dest(struct ip_vs_service *svc, struct ip_vs_dest *dest,
 	if (svc->scheduler->update_service)
 		svc->scheduler->update_service(svc);
 
-	write_unlock_bh(&__ip_vs_svc_lock);
+	ip_vs_svc_thaw();
 }
 
 
@@ -1095,7 +1163,7 @@ ip_vs_del_dest(struct ip_vs_service *svc, struct ip_vs_dest_user_kern *udest)
 		return -ENOENT;
 	}
 
-	write_lock_bh(&__ip_vs_svc_lock);
+	ip_vs_svc_freeze();
 
 	/*
 	 *	Wait until all other svc users go away.
@@ -1107,7 +1175,7 @@ ip_vs_del_dest(struct ip_vs_service *svc, struct ip_vs_dest_user_kern *udest)
 	 */
 	__ip_vs_unlink_dest(svc, dest, 1);
 
-	write_unlock_bh(&__ip_vs_svc_lock);
+	ip_vs_svc_thaw();
 
 	/*
 	 *	Delete the destination
@@ -1284,7 +1352,7 @@ ip_vs_edit_service(struct ip_vs_service *svc, struct ip_vs_service_user_kern *u)
 	}
 #endif
 
-	write_lock_bh(&__ip_vs_svc_lock);
+	ip_vs_svc_freeze();
 
 	/*
 	 * Wait until all other svc users go away.
@@ -1335,7 +1403,7 @@ ip_vs_edit_service(struct ip_vs_service *svc, struct ip_vs_service_user_kern *u)
 	}
 
   out_unlock:
-	write_unlock_bh(&__ip_vs_svc_lock);
+	ip_vs_svc_thaw();
   out:
 	ip_vs_scheduler_put(old_sched);
 	ip_vs_pe_put(old_pe);
@@ -1403,8 +1471,7 @@ static void __ip_vs_del_service(struct ip_vs_service *svc)
 			      svc->fwmark,
 			      IP_VS_DBG_ADDR(svc->af, &svc->addr),
 			      ntohs(svc->port), atomic_read(&svc->usecnt));
-		free_percpu(svc->stats.cpustats);
-		kfree(svc);
+		call_rcu(&svc->rcu_head, ip_vs_service_rcu_free);
 	}
 
 	/* decrease the module use count */
@@ -1419,7 +1486,7 @@ static void ip_vs_unlink_service(struct ip_vs_service *svc)
 	/*
 	 * Unhash it from the service table
 	 */
-	write_lock_bh(&__ip_vs_svc_lock);
+	ip_vs_svc_freeze();
 
 	ip_vs_svc_unhash(svc);
 
@@ -1430,7 +1497,7 @@ static void ip_vs_unlink_service(struct ip_vs_service *svc)
 
 	__ip_vs_del_service(svc);
 
-	write_unlock_bh(&__ip_vs_svc_lock);
+	ip_vs_svc_thaw();
 }
 
 /*
@@ -3776,5 +3843,7 @@ void ip_vs_control_cleanup(void)
 	EnterFunction(2);
 	ip_vs_genl_unregister();
 	nf_unregister_sockopt(&ip_vs_sockopts);
+	/* Wait for the services still queued for freeing */
+	rcu_barrier();
 	LeaveFunction(2);
 }